@@ -0,0 +1,208 @@
+#include "AdminServer.hpp"
+#include "ConsoleUtils.hpp"
+#include <iostream>
+#include <cstring>
+#include <initializer_list>
+
+#ifndef _WIN32
+#include <sys/un.h>
+#endif
+
+namespace
+{
+    // How often the accept loop checks for stop()
+    const int ADMIN_POLL_MS = 200;
+    // How long a scraper gets to send its request line
+    const int REQUEST_TIMEOUT_MS = 250;
+
+    bool sendAll(socket_t socket, const std::string &data)
+    {
+        size_t offset = 0;
+        while (offset < data.size())
+        {
+            int sent = send(socket, data.data() + offset, static_cast<int>(data.size() - offset), SEND_FLAGS);
+            if (sent <= 0)
+            {
+                return false;
+            }
+            offset += sent;
+        }
+        return true;
+    }
+}
+
+AdminServer::AdminServer(const Renderer &renderer)
+    : render(renderer), tcpListener(SOCKET_ERROR_VAL), unixListener(SOCKET_ERROR_VAL), running(false)
+{
+}
+
+AdminServer::~AdminServer()
+{
+    stop();
+}
+
+bool AdminServer::start(int port, const std::string &socketPath)
+{
+    if (port > 0)
+    {
+        tcpListener = socket(AF_INET, SOCK_STREAM, 0);
+        int opt = 1;
+        setsockopt(tcpListener, SOL_SOCKET, SO_REUSEADDR, (const char *)&opt, sizeof(opt));
+
+        // Loopback only: metrics are for operators on this machine
+        sockaddr_in adminAddr;
+        memset(&adminAddr, 0, sizeof(adminAddr));
+        adminAddr.sin_family = AF_INET;
+        adminAddr.sin_port = htons(port);
+        adminAddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (tcpListener == SOCKET_ERROR_VAL || bind(tcpListener, (sockaddr *)&adminAddr, sizeof(adminAddr)) != 0 ||
+            listen(tcpListener, SOMAXCONN) != 0)
+        {
+            std::cerr << RED_COLOR "Failed to open admin port " << port << RESET_COLOR << std::endl;
+            if (tcpListener != SOCKET_ERROR_VAL)
+            {
+                closeSocket(tcpListener);
+            }
+            tcpListener = SOCKET_ERROR_VAL;
+        }
+        else
+        {
+            std::cout << BLUE_COLOR "Metrics available on 127.0.0.1:" << port << RESET_COLOR << std::endl;
+        }
+    }
+
+#ifndef _WIN32
+    if (!socketPath.empty())
+    {
+        sockaddr_un adminAddr;
+        memset(&adminAddr, 0, sizeof(adminAddr));
+        adminAddr.sun_family = AF_UNIX;
+        if (socketPath.size() >= sizeof(adminAddr.sun_path))
+        {
+            std::cerr << RED_COLOR "Admin socket path is too long: " << socketPath << RESET_COLOR << std::endl;
+        }
+        else
+        {
+            strncpy(adminAddr.sun_path, socketPath.c_str(), sizeof(adminAddr.sun_path) - 1);
+            // A stale socket file from an earlier run would make bind() fail
+            unlink(socketPath.c_str());
+            unixListener = socket(AF_UNIX, SOCK_STREAM, 0);
+            if (unixListener == SOCKET_ERROR_VAL || bind(unixListener, (sockaddr *)&adminAddr, sizeof(adminAddr)) != 0 ||
+                listen(unixListener, SOMAXCONN) != 0)
+            {
+                std::cerr << RED_COLOR "Failed to open admin socket " << socketPath << RESET_COLOR << std::endl;
+                if (unixListener != SOCKET_ERROR_VAL)
+                {
+                    close(unixListener);
+                }
+                unixListener = SOCKET_ERROR_VAL;
+            }
+            else
+            {
+                unixPath = socketPath;
+                std::cout << BLUE_COLOR "Metrics available on " << socketPath << RESET_COLOR << std::endl;
+            }
+        }
+    }
+#else
+    if (!socketPath.empty())
+    {
+        std::cerr << YELLOW_COLOR "Unix admin sockets are not supported on Windows, use --admin-port" RESET_COLOR << std::endl;
+    }
+#endif
+
+    if (tcpListener == SOCKET_ERROR_VAL && unixListener == SOCKET_ERROR_VAL)
+    {
+        return false;
+    }
+    running = true;
+    worker = std::thread(&AdminServer::serve, this);
+    return true;
+}
+
+void AdminServer::stop()
+{
+    if (!running.exchange(false))
+    {
+        return;
+    }
+    if (worker.joinable())
+    {
+        worker.join();
+    }
+    if (tcpListener != SOCKET_ERROR_VAL)
+    {
+        closeSocket(tcpListener);
+        tcpListener = SOCKET_ERROR_VAL;
+    }
+#ifndef _WIN32
+    if (unixListener != SOCKET_ERROR_VAL)
+    {
+        close(unixListener);
+        unlink(unixPath.c_str());
+        unixListener = SOCKET_ERROR_VAL;
+    }
+#endif
+}
+
+void AdminServer::serve()
+{
+    while (running)
+    {
+        pollfd_t fds[2];
+        socket_t listeners[2];
+        unsigned long count = 0;
+        for (socket_t listener : {tcpListener, unixListener})
+        {
+            if (listener != SOCKET_ERROR_VAL)
+            {
+                fds[count].fd = listener;
+                fds[count].events = POLLIN;
+                fds[count].revents = 0;
+                listeners[count] = listener;
+                ++count;
+            }
+        }
+
+        if (pollSockets(fds, count, ADMIN_POLL_MS) <= 0)
+        {
+            continue;
+        }
+        for (unsigned long i = 0; i < count; ++i)
+        {
+            if (fds[i].revents & POLLIN)
+            {
+                socket_t client = accept(listeners[i], nullptr, nullptr);
+                if (client != SOCKET_ERROR_VAL)
+                {
+                    answer(client);
+                    closeSocket(client);
+                }
+            }
+        }
+    }
+}
+
+void AdminServer::answer(socket_t client)
+{
+    // Peek at the request without insisting on one: plain nc sends nothing
+    char request[512];
+    int received = 0;
+    pollfd_t pfd;
+    pfd.fd = client;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    if (pollSockets(&pfd, 1, REQUEST_TIMEOUT_MS) > 0)
+    {
+        received = recv(client, request, sizeof(request), 0);
+    }
+    bool http = received >= 3 && strncmp(request, "GET", 3) == 0;
+
+    std::string body = render();
+    if (http)
+    {
+        sendAll(client, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+                            std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n");
+    }
+    sendAll(client, body);
+}
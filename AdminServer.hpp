@@ -0,0 +1,38 @@
+// AdminServer.hpp
+#pragma once
+#include "SocketUtils.hpp"
+#include <string>
+#include <thread>
+#include <atomic>
+#include <functional>
+
+// Local-only scrape endpoint for server metrics. Listens on a loopback TCP
+// port and/or a Unix domain socket on its own thread, away from the chat
+// sockets. Every connection gets the current metrics in the Prometheus text
+// format and is closed; requests starting with "GET" get an HTTP/1.0 header
+// first so curl and Prometheus can scrape it, anything else (e.g. nc) gets
+// the plain text.
+class AdminServer
+{
+public:
+    typedef std::function<std::string()> Renderer;
+
+private:
+    Renderer render;
+    socket_t tcpListener;
+    socket_t unixListener;
+    std::string unixPath;
+    std::atomic<bool> running;
+    std::thread worker;
+
+    void serve();
+    void answer(socket_t client);
+
+public:
+    explicit AdminServer(const Renderer &renderer);
+    ~AdminServer();
+
+    // port 0 / empty path disables that listener; false when nothing could be opened
+    bool start(int port, const std::string &socketPath);
+    void stop();
+};
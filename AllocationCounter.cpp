@@ -0,0 +1,90 @@
+#include "AllocationCounter.hpp"
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+namespace
+{
+    // Plain atomics: anything fancier could allocate from inside operator new
+    std::atomic<uint64_t> allocationCount(0);
+    std::atomic<uint64_t> allocationBytes(0);
+
+    void *allocate(std::size_t size)
+    {
+        allocationCount.fetch_add(1, std::memory_order_relaxed);
+        allocationBytes.fetch_add(size, std::memory_order_relaxed);
+        void *block = std::malloc(size == 0 ? 1 : size);
+        if (!block)
+        {
+            throw std::bad_alloc();
+        }
+        return block;
+    }
+
+    void *allocateNoThrow(std::size_t size)
+    {
+        allocationCount.fetch_add(1, std::memory_order_relaxed);
+        allocationBytes.fetch_add(size, std::memory_order_relaxed);
+        return std::malloc(size == 0 ? 1 : size);
+    }
+}
+
+uint64_t AllocationCounter::allocations()
+{
+    return allocationCount.load(std::memory_order_relaxed);
+}
+
+uint64_t AllocationCounter::bytes()
+{
+    return allocationBytes.load(std::memory_order_relaxed);
+}
+
+void *operator new(std::size_t size)
+{
+    return allocate(size);
+}
+
+void *operator new[](std::size_t size)
+{
+    return allocate(size);
+}
+
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept
+{
+    return allocateNoThrow(size);
+}
+
+void *operator new[](std::size_t size, const std::nothrow_t &) noexcept
+{
+    return allocateNoThrow(size);
+}
+
+void operator delete(void *block) noexcept
+{
+    std::free(block);
+}
+
+void operator delete[](void *block) noexcept
+{
+    std::free(block);
+}
+
+void operator delete(void *block, const std::nothrow_t &) noexcept
+{
+    std::free(block);
+}
+
+void operator delete[](void *block, const std::nothrow_t &) noexcept
+{
+    std::free(block);
+}
+
+void operator delete(void *block, std::size_t) noexcept
+{
+    std::free(block);
+}
+
+void operator delete[](void *block, std::size_t) noexcept
+{
+    std::free(block);
+}
@@ -0,0 +1,18 @@
+// AllocationCounter.hpp
+#pragma once
+#include <cstdint>
+
+// Counts every general-purpose heap allocation of the process. Linking
+// AllocationCounter.cpp replaces the global operator new and delete with
+// versions that bump one counter and then call malloc/free, so allocations
+// made anywhere, the standard library included, are seen. The hot paths are
+// meant not to allocate at all once warmed up; these numbers prove it. The
+// load generator always links it; the server only when built with
+// COUNT_ALLOCATIONS=1, so production builds keep the plain allocator.
+class AllocationCounter
+{
+public:
+    // Allocations since the process started
+    static uint64_t allocations();
+    static uint64_t bytes();
+};
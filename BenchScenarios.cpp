@@ -0,0 +1,422 @@
+#include "BenchScenarios.hpp"
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <string>
+#include <vector>
+#include <cstring>
+
+namespace
+{
+    // Longest wait for an answer the server owes; a resume may first wait up
+    // to two seconds for the connection it replaces to close
+    const int REPLY_TIMEOUT_MS = 4000;
+    // How long to listen for frames that must not arrive
+    const int QUIET_MS = 200;
+
+    int64_t nowMs()
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+    }
+
+    // One blocking client, driven step by step
+    class ScriptedClient
+    {
+    private:
+        socket_t socket;
+        FrameParser parser;
+        std::deque<Frame> received; // Parsed but not taken yet; Batch frames come unpacked
+        bool closed;
+
+        // Reads once, waiting up to timeoutMs for data
+        void receive(int timeoutMs)
+        {
+            pollfd_t pfd;
+            pfd.fd = socket;
+            pfd.events = POLLIN;
+            pfd.revents = 0;
+            if (pollSockets(&pfd, 1, timeoutMs) <= 0)
+            {
+                return;
+            }
+            char buffer[16 * 1024];
+            int bytesReceived = recv(socket, buffer, sizeof(buffer), 0);
+            if (bytesReceived <= 0)
+            {
+                closed = true;
+                return;
+            }
+            parser.feed(buffer, bytesReceived);
+            Frame frame;
+            while (parser.next(frame))
+            {
+                if (frame.type != FrameType::Batch)
+                {
+                    received.push_back(frame);
+                    continue;
+                }
+                FrameParser inner;
+                inner.feed(frame.body.data(), frame.body.size());
+                Frame entry;
+                while (inner.next(entry))
+                {
+                    received.push_back(entry);
+                }
+            }
+            closed = closed || parser.hasError();
+        }
+
+    public:
+        ScriptedClient() : socket(SOCKET_ERROR_VAL), closed(false) {}
+
+        ~ScriptedClient()
+        {
+            if (socket != SOCKET_ERROR_VAL)
+            {
+                closeSocket(socket);
+            }
+        }
+
+        bool connectTo(const BenchConfig &config)
+        {
+            sockaddr_in serverAddr;
+            memset(&serverAddr, 0, sizeof(serverAddr));
+            serverAddr.sin_family = AF_INET;
+            serverAddr.sin_port = htons(config.port);
+            if (inet_pton(AF_INET, config.host.c_str(), &serverAddr.sin_addr) != 1)
+            {
+                return false;
+            }
+            socket = ::socket(AF_INET, SOCK_STREAM, 0);
+            return socket != SOCKET_ERROR_VAL && connect(socket, (sockaddr *)&serverAddr, sizeof(serverAddr)) == 0;
+        }
+
+        bool send(const std::string &data)
+        {
+            size_t offset = 0;
+            while (offset < data.size())
+            {
+                int sent = ::send(socket, data.data() + offset, static_cast<int>(data.size() - offset), SEND_FLAGS);
+                if (sent <= 0)
+                {
+                    return false;
+                }
+                offset += sent;
+            }
+            return true;
+        }
+
+        // Next frame, waiting up to timeoutMs for one; false on timeout or a closed connection
+        bool next(Frame &frame, int timeoutMs)
+        {
+            int64_t deadline = nowMs() + timeoutMs;
+            while (received.empty() && !closed)
+            {
+                int64_t remaining = deadline - nowMs();
+                if (remaining <= 0)
+                {
+                    return false;
+                }
+                receive(static_cast<int>(remaining));
+            }
+            if (received.empty())
+            {
+                return false;
+            }
+            frame = received.front();
+            received.pop_front();
+            return true;
+        }
+
+        // Skips frames up to and including the first that matches
+        bool waitFor(const std::function<bool(const Frame &)> &match, Frame &found, int timeoutMs = REPLY_TIMEOUT_MS)
+        {
+            int64_t deadline = nowMs() + timeoutMs;
+            while (next(found, static_cast<int>(std::max<int64_t>(0, deadline - nowMs()))))
+            {
+                if (match(found))
+                {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        // True once the server closed the connection; whatever was still in flight is discarded
+        bool waitClosed(int timeoutMs)
+        {
+            int64_t deadline = nowMs() + timeoutMs;
+            while (!closed && nowMs() < deadline)
+            {
+                receive(static_cast<int>(deadline - nowMs()));
+                received.clear();
+            }
+            return closed;
+        }
+    };
+
+    // Collects the outcome of every check
+    class CheckList
+    {
+    private:
+        std::ostream &out;
+        bool allPassed;
+
+    public:
+        explicit CheckList(std::ostream &output) : out(output), allPassed(true) {}
+
+        bool report(bool passed, const std::string &what, const std::string &detail = "")
+        {
+            out << (passed ? "  PASS  " : "  FAIL  ") << what;
+            if (!detail.empty())
+            {
+                out << " (" << detail << ")";
+            }
+            out << std::endl;
+            allPassed = allPassed && passed;
+            return passed;
+        }
+
+        bool passed() const { return allPassed; }
+    };
+
+    std::function<bool(const Frame &)> isFrame(FrameType type, const std::string &sender, const std::string &room = "")
+    {
+        return [type, sender, room](const Frame &frame)
+        { return frame.type == type && frame.sender == sender && frame.room == room; };
+    }
+
+    bool joinAs(ScriptedClient &client, const BenchConfig &config, const std::string &name, const std::string &resume = "")
+    {
+        Frame ack;
+        return client.connectTo(config) && client.send(encodeFrame(FrameType::Join, name, resume)) &&
+               client.waitFor(isFrame(FrameType::Join, name), ack);
+    }
+
+    // A client whose connection went quiet reconnects before the server noticed.
+    // The resume must replace the stale connection rather than be refused, and
+    // deliver exactly the messages sent since the last one the client saw, in
+    // order; a plain join of the same name is still refused, and a resume
+    // cannot put the client in more rooms than /join would.
+    bool resumeScenario(const BenchConfig &config, CheckList &checks)
+    {
+        const std::string room = "bench-resume";
+        const int seenCount = 10;
+        const int missedRoomCount = 20;
+        const int missedLobbyCount = 5;
+
+        ScriptedClient sender;
+        ScriptedClient stale;
+        Frame frame;
+        if (!checks.report(joinAs(sender, config, "resume-a") && joinAs(stale, config, "resume-b"), "two clients join"))
+        {
+            return false;
+        }
+        sender.send(encodeFrame(FrameType::RoomJoin, "", "", room));
+        sender.waitFor(isFrame(FrameType::RoomJoin, "resume-a", room), frame);
+        stale.send(encodeFrame(FrameType::RoomJoin, "", "", room));
+        if (!checks.report(sender.waitFor(isFrame(FrameType::RoomJoin, "resume-b", room), frame), "both are in #" + room))
+        {
+            return false;
+        }
+
+        for (int i = 0; i < seenCount; ++i)
+        {
+            sender.send(encodeFrame(FrameType::Chat, "", "seen-" + std::to_string(i), room));
+        }
+        uint64_t lastSeen = 0;
+        std::string lastBody = "seen-" + std::to_string(seenCount - 1);
+        while (stale.next(frame, REPLY_TIMEOUT_MS))
+        {
+            lastSeen = std::max(lastSeen, frame.sequence);
+            if (frame.type == FrameType::Chat && frame.body == lastBody)
+            {
+                break;
+            }
+        }
+        if (!checks.report(frame.body == lastBody && lastSeen != 0, "messages arrive numbered"))
+        {
+            return false;
+        }
+
+        // The stale connection stays open but reads nothing more
+        for (int i = 0; i < missedRoomCount; ++i)
+        {
+            sender.send(encodeFrame(FrameType::Chat, "", "missed-" + std::to_string(i), room));
+        }
+        for (int i = 0; i < missedLobbyCount; ++i)
+        {
+            sender.send(encodeFrame(FrameType::Chat, "", "lobby-" + std::to_string(i)));
+        }
+
+        ScriptedClient plain;
+        plain.connectTo(config);
+        plain.send(encodeFrame(FrameType::Join, "resume-b", ""));
+        checks.report(plain.waitFor(isFrame(FrameType::System, "resume-b"), frame), "a plain join of the name is refused");
+
+        ScriptedClient resumed;
+        bool acknowledged = false;
+        std::vector<std::string> roomBodies;
+        std::vector<std::string> lobbyBodies;
+        resumed.connectTo(config);
+        resumed.send(encodeFrame(FrameType::Join, "resume-b", encodeResume(lastSeen, std::vector<std::string>(1, room))));
+        // Messages the server had not taken in before the resume arrive live instead, after the ack
+        int64_t deadline = nowMs() + REPLY_TIMEOUT_MS;
+        int64_t quietFrom = 0;
+        while (resumed.next(frame, static_cast<int>(std::max<int64_t>(0, (quietFrom ? quietFrom + QUIET_MS : deadline) - nowMs()))))
+        {
+            if (frame.type == FrameType::Join && frame.sender == "resume-b")
+            {
+                acknowledged = true;
+            }
+            else if (frame.type == FrameType::Chat)
+            {
+                (frame.room.empty() ? lobbyBodies : roomBodies).push_back(frame.body);
+            }
+            if (quietFrom == 0 && acknowledged && roomBodies.size() + lobbyBodies.size() >= missedRoomCount + missedLobbyCount)
+            {
+                quietFrom = nowMs();
+            }
+        }
+        if (!checks.report(acknowledged, "a resume takes over the name from the stale connection"))
+        {
+            return false;
+        }
+        checks.report(stale.waitClosed(REPLY_TIMEOUT_MS), "the stale connection is closed");
+
+        std::vector<std::string> expectedRoom;
+        std::vector<std::string> expectedLobby;
+        for (int i = 0; i < missedRoomCount; ++i)
+        {
+            expectedRoom.push_back("missed-" + std::to_string(i));
+        }
+        for (int i = 0; i < missedLobbyCount; ++i)
+        {
+            expectedLobby.push_back("lobby-" + std::to_string(i));
+        }
+        checks.report(roomBodies == expectedRoom && lobbyBodies == expectedLobby, "missed messages arrive once each, in order",
+                      std::to_string(roomBodies.size()) + " of " + std::to_string(missedRoomCount) + " in #" + room + ", " +
+                          std::to_string(lobbyBodies.size()) + " of " + std::to_string(missedLobbyCount) + " in the lobby");
+
+        sender.send(encodeFrame(FrameType::Chat, "", "live", room));
+        checks.report(resumed.waitFor([](const Frame &live)
+                                      { return live.type == FrameType::Chat && live.body == "live"; }, frame),
+                      "the resumed session is back in #" + room);
+
+        // As many rooms as a resume can name: more than the per-client limit
+        std::vector<std::string> names;
+        for (int i = 0; i < 255; ++i)
+        {
+            names.push_back("resume-cap-" + std::to_string(i));
+        }
+        ScriptedClient greedy;
+        greedy.connectTo(config);
+        greedy.send(encodeFrame(FrameType::Join, "resume-c", encodeResume(0, names)));
+        bool limited = greedy.waitFor([](const Frame &notice)
+                                      { return notice.type == FrameType::System && notice.body.compare(0, 17, "Could not rejoin ") == 0; }, frame);
+        checks.report(limited, "a resume is held to the room limits");
+        return checks.passed();
+    }
+
+    // Joins a room and waits for the server's answer: the client's own
+    // RoomJoin notice, or a refusal, whose text ends up in refusal. The
+    // history replay header that comes ahead of the notice is no answer.
+    bool enterRoom(ScriptedClient &client, const std::string &name, const std::string &room, std::string &refusal)
+    {
+        Frame frame;
+        client.send(encodeFrame(FrameType::RoomJoin, "", "", room));
+        if (!client.waitFor([&name, &room](const Frame &answer)
+                            { return (answer.type == FrameType::RoomJoin && answer.sender == name && answer.room == room) ||
+                                     (answer.type == FrameType::System && answer.sender.empty() && answer.body.compare(0, 5, "Last ") != 0); }, frame))
+        {
+            refusal = "no answer";
+            return false;
+        }
+        refusal = frame.type == FrameType::System ? frame.body : std::string();
+        return refusal.empty();
+    }
+
+    bool exitRoom(ScriptedClient &client, const std::string &name, const std::string &room)
+    {
+        Frame frame;
+        client.send(encodeFrame(FrameType::RoomLeave, "", "", room));
+        return client.waitFor(isFrame(FrameType::RoomLeave, name, room), frame);
+    }
+
+    // Rooms live as long as they have members: joining and leaving more
+    // distinct rooms than the server may hold at once must never hit its
+    // room limit, while one client can only be in so many rooms at a time.
+    // A room another member still holds stays, with its history.
+    bool roomsScenario(const BenchConfig &config, CheckList &checks)
+    {
+        // Above the server's default --max-rooms
+        const int cycles = 300;
+        const int greedyLimit = 255;
+
+        ScriptedClient client;
+        ScriptedClient other;
+        Frame frame;
+        std::string refusal;
+        if (!checks.report(joinAs(client, config, "rooms-a") && joinAs(other, config, "rooms-b"), "two clients join"))
+        {
+            return false;
+        }
+
+        int created = 0;
+        while (created < cycles && enterRoom(client, "rooms-a", "cycle-" + std::to_string(created), refusal) &&
+               exitRoom(client, "rooms-a", "cycle-" + std::to_string(created)))
+        {
+            ++created;
+        }
+        checks.report(created == cycles, "rooms are dropped when their last member leaves",
+                      std::to_string(created) + " of " + std::to_string(cycles) + " joined and left" +
+                          (refusal.empty() ? std::string() : ": " + refusal));
+
+        int entered = 0;
+        while (entered < greedyLimit && enterRoom(client, "rooms-a", "held-" + std::to_string(entered), refusal))
+        {
+            ++entered;
+        }
+        checks.report(entered < greedyLimit && refusal.find("leave one first") != std::string::npos,
+                      "a client is in a limited number of rooms at once",
+                      "refused after " + std::to_string(entered) + (refusal.empty() ? std::string() : ": " + refusal));
+        int left = 0;
+        while (left < entered && exitRoom(client, "rooms-a", "held-" + std::to_string(left)))
+        {
+            ++left;
+        }
+        checks.report(left == entered, "a client leaves every room it is in");
+
+        // The room outlives one member leaving while another still holds it
+        const std::string shared = "bench-shared";
+        enterRoom(client, "rooms-a", shared, refusal);
+        enterRoom(other, "rooms-b", shared, refusal);
+        other.send(encodeFrame(FrameType::Chat, "", "kept", shared));
+        client.waitFor(isFrame(FrameType::Chat, "rooms-b", shared), frame);
+        exitRoom(client, "rooms-a", shared);
+        client.send(encodeFrame(FrameType::RoomJoin, "", "", shared));
+        bool kept = client.waitFor([](const Frame &replayed)
+                                   { return replayed.type == FrameType::Chat && replayed.body == "kept"; }, frame);
+        checks.report(kept, "a room another member holds keeps its history");
+        return checks.passed();
+    }
+}
+
+bool runScenario(const BenchConfig &config, std::ostream &out)
+{
+    CheckList checks(out);
+    out << "Scenario " << config.scenario << " against " << config.host << ":" << config.port << std::endl;
+    if (config.scenario == "resume")
+    {
+        return resumeScenario(config, checks);
+    }
+    if (config.scenario == "rooms")
+    {
+        return roomsScenario(config, checks);
+    }
+    out << "Unknown scenario: " << config.scenario << std::endl;
+    return false;
+}
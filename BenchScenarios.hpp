@@ -0,0 +1,11 @@
+// BenchScenarios.hpp
+#pragma once
+#include "LoadGenerator.hpp"
+#include <ostream>
+
+// Scripted regression checks run by bench instead of the load: a few clients
+// driven one step at a time against a running server, each step waiting for
+// the server's answer. Every check is reported on out as it completes.
+// Returns false when a check failed, the server cannot be reached or
+// config.scenario names no scenario.
+bool runScenario(const BenchConfig &config, std::ostream &out);
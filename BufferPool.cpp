@@ -0,0 +1,120 @@
+#include "BufferPool.hpp"
+#include "Protocol.hpp"
+#include "Metrics.hpp"
+#include <vector>
+#include <atomic>
+
+namespace
+{
+    struct SizeClass
+    {
+        size_t bytes; // Capacity of every frame in the class
+        size_t limit; // Most frames one thread keeps
+    };
+
+    // At most 2 MiB for each of the three small classes and 1 MiB for each
+    // of the two large ones, so THREAD_BYTES per thread; the largest holds any frame
+    const SizeClass SIZE_CLASSES[] = {
+        {256, 8192},
+        {1024, 2048},
+        {4096, 512},
+        {16 * 1024, 64},
+        {FRAME_LENGTH_SIZE + MAX_FRAME_SIZE, 16},
+    };
+    const size_t CLASS_COUNT = sizeof(SIZE_CLASSES) / sizeof(SIZE_CLASSES[0]);
+
+    // Pooled frames checked for a free one before a new one is made
+    const size_t PROBE_LIMIT = 16;
+
+    // Frame capacity kept by one thread's pool when every class is full, and
+    // by all pools together. Threaded mode encodes on one thread per client,
+    // so the process cap is what bounds the pool there; threads that find it
+    // used up allocate plainly, the way a full class does.
+    const size_t THREAD_BYTES = 8 * 1024 * 1024;
+    const size_t PROCESS_BYTES = 64 * 1024 * 1024;
+
+    std::atomic<size_t> retainedBytes(0);
+
+    // Takes bytes out of the process budget, false when it has no room left
+    bool reserve(size_t bytes)
+    {
+        size_t current = retainedBytes.load(std::memory_order_relaxed);
+        do
+        {
+            if (current + bytes > PROCESS_BYTES)
+            {
+                return false;
+            }
+        } while (!retainedBytes.compare_exchange_weak(current, current + bytes, std::memory_order_relaxed));
+        return true;
+    }
+
+    struct Ring
+    {
+        std::vector<std::shared_ptr<EncodedFrame>> frames; // In the order they were last handed out
+        size_t next = 0; // Oldest hand-out, looked at first
+    };
+
+    struct ThreadPool
+    {
+        Ring rings[CLASS_COUNT];
+        size_t bytes = 0; // Capacity of the frames in the rings
+
+        // Gives the thread's share of the budget back when it exits; frames
+        // still referenced elsewhere outlive the pool
+        ~ThreadPool()
+        {
+            retainedBytes.fetch_sub(bytes, std::memory_order_relaxed);
+        }
+    };
+
+    thread_local ThreadPool pool;
+
+    std::shared_ptr<EncodedFrame> allocate(size_t capacity)
+    {
+        Metrics::add(Counter::FrameAllocations);
+        std::shared_ptr<EncodedFrame> frame = std::make_shared<EncodedFrame>(std::string());
+        frame->reserve(capacity);
+        return frame;
+    }
+}
+
+std::shared_ptr<EncodedFrame> BufferPool::acquire(size_t bytes)
+{
+    size_t index = 0;
+    while (index < CLASS_COUNT && SIZE_CLASSES[index].bytes < bytes)
+    {
+        ++index;
+    }
+    if (index == CLASS_COUNT)
+    {
+        return allocate(bytes);
+    }
+
+    Ring &ring = pool.rings[index];
+    for (size_t probe = 0; probe < PROBE_LIMIT && probe < ring.frames.size(); ++probe)
+    {
+        std::shared_ptr<EncodedFrame> &candidate = ring.frames[ring.next];
+        ring.next = (ring.next + 1) % ring.frames.size();
+        if (candidate.use_count() == 1)
+        {
+            // The last other owner may have let go on another thread; its
+            // reads of the bytes happen before they are overwritten here
+            std::atomic_thread_fence(std::memory_order_acquire);
+            candidate->clear();
+            candidate->compressed.reset();
+            return candidate;
+        }
+    }
+
+    std::shared_ptr<EncodedFrame> frame = allocate(SIZE_CLASSES[index].bytes);
+    if (ring.frames.size() < SIZE_CLASSES[index].limit && pool.bytes + SIZE_CLASSES[index].bytes <= THREAD_BYTES &&
+        reserve(SIZE_CLASSES[index].bytes))
+    {
+        pool.bytes += SIZE_CLASSES[index].bytes;
+        // Joins the line right behind the cursor, as the newest hand-out
+        ring.frames.insert(ring.frames.begin() + ring.next, frame);
+        ring.next = (ring.next + 1) % ring.frames.size();
+    }
+    return frame;
+}
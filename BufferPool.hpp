@@ -0,0 +1,28 @@
+// BufferPool.hpp
+#pragma once
+#include "MessageBuffer.hpp"
+#include <memory>
+#include <cstddef>
+
+// Recycles the encoded frames of the server's hot path. Every thread that
+// encodes messages keeps its own pool with one ring of frames per size class.
+// A pooled frame is handed out again once no send queue, history slot or
+// batch refers to it any more, which the pool tells from the shared pointer's
+// use count; its string keeps its capacity and the shared pointer its control
+// block, so a warmed-up server encodes and fans out chat messages without
+// touching the heap. Frames are released roughly in the order they were
+// handed out, so the pool looks at the oldest ones first and only a few of
+// them. When those are all still in use and the class is full, or the frame
+// is larger than the largest class, a plain allocation is made instead.
+//
+// Retention is capped: a thread's pool keeps at most 8 MiB of frames, all
+// pools together at most 64 MiB, and a pool returns its share when its
+// thread exits. Once the process cap is reached, further threads, such as
+// the per-client threads of threaded mode, simply allocate.
+class BufferPool
+{
+public:
+    // An empty frame with room for at least bytes; append the encoded frame
+    // to it and hand it out as a MessageBuffer
+    static std::shared_ptr<EncodedFrame> acquire(size_t bytes);
+};
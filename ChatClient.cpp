@@ -1,38 +1,17 @@
 #include "ChatClient.hpp"
 #include "ConsoleUtils.hpp"
-#include <iostream>
-#include <cstring>
-#include <sstream>
+#include "Protocol.hpp"
+#include <chrono>
 
-#ifdef _WIN32
-bool ChatClient::initializeWinsock()
+ChatClient::ChatClient() : joinedOnce(false), reconnecting(false)
 {
-    WSADATA wsaData;
-    return WSAStartup(MAKEWORD(2, 2), &wsaData) == 0;
-}
-#endif
-
-ChatClient::ChatClient()
-{
-#ifdef _WIN32
-    if (!initializeWinsock())
-    {
-        std::cerr << "Failed to initialize Winsock\n";
-        exit(1);
-    }
-    clientSocket = socket(AF_INET, SOCK_STREAM, 0);
-    if (clientSocket == INVALID_SOCKET)
-    {
-        std::cerr << "Socket creation failed with error: " << WSAGetLastError() << std::endl;
-        WSACleanup();
-        exit(1);
-    }
-#else
-    clientSocket = socket(AF_INET, SOCK_STREAM, 0);
-#endif
-    running = false;
     // Initialize console colors
     initConsoleColors();
+
+    session.onMessage([this](const Frame &frame) { renderFrame(frame); });
+    // Everything one read produced is written to the terminal together
+    session.onBatch([this]() { incoming.flush(); });
+    session.onState([this](SessionState state, const std::string &detail) { renderState(state, detail); });
 }
 
 ChatClient::~ChatClient()
@@ -40,119 +19,173 @@ ChatClient::~ChatClient()
     disconnect();
 }
 
-bool ChatClient::connect(const std::string &serverIP, int port)
+JoinResult ChatClient::join(const std::string &serverIP, int port, const std::string &username)
 {
-    sockaddr_in serverAddr;
-    serverAddr.sin_family = AF_INET;
-    serverAddr.sin_port = htons(port);
-
-#ifdef _WIN32
-    inet_pton(AF_INET, serverIP.c_str(), &serverAddr.sin_addr);
-    if (::connect(clientSocket, (sockaddr *)&serverAddr, sizeof(serverAddr)) == SOCKET_ERROR)
+    SessionConfig config;
+    config.host = serverIP;
+    config.port = port;
+    config.username = username;
+    JoinResult result = session.open(config).get();
+    if (result != JoinResult::Joined)
     {
-        std::cerr << FORMAT_SYSTEM_MESSAGE("Connect failed with error: " + std::to_string(WSAGetLastError())) << std::endl;
-        closesocket(clientSocket);
-        WSACleanup();
-        return false;
+        // An interactive user would rather hear about it than wait for redials
+        session.close();
     }
-#else
-    inet_pton(AF_INET, serverIP.c_str(), &serverAddr.sin_addr);
-    if (::connect(clientSocket, (sockaddr *)&serverAddr, sizeof(serverAddr)) < 0)
-    {
-        std::cerr << FORMAT_SYSTEM_MESSAGE("Failed to connect to server") << std::endl;
-        return false;
-    }
-#endif
-
-    std::cout << FORMAT_SYSTEM_MESSAGE("Connected to server successfully") << std::endl;
-    running = true;
-    receiveThread = std::thread(&ChatClient::receiveMessages, this);
-    return true;
+    return result;
 }
 
-void ChatClient::receiveMessages()
+void ChatClient::renderState(SessionState state, const std::string &detail)
 {
-    char buffer[1024];
-    while (running)
+    switch (state)
     {
-#ifdef _WIN32
-        int bytesReceived = recv(clientSocket, buffer, sizeof(buffer), 0);
-        if (bytesReceived <= 0)
+    case SessionState::Joined:
+        if (reconnecting)
         {
-            break;
+            incoming.system("Reconnected to server");
         }
-#else
-        int bytesReceived = recv(clientSocket, buffer, sizeof(buffer), 0);
-        if (bytesReceived <= 0)
+        joinedOnce = true;
+        reconnecting = false;
+        break;
+    case SessionState::Refused:
+        incoming.system(detail);
+        break;
+    case SessionState::Disconnected:
+        // Told once; the session keeps redialing quietly until it is back
+        if (!joinedOnce || reconnecting)
         {
-            break;
+            return;
         }
-#endif
-        std::string rawMessage(buffer, bytesReceived);
-
-        // Parse message to get username and content
-        size_t colonPos = rawMessage.find(':');
-        if (colonPos != std::string::npos)
-        {
-            std::string username = rawMessage.substr(0, colonPos);
-            std::string messageContent = rawMessage.substr(colonPos + 1);
+        incoming.system("Disconnected from server, reconnecting...");
+        reconnecting = true;
+        break;
+    default:
+        return;
+    }
+    incoming.flush();
+}
 
-            // Special system messages
-            if (username == "SERVER")
-            {
-                if (messageContent.find("joined") != std::string::npos)
-                {
-                    std::cout << FORMAT_USER_JOIN(messageContent) << std::endl;
-                }
-                else if (messageContent.find("left") != std::string::npos)
-                {
-                    std::cout << FORMAT_USER_LEAVE(messageContent) << std::endl;
-                }
-                else
-                {
-                    std::cout << FORMAT_SYSTEM_MESSAGE(messageContent) << std::endl;
-                }
-                // Add separator line after system messages
-                std::cout << createSeparator() << std::endl;
-            }
-            else
-            {
-                // Regular message from another user with colorful border
-                std::cout << formatReceivedMessage(username, messageContent) << std::endl;
-                std::cout << createSeparator() << std::endl;
-            }
-        }
-        else
+void ChatClient::renderFrame(const Frame &frame)
+{
+    switch (frame.type)
+    {
+    case FrameType::Join:
+        incoming.userJoin(frame.sender);
+        break;
+    case FrameType::Leave:
+        incoming.userLeave(frame.sender);
+        break;
+    case FrameType::System:
+        incoming.system(frame.body);
+        break;
+    case FrameType::Chat:
+        // Regular message from another user with colorful border
+        incoming.chat(frame.sender, frame.room, frame.body);
+        break;
+    case FrameType::RoomJoin:
+        incoming.system(frame.sender + " joined #" + (frame.room.empty() ? DEFAULT_ROOM : frame.room));
+        break;
+    case FrameType::RoomLeave:
+        incoming.system(frame.sender + " left #" + (frame.room.empty() ? DEFAULT_ROOM : frame.room));
+        break;
+    case FrameType::Direct:
+        // The server's copy of a message this client sent, once it was delivered
+        incoming.bubble((frame.flags & FLAG_ECHO) ? "You -> " + frame.sender + " (private)" : frame.sender + " (private)",
+                        frame.body, std::string(BRIGHT_MAGENTA_COLOR));
+        break;
+    case FrameType::Who:
+    {
+        // One name per line, a tab and the server for users joined elsewhere
+        std::string names;
+        size_t count = 0;
+        size_t start = 0;
+        while (start < frame.body.size())
         {
-            // If message format is unexpected, print as is
-            std::cout << YELLOW_COLOR << rawMessage << RESET_COLOR << std::endl;
+            size_t end = frame.body.find('\n', start);
+            std::string line = frame.body.substr(start, end == std::string::npos ? std::string::npos : end - start);
+            size_t tab = line.find('\t');
+            names += (count++ == 0 ? "" : ", ") + (tab == std::string::npos ? line : line.substr(0, tab) + " (" + line.substr(tab + 1) + ")");
+            start = end == std::string::npos ? frame.body.size() : end + 1;
         }
+        incoming.system("Online (" + std::to_string(count) + "): " + names);
+        break;
     }
-
-    std::cout << FORMAT_SYSTEM_MESSAGE("Disconnected from server") << std::endl;
+    default:
+        // Unknown frame type from a newer server, print as is
+        incoming.line(YELLOW_COLOR, frame.body);
+        break;
+    }
+    incoming.separator();
 }
 
 void ChatClient::sendMessage(const std::string &message)
 {
-    // No need to format here since it will be formatted when echoed back
-    send(clientSocket, message.c_str(), message.length(), 0);
+    // Queued for the session's socket; drawing the echo does not hold it up
+    if (!session.post(message, currentRoom))
+    {
+        screen.system(message.size() > MAX_MESSAGE_LENGTH ? "Message too long, not sent" : "Not connected, message not sent");
+        screen.flush();
+        return;
+    }
 
     // Display the message locally with styling and border
-    std::cout << FORMAT_SENT_MESSAGE("You", message) << std::endl;
-    std::cout << createSeparator() << std::endl;
+    screen.sent(currentRoom, message);
+    screen.separator();
+    screen.flush();
 }
 
-void ChatClient::disconnect()
+void ChatClient::sendDirect(const std::string &recipient, const std::string &message)
+{
+    if (message.size() > MAX_MESSAGE_LENGTH)
+    {
+        screen.system("Message too long, not sent");
+        screen.flush();
+        return;
+    }
+    // Not echoed here: the server sends the message back once it reached
+    // recipient, or says why it did not. A future that is already settled
+    // means it was never queued.
+    std::future<bool> queued = session.sendDirect(recipient, message);
+    if (queued.wait_for(std::chrono::seconds(0)) == std::future_status::ready && !queued.get())
+    {
+        screen.system("Not connected, message not sent");
+        screen.flush();
+    }
+}
+
+void ChatClient::listUsers()
+{
+    session.who();
+}
+
+void ChatClient::search(const std::string &query)
+{
+    session.search(query);
+}
+
+void ChatClient::joinRoom(const std::string &room)
+{
+    session.joinRoom(room);
+}
+
+void ChatClient::leaveRoom(const std::string &room)
 {
-    running = false;
-    if (receiveThread.joinable())
+    std::string name = room == DEFAULT_ROOM ? "" : room;
+    session.leaveRoom(name);
+    if (name == currentRoom)
     {
-        receiveThread.join();
+        currentRoom.clear();
     }
-#ifdef _WIN32
-    closesocket(clientSocket);
-    WSACleanup();
-#else
-    close(clientSocket);
-#endif
+}
+
+void ChatClient::switchRoom(const std::string &room)
+{
+    currentRoom = room == DEFAULT_ROOM ? "" : room;
+    screen.system("Now talking in #" + (currentRoom.empty() ? std::string(DEFAULT_ROOM) : currentRoom));
+    screen.flush();
+}
+
+void ChatClient::disconnect()
+{
+    // Writes what is still queued and says goodbye
+    session.close();
 }
@@ -1,39 +1,36 @@
 #pragma once
+#include "ChatSession.hpp"
+#include "TerminalRenderer.hpp"
 #include <string>
-#include <thread>
-
-#ifdef _WIN32
-#include <winsock2.h>
-#include <ws2tcpip.h>
-#pragma comment(lib, "ws2_32.lib")
-typedef SOCKET socket_t;
-#define SOCKET_ERROR_VAL INVALID_SOCKET
-#else
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
-#include <unistd.h>
-typedef int socket_t;
-#define SOCKET_ERROR_VAL -1
-#endif
 
+// Interactive terminal front end on a ChatSession: draws what arrives and
+// echoes what is typed. The session does all networking on its own thread,
+// so typing never waits for output being drawn and the other way round.
 class ChatClient
 {
 private:
-    socket_t clientSocket;
-    std::thread receiveThread;
-    bool running;
-
-    void receiveMessages();
+    ChatSession session;
+    std::string currentRoom;   // Room plain messages go to, empty for the lobby
+    TerminalRenderer screen;   // Drawing from the input thread
+    TerminalRenderer incoming; // Drawing from the session's thread
+    bool joinedOnce;           // Session thread: the name was accepted at least once
+    bool reconnecting;         // Session thread: the connection dropped and is being redialed
 
-#ifdef _WIN32
-    static bool initializeWinsock();
-#endif
+    void renderFrame(const Frame &frame);
+    void renderState(SessionState state, const std::string &detail);
 
 public:
     ChatClient();
     ~ChatClient();
-    bool connect(const std::string &serverIP, int port);
+    // Connects and joins as username; NameTaken leaves the client ready for another try
+    JoinResult join(const std::string &serverIP, int port, const std::string &username);
     void sendMessage(const std::string &message);
+    void sendDirect(const std::string &recipient, const std::string &message);
+    void listUsers();
+    void search(const std::string &query);
+    void joinRoom(const std::string &room);
+    void leaveRoom(const std::string &room);
+    // Later messages go to room; the client must have joined it
+    void switchRoom(const std::string &room);
     void disconnect();
-};
\ No newline at end of file
+};
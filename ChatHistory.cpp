@@ -0,0 +1,136 @@
+#include "ChatHistory.hpp"
+#include "Protocol.hpp"
+#include <algorithm>
+
+ChatHistory::ChatHistory(size_t capacity)
+    : slotCount(capacity), slots(new Slot[capacity]), nextTicket(1)
+{
+    for (size_t i = 0; i < slotCount; ++i)
+    {
+        slots[i].sequence = 0;
+        slots[i].position = 0;
+    }
+}
+
+void ChatHistory::append(const MessageBuffer &entry)
+{
+    if (slotCount == 0)
+    {
+        return;
+    }
+
+    uint64_t position = entry ? frameSequence(entry->data(), entry->size()) : 0;
+    uint64_t ticket = nextTicket.fetch_add(1);
+    Slot &slot = slots[ticket % slotCount];
+
+    std::lock_guard<std::mutex> lock(slot.lock);
+    // A slower writer holding an older ticket must not overwrite a newer entry
+    if (slot.sequence < ticket)
+    {
+        slot.sequence = ticket;
+        slot.position = position;
+        slot.entry = entry;
+    }
+}
+
+std::vector<MessageBuffer> ChatHistory::recent(size_t count) const
+{
+    std::vector<MessageBuffer> entries;
+    if (slotCount == 0 || count == 0)
+    {
+        return entries;
+    }
+
+    uint64_t end = nextTicket.load();
+    uint64_t available = end - 1;
+    if (count > slotCount)
+    {
+        count = slotCount;
+    }
+    if (count > available)
+    {
+        count = static_cast<size_t>(available);
+    }
+
+    entries.reserve(count);
+    for (uint64_t ticket = end - count; ticket < end; ++ticket)
+    {
+        Slot &slot = slots[ticket % slotCount];
+        std::lock_guard<std::mutex> lock(slot.lock);
+        // Skip entries that were overwritten meanwhile or whose writer has not finished
+        if (slot.sequence == ticket)
+        {
+            entries.push_back(slot.entry);
+        }
+    }
+    return entries;
+}
+
+std::vector<MessageBuffer> ChatHistory::since(uint64_t position, bool &complete) const
+{
+    std::vector<MessageBuffer> entries;
+    complete = true;
+    if (slotCount == 0)
+    {
+        return entries;
+    }
+
+    // Sequence numbers are handed out before the ring tickets, so writers that
+    // race can store them out of order: an entry numbered after position may
+    // sit behind one numbered before it. The whole retained window is walked,
+    // newest first, and every entry numbered after position is kept.
+    uint64_t end = nextTicket.load();
+    uint64_t oldest = end - 1 > slotCount ? end - slotCount : 1;
+    bool reached = false;
+    for (uint64_t ticket = end - 1; ticket >= oldest && ticket > 0; --ticket)
+    {
+        Slot &slot = slots[ticket % slotCount];
+        std::lock_guard<std::mutex> lock(slot.lock);
+        // Its writer has the ticket but has not stored the entry yet, or a
+        // newer one overwrote it: nothing to send
+        if (slot.sequence != ticket)
+        {
+            continue;
+        }
+        // Only a numbered entry marks where the client left off; one without
+        // a number is sent when it is newer than the newest such mark
+        if (slot.position == 0 ? !reached : slot.position > position)
+        {
+            entries.push_back(slot.entry);
+        }
+        else if (slot.position != 0)
+        {
+            reached = true;
+        }
+    }
+    // Without an entry at or before position, the ring only has it all when it never wrapped
+    complete = reached || end - 1 <= slotCount;
+    std::reverse(entries.begin(), entries.end());
+    return entries;
+}
+
+ChatHistory::Lookup ChatHistory::at(uint64_t ticket, MessageBuffer &entry) const
+{
+    if (slotCount == 0 || ticket == 0 || ticket >= nextTicket.load())
+    {
+        return Lookup::Pending;
+    }
+    Slot &slot = slots[ticket % slotCount];
+    std::lock_guard<std::mutex> lock(slot.lock);
+    if (slot.sequence < ticket)
+    {
+        return Lookup::Pending;
+    }
+    if (slot.sequence > ticket)
+    {
+        return Lookup::Gone;
+    }
+    entry = slot.entry;
+    return Lookup::Found;
+}
+
+size_t ChatHistory::size() const
+{
+    uint64_t stored = nextTicket.load() - 1;
+    return stored < slotCount ? static_cast<size_t>(stored) : slotCount;
+}
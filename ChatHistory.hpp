@@ -0,0 +1,62 @@
+// ChatHistory.hpp
+#pragma once
+#include "MessageBuffer.hpp"
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <cstdint>
+
+// Fixed-capacity ring buffer of the most recent messages (encoded frames).
+// All slots are allocated up front and reused, so memory stays flat no matter
+// how long the server runs, and slots share the buffers that were broadcast.
+// Writers claim a slot with one atomic increment and then lock only that slot,
+// so concurrent handler threads do not serialize on a single history lock.
+// Entries are also found by the server sequence number in their frame, so a
+// returning client can be sent just what came after the last one it saw.
+class ChatHistory
+{
+private:
+    struct Slot
+    {
+        std::mutex lock;
+        uint64_t sequence; // Ticket of the entry stored here, 0 when empty
+        uint64_t position; // Server sequence number in the entry's frame, 0 when it has none
+        MessageBuffer entry;
+    };
+
+    size_t slotCount;
+    std::unique_ptr<Slot[]> slots;
+    std::atomic<uint64_t> nextTicket;
+
+public:
+    // What at() found for an entry number
+    enum class Lookup
+    {
+        Found,
+        Pending, // Its writer has the number but has not stored the entry yet
+        Gone     // Overwritten by a newer entry
+    };
+
+    explicit ChatHistory(size_t capacity);
+
+    void append(const MessageBuffer &entry);
+
+    // Up to count most recent entries, oldest first
+    std::vector<MessageBuffer> recent(size_t count) const;
+
+    // Entries numbered after position, in the order they were appended, and
+    // any without a number appended after the newest one numbered up to
+    // position; entries still being written are left out. Walks the whole
+    // ring. complete is false when some of them were already overwritten.
+    std::vector<MessageBuffer> since(uint64_t position, bool &complete) const;
+
+    // Entries are numbered from 1 in the order they were appended; this is
+    // the number the next one gets
+    uint64_t end() const { return nextTicket.load(); }
+    // Entry number ticket, for readers that follow the ring as it fills
+    Lookup at(uint64_t ticket, MessageBuffer &entry) const;
+
+    size_t size() const;
+    size_t capacity() const { return slotCount; }
+};
@@ -1,20 +1,88 @@
 #include "ChatServer.hpp"
 #include "ConsoleUtils.hpp"
+#include "EpollReactor.hpp"
+#include "UringReactor.hpp"
+#include "AdminServer.hpp"
+#include "Metrics.hpp"
+#ifdef COUNT_ALLOCATIONS
+#include "AllocationCounter.hpp"
+#endif
+#include "BufferPool.hpp"
 #include <iostream>
 #include <algorithm>
 #include <cstring>
-#include <map>
+#include <cstdint>
 #include <sstream>
+#include <chrono>
+#include <future>
 
-// Client information structure
-struct ClientInfo
+namespace
 {
-    std::string username;
-    socket_t socket;
-};
+    // Label values may not contain raw quotes, backslashes or newlines
+    std::string labelValue(const std::string &text)
+    {
+        std::string escaped;
+        for (char c : text)
+        {
+            if (c == '"' || c == '\\')
+            {
+                escaped += '\\';
+                escaped += c;
+            }
+            else if (c == '\n')
+            {
+                escaped += "\\n";
+            }
+            else
+            {
+                escaped += c;
+            }
+        }
+        return escaped;
+    }
+
+    // Rooms a predecessor handed over with their history, held until the
+    // clients in them are back; shards adopt those on their own threads, so
+    // the last adoption task to finish lets go of them
+    struct InheritedRooms
+    {
+        RoomRegistry &registry;
+        std::vector<std::shared_ptr<Room>> rooms;
+
+        explicit InheritedRooms(RoomRegistry &owner) : registry(owner) {}
+        ~InheritedRooms()
+        {
+            for (const std::shared_ptr<Room> &room : rooms)
+            {
+                registry.release(room);
+            }
+        }
+    };
+
+#ifdef SO_REUSEPORT
+    // Whether a socket that shares nothing can bind port: a sharded listener
+    // would also bind a port that another sharded server's SO_REUSEPORT
+    // listeners already hold and join their group
+    bool portIsFree(int port)
+    {
+        socket_t probe = socket(AF_INET, SOCK_STREAM, 0);
+        if (probe < 0)
+        {
+            return false;
+        }
+        int opt = 1;
+        setsockopt(probe, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
 
-// Global map to store client info
-std::map<socket_t, std::string> clientUsernames;
+        sockaddr_in addr;
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = INADDR_ANY;
+        bool free = bind(probe, (sockaddr *)&addr, sizeof(addr)) == 0;
+        close(probe);
+        return free;
+    }
+#endif
+}
 
 #ifdef _WIN32
 bool ChatServer::initializeWinsock()
@@ -24,7 +92,12 @@ bool ChatServer::initializeWinsock()
 }
 #endif
 
-ChatServer::ChatServer(int port)
+ChatServer::ChatServer(int port, const ServerConfig &serverConfig)
+    : config(serverConfig), running(false), compressionClients(0), flood(serverConfig.flood),
+      lastSequence(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(
+          std::chrono::system_clock::now().time_since_epoch()).count())),
+      pingMessage(makeMessageBuffer(encodeFrame(FrameType::Ping, "", ""))), handingOff(false), transferred(false),
+      handoffListener(SOCKET_ERROR_VAL), handoffChannel(SOCKET_ERROR_VAL), activeHandlers(0)
 {
 #ifdef _WIN32
     if (!initializeWinsock())
@@ -32,6 +105,117 @@ ChatServer::ChatServer(int port)
         std::cerr << "Failed to initialize Winsock\n";
         exit(1);
     }
+#endif
+
+    // Initialize console colors
+    initConsoleColors();
+
+    // Either bind the port, or inherit the listeners and clients of the server this one replaces
+    HandoffState inherited;
+    if (config.takeoverPath.empty())
+    {
+        openListener(port);
+    }
+    else
+    {
+        takeOver(inherited, port);
+        // Clients hold numbers from the predecessor; never hand out one of those again
+        if (inherited.sequence > lastSequence.load())
+        {
+            lastSequence = inherited.sequence;
+        }
+    }
+
+    createReactors(port, inherited.listeners);
+
+    if (!config.log.directory.empty())
+    {
+        messageLog.reset(new MessageLog());
+        if (!messageLog->open(config.log))
+        {
+            std::cout << YELLOW_COLOR "Continuing without a durable message log" RESET_COLOR << std::endl;
+            messageLog.reset();
+        }
+    }
+
+    // Sized once the shard count is known; rooms track their members per shard
+    rooms.reset(new RoomRegistry(config.historyDepth, reactors.empty() ? 1 : reactors.size(), config.maxRooms > 0 ? config.maxRooms : 1,
+                                 messageLog.get()));
+    lobby = rooms->acquire(DEFAULT_ROOM);
+    adoptClients(inherited);
+
+    // Reactors defer writes on their own loop; handler threads share one flusher
+    if (config.mode == ServerMode::Threaded && config.delivery.mode == DeliveryMode::Coalesce)
+    {
+        coalescer.reset(new WriteCoalescer(config.delivery));
+        coalescer->start();
+    }
+    if (config.mode == ServerMode::Threaded && livenessEnabled())
+    {
+        heartbeats.reset(new HeartbeatMonitor([this](Liveness &liveness)
+                                              {
+                                                  std::shared_ptr<const ClientRegistry::Client> client = clients.find(liveness.socket);
+                                                  if (!client)
+                                                  {
+                                                      return TimerWheel::Clock::time_point::max();
+                                                  }
+                                                  return checkLiveness(liveness, client->state == ClientState::Joined); },
+                                              std::chrono::milliseconds(LIVENESS_TICK_MS)));
+        heartbeats->start();
+    }
+
+    // Reloaded or inherited history is indexed on the first passes
+    indexer.reset(new SearchIndexer([this]()
+                                    { return indexRooms(); },
+                                    std::chrono::milliseconds(SEARCH_INDEX_INTERVAL_MS)));
+    indexer->start();
+
+    if (config.adminPort > 0 || !config.adminSocket.empty())
+    {
+        admin.reset(new AdminServer([this]()
+                                    { return renderMetrics(); }));
+        admin->start(config.adminPort, config.adminSocket);
+    }
+
+    if (config.federation.port > 0 || !config.federation.peers.empty())
+    {
+        if (config.federation.nodeName.empty())
+        {
+            char host[256] = "localhost";
+            gethostname(host, sizeof(host) - 1);
+            config.federation.nodeName = std::string(host) + ":" + std::to_string(port);
+        }
+        federation.reset(new Federation(
+            config.federation,
+            [this](const std::string &room, FrameType type, const std::string &sender, const std::string &body)
+            { deliverRemote(room, type, sender, body); },
+            [this](std::vector<std::string> &roomNames, std::vector<std::string> &users)
+            { describeLocal(roomNames, users); },
+            [this](const std::string &text)
+            {
+                Logger::text(LogLevel::Info, text);
+                broadcastMessage(makeMessageBuffer(encodeFrame(FrameType::System, "", text)), SOCKET_ERROR_VAL);
+            }));
+        if (!federation->start())
+        {
+            std::cout << YELLOW_COLOR "Continuing without peer servers" RESET_COLOR << std::endl;
+            federation.reset();
+        }
+    }
+
+    if (!config.handoffPath.empty())
+    {
+        handoffListener = Handoff::listen(config.handoffPath);
+        if (handoffListener == SOCKET_ERROR_VAL)
+        {
+            std::cout << YELLOW_COLOR "Continuing without hot restart" RESET_COLOR << std::endl;
+        }
+    }
+}
+
+void ChatServer::openListener(int &port)
+{
+#ifdef _WIN32
     serverSocket = socket(AF_INET, SOCK_STREAM, 0);
     if (serverSocket == INVALID_SOCKET)
     {
@@ -48,9 +232,6 @@ ChatServer::ChatServer(int port)
     }
 #endif
 
-    // Initialize console colors
-    initConsoleColors();
-
     // Allow reuse of address
 #ifdef _WIN32
     char opt = 1;
@@ -59,6 +240,14 @@ ChatServer::ChatServer(int port)
     int opt = 1;
     setsockopt(serverSocket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
 #endif
+#ifdef SO_REUSEPORT
+    if (config.mode == ServerMode::Sharded)
+    {
+        // Every shard binds its own listener to this port and the kernel spreads
+        // accepts across them; the bind below first checks nobody else holds it
+        setsockopt(serverSocket, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
+    }
+#endif
 
     // Try to bind to the requested port, if fails try alternative ports
     int currentPort = port;
@@ -86,7 +275,14 @@ ChatServer::ChatServer(int port)
             currentPort++;
         }
 #else
-        if (bind(serverSocket, (sockaddr *)&serverAddr, sizeof(serverAddr)) == 0)
+        bool portFree = true;
+#ifdef SO_REUSEPORT
+        if (config.mode == ServerMode::Sharded)
+        {
+            portFree = portIsFree(currentPort);
+        }
+#endif
+        if (portFree && bind(serverSocket, (sockaddr *)&serverAddr, sizeof(serverAddr)) == 0)
         {
             bindSuccessful = true;
             break;
@@ -123,6 +319,7 @@ ChatServer::ChatServer(int port)
     {
         std::cout << GREEN_COLOR "Successfully bound to alternative port: " << currentPort << RESET_COLOR << std::endl;
         std::cout << YELLOW_COLOR "Clients should connect to port " << currentPort << " instead of " << port << RESET_COLOR << std::endl;
+        port = currentPort;
     }
 
 #ifdef _WIN32
@@ -141,8 +338,133 @@ ChatServer::ChatServer(int port)
         exit(1);
     }
 #endif
+}
 
-    running = false;
+void ChatServer::createReactors(int port, const std::vector<socket_t> &inheritedListeners)
+{
+    size_t shardCount = 1;
+    if (config.mode == ServerMode::Sharded)
+    {
+        shardCount = config.shards > 0 ? config.shards : std::thread::hardware_concurrency();
+        if (shardCount == 0)
+        {
+            shardCount = 1;
+        }
+        // Every listener of a sharded predecessor gets a shard again: closing
+        // one would reset the connections still waiting in its backlog
+        shardCount = std::max(shardCount, inheritedListeners.size());
+    }
+    else
+    {
+        for (size_t i = 1; i < inheritedListeners.size(); ++i)
+        {
+            closeSocket(inheritedListeners[i]);
+        }
+    }
+
+    if (config.mode == ServerMode::Threaded)
+    {
+        return;
+    }
+
+    // Shards other than the first own their listener from the moment they are
+    // constructed, so a shard that fails to open closes it on the way out
+    size_t next = 0;
+    while (next < shardCount)
+    {
+        size_t i = next++;
+        // Shard 0 reuses the primary socket, the others get their own on the same port
+        socket_t listener = (i == 0) ? serverSocket
+                            : (i < inheritedListeners.size()) ? inheritedListeners[i]
+                                                              : openShardListener(port);
+        if (listener == SOCKET_ERROR_VAL)
+        {
+            std::cout << YELLOW_COLOR "Could not open a listener for shard " << i << ", continuing with " << i << " shards" RESET_COLOR << std::endl;
+            break;
+        }
+
+        std::unique_ptr<Reactor> shard;
+        if (config.ioBackend == IoBackend::IoUring)
+        {
+            shard.reset(new UringReactor(*this, listener, i != 0, reactors.size()));
+            if (!shard->open())
+            {
+                shard.reset();
+                if (i != 0)
+                {
+                    // Its listener went with it; the shards before it keep running
+                    break;
+                }
+                // Decided once, on the first shard: every shard runs the same backend
+                std::cout << YELLOW_COLOR "io_uring unavailable on this kernel, using epoll" RESET_COLOR << std::endl;
+                config.ioBackend = IoBackend::Epoll;
+            }
+        }
+        if (!shard)
+        {
+            shard.reset(new EpollReactor(*this, listener, i != 0, reactors.size()));
+            if (!shard->open())
+            {
+                break;
+            }
+        }
+        reactors.push_back(std::move(shard));
+    }
+    // Inherited listeners of shards that were never created; the primary
+    // socket stays open for a threaded fallback, and outside sharded mode the
+    // rest were closed above
+    for (size_t i = std::max<size_t>(next, 1); i < std::min(shardCount, inheritedListeners.size()); ++i)
+    {
+        closeSocket(inheritedListeners[i]);
+    }
+
+    if (reactors.empty())
+    {
+        std::cout << YELLOW_COLOR "Event loop unavailable on this system, falling back to threaded mode" RESET_COLOR << std::endl;
+        config.mode = ServerMode::Threaded;
+    }
+    else
+    {
+        if (reactors.size() > 1)
+        {
+            for (const std::unique_ptr<Reactor> &shard : reactors)
+            {
+                shard->connectShards(reactors.size());
+            }
+        }
+        const char *backend = (config.ioBackend == IoBackend::IoUring) ? "io_uring" : "epoll";
+        std::cout << BLUE_COLOR "Running " << reactors.size() << " " << backend << " reactor"
+                  << (reactors.size() == 1 ? "" : "s") << RESET_COLOR << std::endl;
+    }
+}
+
+socket_t ChatServer::openShardListener(int port)
+{
+#ifdef SO_REUSEPORT
+    socket_t listener = socket(AF_INET, SOCK_STREAM, 0);
+    if (listener < 0)
+    {
+        return SOCKET_ERROR_VAL;
+    }
+
+    int opt = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    setsockopt(listener, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
+
+    sockaddr_in serverAddr;
+    serverAddr.sin_family = AF_INET;
+    serverAddr.sin_port = htons(port);
+    serverAddr.sin_addr.s_addr = INADDR_ANY;
+    if (bind(listener, (sockaddr *)&serverAddr, sizeof(serverAddr)) < 0 || listen(listener, SOMAXCONN) < 0)
+    {
+        closeSocket(listener);
+        return SOCKET_ERROR_VAL;
+    }
+    return listener;
+#else
+    (void)port;
+    return SOCKET_ERROR_VAL;
+#endif
 }
 
 ChatServer::~ChatServer()
@@ -154,9 +476,62 @@ void ChatServer::start()
 {
     running = true;
     std::cout << FORMAT_SYSTEM_MESSAGE("Server started. Waiting for connections...") << std::endl;
+    if (handoffListener != SOCKET_ERROR_VAL)
+    {
+        handoffWatcher = std::thread(&ChatServer::watchForSuccessor, this);
+    }
 
-    while (running)
+    // The loops also return when a successor asks for a handoff, and pick up
+    // where they left off should it fail
+    do
+    {
+        if (!reactors.empty())
+        {
+            // Shard 0 runs on the calling thread, every other shard gets its own
+            std::vector<std::thread> shardThreads;
+            for (size_t i = 1; i < reactors.size(); ++i)
+            {
+                shardThreads.push_back(std::thread(&Reactor::run, reactors[i].get()));
+            }
+            reactors[0]->run();
+            for (std::thread &shardThread : shardThreads)
+            {
+                shardThread.join();
+            }
+        }
+        else
+        {
+            runThreaded();
+        }
+    } while (handingOff && !handOff() && running);
+}
+
+void ChatServer::runThreaded()
+{
+    // Clients adopted from a predecessor, or parked by a handoff that failed
+    std::vector<ParkedClient> waiting;
+    {
+        std::lock_guard<std::mutex> guard(parkLock);
+        waiting.swap(parked);
+    }
+    for (const ParkedClient &client : waiting)
+    {
+        spawnHandler(client);
+    }
+
+    while (running && !handingOff)
     {
+        // Polled rather than blocking in accept(), so a handoff can stop the loop
+        // without shutting the listener down under its successor
+        pollfd_t pfd;
+        pfd.fd = serverSocket;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        if (pollSockets(&pfd, 1, ACCEPT_POLL_MS) <= 0)
+        {
+            continue;
+        }
+
 #ifdef _WIN32
         socket_t clientSocket = accept(serverSocket, nullptr, nullptr);
         if (clientSocket != INVALID_SOCKET)
@@ -165,130 +540,1646 @@ void ChatServer::start()
         if (clientSocket >= 0)
 #endif
         {
-            std::lock_guard<std::mutex> lock(clientsMutex);
-            clientSockets.push_back(clientSocket);
-            std::cout << BLUE_COLOR << "New client connected. Socket ID: " << clientSocket << RESET_COLOR << std::endl;
-            std::thread(&ChatServer::handleClient, this, clientSocket).detach();
+            // Writes go through the client's queue, so the socket must never block
+            setNonBlocking(clientSocket);
+            setNoDelay(clientSocket);
+            std::shared_ptr<SendQueue> outbound(new SendQueue(clientSocket, config.sendQueueLimit, config.overflowPolicy));
+
+            Metrics::add(Counter::ConnectionsOpened);
+            clients.add(clientSocket, ClientRegistry::NO_SHARD, outbound);
+            Logger::event(LogLevel::Info, LogEvent::Connect, "", "", clientSocket);
+            ParkedClient client;
+            client.session.outbound = outbound;
+            spawnHandler(client);
         }
     }
+
+    if (handingOff)
+    {
+        // Every handler parks its client by its next poll timeout
+        std::unique_lock<std::mutex> guard(parkLock);
+        parkChanged.wait(guard, [this]()
+                         { return activeHandlers == 0; });
+    }
 }
 
-void ChatServer::handleClient(socket_t clientSocket)
+void ChatServer::spawnHandler(const ParkedClient &client)
 {
-    char buffer[1024];
-
-    // First message from client should be username
-#ifdef _WIN32
-    int bytesReceived = recv(clientSocket, buffer, sizeof(buffer), 0);
-    if (bytesReceived <= 0)
     {
-        return;
+        std::lock_guard<std::mutex> guard(parkLock);
+        ++activeHandlers;
     }
-#else
-    int bytesReceived = recv(clientSocket, buffer, sizeof(buffer), 0);
-    if (bytesReceived <= 0)
+    std::thread(&ChatServer::handleClient, this, client).detach();
+}
+
+void ChatServer::handleClient(ParkedClient client)
+{
+    ClientSession &session = client.session;
+    FrameParser &parser = client.parser;
+    std::shared_ptr<SendQueue> outbound = session.outbound;
+    socket_t clientSocket = outbound->getSocket();
+
+    // Read in large chunks; the parser pulls out however many frames arrived,
+    // each into the same Frame so its strings keep their capacity
+    char buffer[RECV_BUFFER_SIZE];
+    Frame &frame = client.frame;
+    bool open = true;
+    bool parking = false;
+    Liveness liveness(clientSocket);
+    if (heartbeats)
     {
-        return;
+        heartbeats->watch(liveness, checkLiveness(liveness, !session.username.empty()));
     }
-#endif
 
-    std::string username(buffer, bytesReceived);
-    clientUsernames[clientSocket] = username;
-    std::string joinMessage = "SERVER:" + username + " joined the chat";
-
-    // Add to chat history and notify others
-    chatHistory.push_back(joinMessage);
-    broadcastMessage(joinMessage, clientSocket);
+    while (running && open)
+    {
+        if (handingOff)
+        {
+            parking = true;
+            break;
+        }
 
-    std::cout << FORMAT_USER_JOIN(username) << std::endl;
+        // Flood control holds a frame back without holding up the loop: until
+        // it is due nothing more is read, so the client's socket buffer fills
+        // and TCP makes it wait, but output is still flushed and a handoff or
+        // shutdown still noticed
+        int timeout = FLUSH_RETRY_MS;
+        if (client.held)
+        {
+            int64_t wait = session.flood.heldUntil - std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+            if (wait > 0)
+            {
+                timeout = static_cast<int>(std::min<int64_t>(FLUSH_RETRY_MS, (wait + 999999) / 1000000));
+            }
+            else
+            {
+                open = processFrame(clientSocket, session, frame);
+                client.held = open && session.flood.heldUntil != 0;
+            }
+        }
+        while (open && !client.held && parser.next(frame))
+        {
+            open = processFrame(clientSocket, session, frame);
+            client.held = open && session.flood.heldUntil != 0;
+        }
+        if (!open || parser.hasError())
+        {
+            break;
+        }
 
-    // Handle other messages
-    while (running)
-    {
-#ifdef _WIN32
-        bytesReceived = recv(clientSocket, buffer, sizeof(buffer), 0);
-        if (bytesReceived <= 0)
-#else
-        bytesReceived = recv(clientSocket, buffer, sizeof(buffer), 0);
-        if (bytesReceived <= 0)
-#endif
+        // Also wait for writability while a slow reader still has queued output.
+        // Broadcasts flush opportunistically, so the timeout only matters when
+        // one of those flushes hit a full socket buffer. Output the coalescer
+        // is holding back is left to it.
+        pollfd_t pfd;
+        pfd.fd = clientSocket;
+        pfd.events = client.held ? 0 : POLLIN;
+        pfd.revents = 0;
+        if (outbound->hasPending() && !outbound->isScheduled())
+        {
+            pfd.events |= POLLOUT;
+        }
+        int ready = pollSockets(&pfd, 1, timeout);
+        if (ready < 0 && !socketWouldBlock())
         {
             break;
         }
+        if (ready <= 0)
+        {
+            continue;
+        }
 
-        std::string messageContent(buffer, bytesReceived);
-        std::string formattedMessage = username + ":" + messageContent;
+        if ((pfd.revents & POLLOUT) && outbound->flush() == SendQueue::FlushResult::Failed)
+        {
+            break;
+        }
+        if (client.held && (pfd.revents & (POLLHUP | POLLERR)))
+        {
+            break;
+        }
+        if (client.held || !(pfd.revents & (POLLIN | POLLHUP | POLLERR)))
+        {
+            continue;
+        }
 
-        // Log the message to server console
-        std::cout << CYAN_COLOR << "[" << username << "]: " << RESET_COLOR << messageContent << std::endl;
+        int bytesReceived = recv(clientSocket, buffer, sizeof(buffer), 0);
+        if (bytesReceived < 0 && socketWouldBlock())
+        {
+            continue;
+        }
+        if (bytesReceived <= 0)
+        {
+            break;
+        }
 
-        // Save to chat history
-        chatHistory.push_back(formattedMessage);
+        liveness.touch();
+        Metrics::add(Counter::BytesIn, bytesReceived);
+        parser.feed(buffer, bytesReceived);
+    }
 
-        // Send to other clients
-        broadcastMessage(formattedMessage, clientSocket);
+    if (heartbeats)
+    {
+        heartbeats->forget(liveness);
+    }
+    if (parking)
+    {
+        // Stays open, registered and in its rooms; the handoff decides who serves it next
+        std::lock_guard<std::mutex> guard(parkLock);
+        parked.push_back(std::move(client));
+        --activeHandlers;
+        parkChanged.notify_all();
+        return;
     }
 
     // Handle client disconnect
+    clients.remove(clientSocket);
+    if (!session.username.empty())
     {
-        std::lock_guard<std::mutex> lock(clientsMutex);
-        auto it = std::find(clientSockets.begin(), clientSockets.end(), clientSocket);
-        if (it != clientSockets.end())
-        {
-            clientSockets.erase(it);
-        }
+        announceLeave(clientSocket, session);
     }
 
-    // Get username before removing from map
-    std::string disconnectedUsername = clientUsernames[clientSocket];
-    std::string leaveMessage = "SERVER:" + disconnectedUsername + " left the chat";
-    clientUsernames.erase(clientSocket);
-
-    // Broadcast that user has left
-    chatHistory.push_back(leaveMessage);
-    broadcastMessage(leaveMessage, SOCKET_ERROR_VAL);
+    closeSocket(clientSocket);
+    Metrics::add(Counter::ConnectionsClosed);
 
-    std::cout << FORMAT_USER_LEAVE(disconnectedUsername) << std::endl;
-
-#ifdef _WIN32
-    closesocket(clientSocket);
-#else
-    close(clientSocket);
-#endif
+    std::lock_guard<std::mutex> guard(parkLock);
+    --activeHandlers;
+    parkChanged.notify_all();
 }
 
-void ChatServer::broadcastMessage(const std::string &message, socket_t sender)
+std::shared_ptr<Room> ClientSession::findRoom(const std::string &name) const
 {
-    std::lock_guard<std::mutex> lock(clientsMutex);
-    for (socket_t client : clientSockets)
+    for (const std::shared_ptr<Room> &room : rooms)
     {
-        if (client != sender)
+        if (room->name() == name)
         {
-            send(client, message.c_str(), message.length(), 0);
+            return room;
         }
     }
+    return std::shared_ptr<Room>();
 }
 
-void ChatServer::stop()
+bool ChatServer::processFrame(socket_t clientSocket, ClientSession &session, const Frame &frame)
 {
-    running = false;
-    std::cout << FORMAT_SYSTEM_MESSAGE("Shutting down server...") << std::endl;
+    // A frame flood control held back was counted the first time
+    if (session.flood.heldUntil == 0)
+    {
+        Metrics::add(Counter::MessagesIn);
+    }
 
-    for (socket_t client : clientSockets)
+    if (session.username.empty())
     {
-#ifdef _WIN32
-        closesocket(client);
-#else
-        close(client);
-#endif
+        // First frame from client must be the username handshake
+        if (frame.type != FrameType::Join || frame.sender.empty() || frame.sender.size() > MAX_USERNAME_LENGTH)
+        {
+            return false;
+        }
+        session.flood.heldUntil = 0;
+        uint64_t lastSeen = 0;
+        std::vector<std::string> resumeRooms;
+        bool resuming = parseResume(frame.body, lastSeen, resumeRooms);
+        // Names joined on peer servers count too; two servers admitting the
+        // same name at the same instant both let it through
+        if ((federation && !federation->nodeOf(frame.sender).empty()) ||
+            (!clients.join(clientSocket, frame.sender) && !(resuming && takeOver(clientSocket, session, frame.sender))))
+        {
+            // Still handshaking: the client may send another Join with a different name
+            // Carries the refused name, so a client tells it from other notices
+            sendToClient(clientSocket, std::vector<MessageBuffer>(1, makeMessageBuffer(
+                encodeFrame(FrameType::System, frame.sender, "Username " + frame.sender + " is already taken, pick another one"))));
+            return true;
+        }
+        if (session.flood.heldUntil != 0)
+        {
+            // Waiting for the stale session to close
+            return true;
+        }
+        session.takeoverUntil = 0;
+        session.username = frame.sender;
+        if (config.compressMin > 0 && (frame.flags & FLAG_COMPRESSION))
+        {
+            // Before the join replay, so history already goes out compressed
+            enableCompression(clientSocket, session);
+        }
+        // A Join with a body comes from a client that reconnects
+        if (resuming)
+        {
+            resumeSession(clientSocket, session, lastSeen, resumeRooms);
+        }
+        else
+        {
+            announceJoin(clientSocket, session);
+        }
+        return true;
+    }
+
+    // Frames without a room name address the lobby
+    std::string roomName = frame.room.empty() ? std::string(DEFAULT_ROOM) : frame.room;
+
+    switch (frame.type)
+    {
+    case FrameType::Chat:
+    {
+        std::chrono::steady_clock::time_point received = std::chrono::steady_clock::now();
+        std::shared_ptr<Room> room = session.findRoom(roomName);
+        if (!room)
+        {
+            sendSystemMessage(clientSocket, "You are not in #" + roomName + ", use /join " + roomName + " first");
+            return true;
+        }
+        if (frame.body.size() > MAX_MESSAGE_LENGTH)
+        {
+            // Only reachable through a compressed body, which may expand past one frame
+            sendSystemMessage(clientSocket, "Message too long, not sent");
+            return true;
+        }
+        size_t members = room->members();
+        if (!admitMessage(clientSocket, session, frame.body.size(), members > 0 ? members - 1 : 0, received))
+        {
+            return true;
+        }
+        relayMessage(clientSocket, session.username, room, frame.body);
+        Metrics::observe(Histogram::ReceiveToBroadcast,
+                         std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - received).count());
+        return true;
+    }
+    case FrameType::RoomJoin:
+        enterRoom(clientSocket, session, roomName);
+        return true;
+    case FrameType::RoomLeave:
+        exitRoom(clientSocket, session, roomName);
+        return true;
+    case FrameType::Direct:
+        if (admitMessage(clientSocket, session, frame.body.size(), 1, std::chrono::steady_clock::now()))
+        {
+            sendDirect(clientSocket, session.username, frame.sender, frame.body);
+        }
+        return true;
+    case FrameType::Who:
+        if (admitMessage(clientSocket, session, 0, 0, std::chrono::steady_clock::now()))
+        {
+            listUsers(clientSocket);
+        }
+        return true;
+    case FrameType::Search:
+        if (admitMessage(clientSocket, session, 0, 0, std::chrono::steady_clock::now()))
+        {
+            searchHistory(clientSocket, session, frame.body);
+        }
+        return true;
+    case FrameType::Leave:
+        return false;
+    case FrameType::Ping:
+        sendToClient(clientSocket, std::vector<MessageBuffer>(1, makeMessageBuffer(encodeFrame(FrameType::Pong, "", ""))));
+        return true;
+    case FrameType::Pong:
+        // Receiving it already counted as activity
+        return true;
+    default:
+        // Ignore frame types this server does not understand
+        return true;
+    }
+}
+
+bool ChatServer::takeOver(socket_t clientSocket, ClientSession &session, const std::string &username)
+{
+    int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+    if (session.takeoverUntil == 0)
+    {
+        // Gone already when not found: the next try joins
+        std::shared_ptr<const ClientRegistry::Client> stale = clients.findByName(username);
+        if (stale)
+        {
+            // Its owner sees the connection end and cleans up as for any disconnect
+            Logger::text(LogLevel::Info, username + " reconnected, closing the previous connection");
+            shutdownSocket(stale->socket);
+        }
+        session.takeoverUntil = now + TAKEOVER_TIMEOUT_MS * 1000000LL;
+    }
+    else if (now >= session.takeoverUntil)
+    {
+        session.takeoverUntil = 0;
+        return false;
+    }
+    session.flood.heldUntil = now + TAKEOVER_RETRY_MS * 1000000LL;
+    return true;
+}
+
+bool ChatServer::admitMessage(socket_t clientSocket, ClientSession &session, size_t length, size_t recipients,
+                              std::chrono::steady_clock::time_point now)
+{
+    bool wasHeld = session.flood.heldUntil != 0;
+    session.flood.heldUntil = 0;
+    if (!flood.enabled())
+    {
+        return true;
+    }
+    int64_t nowNs = std::chrono::duration_cast<std::chrono::nanoseconds>(now.time_since_epoch()).count();
+    int64_t retryAt = flood.admit(session.flood, length, recipients, nowNs);
+    if (retryAt == 0)
+    {
+        return true;
+    }
+
+    bool notify = nowNs - session.flood.lastNotice >= FLOOD_NOTICE_INTERVAL_MS * 1000000LL;
+    if (notify)
+    {
+        session.flood.lastNotice = nowNs;
+    }
+    if (flood.policy() == FloodPolicy::Delay)
+    {
+        session.flood.heldUntil = retryAt;
+        if (!wasHeld)
+        {
+            Metrics::add(Counter::FloodDelayed);
+        }
+        if (notify)
+        {
+            sendSystemMessage(clientSocket, "You are sending too fast, your messages are being delayed");
+        }
+        return false;
+    }
+
+    // Drops between two notices are reported together with the next one
+    ++session.flood.dropped;
+    Metrics::add(Counter::FloodDropped);
+    if (notify)
+    {
+        sendSystemMessage(clientSocket, "You are sending too fast: " + std::to_string(session.flood.dropped) +
+                                            (session.flood.dropped == 1 ? " message was" : " messages were") + " not sent");
+        session.flood.dropped = 0;
+    }
+    return false;
+}
+
+void ChatServer::announceJoin(socket_t clientSocket, ClientSession &session)
+{
+    // Catch the newcomer up before their own join notice lands in history
+    replayHistory(clientSocket, session, *lobby);
+
+    joinRoom(clientSocket, session, lobby);
+    MessageBuffer joinMessage = encodeMessage(FrameType::Join, session.username, "", "", nextSequence());
+
+    // Add to chat history and notify others; the newcomer's own copy
+    // acknowledges the handshake
+    recordHistory(*lobby, joinMessage);
+    sendToClient(clientSocket, std::vector<MessageBuffer>(1, joinMessage));
+    broadcastMessage(joinMessage, clientSocket);
+    federate(*lobby, FrameType::Join, session.username);
+
+    Logger::event(LogLevel::Info, LogEvent::Join, session.username);
+}
+
+void ChatServer::resumeSession(socket_t clientSocket, ClientSession &session, uint64_t lastSeen, const std::vector<std::string> &roomNames)
+{
+    // The rooms it was in, minus any it may not enter any more; they come
+    // back silently, as disconnecting left them silently. Names are checked
+    // and counted as /join would, so a resume cannot create rooms past the
+    // per-client limit.
+    std::vector<std::shared_ptr<Room>> resumed(1, lobby);
+    std::string refused;
+    for (const std::string &name : roomNames)
+    {
+        if (!isValidRoomName(name) || name == DEFAULT_ROOM ||
+            std::find_if(resumed.begin(), resumed.end(), [&name](const std::shared_ptr<Room> &room)
+                         { return room->name() == name; }) != resumed.end())
+        {
+            continue;
+        }
+        std::shared_ptr<Room> room = resumed.size() < config.maxRoomsPerClient ? rooms->acquire(name) : std::shared_ptr<Room>();
+        if (!room)
+        {
+            refused += (refused.empty() ? "#" : ", #") + name;
+            continue;
+        }
+        resumed.push_back(room);
+    }
+    if (!refused.empty())
+    {
+        sendSystemMessage(clientSocket, "Could not rejoin " + refused + ": too many rooms");
+    }
+
+    // Like the full replay, the delta is taken before subscribing, so
+    // nothing reaches the client twice
+    replayMissed(clientSocket, session, resumed, lastSeen);
+    for (const std::shared_ptr<Room> &room : resumed)
+    {
+        joinRoom(clientSocket, session, room);
+    }
+
+    MessageBuffer joinMessage = encodeMessage(FrameType::Join, session.username, "", "", nextSequence());
+    recordHistory(*lobby, joinMessage);
+    sendToClient(clientSocket, std::vector<MessageBuffer>(1, joinMessage));
+    broadcastMessage(joinMessage, clientSocket);
+    federate(*lobby, FrameType::Join, session.username);
+    Metrics::add(Counter::SessionsResumed);
+
+    Logger::event(LogLevel::Info, LogEvent::Join, session.username);
+}
+
+void ChatServer::relayMessage(socket_t clientSocket, const std::string &username, const std::shared_ptr<Room> &room, const std::string &messageContent)
+{
+    // Encoded once; history and every recipient queue share this buffer
+    MessageBuffer formattedMessage = encodeMessage(FrameType::Chat, username, messageContent, wireRoomName(*room), nextSequence());
+
+    // Queued for the log writer thread, and sampled under load
+    Logger::chat(username, room->name(), messageContent);
+
+    // Save to the room's history
+    recordHistory(*room, formattedMessage);
+
+    // Send to the room's other members, here and on peer servers
+    broadcastToRoom(room, formattedMessage, clientSocket);
+    federate(*room, FrameType::Chat, username, messageContent);
+}
+
+void ChatServer::sendDirect(socket_t clientSocket, const std::string &username, const std::string &recipient, const std::string &text)
+{
+    if (recipient.empty() || recipient.size() > MAX_USERNAME_LENGTH)
+    {
+        sendSystemMessage(clientSocket, "Name the user to message: /msg NAME TEXT");
+        return;
+    }
+    if (text.size() > MAX_MESSAGE_LENGTH)
+    {
+        sendSystemMessage(clientSocket, "Message too long, not sent");
+        return;
+    }
+
+    // One lookup in the name index, however many users are online
+    std::shared_ptr<const ClientRegistry::Client> target = clients.findByName(recipient);
+    if (target && target->state == ClientState::Joined)
+    {
+        deliverTo(*target, encodeMessage(FrameType::Direct, username, text));
+    }
+    else if (!federation || !federation->sendDirect(recipient, username, text))
+    {
+        sendSystemMessage(clientSocket, recipient + " is not online, message not sent");
+        return;
+    }
+    // Tells the sender it went out, so its client echoes the message only now
+    sendToClient(clientSocket, std::vector<MessageBuffer>(1, makeMessageBuffer(encodeFrame(FrameType::Direct, recipient, text, "", FLAG_ECHO))));
+    Metrics::add(Counter::DirectMessages);
+    Logger::event(LogLevel::Debug, LogEvent::Direct, username, recipient);
+}
+
+void ChatServer::listUsers(socket_t clientSocket)
+{
+    std::vector<std::string> lines = clients.usernames();
+    if (federation)
+    {
+        for (const std::pair<std::string, std::string> &remote : federation->remoteUserList())
+        {
+            lines.push_back(remote.first + "\t" + remote.second);
+        }
+    }
+    std::sort(lines.begin(), lines.end());
+
+    // Split over as many frames as the list needs
+    std::vector<MessageBuffer> batch;
+    std::string body;
+    for (const std::string &line : lines)
+    {
+        if (!body.empty() && body.size() + line.size() + 1 > MAX_MESSAGE_LENGTH)
+        {
+            batch.push_back(makeMessageBuffer(encodeFrame(FrameType::Who, "", body)));
+            body.clear();
+        }
+        if (!body.empty())
+        {
+            body += '\n';
+        }
+        body += line;
+    }
+    batch.push_back(makeMessageBuffer(encodeFrame(FrameType::Who, "", body)));
+    sendToClient(clientSocket, batch);
+}
+
+void ChatServer::searchHistory(socket_t clientSocket, const ClientSession &session, const std::string &query)
+{
+    std::vector<uint64_t> terms = SearchIndex::parseQuery(query);
+    if (terms.empty())
+    {
+        sendSystemMessage(clientSocket, "Search for words, from:NAME or both: /search [from:NAME] WORDS");
+        return;
+    }
+
+    // Each room gives its newest matches; one more than is shown tells whether older ones exist
+    std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+    std::vector<MessageBuffer> matches;
+    for (const std::shared_ptr<Room> &room : session.rooms)
+    {
+        room->index().search(room->history(), terms, SEARCH_RESULT_LIMIT + 1, matches);
+    }
+    std::stable_sort(matches.begin(), matches.end(), [](const MessageBuffer &a, const MessageBuffer &b)
+                     { return frameSequence(a->data(), a->size()) > frameSequence(b->data(), b->size()); });
+    bool more = matches.size() > SEARCH_RESULT_LIMIT;
+    if (more)
+    {
+        matches.resize(SEARCH_RESULT_LIMIT);
+    }
+    Metrics::add(Counter::Searches);
+    Metrics::observe(Histogram::Search,
+                     std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - started).count());
+
+    if (matches.empty())
+    {
+        sendSystemMessage(clientSocket, "No messages match \"" + query + "\"");
+        return;
+    }
+    std::string notice = more ? "Newest " + std::to_string(matches.size()) + " messages matching \"" + query + "\", narrow the search for older ones:"
+                              : std::to_string(matches.size()) + (matches.size() == 1 ? " message matches \"" : " messages match \"") + query + "\", newest first:";
+    sendReplay(clientSocket, session, notice, matches);
+}
+
+bool ChatServer::indexRooms()
+{
+    bool done = true;
+    rooms->list(indexedRooms);
+    for (const std::shared_ptr<Room> &room : indexedRooms)
+    {
+        done = room->index().catchUp(room->history(), SEARCH_INDEX_BATCH) && done;
+    }
+    return done;
+}
+
+void ChatServer::announceLeave(socket_t clientSocket, ClientSession &session)
+{
+    if (session.compression)
+    {
+        compressionClients.fetch_sub(1);
+    }
+
+    // Disconnecting leaves every room silently; the Leave notice covers them all
+    while (!session.rooms.empty())
+    {
+        std::shared_ptr<Room> room = session.rooms.back();
+        leaveRoom(clientSocket, session, room);
+    }
+
+    MessageBuffer leaveMessage = encodeMessage(FrameType::Leave, session.username, "", "", nextSequence());
+
+    // Broadcast that user has left
+    recordHistory(*lobby, leaveMessage);
+    broadcastMessage(leaveMessage, SOCKET_ERROR_VAL);
+    federate(*lobby, FrameType::Leave, session.username);
+
+    Logger::event(LogLevel::Info, LogEvent::Leave, session.username);
+}
+
+void ChatServer::joinRoom(socket_t clientSocket, ClientSession &session, const std::shared_ptr<Room> &room)
+{
+    session.rooms.push_back(room);
+    if (session.outbound)
+    {
+        room->subscribe(session.outbound);
+        return;
+    }
+    Reactor *local = Reactor::current();
+    if (local)
+    {
+        local->subscribe(clientSocket, room);
+    }
+}
+
+void ChatServer::leaveRoom(socket_t clientSocket, ClientSession &session, const std::shared_ptr<Room> &room)
+{
+    auto it = std::find(session.rooms.begin(), session.rooms.end(), room);
+    if (it == session.rooms.end())
+    {
+        return;
+    }
+    session.rooms.erase(it);
+    if (session.outbound)
+    {
+        room->unsubscribe(session.outbound);
+    }
+    else if (Reactor *local = Reactor::current())
+    {
+        local->unsubscribe(clientSocket, *room);
+    }
+    // The server holds the lobby for good; any other room goes with its last member
+    if (room != lobby)
+    {
+        rooms->release(room);
+    }
+}
+
+void ChatServer::enterRoom(socket_t clientSocket, ClientSession &session, const std::string &name)
+{
+    if (!isValidRoomName(name))
+    {
+        sendSystemMessage(clientSocket, "Room names are 1-" + std::to_string(MAX_ROOM_NAME_LENGTH) + " letters, digits, '-' or '_'");
+        return;
+    }
+    if (session.findRoom(name))
+    {
+        sendSystemMessage(clientSocket, "You are already in #" + name);
+        return;
+    }
+    if (session.rooms.size() >= config.maxRoomsPerClient)
+    {
+        sendSystemMessage(clientSocket, "You are already in " + std::to_string(session.rooms.size()) + " rooms, leave one first");
+        return;
+    }
+
+    // The only place a room is looked up by name
+    std::shared_ptr<Room> room = rooms->acquire(name);
+    if (!room)
+    {
+        sendSystemMessage(clientSocket, "Cannot create #" + name + ": the server already has " + std::to_string(config.maxRooms) + " rooms");
+        return;
+    }
+
+    replayHistory(clientSocket, session, *room);
+    joinRoom(clientSocket, session, room);
+
+    // The newcomer gets the notice too, as confirmation
+    MessageBuffer notice = encodeMessage(FrameType::RoomJoin, session.username, "", wireRoomName(*room), nextSequence());
+    recordHistory(*room, notice);
+    broadcastToRoom(room, notice, SOCKET_ERROR_VAL);
+    federate(*room, FrameType::RoomJoin, session.username);
+
+    Logger::event(LogLevel::Info, LogEvent::RoomJoin, session.username, name);
+}
+
+void ChatServer::exitRoom(socket_t clientSocket, ClientSession &session, const std::string &name)
+{
+    std::shared_ptr<Room> room = session.findRoom(name);
+    if (!room)
+    {
+        sendSystemMessage(clientSocket, "You are not in #" + name);
+        return;
+    }
+
+    // Sent before unsubscribing so the leaver gets it as confirmation
+    MessageBuffer notice = encodeMessage(FrameType::RoomLeave, session.username, "", wireRoomName(*room), nextSequence());
+    recordHistory(*room, notice);
+    broadcastToRoom(room, notice, SOCKET_ERROR_VAL);
+    federate(*room, FrameType::RoomLeave, session.username);
+    leaveRoom(clientSocket, session, room);
+
+    Logger::event(LogLevel::Info, LogEvent::RoomLeave, session.username, name);
+}
+
+std::string ChatServer::wireRoomName(const Room &room) const
+{
+    // Lobby frames go out without a room name, as they did before rooms existed
+    return &room == lobby.get() ? std::string() : room.name();
+}
+
+void ChatServer::federate(const Room &room, FrameType type, const std::string &sender, const std::string &body)
+{
+    if (federation)
+    {
+        federation->publish(room.name(), type, sender, body);
+    }
+}
+
+void ChatServer::deliverRemote(const std::string &roomName, FrameType type, const std::string &sender, const std::string &body)
+{
+    if (type == FrameType::Direct)
+    {
+        // roomName is the recipient; one that left meanwhile misses it
+        std::shared_ptr<const ClientRegistry::Client> target = clients.findByName(roomName);
+        if (target && target->state == ClientState::Joined)
+        {
+            deliverTo(*target, encodeMessage(FrameType::Direct, sender, body));
+            Metrics::add(Counter::DirectMessages);
+        }
+        return;
+    }
+
+    // Peers only relay rooms this server reported members in; one that was
+    // never created here in the meantime is left alone
+    std::shared_ptr<Room> room = rooms->find(roomName);
+    if (!room)
+    {
+        return;
+    }
+    MessageBuffer message = encodeMessage(type, sender, body, wireRoomName(*room), nextSequence());
+    recordHistory(*room, message);
+    if (type == FrameType::Join || type == FrameType::Leave)
+    {
+        broadcastMessage(message, SOCKET_ERROR_VAL);
+    }
+    else
+    {
+        broadcastToRoom(room, message, SOCKET_ERROR_VAL);
+    }
+}
+
+void ChatServer::describeLocal(std::vector<std::string> &roomNames, std::vector<std::string> &users)
+{
+    for (const std::shared_ptr<Room> &room : rooms->list())
+    {
+        if (room->members() > 0)
+        {
+            roomNames.push_back(room->name());
+        }
+    }
+    std::shared_ptr<const ClientRegistry::Snapshot> current = clients.snapshot();
+    for (const std::shared_ptr<const ClientRegistry::Client> &client : *current)
+    {
+        if (client->state == ClientState::Joined)
+        {
+            users.push_back(client->username);
+        }
+    }
+}
+
+bool ChatServer::livenessEnabled() const
+{
+    return config.heartbeatSeconds > 0 || config.idleTimeoutSeconds > 0 || config.handshakeTimeoutSeconds > 0;
+}
+
+TimerWheel::Clock::time_point ChatServer::checkLiveness(Liveness &liveness, bool joined)
+{
+    const int64_t never = INT64_MAX;
+    int64_t now = Liveness::now();
+    int64_t lastActivity = liveness.lastActivity.load(std::memory_order_relaxed);
+
+    int64_t handshakeDeadline = never;
+    if (!joined && config.handshakeTimeoutSeconds > 0)
+    {
+        handshakeDeadline = liveness.connectedAt + config.handshakeTimeoutSeconds * 1000LL;
+    }
+    int64_t idleDeadline = never;
+    if (config.idleTimeoutSeconds > 0)
+    {
+        idleDeadline = lastActivity + config.idleTimeoutSeconds * 1000LL;
+    }
+
+    // Closed the way slow consumers are: the owner of the socket sees EOF and cleans up
+    if (now >= handshakeDeadline)
+    {
+        Metrics::add(Counter::HandshakeTimeouts);
+        Logger::text(LogLevel::Info, "Closing socket " + std::to_string(liveness.socket) + ": no handshake within " +
+                                         std::to_string(config.handshakeTimeoutSeconds) + " s");
+        shutdownSocket(liveness.socket);
+        return TimerWheel::Clock::time_point::max();
+    }
+    if (now >= idleDeadline)
+    {
+        Metrics::add(Counter::IdleDisconnects);
+        Logger::text(LogLevel::Info, "Closing socket " + std::to_string(liveness.socket) + ": nothing received for " +
+                                         std::to_string(config.idleTimeoutSeconds) + " s");
+        shutdownSocket(liveness.socket);
+        return TimerWheel::Clock::time_point::max();
+    }
+
+    // One ping per quiet interval; a client that answers is active again
+    int64_t pingAt = never;
+    if (config.heartbeatSeconds > 0)
+    {
+        pingAt = std::max(lastActivity, liveness.lastPing) + config.heartbeatSeconds * 1000LL;
+        if (joined && now >= pingAt)
+        {
+            sendToClient(liveness.socket, std::vector<MessageBuffer>(1, pingMessage));
+            Metrics::add(Counter::HeartbeatsSent);
+            liveness.lastPing = now;
+            pingAt = now + config.heartbeatSeconds * 1000LL;
+        }
+    }
+
+    int64_t next = std::min(handshakeDeadline, std::min(idleDeadline, pingAt));
+    return next == never ? TimerWheel::Clock::time_point::max() : Liveness::at(next);
+}
+
+std::vector<ClientQueueStat> ChatServer::collectQueueStats()
+{
+    std::vector<ClientQueueStat> stats;
+
+    if (!reactors.empty())
+    {
+        // Connections belong to their loop thread, so each shard takes the
+        // snapshot itself; a loop that does not answer in time is skipped
+        for (const std::unique_ptr<Reactor> &shard : reactors)
+        {
+            std::shared_ptr<std::promise<std::vector<ClientQueueStat>>> reply(new std::promise<std::vector<ClientQueueStat>>());
+            std::future<std::vector<ClientQueueStat>> answer = reply->get_future();
+            Reactor *target = shard.get();
+            shard->post([target, reply]()
+                        { reply->set_value(target->queueStats()); });
+            if (answer.wait_for(std::chrono::milliseconds(500)) == std::future_status::ready)
+            {
+                std::vector<ClientQueueStat> shardStats = answer.get();
+                stats.insert(stats.end(), shardStats.begin(), shardStats.end());
+            }
+        }
+        return stats;
+    }
+
+    std::shared_ptr<const ClientRegistry::Snapshot> current = clients.snapshot();
+    for (const std::shared_ptr<const ClientRegistry::Client> &client : *current)
+    {
+        ClientQueueStat stat;
+        stat.socket = client->socket;
+        stat.username = client->username;
+        stat.queuedBytes = client->outbound ? client->outbound->pendingBytes() : 0;
+        stats.push_back(stat);
+    }
+    return stats;
+}
+
+std::string ChatServer::renderMetrics()
+{
+    std::ostringstream out;
+    Metrics::render(out);
+
+#ifdef COUNT_ALLOCATIONS
+    // Process-wide, counted by the replaced operator new
+    out << "# HELP chat_heap_allocations_total Heap allocations made by the server process\n";
+    out << "# TYPE chat_heap_allocations_total counter\n";
+    out << "chat_heap_allocations_total " << AllocationCounter::allocations() << "\n";
+    out << "# HELP chat_heap_allocated_bytes_total Bytes requested by those allocations\n";
+    out << "# TYPE chat_heap_allocated_bytes_total counter\n";
+    out << "chat_heap_allocated_bytes_total " << AllocationCounter::bytes() << "\n";
+#endif
+
+    uint64_t opened = Metrics::read(Counter::ConnectionsOpened);
+    uint64_t closed = Metrics::read(Counter::ConnectionsClosed);
+    out << "# HELP chat_connected_clients Open client connections\n";
+    out << "# TYPE chat_connected_clients gauge\n";
+    out << "chat_connected_clients " << (opened > closed ? opened - closed : 0) << "\n";
+
+    std::vector<std::shared_ptr<Room>> allRooms = rooms->list();
+    size_t historyMessages = 0;
+    size_t historyCapacity = 0;
+    out << "# HELP chat_rooms Rooms that currently exist\n";
+    out << "# TYPE chat_rooms gauge\n";
+    out << "chat_rooms " << allRooms.size() << "\n";
+    out << "# HELP chat_room_members Clients subscribed to one room\n";
+    out << "# TYPE chat_room_members gauge\n";
+    for (const std::shared_ptr<Room> &room : allRooms)
+    {
+        // Room names are restricted to [A-Za-z0-9_-], safe as label values
+        out << "chat_room_members{room=\"" << room->name() << "\"} " << room->members() << "\n";
+        historyMessages += room->history().size();
+        historyCapacity += room->history().capacity();
+    }
+    out << "# HELP chat_history_messages Messages held in the history ring buffers of all rooms\n";
+    out << "# TYPE chat_history_messages gauge\n";
+    out << "chat_history_messages " << historyMessages << "\n";
+    out << "# HELP chat_history_capacity Combined size of the history ring buffers of all rooms\n";
+    out << "# TYPE chat_history_capacity gauge\n";
+    out << "chat_history_capacity " << historyCapacity << "\n";
+    size_t indexedMessages = 0;
+    size_t indexPostings = 0;
+    for (const std::shared_ptr<Room> &room : allRooms)
+    {
+        indexedMessages += room->index().messages();
+        indexPostings += room->index().postingCount();
+    }
+    out << "# HELP chat_search_indexed_messages Chat messages in the search indexes of all rooms\n";
+    out << "# TYPE chat_search_indexed_messages gauge\n";
+    out << "chat_search_indexed_messages " << indexedMessages << "\n";
+    out << "# HELP chat_search_postings Word and sender entries in the search indexes of all rooms\n";
+    out << "# TYPE chat_search_postings gauge\n";
+    out << "chat_search_postings " << indexPostings << "\n";
+    if (messageLog)
+    {
+        out << "# HELP chat_log_records Records kept in the durable message log\n";
+        out << "# TYPE chat_log_records gauge\n";
+        out << "chat_log_records " << messageLog->recordCount() << "\n";
+        out << "# HELP chat_log_bytes Size of the durable message log on disk\n";
+        out << "# TYPE chat_log_bytes gauge\n";
+        out << "chat_log_bytes " << messageLog->diskBytes() << "\n";
+        out << "# HELP chat_log_segments Segment files of the durable message log\n";
+        out << "# TYPE chat_log_segments gauge\n";
+        out << "chat_log_segments " << messageLog->segmentCount() << "\n";
+    }
+
+    bool coalescing = config.delivery.mode == DeliveryMode::Coalesce;
+    out << "# HELP chat_delivery_mode When queued output is written: at once, or after the coalescing window\n";
+    out << "# TYPE chat_delivery_mode gauge\n";
+    out << "chat_delivery_mode{mode=\"low-latency\"} " << (coalescing ? 0 : 1) << "\n";
+    out << "chat_delivery_mode{mode=\"coalesce\"} " << (coalescing ? 1 : 0) << "\n";
+    if (coalescing)
+    {
+        out << "# HELP chat_delivery_window_microseconds Longest queued output waits to be coalesced\n";
+        out << "# TYPE chat_delivery_window_microseconds gauge\n";
+        out << "chat_delivery_window_microseconds " << config.delivery.windowMicros << "\n";
+        out << "# HELP chat_delivery_flush_bytes Queued bytes that are written without waiting for the window\n";
+        out << "# TYPE chat_delivery_flush_bytes gauge\n";
+        out << "chat_delivery_flush_bytes " << config.delivery.flushBytes << "\n";
+    }
+
+    if (federation)
+    {
+        FederationStatus peers = federation->currentStatus();
+        out << "# HELP chat_federation_nodes Other servers reachable over peer links\n";
+        out << "# TYPE chat_federation_nodes gauge\n";
+        out << "chat_federation_nodes " << peers.nodes << "\n";
+        out << "# HELP chat_federation_remote_users Clients joined on the other servers\n";
+        out << "# TYPE chat_federation_remote_users gauge\n";
+        out << "chat_federation_remote_users " << peers.remoteUsers << "\n";
+        out << "# HELP chat_federation_link_queue_bytes Unsent bytes queued for one peer server\n";
+        out << "# TYPE chat_federation_link_queue_bytes gauge\n";
+        for (const std::pair<std::string, size_t> &link : peers.links)
+        {
+            out << "chat_federation_link_queue_bytes{node=\"" << labelValue(link.first) << "\"} " << link.second << "\n";
+        }
+    }
+
+    std::vector<ClientQueueStat> queues = collectQueueStats();
+    size_t totalQueued = 0;
+    out << "# HELP chat_client_queue_bytes Unsent bytes queued for one client\n";
+    out << "# TYPE chat_client_queue_bytes gauge\n";
+    for (const ClientQueueStat &stat : queues)
+    {
+        out << "chat_client_queue_bytes{socket=\"" << stat.socket << "\",user=\"" << labelValue(stat.username) << "\"} " << stat.queuedBytes << "\n";
+        totalQueued += stat.queuedBytes;
+    }
+    out << "# HELP chat_queued_bytes Unsent bytes queued across all clients\n";
+    out << "# TYPE chat_queued_bytes gauge\n";
+    out << "chat_queued_bytes " << totalQueued << "\n";
+    return out.str();
+}
+
+void ChatServer::replayHistory(socket_t clientSocket, const ClientSession &session, Room &room)
+{
+    std::vector<MessageBuffer> entries = room.history().recent(config.historyReplay);
+    if (entries.empty())
+    {
+        return;
+    }
+
+    // Queued as one batch so it goes out in as few writes as possible
+    std::string header = "Last " + std::to_string(entries.size()) + " messages";
+    if (&room != lobby.get())
+    {
+        header += " in #" + room.name();
+    }
+    sendReplay(clientSocket, session, header + ":", entries);
+}
+
+void ChatServer::replayMissed(socket_t clientSocket, const ClientSession &session, const std::vector<std::shared_ptr<Room>> &missedRooms, uint64_t lastSeen)
+{
+    // Each room's history is walked back only as far as lastSeen
+    std::vector<MessageBuffer> entries;
+    bool complete = true;
+    for (const std::shared_ptr<Room> &room : missedRooms)
+    {
+        bool roomComplete = true;
+        std::vector<MessageBuffer> missed = room->history().since(lastSeen, roomComplete);
+        entries.insert(entries.end(), missed.begin(), missed.end());
+        complete = complete && roomComplete;
+    }
+    if (entries.empty() && complete)
+    {
+        return;
+    }
+
+    // Rooms interleave in the order the messages were sent
+    std::stable_sort(entries.begin(), entries.end(), [](const MessageBuffer &a, const MessageBuffer &b)
+                     { return frameSequence(a->data(), a->size()) < frameSequence(b->data(), b->size()); });
+    std::string notice = "Missed " + std::to_string(entries.size()) + " messages while away";
+    if (!complete)
+    {
+        notice += ", older ones are no longer in history";
+    }
+    sendReplay(clientSocket, session, notice + (entries.empty() ? "" : ":"), entries);
+    Metrics::add(Counter::MessagesResumed, entries.size());
+}
+
+void ChatServer::sendReplay(socket_t clientSocket, const ClientSession &session, const std::string &notice, const std::vector<MessageBuffer> &entries)
+{
+    std::vector<MessageBuffer> batch(1, makeMessageBuffer(encodeFrame(FrameType::System, "", notice)));
+    if (!session.compression)
+    {
+        batch.insert(batch.end(), entries.begin(), entries.end());
+        sendToClient(clientSocket, batch);
+        return;
+    }
+
+    // Many short messages compress far better together than one by one:
+    // pack runs of them into Batch frames, each small enough that its
+    // decompressed body still fits in one frame
+    const size_t groupLimit = MAX_FRAME_SIZE - FRAME_HEADER_SIZE;
+    size_t first = 0;
+    while (first < entries.size())
+    {
+        std::string group;
+        size_t last = first;
+        while (last < entries.size() && group.size() + entries[last]->size() <= groupLimit)
+        {
+            group += *entries[last];
+            ++last;
+        }
+        if (last == first)
+        {
+            // One entry alone fills a frame
+            batch.push_back(entries[first]);
+            ++first;
+            continue;
+        }
+
+        MessageBuffer packed = group.size() >= config.compressMin ? compressMessage(FrameType::Batch, "", group) : MessageBuffer();
+        if (packed)
+        {
+            batch.push_back(packed);
+        }
+        else
+        {
+            batch.insert(batch.end(), entries.begin() + first, entries.begin() + last);
+        }
+        first = last;
+    }
+    sendToClient(clientSocket, batch);
+}
+
+void ChatServer::recordHistory(Room &room, const MessageBuffer &message)
+{
+    room.history().append(message);
+    if (messageLog)
+    {
+        messageLog->append(room.name(), message);
+    }
+}
+
+MessageBuffer ChatServer::compressMessage(FrameType type, const std::string &sender, const std::string &body, const std::string &room, uint64_t sequence)
+{
+    std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+    std::string packed;
+    bool smaller = appendCompressedFrame(packed, type, sender, body, room, sequence);
+    Metrics::observe(Histogram::Compression,
+                     std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - started).count());
+
+    // Compared as whole frames: the header is the same either way
+    size_t frameBytes = frameSize(sender, body.size(), room, sequence);
+    Metrics::add(Counter::CompressionInputBytes, frameBytes);
+    if (!smaller)
+    {
+        Metrics::add(Counter::CompressionSkipped);
+        Metrics::add(Counter::CompressionOutputBytes, frameBytes);
+        return MessageBuffer();
+    }
+    Metrics::add(Counter::CompressionOutputBytes, packed.size());
+    return makeMessageBuffer(std::move(packed));
+}
+
+MessageBuffer ChatServer::encodeMessage(FrameType type, const std::string &sender, const std::string &body, const std::string &room, uint64_t sequence)
+{
+    // Compressed once per message, whatever the number of recipients, and
+    // only while a connected client can read it
+    MessageBuffer compressed;
+    if (config.compressMin > 0 && body.size() >= config.compressMin && compressionClients.load(std::memory_order_relaxed) > 0)
+    {
+        compressed = compressMessage(type, sender, body, room, sequence);
+    }
+    // Encoded straight into a recycled buffer
+    std::shared_ptr<EncodedFrame> frame = BufferPool::acquire(frameSize(sender, body.size(), room, sequence));
+    appendFrame(*frame, type, sender, body, room, 0, sequence);
+    frame->compressed = std::move(compressed);
+    return frame;
+}
+
+void ChatServer::enableCompression(socket_t clientSocket, ClientSession &session, bool announce)
+{
+    session.compression = true;
+    compressionClients.fetch_add(1);
+    if (session.outbound)
+    {
+        session.outbound->enableCompression();
+    }
+    else if (Reactor *local = Reactor::current())
+    {
+        local->enableCompression(clientSocket);
+    }
+    if (!announce)
+    {
+        return;
+    }
+    sendToClient(clientSocket, std::vector<MessageBuffer>(1, makeMessageBuffer(encodeFrame(
+        FrameType::System, "", "Compressing messages of " + std::to_string(config.compressMin) + " bytes or more", "", FLAG_COMPRESSION))));
+}
+
+void ChatServer::sendSystemMessage(socket_t clientSocket, const std::string &text)
+{
+    sendToClient(clientSocket, std::vector<MessageBuffer>(1, makeMessageBuffer(encodeFrame(FrameType::System, "", text))));
+}
+
+void ChatServer::sendToClient(socket_t clientSocket, const std::vector<MessageBuffer> &batch)
+{
+    if (!reactors.empty())
+    {
+        // Only ever called from the shard that owns clientSocket
+        Reactor *local = Reactor::current();
+        if (local)
+        {
+            local->sendTo(clientSocket, batch);
+        }
+        return;
+    }
+
+    std::shared_ptr<const ClientRegistry::Client> client = clients.find(clientSocket);
+    if (!client || !client->outbound)
+    {
+        return;
+    }
+    if (client->outbound->push(batch))
+    {
+        flushQueues(std::vector<std::shared_ptr<SendQueue>>(1, client->outbound));
+    }
+    else
+    {
+        shutdownSocket(clientSocket);
+    }
+}
+
+void ChatServer::deliverTo(const ClientRegistry::Client &target, const MessageBuffer &message)
+{
+    std::vector<MessageBuffer> batch(1, message);
+    if (!reactors.empty())
+    {
+        if (target.shard >= reactors.size())
+        {
+            return;
+        }
+        Reactor *owner = reactors[target.shard].get();
+        if (owner == Reactor::current())
+        {
+            owner->sendTo(target.socket, batch);
+            return;
+        }
+        // By the time the owning shard runs this, the client may have left and
+        // its descriptor been reused by someone else
+        socket_t targetSocket = target.socket;
+        std::string username = target.username;
+        owner->post([this, owner, targetSocket, username, batch]()
+                    {
+                        std::shared_ptr<const ClientRegistry::Client> current = clients.find(targetSocket);
+                        if (current && current->username == username)
+                        {
+                            owner->sendTo(targetSocket, batch);
+                        }
+                    });
+        return;
+    }
+
+    if (!target.outbound)
+    {
+        return;
+    }
+    if (target.outbound->push(batch))
+    {
+        flushQueues(std::vector<std::shared_ptr<SendQueue>>(1, target.outbound));
+    }
+    else
+    {
+        shutdownSocket(target.socket);
+    }
+}
+
+void ChatServer::broadcastMessage(const MessageBuffer &message, socket_t sender)
+{
+    if (!reactors.empty())
+    {
+        // The calling shard fans out to its own clients directly; every other
+        // shard gets the same buffer through its lock-free inbox
+        Reactor *local = Reactor::current();
+        for (const std::unique_ptr<Reactor> &shard : reactors)
+        {
+            if (shard.get() == local)
+            {
+                shard->broadcast(message, sender);
+            }
+            else
+            {
+                shard->post(message, sender);
+            }
+        }
+        return;
+    }
+
+    // A snapshot of the registry: joins and leaves proceed while this loop runs
+    std::shared_ptr<const ClientRegistry::Snapshot> current = clients.snapshot();
+    // Kept per thread so its capacity is reused by the next broadcast; emptied
+    // before returning, so it never holds on to a queue
+    static thread_local std::vector<std::shared_ptr<SendQueue>> recipients;
+    for (const std::shared_ptr<const ClientRegistry::Client> &client : *current)
+    {
+        if (client->socket == sender || !client->outbound)
+        {
+            continue;
+        }
+        if (client->outbound->push(message))
+        {
+            recipients.push_back(client->outbound);
+        }
+        else
+        {
+            // Slow consumer under the Disconnect policy: its handler thread sees EOF and cleans up
+            shutdownSocket(client->socket);
+        }
+    }
+    flushQueues(recipients);
+    recipients.clear();
+}
+
+void ChatServer::broadcastToRoom(const std::shared_ptr<Room> &room, const MessageBuffer &message, socket_t sender)
+{
+    if (!reactors.empty())
+    {
+        // Shards without a member in this room never see the message
+        Reactor *local = Reactor::current();
+        for (const std::unique_ptr<Reactor> &shard : reactors)
+        {
+            if (shard.get() == local)
+            {
+                shard->broadcast(message, sender, room->id());
+            }
+            else if (room->hasMembersOn(shard->index()))
+            {
+                shard->post(message, sender, room->id());
+            }
+        }
+        return;
+    }
+
+    // An immutable snapshot: joins and leaves elsewhere never block this loop
+    std::shared_ptr<const Room::Subscribers> members = room->snapshot();
+    static thread_local std::vector<std::shared_ptr<SendQueue>> recipients; // As in broadcastMessage()
+    for (const std::shared_ptr<SendQueue> &queue : *members)
+    {
+        if (queue->getSocket() == sender)
+        {
+            continue;
+        }
+        if (queue->push(message))
+        {
+            recipients.push_back(queue);
+        }
+        else
+        {
+            shutdownSocket(queue->getSocket());
+        }
+    }
+    flushQueues(recipients);
+    recipients.clear();
+}
+
+void ChatServer::flushQueues(const std::vector<std::shared_ptr<SendQueue>> &queues)
+{
+    if (coalescer)
+    {
+        for (const std::shared_ptr<SendQueue> &queue : queues)
+        {
+            coalescer->submit(queue);
+        }
+        return;
+    }
+
+    for (const std::shared_ptr<SendQueue> &queue : queues)
+    {
+        // Pending output is retried by the owning handler thread once the socket is writable
+        if (queue->flush() == SendQueue::FlushResult::Failed)
+        {
+            shutdownSocket(queue->getSocket());
+        }
+    }
+}
+
+void ChatServer::watchForSuccessor()
+{
+    while (running)
+    {
+        // One successor at a time; a second one waits in the backlog
+        if (handingOff)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(ACCEPT_POLL_MS));
+            continue;
+        }
+        pollfd_t pfd;
+        pfd.fd = handoffListener;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        if (pollSockets(&pfd, 1, ACCEPT_POLL_MS) <= 0)
+        {
+            continue;
+        }
+        socket_t channel = accept(handoffListener, nullptr, nullptr);
+        if (channel == SOCKET_ERROR_VAL)
+        {
+            continue;
+        }
+
+        Logger::text(LogLevel::Info, "A new server process connected, handing over");
+        handoffChannel = channel;
+        handingOff = true;
+        // Loops notice once woken; the accept loop and handler threads at their next poll
+        for (const std::unique_ptr<Reactor> &shard : reactors)
+        {
+            shard->stop();
+        }
+    }
+
+    closeSocket(handoffListener);
+    handoffListener = SOCKET_ERROR_VAL;
+#ifndef _WIN32
+    // After a handoff the path belongs to the successor, which may listen there already
+    if (!transferred)
+    {
+        unlink(config.handoffPath.c_str());
+    }
+#endif
+}
+
+HandoffClient ChatServer::exportSession(socket_t clientSocket, const ClientSession &session, const FrameParser &parser, SendQueue &outbound,
+                                       const Frame *held)
+{
+    HandoffClient client;
+    client.socket = clientSocket;
+    client.username = session.username;
+    for (const std::shared_ptr<Room> &room : session.rooms)
+    {
+        client.rooms.push_back(room->name());
+    }
+    client.compression = session.compression;
+    client.unparsedInput = parser.unparsed();
+    if (held)
+    {
+        // Sent again as the client sent it, only uncompressed
+        client.unparsedInput.insert(0, encodeFrame(held->type, held->sender, held->body, held->room));
+    }
+    client.unsentOutput = outbound.unsentBytes();
+    return client;
+}
+
+bool ChatServer::handOff()
+{
+    std::cout << BLUE_COLOR "Handing over to a new server process..." RESET_COLOR << std::endl;
+
+    // Every loop and handler thread has stopped; these are the last threads
+    // that could still write to a client or to the log
+    if (admin)
+    {
+        admin->stop();
+    }
+    if (coalescer)
+    {
+        coalescer->stop();
+    }
+    if (messageLog)
+    {
+        messageLog->close();
+    }
+    if (federation)
+    {
+        // Peers rebuild their links with the successor, which retries the peer port until it is free
+        federation->stop();
+    }
+
+    HandoffState state;
+    state.sequence = lastSequence.load();
+    state.listeners.push_back(serverSocket);
+    for (size_t i = 1; i < reactors.size(); ++i)
+    {
+        state.listeners.push_back(reactors[i]->listener());
+    }
+    for (const std::unique_ptr<Reactor> &shard : reactors)
+    {
+        shard->exportConnections(state.clients);
+    }
+    for (const ParkedClient &client : parked)
+    {
+        state.clients.push_back(exportSession(client.session.outbound->getSocket(), client.session, client.parser, *client.session.outbound,
+                                              client.held ? &client.frame : nullptr));
+    }
+    if (!messageLog)
+    {
+        // With a durable log the successor reloads history from disk instead
+        for (const std::shared_ptr<Room> &room : rooms->list())
+        {
+            HandoffRoom saved;
+            saved.name = room->name();
+            for (const MessageBuffer &entry : room->history().recent(config.historyDepth))
+            {
+                saved.history.push_back(*entry);
+            }
+            state.rooms.push_back(saved);
+        }
+    }
+
+    bool delivered = Handoff::send(handoffChannel, state) && Handoff::awaitAcknowledgement(handoffChannel, HANDOFF_ACK_TIMEOUT_MS);
+    closeSocket(handoffChannel);
+    handoffChannel = SOCKET_ERROR_VAL;
+    if (delivered)
+    {
+        transferred = true;
+        running = false;
+        Logger::text(LogLevel::Info, "Handed " + std::to_string(state.clients.size()) + " connections over to the new server process");
+        return true;
+    }
+
+    std::cout << YELLOW_COLOR "Handoff failed, this server keeps running" RESET_COLOR << std::endl;
+    if (messageLog && !messageLog->open(config.log))
+    {
+        std::cout << YELLOW_COLOR "Could not reopen the durable message log, new messages are not kept on disk" RESET_COLOR << std::endl;
+    }
+    if (coalescer)
+    {
+        coalescer->start();
+    }
+    if (admin)
+    {
+        admin->start(config.adminPort, config.adminSocket);
+    }
+    if (federation)
+    {
+        federation->start();
+    }
+    handingOff = false;
+    return false;
+}
+
+void ChatServer::takeOver(HandoffState &inherited, int &port)
+{
+    std::cout << BLUE_COLOR "Taking over from the server at " << config.takeoverPath << "..." RESET_COLOR << std::endl;
+    socket_t channel = Handoff::connect(config.takeoverPath);
+    bool received = channel != SOCKET_ERROR_VAL && Handoff::receive(channel, inherited) && Handoff::acknowledge(channel);
+    if (channel != SOCKET_ERROR_VAL)
+    {
+        closeSocket(channel);
+    }
+    if (!received)
+    {
+        std::cerr << RED_COLOR BOLD_TEXT "Could not take over from " << config.takeoverPath << RESET_COLOR << std::endl;
+        std::cerr << YELLOW_COLOR "Is a server running with --handoff-socket " << config.takeoverPath << "?" RESET_COLOR << std::endl;
+        exit(1);
+    }
+
+    // Blocking, as a fresh listener would be; the modes that want them non-blocking set that up themselves
+    serverSocket = inherited.listeners[0];
+    for (socket_t listener : inherited.listeners)
+    {
+        setNonBlocking(listener, false);
+    }
+    sockaddr_in bound;
+    socklen_t boundLength = sizeof(bound);
+    if (getsockname(serverSocket, (sockaddr *)&bound, &boundLength) == 0)
+    {
+        port = ntohs(bound.sin_port);
+    }
+    std::cout << GREEN_COLOR "Took over port " << port << " and " << inherited.clients.size() << " connections" RESET_COLOR << std::endl;
+}
+
+void ChatServer::adoptClients(const HandoffState &inherited)
+{
+    // Only sent along when the predecessor had no durable log to reload it from
+    std::shared_ptr<InheritedRooms> held = std::make_shared<InheritedRooms>(*rooms);
+    for (const HandoffRoom &saved : inherited.rooms)
+    {
+        std::shared_ptr<Room> room = saved.name == DEFAULT_ROOM ? lobby : rooms->acquire(saved.name);
+        if (!room)
+        {
+            continue;
+        }
+        for (const std::string &frame : saved.history)
+        {
+            room->history().append(makeMessageBuffer(frame));
+        }
+        if (room != lobby)
+        {
+            held->rooms.push_back(room);
+        }
+    }
+
+    for (size_t i = 0; i < inherited.clients.size(); ++i)
+    {
+        const HandoffClient &client = inherited.clients[i];
+        if (!reactors.empty())
+        {
+            // Spread over the shards; each sets its connections up on its own loop thread
+            Reactor *shard = reactors[i % reactors.size()].get();
+            shard->post([shard, client, held]()
+                        { shard->adopt(client); });
+            continue;
+        }
+
+        setNonBlocking(client.socket);
+        ParkedClient adopted;
+        adopted.session.outbound.reset(new SendQueue(client.socket, config.sendQueueLimit, config.overflowPolicy));
+        // Queued first: it may end halfway through a frame the client is still reading
+        if (!client.unsentOutput.empty())
+        {
+            adopted.session.outbound->push(makeMessageBuffer(client.unsentOutput));
+        }
+        Metrics::add(Counter::ConnectionsOpened);
+        clients.add(client.socket, ClientRegistry::NO_SHARD, adopted.session.outbound);
+        restoreSession(client.socket, adopted.session, client);
+        adopted.parser.feed(client.unparsedInput.data(), client.unparsedInput.size());
+        parked.push_back(adopted);
+    }
+}
+
+void ChatServer::restoreSession(socket_t clientSocket, ClientSession &session, const HandoffClient &client)
+{
+    if (client.username.empty())
+    {
+        // Still handshaking: its Join is in the unparsed input or yet to come
+        return;
+    }
+    clients.join(clientSocket, client.username);
+    session.username = client.username;
+    for (const std::string &name : client.rooms)
+    {
+        std::shared_ptr<Room> room = name == DEFAULT_ROOM ? lobby : rooms->acquire(name);
+        if (room)
+        {
+            joinRoom(clientSocket, session, room);
+        }
+    }
+    // A successor without compression simply sends plain bodies, which every client reads
+    if (client.compression && config.compressMin > 0)
+    {
+        enableCompression(clientSocket, session, false);
+    }
+}
+
+void ChatServer::stop()
+{
+    if (serverSocket == SOCKET_ERROR_VAL)
+    {
+        return;
+    }
+
+    running = false;
+    if (handoffWatcher.joinable())
+    {
+        handoffWatcher.join();
+    }
+    if (transferred)
+    {
+        // The successor holds the same sockets: only drop our descriptors,
+        // a shutdown() would hang up on it as well
+        for (const ParkedClient &client : parked)
+        {
+            closeSocket(client.session.outbound->getSocket());
+        }
+        parked.clear();
+        clients.clear();
+        reactors.clear();
+        closeSocket(serverSocket);
+        serverSocket = SOCKET_ERROR_VAL;
+        return;
+    }
+
+    std::cout << FORMAT_SYSTEM_MESSAGE("Shutting down server...") << std::endl;
+
+    if (admin)
+    {
+        admin->stop();
+    }
+    if (federation)
+    {
+        federation->stop();
+    }
+    if (coalescer)
+    {
+        coalescer->stop();
+    }
+    if (heartbeats)
+    {
+        heartbeats->stop();
+    }
+    if (indexer)
+    {
+        indexer->stop();
+    }
+
+    for (const std::unique_ptr<Reactor> &shard : reactors)
+    {
+        // Each loop closes its own client sockets once it wakes up
+        shard->stop();
+    }
+
+    // Handler threads notice the shutdown, clean up and close their own sockets
+    std::shared_ptr<const ClientRegistry::Snapshot> current = clients.snapshot();
+    for (const std::shared_ptr<const ClientRegistry::Client> &client : *current)
+    {
+        if (client->outbound)
+        {
+            shutdownSocket(client->socket);
+        }
+    }
+    clients.clear();
+
+    if (messageLog)
+    {
+        // Whatever is still queued is written and synced before exit
+        messageLog->close();
     }
-    clientSockets.clear();
-    clientUsernames.clear();
 
 #ifdef _WIN32
     closesocket(serverSocket);
     WSACleanup();
 #else
+    // shutdown() is what actually unblocks a thread sitting in accept()
+    shutdown(serverSocket, SHUT_RDWR);
     close(serverSocket);
 #endif
+    serverSocket = SOCKET_ERROR_VAL;
 }
\ No newline at end of file
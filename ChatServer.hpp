@@ -4,41 +4,268 @@
 #include <string>
 #include <thread>
 #include <mutex>
+#include <atomic>
+#include <memory>
+#include <condition_variable>
+#include "Protocol.hpp"
+#include "ChatHistory.hpp"
+#include "Room.hpp"
+#include "MessageLog.hpp"
+#include "ClientRegistry.hpp"
+#include "Logger.hpp"
+#include "SendQueue.hpp"
+#include "WriteCoalescer.hpp"
+#include "HeartbeatMonitor.hpp"
+#include "Handoff.hpp"
+#include "Federation.hpp"
+#include "FloodControl.hpp"
+#include "SearchIndex.hpp"
+#include "SocketUtils.hpp"
 
-#ifdef _WIN32
-#include <winsock2.h>
-#include <ws2tcpip.h>
-#pragma comment(lib, "ws2_32.lib")
-typedef SOCKET socket_t;
-#define SOCKET_ERROR_VAL INVALID_SOCKET
-#else
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
-#include <unistd.h>
-typedef int socket_t;
-#define SOCKET_ERROR_VAL -1
-#endif
+// How the server multiplexes client sockets, chosen at startup
+enum class ServerMode
+{
+    Threaded, // One detached thread per client (portable default)
+    Epoll,    // Single event loop over non-blocking sockets (Linux only)
+    Sharded   // One event loop per core, each with its own SO_REUSEPORT listener (Linux only)
+};
+
+// How the event-driven modes talk to the kernel
+enum class IoBackend
+{
+    Epoll,  // Readiness notifications plus non-blocking recv()/sendmsg()
+    IoUring // Batched asynchronous requests on an io_uring, falls back to Epoll when unsupported
+};
+
+struct ServerConfig
+{
+    ServerMode mode = ServerMode::Threaded;
+    IoBackend ioBackend = IoBackend::Epoll; // Ignored in Threaded mode
+    size_t shards = 0;          // Reactor threads in Sharded mode, 0 = one per core
+    size_t historyDepth = 1000; // Messages kept in each room's in-memory ring buffer
+    size_t historyReplay = 50;  // Messages replayed to a client right after it joins a room
+    size_t maxRooms = 256;      // Rooms that can exist at once, including the lobby
+    size_t maxRoomsPerClient = 32; // Rooms one client can be in at once, including the lobby
+    MessageLogConfig log;       // Durable history on disk, off unless log.directory is set
+    size_t sendQueueLimit = 1024 * 1024; // Unsent bytes allowed per client before the overflow policy applies
+    OverflowPolicy overflowPolicy = OverflowPolicy::DropOldest;
+    DeliveryPolicy delivery;    // Write queued output right away or coalesce it first
+    size_t compressMin = 0;     // Compress bodies this long for clients that negotiated it, 0 = off
+    unsigned heartbeatSeconds = 30;        // Ping a joined client after this long without data from it, 0 = off
+    unsigned idleTimeoutSeconds = 90;      // Close connections that sent nothing for this long, 0 = off
+    unsigned handshakeTimeoutSeconds = 10; // Close connections that have not joined by then, 0 = off
+    int adminPort = 0;       // Loopback port serving metrics, 0 = off
+    std::string adminSocket; // Unix socket path serving metrics, empty = off
+    std::string handoffPath;  // Unix socket where a successor process can take over, empty = off
+    std::string takeoverPath; // Take over the server waiting at this handoff path instead of binding the port
+    FederationConfig federation; // Peer servers sharing the chat, off unless a peer port or peers are set
+    LogConfig logging;       // Server log: level, destination, chat line rate
+    FloodConfig flood;       // Per-client message and byte rates, optional server-wide fan-out cap
+};
+
+// Outbound backlog of one client, as reported on the metrics endpoint
+struct ClientQueueStat
+{
+    socket_t socket;
+    std::string username;
+    size_t queuedBytes;
+};
+
+// Per-connection state shared by the threaded and event-driven paths
+struct ClientSession
+{
+    std::string username;                     // Empty until the Join handshake has been processed
+    std::shared_ptr<SendQueue> outbound;      // Threaded mode only; reactors own their queues
+    std::vector<std::shared_ptr<Room>> rooms; // Rooms this client is subscribed to
+    bool compression = false;                 // Negotiated compressed bodies in the handshake
+    ClientFlood flood;                        // Position in the flood control buckets
+    int64_t takeoverUntil = 0;                // Resume waiting for the name's stale session to close until then
+
+    std::shared_ptr<Room> findRoom(const std::string &name) const;
+};
+
+// A threaded-mode client without a handler thread: parked by a handoff that
+// may still fail, or adopted from the process this one took over from
+struct ParkedClient
+{
+    ClientSession session;
+    FrameParser parser;
+    Frame frame;        // Last frame parsed; the one flood control holds back while held
+    bool held = false;
+};
+
+class Reactor;
+class AdminServer;
+
+// Size of the per-read buffer; one recv() may carry many frames
+const size_t RECV_BUFFER_SIZE = 16 * 1024;
+
+// How long a threaded handler waits before retrying a flush that hit a full socket buffer
+const int FLUSH_RETRY_MS = 50;
+
+// Resolution of the heartbeat and timeout timers
+const int LIVENESS_TICK_MS = 100;
+
+// How often the threaded accept loop and the handoff listener check for a handoff or shutdown
+const int ACCEPT_POLL_MS = 200;
+
+// How long the old process waits for its successor to confirm it holds every socket
+const int HANDOFF_ACK_TIMEOUT_MS = 10000;
+
+// How long a resume waits for the stale session holding its name to close,
+// and how often it checks meanwhile
+const int TAKEOVER_TIMEOUT_MS = 2000;
+const int TAKEOVER_RETRY_MS = 20;
+
+// Least time between two notices telling a client it is over its flood limit
+const int FLOOD_NOTICE_INTERVAL_MS = 2000;
+
+// Matches one search returns; older ones need a narrower query
+const size_t SEARCH_RESULT_LIMIT = 20;
+
+// How often the indexer thread brings the search indexes up to date with history
+const int SEARCH_INDEX_INTERVAL_MS = 50;
+
+// History entries an index takes in per pass, so a search never waits long behind a backlog
+const size_t SEARCH_INDEX_BATCH = 512;
 
 class ChatServer
 {
 private:
+    friend class Reactor;
+
     socket_t serverSocket;
-    std::vector<socket_t> clientSockets;
-    std::vector<std::string> chatHistory;
-    std::mutex clientsMutex;
-    bool running;
+    ServerConfig config;
+    ClientRegistry clients; // Every connection of every mode, by socket and by username
+    std::unique_ptr<MessageLog> messageLog; // Null when the durable log is off
+    std::unique_ptr<RoomRegistry> rooms;
+    std::shared_ptr<Room> lobby; // Every client joins it after the handshake
+    std::atomic<bool> running;
+    std::atomic<size_t> compressionClients; // Joined clients that read compressed bodies
+    FloodControl flood;
+    // Last sequence number given to a message kept in history. Starts at the
+    // startup time in microseconds, so numbers keep growing across restarts.
+    std::atomic<uint64_t> lastSequence;
+    std::vector<std::unique_ptr<Reactor>> reactors; // Event-driven modes: one per shard
+    std::unique_ptr<AdminServer> admin;
+    std::unique_ptr<WriteCoalescer> coalescer; // Threaded mode with Coalesce delivery only
+    std::unique_ptr<HeartbeatMonitor> heartbeats; // Threaded mode with any liveness timer on
+    std::unique_ptr<Federation> federation; // Null unless this server has peers
+    std::unique_ptr<SearchIndexer> indexer;
+    std::vector<std::shared_ptr<Room>> indexedRooms; // Indexer thread only
+    MessageBuffer pingMessage;
+
+    // Hot restart. Once a successor connects to the handoff socket, the loops
+    // and handler threads stop where they are, without closing anything; the
+    // thread that runs start() then sends every socket and session over and
+    // either exits or, when the successor does not confirm, carries on.
+    std::atomic<bool> handingOff;
+    bool transferred;       // The successor owns every socket; nothing is shut down on the way out
+    socket_t handoffListener;
+    socket_t handoffChannel; // Connection to the successor during a handoff
+    std::thread handoffWatcher;
+    std::mutex parkLock;
+    std::condition_variable parkChanged;
+    size_t activeHandlers;             // Threaded handler threads that neither exited nor parked
+    std::vector<ParkedClient> parked;  // Threaded clients waiting for a handler thread
+
+    void openListener(int &port);
+    void createReactors(int port, const std::vector<socket_t> &inheritedListeners);
+    socket_t openShardListener(int port);
+    void runThreaded();
+    void spawnHandler(const ParkedClient &client);
+    void handleClient(ParkedClient client);
+    void broadcastMessage(const MessageBuffer &message, socket_t sender);
+    void broadcastToRoom(const std::shared_ptr<Room> &room, const MessageBuffer &message, socket_t sender);
+    void sendToClient(socket_t clientSocket, const std::vector<MessageBuffer> &batch);
+    // Any thread: queues a message for one joined client, on whichever shard owns it
+    void deliverTo(const ClientRegistry::Client &target, const MessageBuffer &message);
+    void flushQueues(const std::vector<std::shared_ptr<SendQueue>> &queues);
+    void sendSystemMessage(socket_t clientSocket, const std::string &text);
+    void replayHistory(socket_t clientSocket, const ClientSession &session, Room &room);
+    // Messages of missedRooms after lastSeen, merged in sequence order, for a resumed join
+    void replayMissed(socket_t clientSocket, const ClientSession &session, const std::vector<std::shared_ptr<Room>> &missedRooms, uint64_t lastSeen);
+    // A System notice followed by history entries, packed into Batch frames for compression clients
+    void sendReplay(socket_t clientSocket, const ClientSession &session, const std::string &notice, const std::vector<MessageBuffer> &entries);
+    void recordHistory(Room &room, const MessageBuffer &message);
+    uint64_t nextSequence() { return lastSequence.fetch_add(1) + 1; }
+    // Encodes a message for fan-out, with a compressed variant when someone can use it;
+    // messages kept in history pass nextSequence()
+    MessageBuffer encodeMessage(FrameType type, const std::string &sender, const std::string &body, const std::string &room = "", uint64_t sequence = 0);
+    // The frame with its body compressed, null when that would not be smaller
+    MessageBuffer compressMessage(FrameType type, const std::string &sender, const std::string &body, const std::string &room = "", uint64_t sequence = 0);
+    // announce = false switches it on without telling the client, which already knows
+    void enableCompression(socket_t clientSocket, ClientSession &session, bool announce = true);
+    // Heartbeats and timeouts, for whichever thread owns the connection's
+    // timer. checkLiveness() pings or closes the connection as due and returns
+    // when to check again, TimerWheel::Clock::time_point::max() for never.
+    bool livenessEnabled() const;
+    TimerWheel::Clock::time_point checkLiveness(Liveness &liveness, bool joined);
+    std::vector<ClientQueueStat> collectQueueStats();
+    std::string renderMetrics();
+
+    // Shared by the threaded and event-driven paths. processFrame() returns
+    // false when the connection should be closed; session.username stays
+    // empty until the handshake succeeds.
+    bool processFrame(socket_t clientSocket, ClientSession &session, const Frame &frame);
+    // Flood control of one message: false when it must not go out now. Under
+    // the Delay policy session.flood.heldUntil then says when to pass the
+    // same frame to processFrame() again; the caller reads nothing more from
+    // the client until then.
+    bool admitMessage(socket_t clientSocket, ClientSession &session, size_t length, size_t recipients,
+                      std::chrono::steady_clock::time_point now);
+    void announceJoin(socket_t clientSocket, ClientSession &session);
+    // Resume Join for a name a local client holds: closes that connection, which
+    // the reconnecting client has most likely lost, and holds the Join back like
+    // flood control until the name is free. False once that takes too long.
+    bool takeOver(socket_t clientSocket, ClientSession &session, const std::string &username);
+    // Join of a reconnecting client: back into its rooms with only the messages it missed
+    void resumeSession(socket_t clientSocket, ClientSession &session, uint64_t lastSeen, const std::vector<std::string> &roomNames);
+    void relayMessage(socket_t clientSocket, const std::string &username, const std::shared_ptr<Room> &room, const std::string &messageContent);
+    void announceLeave(socket_t clientSocket, ClientSession &session);
+    // Private messages and the /who list, both served from the registry's name index
+    void sendDirect(socket_t clientSocket, const std::string &username, const std::string &recipient, const std::string &text);
+    void listUsers(socket_t clientSocket);
+    // /search over the indexed history of the client's rooms
+    void searchHistory(socket_t clientSocket, const ClientSession &session, const std::string &query);
+    // Indexer thread: one catch-up pass over every room, false while a backlog is left
+    bool indexRooms();
+
+    // Room membership; joinRoom()/leaveRoom() only subscribe and unsubscribe,
+    // enterRoom()/exitRoom() also notify the room's members
+    void joinRoom(socket_t clientSocket, ClientSession &session, const std::shared_ptr<Room> &room);
+    void leaveRoom(socket_t clientSocket, ClientSession &session, const std::shared_ptr<Room> &room);
+    void enterRoom(socket_t clientSocket, ClientSession &session, const std::string &name);
+    void exitRoom(socket_t clientSocket, ClientSession &session, const std::string &name);
+    std::string wireRoomName(const Room &room) const;
+
+    // Federation: messages of local clients go to peer servers with members
+    // in the room; messages relayed from there reach the local members
+    void federate(const Room &room, FrameType type, const std::string &sender, const std::string &body = "");
+    void deliverRemote(const std::string &roomName, FrameType type, const std::string &sender, const std::string &body);
+    void describeLocal(std::vector<std::string> &roomNames, std::vector<std::string> &users);
 
-    void handleClient(socket_t clientSocket);
-    void broadcastMessage(const std::string &message, socket_t sender);
+    // Handoff, old process: waits for a successor, then hands everything over from start()
+    void watchForSuccessor();
+    bool handOff();
+    // held is a frame flood control still holds back; it goes first into the unparsed input
+    static HandoffClient exportSession(socket_t clientSocket, const ClientSession &session, const FrameParser &parser, SendQueue &outbound,
+                                       const Frame *held = nullptr);
+    // Handoff, new process: receives the state in the constructor; clients are
+    // registered and put back in their rooms without any notice going out
+    void takeOver(HandoffState &inherited, int &port);
+    void adoptClients(const HandoffState &inherited);
+    void restoreSession(socket_t clientSocket, ClientSession &session, const HandoffClient &client);
 
 #ifdef _WIN32
     static bool initializeWinsock();
 #endif
 
 public:
-    ChatServer(int port);
+    ChatServer(int port, const ServerConfig &serverConfig = ServerConfig());
     ~ChatServer();
     void start();
     void stop();
+    // True once a successor took over; start() has returned and the process may exit
+    bool handedOff() const { return transferred; }
 };
\ No newline at end of file
@@ -0,0 +1,776 @@
+#include "ChatSession.hpp"
+#include <chrono>
+#include <cstring>
+#include <vector>
+
+#ifndef _WIN32
+#include <sys/uio.h>
+#endif
+
+namespace
+{
+    // Frames gathered into one write call
+    const int MAX_BATCH = 64;
+    // Longest wait for a connect() to complete
+    const int CONNECT_TIMEOUT_MS = 5000;
+    // close(): longest wait for queued frames to reach the kernel
+    const int DRAIN_TIMEOUT_MS = 1000;
+#ifdef _WIN32
+    // WSAPoll() cannot wait on a pipe, so the thread looks at the queue this often
+    const int IDLE_POLL_MS = 10;
+#else
+    const int IDLE_POLL_MS = -1;
+#endif
+
+    int64_t nowMs()
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    bool connectInProgress()
+    {
+#ifdef _WIN32
+        return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+        return errno == EINPROGRESS;
+#endif
+    }
+
+    std::future<bool> settled(bool value)
+    {
+        std::promise<bool> done;
+        done.set_value(value);
+        return done.get_future();
+    }
+}
+
+#ifdef _WIN32
+bool ChatSession::initializeWinsock()
+{
+    WSADATA wsaData;
+    return WSAStartup(MAKEWORD(2, 2), &wsaData) == 0;
+}
+#endif
+
+ChatSession::ChatSession()
+    : running(false), compression(false), socket(SOCKET_ERROR_VAL), lastSequence(0),
+      headOffset(0), queuedBytes(0), writable(false)
+{
+#ifdef _WIN32
+    initializeWinsock();
+#else
+    if (pipe(wakePipe) == 0)
+    {
+        setNonBlocking(wakePipe[0]);
+        setNonBlocking(wakePipe[1]);
+    }
+    else
+    {
+        wakePipe[0] = wakePipe[1] = -1;
+    }
+#endif
+}
+
+ChatSession::~ChatSession()
+{
+    close();
+#ifdef _WIN32
+    WSACleanup();
+#else
+    if (wakePipe[0] >= 0)
+    {
+        ::close(wakePipe[0]);
+        ::close(wakePipe[1]);
+    }
+#endif
+}
+
+std::future<JoinResult> ChatSession::open(const SessionConfig &sessionConfig)
+{
+    close();
+    config = sessionConfig;
+    firstJoin.reset(new std::promise<JoinResult>());
+    lastSequence = 0;
+    std::future<JoinResult> result = firstJoin->get_future();
+    {
+        std::lock_guard<std::mutex> guard(queueLock);
+        rooms.clear();
+        running = true;
+    }
+    worker = std::thread(&ChatSession::run, this);
+    return result;
+}
+
+void ChatSession::close()
+{
+    bool wasRunning;
+    {
+        std::lock_guard<std::mutex> guard(queueLock);
+        wasRunning = running.exchange(false);
+    }
+    wake();
+    if (worker.joinable())
+    {
+        worker.join();
+    }
+    failQueued();
+    if (wasRunning)
+    {
+        setState(SessionState::Closed);
+    }
+}
+
+void ChatSession::run()
+{
+    unsigned delayMs = config.reconnectDelayMs;
+    while (running)
+    {
+        if (!serveConnection(delayMs) || !config.reconnect)
+        {
+            break;
+        }
+
+        // Back off before the next attempt; close() cuts the wait short
+        int64_t until = nowMs() + delayMs;
+        while (running && nowMs() < until)
+        {
+#ifdef _WIN32
+            std::this_thread::sleep_for(std::chrono::milliseconds(IDLE_POLL_MS));
+#else
+            pollfd_t wakeEntry = {wakePipe[0], POLLIN, 0};
+            pollSockets(&wakeEntry, 1, static_cast<int>(until - nowMs()));
+            drainWake();
+#endif
+        }
+        delayMs = delayMs * 2 < config.maxReconnectDelayMs ? delayMs * 2 : config.maxReconnectDelayMs;
+    }
+
+    // Ended on its own (refused, or lost without reconnect): later sends are refused
+    {
+        std::lock_guard<std::mutex> guard(queueLock);
+        running = false;
+    }
+    failQueued();
+    settleFirstJoin(JoinResult::Unreachable);
+}
+
+bool ChatSession::serveConnection(unsigned &delayMs)
+{
+    setState(SessionState::Connecting);
+    if (!dial() || !handshake())
+    {
+        dropConnection();
+        settleFirstJoin(JoinResult::Unreachable);
+        if (running)
+        {
+            setState(SessionState::Disconnected, "Cannot reach " + config.host + ":" + std::to_string(config.port));
+        }
+        return running;
+    }
+
+    char buffer[64 * 1024];
+    bool joined = false;
+    std::string refusal;
+    bool lost = false;
+    while (running && !lost)
+    {
+        pollfd_t fds[2];
+        fds[0].fd = socket;
+        fds[0].events = POLLIN;
+        fds[0].revents = 0;
+        {
+            std::lock_guard<std::mutex> guard(queueLock);
+            if (writable && queuedBytes > 0)
+            {
+                fds[0].events |= POLLOUT;
+            }
+        }
+        unsigned long count = 1;
+#ifndef _WIN32
+        fds[1].fd = wakePipe[0];
+        fds[1].events = POLLIN;
+        fds[1].revents = 0;
+        count = 2;
+#endif
+        if (pollSockets(fds, count, IDLE_POLL_MS) < 0)
+        {
+            continue;
+        }
+        if (count > 1 && fds[1].revents)
+        {
+            drainWake();
+        }
+
+        if (fds[0].revents & (POLLIN | POLLERR | POLLHUP))
+        {
+            int bytesReceived = recv(socket, buffer, sizeof(buffer), 0);
+            if (bytesReceived <= 0)
+            {
+                if (bytesReceived == 0 || !socketWouldBlock())
+                {
+                    lost = true;
+                }
+                continue;
+            }
+
+            // Hand over every frame this read completed, then let the caller finish the batch
+            parser.feed(buffer, bytesReceived);
+            while (parser.next(incoming))
+            {
+                if (!handleFrame(incoming, joined, refusal))
+                {
+                    dropConnection();
+                    settleFirstJoin(JoinResult::NameTaken);
+                    setState(SessionState::Refused, refusal);
+                    return false;
+                }
+            }
+            if (batchHandler)
+            {
+                batchHandler();
+            }
+            if (parser.hasError())
+            {
+                lost = true;
+                continue;
+            }
+            if (joined)
+            {
+                delayMs = config.reconnectDelayMs;
+            }
+        }
+        if ((fds[0].revents & POLLOUT) && flush() == FlushResult::Failed)
+        {
+            lost = true;
+        }
+    }
+
+    if (!running && joined)
+    {
+        // close(): let what was sent before it go out, then say goodbye
+        {
+            std::lock_guard<std::mutex> guard(queueLock);
+            std::string leave = encodeFrame(FrameType::Leave, "", "");
+            queuedBytes += leave.size();
+            outbound.push_back(Outgoing(std::move(leave), std::unique_ptr<std::promise<bool>>()));
+        }
+        int64_t deadline = nowMs() + DRAIN_TIMEOUT_MS;
+        FlushResult result;
+        while ((result = flush()) != FlushResult::Drained && result != FlushResult::Failed && nowMs() < deadline)
+        {
+            pollfd_t entry = {socket, POLLOUT, 0};
+            pollSockets(&entry, 1, result == FlushResult::Busy ? 1 : static_cast<int>(deadline - nowMs()));
+        }
+    }
+    dropConnection();
+    if (!running)
+    {
+        return false;
+    }
+    if (!joined)
+    {
+        settleFirstJoin(JoinResult::Unreachable);
+    }
+    setState(SessionState::Disconnected, "Connection to server lost");
+    return true;
+}
+
+bool ChatSession::dial()
+{
+    sockaddr_in serverAddr;
+    memset(&serverAddr, 0, sizeof(serverAddr));
+    serverAddr.sin_family = AF_INET;
+    serverAddr.sin_port = htons(config.port);
+    if (inet_pton(AF_INET, config.host.c_str(), &serverAddr.sin_addr) != 1)
+    {
+        return false;
+    }
+
+    socket = ::socket(AF_INET, SOCK_STREAM, 0);
+    if (socket == SOCKET_ERROR_VAL || !setNonBlocking(socket))
+    {
+        return false;
+    }
+    // Every frame goes out as soon as it is written; batching is done above the socket
+    setNoDelay(socket);
+
+    if (::connect(socket, (sockaddr *)&serverAddr, sizeof(serverAddr)) == 0)
+    {
+        return true;
+    }
+    if (!connectInProgress())
+    {
+        return false;
+    }
+
+    // Wait for the connection, or for close()
+    int64_t deadline = nowMs() + CONNECT_TIMEOUT_MS;
+    while (running && nowMs() < deadline)
+    {
+        pollfd_t fds[2];
+        fds[0].fd = socket;
+        fds[0].events = POLLOUT;
+        fds[0].revents = 0;
+        unsigned long count = 1;
+#ifndef _WIN32
+        fds[1].fd = wakePipe[0];
+        fds[1].events = POLLIN;
+        fds[1].revents = 0;
+        count = 2;
+#endif
+        int remaining = static_cast<int>(deadline - nowMs());
+        if (pollSockets(fds, count, IDLE_POLL_MS < 0 || remaining < IDLE_POLL_MS ? remaining : IDLE_POLL_MS) < 0)
+        {
+            continue;
+        }
+        if (count > 1 && fds[1].revents)
+        {
+            drainWake();
+        }
+        if (fds[0].revents)
+        {
+            int error = 0;
+            socklen_t length = sizeof(error);
+            getsockopt(socket, SOL_SOCKET, SO_ERROR, reinterpret_cast<char *>(&error), &length);
+            return error == 0;
+        }
+    }
+    return false;
+}
+
+bool ChatSession::handshake()
+{
+    // After a drop, ask to be put back in the rooms with just the messages
+    // missed since the last one received
+    std::string resume;
+    restored.clear();
+    if (lastSequence != 0)
+    {
+        std::lock_guard<std::mutex> guard(queueLock);
+        restored = rooms;
+        resume = encodeResume(lastSequence, std::vector<std::string>(rooms.begin(), rooms.end()));
+    }
+
+    // An empty socket buffer takes the whole Join frame at once. Offer
+    // compression; the server decides whether it is used.
+    std::string join = encodeFrame(FrameType::Join, config.username, resume, "", config.compression ? FLAG_COMPRESSION : 0);
+    return ::send(socket, join.data(), static_cast<int>(join.size()), SEND_FLAGS) == static_cast<int>(join.size());
+}
+
+bool ChatSession::handleFrame(const Frame &frame, bool &joined, std::string &refusal)
+{
+    if (frame.sequence > lastSequence)
+    {
+        lastSequence = frame.sequence;
+    }
+
+    switch (frame.type)
+    {
+    case FrameType::Ping:
+    {
+        // Heartbeat from the server; answering keeps an idle session open
+        std::lock_guard<std::mutex> guard(queueLock);
+        std::string pong = encodeFrame(FrameType::Pong, "", "");
+        queuedBytes += pong.size();
+        outbound.push_back(Outgoing(std::move(pong), std::unique_ptr<std::promise<bool>>()));
+        return true;
+    }
+    case FrameType::Pong:
+        return true;
+    case FrameType::System:
+        if (frame.flags & FLAG_COMPRESSION)
+        {
+            compression = true;
+        }
+        else if (!joined && frame.sender == config.username)
+        {
+            refusal = frame.body;
+            return false;
+        }
+        deliver(frame);
+        return true;
+    case FrameType::Join:
+        if (joined || frame.sender != config.username)
+        {
+            deliver(frame);
+            return true;
+        }
+        break;
+    case FrameType::Batch:
+    {
+        // History replay packed into one frame; the frames inside are delivered as usual
+        FrameParser inner;
+        inner.feed(frame.body.data(), frame.body.size());
+        Frame entry;
+        while (inner.next(entry))
+        {
+            if (entry.type != FrameType::Batch)
+            {
+                if (entry.sequence > lastSequence)
+                {
+                    lastSequence = entry.sequence;
+                }
+                deliver(entry);
+            }
+        }
+        return true;
+    }
+    default:
+        deliver(frame);
+        return true;
+    }
+
+    // Our own Join came back: the name is ours. The server put us back in the
+    // rooms the Join listed; any joined or left since are changed ahead of
+    // everything queued, and room frames still queued from before are superseded.
+    joined = true;
+    {
+        std::lock_guard<std::mutex> guard(queueLock);
+        for (size_t i = 0; i < outbound.size();)
+        {
+            Outgoing &queued = outbound[i];
+            FrameType type = static_cast<FrameType>(static_cast<uint8_t>(queued.bytes[FRAME_LENGTH_SIZE]));
+            if (type != FrameType::RoomJoin && type != FrameType::RoomLeave)
+            {
+                ++i;
+                continue;
+            }
+            if (queued.written)
+            {
+                queued.written->set_value(true);
+            }
+            queuedBytes -= queued.bytes.size();
+            outbound.erase(i);
+        }
+        for (std::set<std::string>::reverse_iterator room = rooms.rbegin(); room != rooms.rend(); ++room)
+        {
+            if (restored.count(*room))
+            {
+                continue;
+            }
+            std::string rejoin = encodeFrame(FrameType::RoomJoin, "", "", *room);
+            queuedBytes += rejoin.size();
+            outbound.push_front(Outgoing(std::move(rejoin), std::unique_ptr<std::promise<bool>>()));
+        }
+        for (const std::string &room : restored)
+        {
+            if (rooms.count(room))
+            {
+                continue;
+            }
+            std::string leave = encodeFrame(FrameType::RoomLeave, "", "", room);
+            queuedBytes += leave.size();
+            outbound.push_front(Outgoing(std::move(leave), std::unique_ptr<std::promise<bool>>()));
+        }
+        writable = true;
+    }
+    settleFirstJoin(JoinResult::Joined);
+    setState(SessionState::Joined);
+    flush();
+    return true;
+}
+
+void ChatSession::deliver(const Frame &frame)
+{
+    if (messageHandler)
+    {
+        messageHandler(frame);
+    }
+}
+
+void ChatSession::dropConnection()
+{
+    {
+        // Producers stop writing before the descriptor goes away
+        std::lock_guard<std::mutex> guard(queueLock);
+        writable = false;
+        // A frame the old connection took only in part goes again in full
+        queuedBytes += headOffset;
+        headOffset = 0;
+    }
+    if (socket != SOCKET_ERROR_VAL)
+    {
+        closeSocket(socket);
+        socket = SOCKET_ERROR_VAL;
+    }
+    parser = FrameParser();
+    compression = false;
+}
+
+void ChatSession::setState(SessionState state, const std::string &detail)
+{
+    if (stateHandler)
+    {
+        stateHandler(state, detail);
+    }
+}
+
+void ChatSession::settleFirstJoin(JoinResult result)
+{
+    if (firstJoin)
+    {
+        firstJoin->set_value(result);
+        firstJoin.reset();
+    }
+}
+
+void ChatSession::wake()
+{
+#ifndef _WIN32
+    if (wakePipe[1] >= 0)
+    {
+        char byte = 0;
+        if (write(wakePipe[1], &byte, 1) < 0)
+        {
+            // Pipe full: the thread has wake-ups pending anyway
+        }
+    }
+#endif
+}
+
+void ChatSession::drainWake()
+{
+#ifndef _WIN32
+    char bytes[64];
+    while (read(wakePipe[0], bytes, sizeof(bytes)) > 0)
+    {
+    }
+#endif
+}
+
+std::string ChatSession::encodeText(FrameType type, const std::string &sender, const std::string &text, const std::string &room)
+{
+    std::string frame;
+    {
+        std::lock_guard<std::mutex> guard(queueLock);
+        if (!spares.empty())
+        {
+            frame.swap(spares.back());
+            spares.pop_back();
+        }
+    }
+    // Long messages go compressed once the server has agreed to it
+    if (!compression || text.size() < COMPRESS_MIN_BYTES || !appendCompressedFrame(frame, type, sender, text, room))
+    {
+        appendFrame(frame, type, sender, text, room);
+    }
+    return frame;
+}
+
+std::future<bool> ChatSession::submit(std::string frame)
+{
+    std::unique_ptr<std::promise<bool>> done(new std::promise<bool>());
+    std::future<bool> result = done->get_future();
+    enqueue(std::move(frame), std::move(done));
+    return result;
+}
+
+std::future<bool> ChatSession::send(const std::string &text, const std::string &room)
+{
+    if (text.size() > MAX_MESSAGE_LENGTH)
+    {
+        return settled(false);
+    }
+    // Server prefixes the stored username, so only the text goes on the wire
+    return submit(encodeText(FrameType::Chat, "", text, room == DEFAULT_ROOM ? "" : room));
+}
+
+bool ChatSession::post(const std::string &text, const std::string &room)
+{
+    if (text.size() > MAX_MESSAGE_LENGTH)
+    {
+        return false;
+    }
+    return enqueue(encodeText(FrameType::Chat, "", text, room == DEFAULT_ROOM ? "" : room), std::unique_ptr<std::promise<bool>>());
+}
+
+std::future<bool> ChatSession::sendDirect(const std::string &recipient, const std::string &text)
+{
+    if (text.size() > MAX_MESSAGE_LENGTH || recipient.empty() || recipient.size() > MAX_USERNAME_LENGTH)
+    {
+        return settled(false);
+    }
+    return submit(encodeText(FrameType::Direct, recipient, text, ""));
+}
+
+std::future<bool> ChatSession::who()
+{
+    return submit(encodeFrame(FrameType::Who, "", ""));
+}
+
+std::future<bool> ChatSession::search(const std::string &query)
+{
+    if (query.size() > MAX_MESSAGE_LENGTH)
+    {
+        return settled(false);
+    }
+    return submit(encodeFrame(FrameType::Search, "", query));
+}
+
+std::future<bool> ChatSession::joinRoom(const std::string &room)
+{
+    std::string name = room == DEFAULT_ROOM ? "" : room;
+    std::unique_ptr<std::promise<bool>> done(new std::promise<bool>());
+    std::future<bool> result = done->get_future();
+    enqueue(encodeFrame(FrameType::RoomJoin, "", "", name), std::move(done), name, true);
+    return result;
+}
+
+std::future<bool> ChatSession::leaveRoom(const std::string &room)
+{
+    std::string name = room == DEFAULT_ROOM ? "" : room;
+    std::unique_ptr<std::promise<bool>> done(new std::promise<bool>());
+    std::future<bool> result = done->get_future();
+    enqueue(encodeFrame(FrameType::RoomLeave, "", "", name), std::move(done), name, false);
+    return result;
+}
+
+bool ChatSession::enqueue(std::string frame, std::unique_ptr<std::promise<bool>> done, const std::string &room, bool entering)
+{
+    {
+        std::lock_guard<std::mutex> guard(queueLock);
+        if (!running || (queuedBytes > 0 && queuedBytes + frame.size() > config.queueLimit))
+        {
+            if (done)
+            {
+                done->set_value(false);
+            }
+            return false;
+        }
+        // Room changes are recorded together with their frame, so a rejoin
+        // after a reconnect sees either both or neither
+        if (!room.empty() && entering)
+        {
+            rooms.insert(room);
+        }
+        else if (!room.empty())
+        {
+            rooms.erase(room);
+        }
+        queuedBytes += frame.size();
+        outbound.push_back(Outgoing(std::move(frame), std::move(done)));
+    }
+
+    // Written right here unless another thread is at it or the socket is full
+    FlushResult result = flush();
+    if (result == FlushResult::Pending || result == FlushResult::Failed)
+    {
+        wake();
+    }
+    return true;
+}
+
+ChatSession::FlushResult ChatSession::flush()
+{
+    std::unique_lock<std::mutex> guard(queueLock, std::try_to_lock);
+    if (!guard.owns_lock())
+    {
+        return FlushResult::Busy;
+    }
+    if (!writable)
+    {
+        // Not joined yet: written once the handshake is done
+        return FlushResult::Waiting;
+    }
+
+    while (!outbound.empty())
+    {
+        // Gather as many queued frames as fit into one write call
+#ifdef _WIN32
+        WSABUF parts[MAX_BATCH];
+#else
+        iovec parts[MAX_BATCH];
+#endif
+        int count = 0;
+        for (; static_cast<size_t>(count) < outbound.size() && count < MAX_BATCH; ++count)
+        {
+            const std::string &bytes = outbound[count].bytes;
+            size_t skip = (count == 0) ? headOffset : 0;
+#ifdef _WIN32
+            parts[count].buf = const_cast<char *>(bytes.data()) + skip;
+            parts[count].len = static_cast<ULONG>(bytes.size() - skip);
+#else
+            parts[count].iov_base = const_cast<char *>(bytes.data()) + skip;
+            parts[count].iov_len = bytes.size() - skip;
+#endif
+        }
+
+#ifdef _WIN32
+        DWORD written = 0;
+        if (WSASend(socket, parts, count, &written, 0, nullptr, nullptr) != 0)
+        {
+            return socketWouldBlock() ? FlushResult::Pending : FlushResult::Failed;
+        }
+        size_t sent = written;
+#else
+        msghdr header = {};
+        header.msg_iov = parts;
+        header.msg_iovlen = count;
+        ssize_t result = sendmsg(socket, &header, SEND_FLAGS);
+        if (result < 0)
+        {
+            return socketWouldBlock() ? FlushResult::Pending : FlushResult::Failed;
+        }
+        size_t sent = static_cast<size_t>(result);
+#endif
+
+        // Retire every frame the kernel took in full, remember where the partial one stopped
+        queuedBytes -= sent;
+        while (sent > 0)
+        {
+            size_t remaining = outbound.front().bytes.size() - headOffset;
+            if (sent < remaining)
+            {
+                headOffset += sent;
+                break;
+            }
+            sent -= remaining;
+            retireFront();
+            headOffset = 0;
+        }
+    }
+    return FlushResult::Drained;
+}
+
+void ChatSession::retireFront()
+{
+    Outgoing &frame = outbound.front();
+    if (frame.written)
+    {
+        frame.written->set_value(true);
+    }
+    // Kept for encodeText(), unless it grew for an unusually long message
+    if (spares.size() < SPARE_LIMIT && frame.bytes.capacity() <= SPARE_MAX_CAPACITY)
+    {
+        frame.bytes.clear();
+        spares.push_back(std::move(frame.bytes));
+    }
+    outbound.pop_front();
+}
+
+void ChatSession::failQueued()
+{
+    std::lock_guard<std::mutex> guard(queueLock);
+    for (size_t i = 0; i < outbound.size(); ++i)
+    {
+        if (outbound[i].written)
+        {
+            outbound[i].written->set_value(false);
+        }
+    }
+    outbound.clear();
+    headOffset = 0;
+    queuedBytes = 0;
+}
+
+size_t ChatSession::queued()
+{
+    std::lock_guard<std::mutex> guard(queueLock);
+    return queuedBytes;
+}
+
+bool ChatSession::isJoined()
+{
+    std::lock_guard<std::mutex> guard(queueLock);
+    return writable;
+}
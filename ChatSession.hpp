@@ -0,0 +1,205 @@
+// ChatSession.hpp
+#pragma once
+#include "Protocol.hpp"
+#include "SocketUtils.hpp"
+#include "RingQueue.hpp"
+#include <string>
+#include <vector>
+#include <set>
+#include <memory>
+#include <future>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <cstdint>
+
+struct SessionConfig
+{
+    std::string host = "127.0.0.1";      // IPv4 address of the server
+    int port = 12345;
+    std::string username;
+    bool compression = true;             // Offer compressed bodies in the handshake
+    bool reconnect = true;               // Redial and rejoin, rooms included, when the connection drops;
+                                         // the server then sends only the messages missed meanwhile
+    unsigned reconnectDelayMs = 250;     // First redial delay, doubled after every failed attempt
+    unsigned maxReconnectDelayMs = 8000;
+    size_t queueLimit = 16 * 1024 * 1024; // Unsent bytes beyond which sends are refused
+};
+
+enum class SessionState
+{
+    Connecting,   // Dialing or waiting for the server to accept the name
+    Joined,       // Handshake done; queued messages are being written
+    Refused,      // Server refused the name; the session is closed
+    Disconnected, // Connection lost; redialing when reconnect is on, closed otherwise
+    Closed        // close() was called
+};
+
+// Outcome of the first handshake of open()
+enum class JoinResult
+{
+    Joined,
+    NameTaken,  // Server refused the username, detail in the Refused state notice
+    Unreachable // No connection, or it dropped during the handshake
+};
+
+// Headless chat client for bots, bridges and the interactive client alike.
+// One background thread owns the socket: it dials, joins, reads, answers
+// pings and redials with backoff when the connection drops. Sending never
+// waits for it: a message is encoded on the caller's thread, appended to an
+// outbound queue and written at once with a non-blocking write when no other
+// thread is writing; whatever the socket does not take is written by the
+// background thread. Many sends in a row therefore go out pipelined, several
+// frames per write call, without a round trip each.
+//
+// Messages queued while the connection is down are written after the rejoin;
+// a frame the old connection took only in part is sent again in full. Frames
+// the old connection did take may still have been lost with it. Incoming
+// messages are not lost that way: the rejoin names the last sequence number
+// received, and the server sends whatever came after it that is still in
+// its history, after a System notice saying how many messages that is.
+//
+// Handlers run on the background thread. They may call any method except
+// close(), and should not block for long: while they run, replies to pings and
+// writes of a full socket wait.
+class ChatSession
+{
+public:
+    // Every frame from the server except pings, pongs and the own join
+    // acknowledgment; history replays arrive as their individual frames.
+    // frame.sequence orders the messages the server keeps in history.
+    typedef std::function<void(const Frame &frame)> MessageHandler;
+    // After the frames one read produced were handed to the message handler
+    typedef std::function<void()> BatchHandler;
+    // detail explains Refused and Disconnected
+    typedef std::function<void(SessionState state, const std::string &detail)> StateHandler;
+
+private:
+    struct Outgoing
+    {
+        std::string bytes;
+        std::unique_ptr<std::promise<bool>> written; // Null for post()
+
+        Outgoing() {}
+        Outgoing(std::string frame, std::unique_ptr<std::promise<bool>> done)
+            : bytes(std::move(frame)), written(std::move(done))
+        {
+        }
+    };
+
+    // Strings of written frames kept for encoding the next messages
+    static const size_t SPARE_LIMIT = 64;
+    static const size_t SPARE_MAX_CAPACITY = 4096;
+
+    enum class FlushResult
+    {
+        Drained, // Everything queued has been handed to the kernel
+        Pending, // Socket buffer is full, the background thread waits for it
+        Busy,    // Another thread is writing and will see the new frames
+        Waiting, // Not joined yet; written once the handshake is done
+        Failed   // Socket error, the background thread notices the drop
+    };
+
+    SessionConfig config;
+    MessageHandler messageHandler;
+    BatchHandler batchHandler;
+    StateHandler stateHandler;
+    std::thread worker;
+    std::atomic<bool> running;
+    std::atomic<bool> compression; // Server agreed to compressed bodies on this connection
+
+    // Background thread only
+    socket_t socket;
+    FrameParser parser;
+    Frame incoming;                // Reused for every frame read, so its strings keep their capacity
+    std::unique_ptr<std::promise<JoinResult>> firstJoin; // Until the first handshake settles
+    uint64_t lastSequence;         // Highest server sequence number received, 0 before any
+    std::set<std::string> restored; // Rooms the last Join asked the server to put us back in
+
+    // Guards everything below; held during non-blocking writes
+    std::mutex queueLock;
+    RingQueue<Outgoing> outbound;
+    std::vector<std::string> spares; // Emptied strings of written frames, see SPARE_LIMIT
+    size_t headOffset;   // Bytes of outbound.front() already written
+    size_t queuedBytes;  // Unwritten bytes across outbound
+    bool writable;       // Joined on a live socket: frames may be written
+    std::set<std::string> rooms; // Joined rooms, rejoined after a reconnect
+
+#ifndef _WIN32
+    int wakePipe[2]; // Written to pull the background thread out of poll()
+#endif
+
+    void run();
+    // One connection from dial to drop; false when the session must end
+    bool serveConnection(unsigned &delayMs);
+    bool dial();
+    bool handshake();
+    bool handleFrame(const Frame &frame, bool &joined, std::string &refusal);
+    void deliver(const Frame &frame);
+    // Chat or Direct frame, compressed when the server agreed and it pays;
+    // built in a spare string when one is left from an earlier write
+    std::string encodeText(FrameType type, const std::string &sender, const std::string &text, const std::string &room);
+    std::future<bool> submit(std::string frame);
+    void dropConnection();
+    void setState(SessionState state, const std::string &detail = "");
+    void settleFirstJoin(JoinResult result);
+    void wake();
+    void drainWake();
+
+    // Queues an encoded frame and tries to write it right away; room frames
+    // also update rooms (entering tells a RoomJoin from a RoomLeave)
+    bool enqueue(std::string frame, std::unique_ptr<std::promise<bool>> done, const std::string &room = "", bool entering = false);
+    FlushResult flush();
+    // queueLock held: the front frame was written in full
+    void retireFront();
+    void failQueued();
+
+#ifdef _WIN32
+    static bool initializeWinsock();
+#endif
+
+public:
+    ChatSession();
+    ~ChatSession();
+
+    // Handlers must be set before open()
+    void onMessage(const MessageHandler &handler) { messageHandler = handler; }
+    void onBatch(const BatchHandler &handler) { batchHandler = handler; }
+    void onState(const StateHandler &handler) { stateHandler = handler; }
+
+    // Starts the background thread, which connects and joins. The future
+    // tells how the first handshake went; with reconnect on, a session that
+    // could not reach the server keeps trying anyway. A closed session may
+    // be opened again.
+    std::future<JoinResult> open(const SessionConfig &sessionConfig);
+
+    // Chat message to room (empty or DEFAULT_ROOM for the lobby). The future
+    // becomes true once the whole frame has been handed to the kernel, false
+    // when the queue is over its limit or the session closes first.
+    std::future<bool> send(const std::string &text, const std::string &room = "");
+    // Same without a future, for senders that do not track each message;
+    // false when the queue is over its limit
+    bool post(const std::string &text, const std::string &room = "");
+    // Private message to the user named recipient, on this server or a peer;
+    // the server answers with a copy flagged FLAG_ECHO once it went out, or a
+    // System notice when nobody of that name is online
+    std::future<bool> sendDirect(const std::string &recipient, const std::string &text);
+    std::future<bool> joinRoom(const std::string &room);
+    std::future<bool> leaveRoom(const std::string &room);
+    // Asks for the list of joined users, which arrives as Who frames
+    std::future<bool> who();
+    // Searches the history of the joined rooms for messages with every word
+    // of query (and from:NAME for one sender's); the matches arrive newest
+    // first after a System notice
+    std::future<bool> search(const std::string &query);
+
+    // Unsent bytes, for callers that pace themselves
+    size_t queued();
+    bool isJoined();
+    const std::string &username() const { return config.username; }
+
+    // Writes what is queued (waiting at most a second for a slow socket),
+    // says goodbye and stops the background thread
+    void close();
+};
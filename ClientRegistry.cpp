@@ -0,0 +1,134 @@
+#include "ClientRegistry.hpp"
+
+ClientRegistry::ClientRegistry()
+    : version(0), published(std::make_shared<const Snapshot>()), publishedVersion(0)
+{
+}
+
+void ClientRegistry::replace(const std::shared_ptr<const Client> &entry)
+{
+    bySocket[entry->socket] = entry;
+    if (!entry->username.empty())
+    {
+        byName[entry->username] = entry;
+    }
+    version.fetch_add(1, std::memory_order_release);
+}
+
+void ClientRegistry::add(socket_t socket, size_t shard, const std::shared_ptr<SendQueue> &outbound)
+{
+    std::shared_ptr<Client> entry = std::make_shared<Client>();
+    entry->socket = socket;
+    entry->state = ClientState::Handshaking;
+    entry->shard = shard;
+    entry->outbound = outbound;
+
+    std::lock_guard<std::mutex> guard(lock);
+    replace(entry);
+}
+
+bool ClientRegistry::join(socket_t socket, const std::string &username)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    auto current = bySocket.find(socket);
+    if (current == bySocket.end() || byName.count(username) > 0)
+    {
+        return false;
+    }
+
+    std::shared_ptr<Client> entry = std::make_shared<Client>(*current->second);
+    entry->username = username;
+    entry->state = ClientState::Joined;
+    replace(entry);
+    return true;
+}
+
+void ClientRegistry::remove(socket_t socket)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = bySocket.find(socket);
+    if (it == bySocket.end())
+    {
+        return;
+    }
+    if (!it->second->username.empty())
+    {
+        byName.erase(it->second->username);
+    }
+    bySocket.erase(it);
+    version.fetch_add(1, std::memory_order_release);
+}
+
+void ClientRegistry::clear()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    bySocket.clear();
+    byName.clear();
+    version.fetch_add(1, std::memory_order_release);
+}
+
+std::shared_ptr<const ClientRegistry::Client> ClientRegistry::find(socket_t socket)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = bySocket.find(socket);
+    return it == bySocket.end() ? std::shared_ptr<const Client>() : it->second;
+}
+
+std::shared_ptr<const ClientRegistry::Client> ClientRegistry::findByName(const std::string &username)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = byName.find(username);
+    return it == byName.end() ? std::shared_ptr<const Client>() : it->second;
+}
+
+std::vector<std::string> ClientRegistry::usernames()
+{
+    std::vector<std::string> names;
+    std::lock_guard<std::mutex> guard(lock);
+    names.reserve(byName.size());
+    for (const auto &entry : byName)
+    {
+        names.push_back(entry.first);
+    }
+    return names;
+}
+
+std::shared_ptr<const ClientRegistry::Snapshot> ClientRegistry::snapshot()
+{
+    // Fast path: nothing changed since the last rebuild. The snapshot is
+    // stored before its version, so it is at least as new as the check.
+    if (publishedVersion.load(std::memory_order_acquire) == version.load(std::memory_order_acquire))
+    {
+        return std::atomic_load(&published);
+    }
+
+    std::lock_guard<std::mutex> rebuild(rebuildLock);
+    uint64_t current = version.load(std::memory_order_acquire);
+    if (current == publishedVersion.load(std::memory_order_relaxed))
+    {
+        return std::atomic_load(&published);
+    }
+
+    // Stale: copy the entry pointers once, every reader until the next
+    // change shares the result. The copy costs about as much as the fan-out
+    // loop that follows, so it at most doubles the work of one broadcast.
+    std::shared_ptr<Snapshot> next = std::make_shared<Snapshot>();
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        current = version.load(std::memory_order_acquire);
+        next->reserve(bySocket.size());
+        for (const auto &entry : bySocket)
+        {
+            next->push_back(entry.second);
+        }
+    }
+    std::atomic_store(&published, std::shared_ptr<const Snapshot>(next));
+    publishedVersion.store(current, std::memory_order_release);
+    return next;
+}
+
+size_t ClientRegistry::size()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return bySocket.size();
+}
@@ -0,0 +1,72 @@
+// ClientRegistry.hpp
+#pragma once
+#include "SendQueue.hpp"
+#include "SocketUtils.hpp"
+#include <string>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <unordered_map>
+
+// Where a connection stands in its lifetime
+enum class ClientState
+{
+    Handshaking, // Connected, Join frame not processed yet
+    Joined       // Has a username and receives broadcasts
+};
+
+// Every connected client in one place, whichever mode the server runs in.
+// Adding, removing and looking up a client by socket or username are hash
+// map operations under a lock that only those calls take. Broadcasts read a
+// snapshot instead (read-copy-update): an immutable list rebuilt on the first
+// read after a change and shared by every read until the next one, so the
+// fan-out loop never holds a lock that joins and leaves wait for.
+class ClientRegistry
+{
+public:
+    // Marks clients owned by the threaded path rather than a reactor shard
+    static const size_t NO_SHARD = static_cast<size_t>(-1);
+
+    // Entries are immutable once published; changes replace the entry
+    struct Client
+    {
+        socket_t socket;
+        std::string username;                // Empty while handshaking
+        ClientState state;
+        size_t shard;                        // Reactor that owns the connection, NO_SHARD in threaded mode
+        std::shared_ptr<SendQueue> outbound; // Threaded mode only; reactors own their queues
+    };
+
+    typedef std::vector<std::shared_ptr<const Client>> Snapshot;
+
+private:
+    std::mutex lock;
+    std::unordered_map<socket_t, std::shared_ptr<const Client>> bySocket;
+    std::unordered_map<std::string, std::shared_ptr<const Client>> byName;
+    std::atomic<uint64_t> version; // Bumped by every change
+
+    std::mutex rebuildLock; // Only taken when the snapshot is stale
+    std::shared_ptr<const Snapshot> published; // Read and written with atomic_load/atomic_store
+    std::atomic<uint64_t> publishedVersion;
+
+    void replace(const std::shared_ptr<const Client> &entry);
+
+public:
+    ClientRegistry();
+
+    void add(socket_t socket, size_t shard, const std::shared_ptr<SendQueue> &outbound);
+    // Completes the handshake; false when another client already has the name
+    bool join(socket_t socket, const std::string &username);
+    void remove(socket_t socket);
+    void clear();
+
+    std::shared_ptr<const Client> find(socket_t socket);
+    std::shared_ptr<const Client> findByName(const std::string &username);
+    // Names of the joined clients, straight from the name index
+    std::vector<std::string> usernames();
+
+    // Every registered client as of some point after the last completed change
+    std::shared_ptr<const Snapshot> snapshot();
+    size_t size();
+};
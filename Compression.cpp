@@ -0,0 +1,196 @@
+#include "Compression.hpp"
+#include <vector>
+#include <cstring>
+#include <cstdint>
+
+namespace
+{
+    const size_t LENGTH_PREFIX = 4;
+    const size_t MIN_MATCH = 4;
+    const size_t MAX_OFFSET = 65535;
+    const int HASH_BITS = 12;
+
+    // Each sequence starts with a token: literal count in the high nibble,
+    // match length minus MIN_MATCH in the low one. 15 means more length
+    // bytes follow, each adding up to 255.
+    const unsigned NIBBLE_MAX = 15;
+
+    uint32_t read32(const unsigned char *p)
+    {
+        uint32_t value;
+        memcpy(&value, p, sizeof(value));
+        return value;
+    }
+
+    size_t hashOf(uint32_t sequence)
+    {
+        return (sequence * 2654435761u) >> (32 - HASH_BITS);
+    }
+
+    void appendLength(std::string &out, size_t extra)
+    {
+        while (extra >= 255)
+        {
+            out += static_cast<char>(255);
+            extra -= 255;
+        }
+        out += static_cast<char>(extra);
+    }
+
+    void appendSequence(std::string &out, const unsigned char *literals, size_t literalCount, size_t offset, size_t matchLength)
+    {
+        size_t matchCode = matchLength > 0 ? matchLength - MIN_MATCH : 0;
+        unsigned token = (literalCount < NIBBLE_MAX ? literalCount : NIBBLE_MAX) << 4;
+        token |= matchCode < NIBBLE_MAX ? matchCode : NIBBLE_MAX;
+        out += static_cast<char>(token);
+        if (literalCount >= NIBBLE_MAX)
+        {
+            appendLength(out, literalCount - NIBBLE_MAX);
+        }
+        out.append(reinterpret_cast<const char *>(literals), literalCount);
+
+        // The last sequence carries only literals
+        if (matchLength == 0)
+        {
+            return;
+        }
+        out += static_cast<char>(offset & 0xFF);
+        out += static_cast<char>((offset >> 8) & 0xFF);
+        if (matchCode >= NIBBLE_MAX)
+        {
+            appendLength(out, matchCode - NIBBLE_MAX);
+        }
+    }
+
+    // Reads a 15+ length continuation; false when the input ends first
+    bool readLength(const unsigned char *&p, const unsigned char *end, size_t &value)
+    {
+        unsigned char byte;
+        do
+        {
+            if (p == end)
+            {
+                return false;
+            }
+            byte = *p++;
+            value += byte;
+        } while (byte == 255);
+        return true;
+    }
+}
+
+bool compressBody(const char *data, size_t length, std::string &out)
+{
+    const unsigned char *in = reinterpret_cast<const unsigned char *>(data);
+    size_t start = out.size();
+    out += static_cast<char>((length >> 24) & 0xFF);
+    out += static_cast<char>((length >> 16) & 0xFF);
+    out += static_cast<char>((length >> 8) & 0xFF);
+    out += static_cast<char>(length & 0xFF);
+
+    // Position + 1 of the last place each hash was seen, 0 = never
+    std::vector<uint32_t> table(static_cast<size_t>(1) << HASH_BITS, 0);
+    size_t anchor = 0;
+    size_t i = 0;
+    while (i + MIN_MATCH <= length)
+    {
+        uint32_t sequence = read32(in + i);
+        size_t slot = hashOf(sequence);
+        size_t candidate = table[slot];
+        table[slot] = static_cast<uint32_t>(i + 1);
+
+        if (candidate == 0 || i - (candidate - 1) > MAX_OFFSET || read32(in + candidate - 1) != sequence)
+        {
+            ++i;
+            continue;
+        }
+
+        size_t match = candidate - 1;
+        size_t matchLength = MIN_MATCH;
+        while (i + matchLength < length && in[match + matchLength] == in[i + matchLength])
+        {
+            ++matchLength;
+        }
+        appendSequence(out, in + anchor, i - anchor, i - match, matchLength);
+        i += matchLength;
+        anchor = i;
+
+        // Give up early on input that is not shrinking
+        if (out.size() - start >= length)
+        {
+            out.resize(start);
+            return false;
+        }
+    }
+    appendSequence(out, in + anchor, length - anchor, 0, 0);
+
+    if (out.size() - start >= length)
+    {
+        out.resize(start);
+        return false;
+    }
+    return true;
+}
+
+bool decompressBody(const char *data, size_t length, size_t maxLength, std::string &out)
+{
+    if (length < LENGTH_PREFIX)
+    {
+        return false;
+    }
+    const unsigned char *p = reinterpret_cast<const unsigned char *>(data);
+    size_t original = (static_cast<size_t>(p[0]) << 24) | (static_cast<size_t>(p[1]) << 16) |
+                      (static_cast<size_t>(p[2]) << 8) | static_cast<size_t>(p[3]);
+    if (original > maxLength)
+    {
+        return false;
+    }
+
+    const unsigned char *end = p + length;
+    p += LENGTH_PREFIX;
+    out.clear();
+    out.reserve(original);
+    while (p < end)
+    {
+        unsigned token = *p++;
+        size_t literalCount = token >> 4;
+        if (literalCount == NIBBLE_MAX && !readLength(p, end, literalCount))
+        {
+            return false;
+        }
+        if (literalCount > static_cast<size_t>(end - p) || out.size() + literalCount > original)
+        {
+            return false;
+        }
+        out.append(reinterpret_cast<const char *>(p), literalCount);
+        p += literalCount;
+        if (p == end)
+        {
+            break;
+        }
+
+        if (end - p < 2)
+        {
+            return false;
+        }
+        size_t offset = static_cast<size_t>(p[0]) | (static_cast<size_t>(p[1]) << 8);
+        p += 2;
+        size_t matchLength = token & NIBBLE_MAX;
+        if (matchLength == NIBBLE_MAX && !readLength(p, end, matchLength))
+        {
+            return false;
+        }
+        matchLength += MIN_MATCH;
+        if (offset == 0 || offset > out.size() || out.size() + matchLength > original)
+        {
+            return false;
+        }
+        // Byte by byte: the source may overlap what is being written
+        size_t from = out.size() - offset;
+        for (size_t k = 0; k < matchLength; ++k)
+        {
+            out += out[from + k];
+        }
+    }
+    return out.size() == original;
+}
@@ -0,0 +1,20 @@
+// Compression.hpp
+#pragma once
+#include <string>
+#include <cstddef>
+
+// Small LZ77 block codec for frame bodies, in the spirit of LZ4: byte-aligned
+// literal runs and back-references into the last 64 KiB, found through one
+// hash table probe per position. It trades ratio for speed, which suits chat
+// text where the win comes from repeated words and pasted blocks, and needs
+// no third-party library on either platform.
+//
+// A compressed body is [uint32 originalLength, big-endian][block].
+
+// Appends the compressed form of data to out. Returns false and leaves out
+// as it was when the result would not be smaller than the input.
+bool compressBody(const char *data, size_t length, std::string &out);
+
+// Replaces out with the decompressed body. Fails on malformed input or when
+// the original length exceeds maxLength.
+bool decompressBody(const char *data, size_t length, size_t maxLength, std::string &out);
@@ -2,6 +2,7 @@
 #include <string>
 #include <unordered_map>
 #include <vector>
+#include <mutex>
 
 // Cross-platform console colors and formatting
 #ifdef _WIN32
@@ -100,11 +101,10 @@ inline void initConsoleColors() {}
 #define LEAVE_BOX_SIDE "|"
 #endif
 
-// User color assignment system using static local variables to avoid multiple definition
-inline std::string getUserColor(const std::string &username)
+// Colors handed out to usernames, in order of first appearance
+inline const std::vector<std::string> &userColorPalette()
 {
-  static std::unordered_map<std::string, std::string> userColors;
-  static std::vector<std::string> colorPalette = {
+  static const std::vector<std::string> colorPalette = {
       // Extended diverse color palette with 256-color ANSI codes
       "\033[38;5;208m", // Bright orange
       "\033[38;5;129m", // Purple
@@ -137,14 +137,32 @@ inline std::string getUserColor(const std::string &username)
       "\033[38;5;75m",  // Steel blue
       "\033[38;5;215m"  // Light orange
   };
+  return colorPalette;
+}
+
+// User color assignment system using static local variables to avoid multiple definition.
+// The client draws from more than one thread, so the table is locked; the
+// returned reference points into the palette and stays valid.
+inline const std::string &assignUserColor(const std::string &username)
+{
+  static std::mutex userColorsLock;
+  static std::unordered_map<std::string, size_t> userColors;
   static size_t colorIndex = 0;
 
-  if (userColors.find(username) == userColors.end())
+  const std::vector<std::string> &colorPalette = userColorPalette();
+  std::lock_guard<std::mutex> guard(userColorsLock);
+  auto it = userColors.find(username);
+  if (it == userColors.end())
   {
-    userColors[username] = colorPalette[colorIndex % colorPalette.size()];
+    it = userColors.emplace(username, colorIndex % colorPalette.size()).first;
     colorIndex++;
   }
-  return userColors[username];
+  return colorPalette[it->second];
+}
+
+inline std::string getUserColor(const std::string &username)
+{
+  return assignUserColor(username);
 }
 
 // Helper function to create bordered messages
@@ -0,0 +1,293 @@
+#include "EpollReactor.hpp"
+#include "ConsoleUtils.hpp"
+#include "Logger.hpp"
+#include <iostream>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <cerrno>
+
+namespace
+{
+    const int MAX_EVENTS = 256;
+
+    // recv() calls per readiness event before moving on. Bounds how much one
+    // chatty client can enqueue for everyone else before the next flush, and
+    // keeps it from starving the rest of the loop; level-triggered epoll
+    // reports the leftover input again on the next wait.
+    const int MAX_READS_PER_EVENT = 4;
+}
+
+EpollReactor::EpollReactor(ChatServer &owner, socket_t listeningSocket, bool closeListener, size_t index)
+    : Reactor(owner, listeningSocket, closeListener, index), epollFd(-1)
+{
+}
+
+EpollReactor::~EpollReactor()
+{
+    if (epollFd >= 0)
+    {
+        close(epollFd);
+    }
+}
+
+bool EpollReactor::open()
+{
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (epollFd < 0 || !openWakeFd())
+    {
+        return false;
+    }
+
+    epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.fd = listenSocket;
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, listenSocket, &ev) < 0)
+    {
+        return false;
+    }
+
+    ev.data.fd = wakeFd;
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &ev) < 0)
+    {
+        return false;
+    }
+
+    if (needsTimer())
+    {
+        if (!openTimer(true))
+        {
+            return false;
+        }
+        ev.data.fd = timerFd;
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, timerFd, &ev) < 0)
+        {
+            return false;
+        }
+    }
+
+    // Last, so a failed open() leaves the socket usable by the threaded fallback
+    return setNonBlocking(listenSocket);
+}
+
+void EpollReactor::run()
+{
+    epoll_event events[MAX_EVENTS];
+    enterLoop();
+
+    while (isRunning())
+    {
+        int ready = epoll_wait(epollFd, events, MAX_EVENTS, -1);
+        if (ready < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            Logger::text(LogLevel::Error, "epoll_wait failed");
+            break;
+        }
+
+        for (int i = 0; i < ready; ++i)
+        {
+            int fd = events[i].data.fd;
+            uint32_t mask = events[i].events;
+
+            if (fd == wakeFd)
+            {
+                uint64_t counter;
+                while (read(wakeFd, &counter, sizeof(counter)) > 0)
+                {
+                }
+                continue;
+            }
+            if (fd == timerFd)
+            {
+                uint64_t expirations;
+                if (read(timerFd, &expirations, sizeof(expirations)) > 0)
+                {
+                    onTimer();
+                }
+                continue;
+            }
+            if (fd == listenSocket)
+            {
+                acceptClients();
+                continue;
+            }
+
+            auto it = connections.find(fd);
+            if (it == connections.end())
+            {
+                continue;
+            }
+            if (mask & EPOLLOUT)
+            {
+                writeToClient(*it->second);
+            }
+            if (it->second->held)
+            {
+                // Only a hangup is reported while reading is paused
+                if (mask & (EPOLLHUP | EPOLLERR))
+                {
+                    closeClient(fd);
+                }
+            }
+            else if (mask & (EPOLLIN | EPOLLHUP | EPOLLERR | EPOLLRDHUP))
+            {
+                readFromClient(fd);
+            }
+        }
+
+        // Broadcasts from other shards and due heartbeats, then everything the
+        // batch enqueued goes out, at most one flush per client
+        drainInbox();
+        expireTimers();
+        flushDirty();
+    }
+
+    leaveLoop();
+    // Handing off: the connections stay open for the successor, or for the
+    // next run() should the handoff fail
+    if (!isHandingOff())
+    {
+        closeAll();
+    }
+}
+
+void EpollReactor::acceptClients()
+{
+    while (true)
+    {
+        socket_t clientSocket = accept4(listenSocket, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (clientSocket < 0)
+        {
+            // EAGAIN means the backlog is drained; anything else is per-connection noise
+            return;
+        }
+
+        epoll_event ev = {};
+        ev.events = EPOLLIN | EPOLLRDHUP;
+        ev.data.fd = clientSocket;
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, clientSocket, &ev) < 0)
+        {
+            close(clientSocket);
+            continue;
+        }
+
+        addConnection(new Connection(clientSocket, config.sendQueueLimit, config.overflowPolicy));
+    }
+}
+
+Reactor::Connection *EpollReactor::adoptConnection(socket_t clientSocket)
+{
+    epoll_event ev = {};
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.fd = clientSocket;
+    if (!setNonBlocking(clientSocket) || epoll_ctl(epollFd, EPOLL_CTL_ADD, clientSocket, &ev) < 0)
+    {
+        return nullptr;
+    }
+    // Level-triggered: input that arrived during the handoff is reported on the next wait
+    return new Connection(clientSocket, config.sendQueueLimit, config.overflowPolicy);
+}
+
+void EpollReactor::readFromClient(socket_t clientSocket)
+{
+    char buffer[RECV_BUFFER_SIZE];
+
+    for (int reads = 0; reads < MAX_READS_PER_EVENT; ++reads)
+    {
+        auto it = connections.find(clientSocket);
+        if (it == connections.end())
+        {
+            return;
+        }
+
+        ssize_t bytesReceived = recv(clientSocket, buffer, sizeof(buffer), 0);
+        if (bytesReceived < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            return;
+        }
+        if (bytesReceived < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (bytesReceived <= 0 || !handleInput(*it->second, buffer, bytesReceived))
+        {
+            closeClient(clientSocket);
+            return;
+        }
+        if (it->second->held)
+        {
+            return;
+        }
+    }
+}
+
+void EpollReactor::writeToClient(Connection &conn)
+{
+    conn.dirty = false;
+    SendQueue::FlushResult result = conn.outbound.flush();
+    if (result == SendQueue::FlushResult::Failed)
+    {
+        // Broken peer: let the next epoll_wait report the hangup and clean up there,
+        // so a broadcast never tears down connections it is iterating over
+        shutdown(conn.socket, SHUT_RDWR);
+        return;
+    }
+    updateInterest(conn, result == SendQueue::FlushResult::Pending);
+}
+
+void EpollReactor::holdChanged(Connection &conn)
+{
+    updateInterest(conn, conn.wantWrite);
+}
+
+void EpollReactor::updateInterest(Connection &conn, bool needWrite)
+{
+    if (needWrite == conn.wantWrite && conn.held == conn.readPaused)
+    {
+        return;
+    }
+
+    // Level-triggered: a held connection with input pending would be
+    // reported over and over, so it is not watched for input at all
+    epoll_event ev = {};
+    ev.events = conn.held ? 0 : EPOLLIN | EPOLLRDHUP;
+    if (needWrite)
+    {
+        ev.events |= EPOLLOUT;
+    }
+    ev.data.fd = conn.socket;
+    if (epoll_ctl(epollFd, EPOLL_CTL_MOD, conn.socket, &ev) == 0)
+    {
+        conn.wantWrite = needWrite;
+        conn.readPaused = conn.held;
+    }
+}
+
+#else
+
+EpollReactor::EpollReactor(ChatServer &owner, socket_t listeningSocket, bool closeListener, size_t index)
+    : Reactor(owner, listeningSocket, closeListener, index), epollFd(-1)
+{
+}
+
+EpollReactor::~EpollReactor() {}
+
+bool EpollReactor::open()
+{
+    // epoll is Linux-only
+    return false;
+}
+
+void EpollReactor::run() {}
+void EpollReactor::acceptClients() {}
+void EpollReactor::readFromClient(socket_t) {}
+void EpollReactor::writeToClient(Connection &) {}
+void EpollReactor::holdChanged(Connection &) {}
+Reactor::Connection *EpollReactor::adoptConnection(socket_t) { return nullptr; }
+void EpollReactor::updateInterest(Connection &, bool) {}
+
+#endif
@@ -0,0 +1,27 @@
+// EpollReactor.hpp
+#pragma once
+#include "Reactor.hpp"
+
+// Readiness-based backend: level-triggered epoll over non-blocking sockets.
+// Reads and writes are plain recv()/sendmsg() calls made when epoll reports
+// the socket ready; EPOLLOUT is only armed while a client's socket is full.
+class EpollReactor : public Reactor
+{
+private:
+    int epollFd;
+
+    void acceptClients();
+    void readFromClient(socket_t clientSocket);
+    void updateInterest(Connection &conn, bool needWrite);
+
+protected:
+    void writeToClient(Connection &conn) override;
+    void holdChanged(Connection &conn) override;
+    Connection *adoptConnection(socket_t clientSocket) override;
+
+public:
+    EpollReactor(ChatServer &owner, socket_t listeningSocket, bool closeListener, size_t index);
+    ~EpollReactor();
+    bool open() override;
+    void run() override;
+};
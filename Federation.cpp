@@ -0,0 +1,1118 @@
+#include "Federation.hpp"
+#include "ConsoleUtils.hpp"
+#include "Logger.hpp"
+#include "Metrics.hpp"
+#include <iostream>
+#include <algorithm>
+#include <deque>
+#include <chrono>
+#include <cstring>
+#include <cstdlib>
+
+namespace
+{
+    // Longest the federation thread sleeps in poll(); also how often it retries
+    // a flush that hit a full socket buffer
+    const int FEDERATION_TICK_MS = 50;
+    // How often the rooms and users of this server are compared with what it last published
+    const int64_t STATE_INTERVAL_MS = 100;
+    // Pause before redialing a peer, or rebinding a busy peer port
+    const int64_t PEER_RETRY_MS = 1000;
+    // A link must complete its PeerHello within this time
+    const int64_t PEER_HANDSHAKE_MS = 5000;
+    // Links are pinged this often and dropped after this long without any frame
+    const int64_t PEER_PING_MS = 2000;
+    const int64_t PEER_TIMEOUT_MS = 10000;
+    // Unsent bytes allowed per link before it is dropped and rebuilt
+    const size_t PEER_QUEUE_LIMIT = 64 * 1024 * 1024;
+    // Longest path a relay may take; only exceeded while servers disagree on the topology
+    const uint8_t MAX_HOPS = 16;
+    // A state larger than this goes out in several NodeState frames
+    const size_t STATE_CHUNK_BYTES = 32 * 1024;
+    // type, hops, epoch, sequence, origin length
+    const size_t RELAY_HEADER_SIZE = 1 + 1 + 8 + 8 + 1;
+    // epoch, version, part, parts
+    const size_t STATE_HEADER_SIZE = 8 + 8 + 2 + 2;
+
+    int64_t nowMs()
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    void putU16(std::string &out, uint16_t value)
+    {
+        out += static_cast<char>((value >> 8) & 0xFF);
+        out += static_cast<char>(value & 0xFF);
+    }
+
+    void putU32(std::string &out, uint32_t value)
+    {
+        putU16(out, static_cast<uint16_t>(value >> 16));
+        putU16(out, static_cast<uint16_t>(value & 0xFFFF));
+    }
+
+    void putU64(std::string &out, uint64_t value)
+    {
+        putU32(out, static_cast<uint32_t>(value >> 32));
+        putU32(out, static_cast<uint32_t>(value & 0xFFFFFFFF));
+    }
+
+    void putNames(std::string &out, const std::vector<std::string> &names)
+    {
+        putU32(out, static_cast<uint32_t>(names.size()));
+        for (const std::string &name : names)
+        {
+            size_t length = std::min<size_t>(name.size(), 255);
+            out += static_cast<char>(length);
+            out.append(name, 0, length);
+        }
+    }
+
+    // Reads what the put* helpers wrote; any read past the end marks it failed
+    struct Reader
+    {
+        const std::string &data;
+        size_t offset;
+        bool failed;
+
+        Reader(const std::string &source, size_t start) : data(source), offset(start), failed(false) {}
+
+        uint64_t number(size_t bytes)
+        {
+            if (failed || data.size() - offset < bytes)
+            {
+                failed = true;
+                return 0;
+            }
+            uint64_t value = 0;
+            for (size_t i = 0; i < bytes; ++i)
+            {
+                value = (value << 8) | static_cast<unsigned char>(data[offset + i]);
+            }
+            offset += bytes;
+            return value;
+        }
+
+        std::string text(size_t length)
+        {
+            if (failed || data.size() - offset < length)
+            {
+                failed = true;
+                return std::string();
+            }
+            std::string value = data.substr(offset, length);
+            offset += length;
+            return value;
+        }
+
+        bool names(std::vector<std::string> &out)
+        {
+            uint64_t count = number(4);
+            // Every name takes at least its length byte
+            if (failed || count > data.size() - offset)
+            {
+                failed = true;
+                return false;
+            }
+            out.clear();
+            out.reserve(count);
+            for (uint64_t i = 0; i < count && !failed; ++i)
+            {
+                out.push_back(text(number(1)));
+            }
+            return !failed;
+        }
+    };
+
+    std::string encodeRelay(FrameType type, uint8_t hops, uint64_t epoch, uint64_t sequence, const std::string &origin,
+                            const std::string &sender, const std::string &room, const std::string &body)
+    {
+        std::string payload;
+        payload.reserve(RELAY_HEADER_SIZE + origin.size() + body.size());
+        payload += static_cast<char>(type);
+        payload += static_cast<char>(hops);
+        putU64(payload, epoch);
+        putU64(payload, sequence);
+        payload += static_cast<char>(origin.size());
+        payload += origin;
+        payload += body;
+        return encodeFrame(FrameType::Relay, sender, payload, room);
+    }
+
+    bool parseEndpoint(const std::string &address, sockaddr_in &endpoint)
+    {
+        size_t colon = address.rfind(':');
+        if (colon == std::string::npos || colon == 0 || colon + 1 == address.size())
+        {
+            return false;
+        }
+        int port = std::atoi(address.c_str() + colon + 1);
+        if (port <= 0 || port > 65535)
+        {
+            return false;
+        }
+        memset(&endpoint, 0, sizeof(endpoint));
+        endpoint.sin_family = AF_INET;
+        endpoint.sin_port = htons(static_cast<uint16_t>(port));
+        return inet_pton(AF_INET, address.substr(0, colon).c_str(), &endpoint.sin_addr) == 1;
+    }
+
+    bool connectInProgress()
+    {
+#ifdef _WIN32
+        return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+        return errno == EINPROGRESS;
+#endif
+    }
+
+    // Takes as long whichever byte differs, so the secret cannot be guessed one byte at a time
+    bool sameSecret(const std::string &given, const std::string &expected)
+    {
+        unsigned char difference = given.size() == expected.size() ? 0 : 1;
+        for (size_t i = 0; i < expected.size(); ++i)
+        {
+            difference |= static_cast<unsigned char>(expected[i] ^ (i < given.size() ? given[i] : 0));
+        }
+        return difference == 0;
+    }
+}
+
+Federation::PeerLink::PeerLink(socket_t peerSocket, int dialed, int64_t now)
+    : socket(peerSocket), outbound(new SendQueue(peerSocket, PEER_QUEUE_LIMIT, OverflowPolicy::Disconnect)), dialIndex(dialed),
+      connecting(false), established(false), open(true), openedAt(now), lastReceived(now), lastPing(now)
+{
+}
+
+Federation::PeerLink::~PeerLink()
+{
+    closeSocket(socket);
+}
+
+Federation::Federation(const FederationConfig &federationConfig, const Deliver &deliverRelay, const LocalState &describe, const Notice &announce)
+    : config(federationConfig), deliver(deliverRelay), localState(describe), notice(announce), nextSequence(1), running(false),
+      listener(SOCKET_ERROR_VAL), nextListenAttempt(0), linksChanged(false), nextStateCheck(0),
+      ownRoutes(std::make_shared<const Routes>())
+{
+    // Wall-clock start time: a restarted server must outrank its earlier run
+    epoch = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(
+                                      std::chrono::system_clock::now().time_since_epoch())
+                                      .count());
+}
+
+Federation::~Federation()
+{
+    stop();
+}
+
+bool Federation::start()
+{
+    if (config.nodeName.empty() || config.nodeName.size() > MAX_NODE_NAME_LENGTH)
+    {
+        std::cerr << RED_COLOR "Node names are 1-" << MAX_NODE_NAME_LENGTH << " characters: " << config.nodeName << RESET_COLOR << std::endl;
+        return false;
+    }
+
+    if (inet_pton(AF_INET, config.bindAddress.c_str(), &listenAddress) != 1)
+    {
+        std::cerr << RED_COLOR "Invalid peer bind address (expected IPv4): " << config.bindAddress << RESET_COLOR << std::endl;
+        return false;
+    }
+
+    targets.clear();
+    for (const std::string &address : config.peers)
+    {
+        DialTarget target;
+        if (!parseEndpoint(address, target.endpoint))
+        {
+            std::cerr << RED_COLOR "Invalid peer address (expected IPv4:port): " << address << RESET_COLOR << std::endl;
+            return false;
+        }
+        target.address = address;
+        target.nextAttempt = 0;
+        targets.push_back(target);
+    }
+
+    // Starts over after stop(); this process keeps its epoch and sequence numbers
+    NodeState self;
+    std::map<std::string, NodeState>::iterator previous = nodes.find(config.nodeName);
+    if (previous != nodes.end())
+    {
+        self.version = previous->second.version;
+    }
+    self.epoch = epoch;
+    nodes.clear();
+    nodes[config.nodeName] = self;
+    partial.clear();
+    seen.clear();
+    routeCache.clear();
+    reachable.clear();
+    reachable.insert(config.nodeName);
+    linksChanged = true;
+    nextStateCheck = 0;
+    nextListenAttempt = 0;
+
+    running = true;
+    worker = std::thread(&Federation::serve, this);
+    std::cout << BLUE_COLOR "Federating as node " << config.nodeName;
+    if (config.port > 0)
+    {
+        std::cout << ", peer port " << config.bindAddress << ":" << config.port;
+    }
+    if (!targets.empty())
+    {
+        std::cout << ", " << targets.size() << " peers to dial";
+    }
+    std::cout << RESET_COLOR << std::endl;
+    return true;
+}
+
+void Federation::stop()
+{
+    if (!running.exchange(false))
+    {
+        return;
+    }
+    if (worker.joinable())
+    {
+        worker.join();
+    }
+
+    // Publishers holding an older snapshot finish on shut-down sockets
+    std::atomic_store(&ownRoutes, std::make_shared<const Routes>());
+    for (const std::shared_ptr<PeerLink> &link : links)
+    {
+        shutdownSocket(link->socket);
+    }
+    links.clear();
+    linked.clear();
+    routeCache.clear();
+    if (listener != SOCKET_ERROR_VAL)
+    {
+        closeSocket(listener);
+        listener = SOCKET_ERROR_VAL;
+    }
+    {
+        std::lock_guard<std::mutex> guard(presenceLock);
+        remoteUsers.clear();
+    }
+    std::lock_guard<std::mutex> guard(statusLock);
+    status = FederationStatus();
+}
+
+void Federation::publish(const std::string &room, FrameType type, const std::string &sender, const std::string &body)
+{
+    std::shared_ptr<const Routes> routes = std::atomic_load(&ownRoutes);
+    MessageBuffer frame;
+    for (const Route &route : *routes)
+    {
+        if (route.rooms.count(room) == 0)
+        {
+            continue;
+        }
+        // Encoded once, and only when some server wants it
+        if (!frame)
+        {
+            frame = makeMessageBuffer(encodeRelay(type, 0, epoch, nextSequence.fetch_add(1), config.nodeName, sender, room, body));
+        }
+        Metrics::add(Counter::FederationRelayed);
+        send(*route.link, frame);
+    }
+}
+
+bool Federation::sendDirect(const std::string &recipient, const std::string &sender, const std::string &body)
+{
+    std::string node = nodeOf(recipient);
+    if (node.empty())
+    {
+        return false;
+    }
+    std::shared_ptr<const Routes> routes = std::atomic_load(&ownRoutes);
+    for (const Route &route : *routes)
+    {
+        if (route.nodes.count(node) == 0)
+        {
+            continue;
+        }
+        // The recipient's server leads the payload, so servers on the way need no lookup
+        std::string payload(1, static_cast<char>(node.size()));
+        payload += node;
+        payload += body;
+        Metrics::add(Counter::FederationRelayed);
+        send(*route.link, makeMessageBuffer(encodeRelay(FrameType::Direct, 0, epoch, nextSequence.fetch_add(1), config.nodeName, sender, recipient, payload)));
+        return true;
+    }
+    return false;
+}
+
+void Federation::send(PeerLink &link, const MessageBuffer &frame)
+{
+    // Whatever does not fit the socket buffer is written by the federation thread
+    if (!link.outbound->push(frame) || link.outbound->flush() == SendQueue::FlushResult::Failed)
+    {
+        shutdownSocket(link.socket);
+    }
+}
+
+std::string Federation::nodeOf(const std::string &username)
+{
+    std::lock_guard<std::mutex> guard(presenceLock);
+    std::unordered_map<std::string, std::string>::const_iterator it = remoteUsers.find(username);
+    return it == remoteUsers.end() ? std::string() : it->second;
+}
+
+std::vector<std::pair<std::string, std::string>> Federation::remoteUserList()
+{
+    std::lock_guard<std::mutex> guard(presenceLock);
+    return std::vector<std::pair<std::string, std::string>>(remoteUsers.begin(), remoteUsers.end());
+}
+
+FederationStatus Federation::currentStatus()
+{
+    std::lock_guard<std::mutex> guard(statusLock);
+    return status;
+}
+
+void Federation::serve()
+{
+    std::vector<pollfd_t> fds;
+    std::vector<std::shared_ptr<PeerLink>> polled;
+    while (running)
+    {
+        int64_t now = nowMs();
+        openListener(now);
+        dialPeers(now);
+        checkLinks(now);
+        closeLinks(now);
+        refreshOwnState(now);
+        updateStatus();
+
+        fds.clear();
+        polled.clear();
+        if (listener != SOCKET_ERROR_VAL)
+        {
+            pollfd_t entry;
+            entry.fd = listener;
+            entry.events = POLLIN;
+            entry.revents = 0;
+            fds.push_back(entry);
+            polled.push_back(std::shared_ptr<PeerLink>());
+        }
+        for (const std::shared_ptr<PeerLink> &link : links)
+        {
+            pollfd_t entry;
+            entry.fd = link->socket;
+            entry.events = link->connecting ? POLLOUT : POLLIN;
+            if (!link->connecting && link->outbound->hasPending())
+            {
+                entry.events |= POLLOUT;
+            }
+            entry.revents = 0;
+            fds.push_back(entry);
+            polled.push_back(link);
+        }
+        if (fds.empty())
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(FEDERATION_TICK_MS));
+            continue;
+        }
+        if (pollSockets(fds.data(), fds.size(), FEDERATION_TICK_MS) <= 0)
+        {
+            continue;
+        }
+
+        now = nowMs();
+        for (size_t i = 0; i < fds.size(); ++i)
+        {
+            if (!polled[i])
+            {
+                if (fds[i].revents & POLLIN)
+                {
+                    acceptPeer(now);
+                }
+                continue;
+            }
+
+            PeerLink &link = *polled[i];
+            if (link.connecting)
+            {
+                if (!(fds[i].revents & (POLLOUT | POLLERR | POLLHUP)))
+                {
+                    continue;
+                }
+                int error = 0;
+                socklen_t length = sizeof(error);
+                if (getsockopt(link.socket, SOL_SOCKET, SO_ERROR, reinterpret_cast<char *>(&error), &length) != 0 || error != 0)
+                {
+                    link.open = false;
+                    continue;
+                }
+                link.connecting = false;
+                link.lastReceived = now;
+                send(link, makeMessageBuffer(encodeFrame(FrameType::PeerHello, config.nodeName, config.secret)));
+                continue;
+            }
+
+            if ((fds[i].revents & POLLOUT) && link.outbound->flush() == SendQueue::FlushResult::Failed)
+            {
+                link.open = false;
+                continue;
+            }
+            if (fds[i].revents & (POLLIN | POLLHUP | POLLERR))
+            {
+                readLink(polled[i], now);
+            }
+        }
+    }
+}
+
+void Federation::openListener(int64_t now)
+{
+    if (config.port <= 0 || listener != SOCKET_ERROR_VAL || now < nextListenAttempt)
+    {
+        return;
+    }
+
+    socket_t candidate = socket(AF_INET, SOCK_STREAM, 0);
+    if (candidate == SOCKET_ERROR_VAL)
+    {
+        nextListenAttempt = now + PEER_RETRY_MS;
+        return;
+    }
+    int opt = 1;
+    setsockopt(candidate, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char *>(&opt), sizeof(opt));
+    sockaddr_in peerAddr;
+    memset(&peerAddr, 0, sizeof(peerAddr));
+    peerAddr.sin_family = AF_INET;
+    peerAddr.sin_port = htons(static_cast<uint16_t>(config.port));
+    peerAddr.sin_addr = listenAddress;
+    if (bind(candidate, (sockaddr *)&peerAddr, sizeof(peerAddr)) != 0 || listen(candidate, SOMAXCONN) != 0)
+    {
+        // Typically the process this one took over from, which lets go of it shortly
+        if (nextListenAttempt == 0)
+        {
+            Logger::text(LogLevel::Warn, "Peer port " + std::to_string(config.port) + " is busy, retrying every second");
+        }
+        closeSocket(candidate);
+        nextListenAttempt = now + PEER_RETRY_MS;
+        return;
+    }
+    listener = candidate;
+}
+
+void Federation::dialPeers(int64_t now)
+{
+    for (size_t i = 0; i < targets.size(); ++i)
+    {
+        DialTarget &target = targets[i];
+        if (now < target.nextAttempt || (!target.node.empty() && linked.count(target.node) > 0))
+        {
+            continue;
+        }
+        bool dialing = false;
+        for (const std::shared_ptr<PeerLink> &link : links)
+        {
+            dialing = dialing || link->dialIndex == static_cast<int>(i);
+        }
+        if (dialing)
+        {
+            continue;
+        }
+
+        target.nextAttempt = now + PEER_RETRY_MS;
+        socket_t peerSocket = socket(AF_INET, SOCK_STREAM, 0);
+        if (peerSocket == SOCKET_ERROR_VAL)
+        {
+            continue;
+        }
+        setNonBlocking(peerSocket);
+        setNoDelay(peerSocket);
+        std::shared_ptr<PeerLink> link = std::make_shared<PeerLink>(peerSocket, static_cast<int>(i), now);
+        if (connect(peerSocket, (sockaddr *)&target.endpoint, sizeof(target.endpoint)) != 0)
+        {
+            if (!connectInProgress())
+            {
+                continue;
+            }
+            link->connecting = true;
+        }
+        else
+        {
+            send(*link, makeMessageBuffer(encodeFrame(FrameType::PeerHello, config.nodeName, config.secret)));
+        }
+        links.push_back(link);
+    }
+}
+
+void Federation::acceptPeer(int64_t now)
+{
+    socket_t peerSocket = accept(listener, nullptr, nullptr);
+    if (peerSocket == SOCKET_ERROR_VAL)
+    {
+        return;
+    }
+    setNonBlocking(peerSocket);
+    setNoDelay(peerSocket);
+    // Answered with this server's PeerHello, secret included, only once the
+    // peer's own has been accepted
+    links.push_back(std::make_shared<PeerLink>(peerSocket, -1, now));
+}
+
+void Federation::checkLinks(int64_t now)
+{
+    for (const std::shared_ptr<PeerLink> &link : links)
+    {
+        if (!link->established)
+        {
+            if (now - link->openedAt > PEER_HANDSHAKE_MS)
+            {
+                link->open = false;
+            }
+            continue;
+        }
+        if (now - link->lastReceived > PEER_TIMEOUT_MS)
+        {
+            Logger::text(LogLevel::Warn, "Peer " + link->node + " went silent, dropping the link");
+            link->open = false;
+            continue;
+        }
+        if (now - link->lastPing >= PEER_PING_MS)
+        {
+            link->lastPing = now;
+            send(*link, makeMessageBuffer(encodeFrame(FrameType::Ping, "", "")));
+        }
+    }
+}
+
+void Federation::readLink(const std::shared_ptr<PeerLink> &link, int64_t now)
+{
+    char buffer[16 * 1024];
+    int bytesReceived = recv(link->socket, buffer, sizeof(buffer), 0);
+    if (bytesReceived < 0 && socketWouldBlock())
+    {
+        return;
+    }
+    if (bytesReceived <= 0)
+    {
+        link->open = false;
+        return;
+    }
+
+    link->lastReceived = now;
+    link->parser.feed(buffer, bytesReceived);
+    Frame frame;
+    while (link->open && link->parser.next(frame))
+    {
+        link->open = handleFrame(link, frame);
+    }
+    if (link->parser.hasError())
+    {
+        link->open = false;
+    }
+}
+
+void Federation::closeLinks(int64_t now)
+{
+    for (size_t i = 0; i < links.size();)
+    {
+        std::shared_ptr<PeerLink> link = links[i];
+        if (link->open)
+        {
+            ++i;
+            continue;
+        }
+
+        shutdownSocket(link->socket);
+        if (link->established)
+        {
+            linked.erase(link->node);
+            linksChanged = true;
+            Logger::text(LogLevel::Info, "Link to peer " + link->node + " closed");
+        }
+        if (link->dialIndex >= 0)
+        {
+            targets[link->dialIndex].nextAttempt = now + PEER_RETRY_MS;
+        }
+        links.erase(links.begin() + i);
+    }
+}
+
+bool Federation::handleFrame(const std::shared_ptr<PeerLink> &link, const Frame &frame)
+{
+    if (!link->established)
+    {
+        // The first frame of a peer must introduce it
+        return frame.type == FrameType::PeerHello && onHello(link, frame);
+    }
+
+    switch (frame.type)
+    {
+    case FrameType::Relay:
+        onRelay(*link, frame);
+        return true;
+    case FrameType::NodeState:
+        onState(*link, frame);
+        return true;
+    case FrameType::Ping:
+        send(*link, makeMessageBuffer(encodeFrame(FrameType::Pong, "", "")));
+        return true;
+    default:
+        // Pong, or frame types of a newer server
+        return true;
+    }
+}
+
+bool Federation::onHello(const std::shared_ptr<PeerLink> &link, const Frame &frame)
+{
+    const std::string &peer = frame.sender;
+    if (peer.empty() || peer.size() > MAX_NODE_NAME_LENGTH)
+    {
+        return false;
+    }
+    if (!sameSecret(frame.body, config.secret))
+    {
+        Logger::text(LogLevel::Warn, "Peer " + peer + " did not present the peer secret, refusing the link");
+        return false;
+    }
+    if (peer == config.nodeName)
+    {
+        Logger::text(LogLevel::Error, "A peer uses this server's own node name " + peer + ", refusing the link");
+        return false;
+    }
+    if (link->dialIndex >= 0)
+    {
+        targets[link->dialIndex].node = peer;
+    }
+
+    // Two servers that dial each other end up with two links: both keep the
+    // one dialed by the server with the smaller name
+    std::map<std::string, std::shared_ptr<PeerLink>>::iterator existing = linked.find(peer);
+    if (existing != linked.end())
+    {
+        bool dialedBySmaller = (link->dialIndex >= 0) == (config.nodeName < peer);
+        if (!dialedBySmaller)
+        {
+            return false;
+        }
+        existing->second->established = false;
+        existing->second->open = false;
+        linked.erase(existing);
+    }
+
+    if (link->dialIndex < 0)
+    {
+        send(*link, makeMessageBuffer(encodeFrame(FrameType::PeerHello, config.nodeName, config.secret)));
+    }
+    link->node = peer;
+    link->established = true;
+    linked[peer] = link;
+    linksChanged = true;
+    Logger::text(LogLevel::Info, "Linked to peer " + peer);
+
+    // Catch the peer up on every server this one knows about
+    for (const std::pair<const std::string, NodeState> &entry : nodes)
+    {
+        for (const MessageBuffer &part : entry.second.frames)
+        {
+            send(*link, part);
+        }
+    }
+    return true;
+}
+
+void Federation::onRelay(PeerLink &link, const Frame &frame)
+{
+    Reader reader(frame.body, 0);
+    FrameType type = static_cast<FrameType>(reader.number(1));
+    uint8_t hops = static_cast<uint8_t>(reader.number(1));
+    uint64_t originEpoch = reader.number(8);
+    uint64_t sequence = reader.number(8);
+    std::string origin = reader.text(reader.number(1));
+    if (reader.failed || origin == config.nodeName || frame.room.empty())
+    {
+        return;
+    }
+    Metrics::add(Counter::FederationReceived);
+    if (!firstSighting(origin, originEpoch, sequence))
+    {
+        Metrics::add(Counter::FederationDuplicates);
+        return;
+    }
+    std::string body = frame.body.substr(reader.offset);
+    // A private message names its recipient's server; the room is the recipient
+    std::string target;
+    if (type == FrameType::Direct)
+    {
+        target = reader.text(reader.number(1));
+        if (reader.failed)
+        {
+            return;
+        }
+    }
+
+    // Passed on down the origin's tree, never back towards it; a private
+    // message only down the branch with its recipient's server
+    if (hops + 1 < MAX_HOPS && target != config.nodeName)
+    {
+        MessageBuffer forwarded;
+        for (const Route &route : routesFor(origin))
+        {
+            if (route.link.get() == &link || (target.empty() ? route.rooms.count(frame.room) : route.nodes.count(target)) == 0)
+            {
+                continue;
+            }
+            if (!forwarded)
+            {
+                forwarded = makeMessageBuffer(encodeRelay(type, static_cast<uint8_t>(hops + 1), originEpoch, sequence, origin, frame.sender, frame.room, body));
+            }
+            Metrics::add(Counter::FederationRelayed);
+            send(*route.link, forwarded);
+        }
+    }
+
+    if (target.empty())
+    {
+        deliver(frame.room, type, frame.sender, body);
+    }
+    else if (target == config.nodeName)
+    {
+        deliver(frame.room, type, frame.sender, frame.body.substr(reader.offset));
+    }
+}
+
+bool Federation::firstSighting(const std::string &origin, uint64_t originEpoch, uint64_t sequence)
+{
+    SeenWindow &window = seen[origin];
+    if (originEpoch < window.epoch)
+    {
+        // From an earlier run of that server, still in flight somewhere
+        return false;
+    }
+    if (originEpoch > window.epoch)
+    {
+        window.epoch = originEpoch;
+        window.highest = 0;
+        window.seen.reset();
+    }
+    if (sequence > window.highest)
+    {
+        uint64_t shift = sequence - window.highest;
+        if (shift >= SEEN_WINDOW)
+        {
+            window.seen.reset();
+        }
+        else
+        {
+            window.seen <<= shift;
+        }
+        window.highest = sequence;
+        window.seen.set(0);
+        return true;
+    }
+    uint64_t age = window.highest - sequence;
+    if (age >= SEEN_WINDOW || window.seen.test(age))
+    {
+        return false;
+    }
+    window.seen.set(age);
+    return true;
+}
+
+void Federation::onState(PeerLink &link, const Frame &frame)
+{
+    const std::string &origin = frame.sender;
+    Reader reader(frame.body, 0);
+    uint64_t stateEpoch = reader.number(8);
+    uint64_t version = reader.number(8);
+    size_t part = reader.number(2);
+    size_t parts = reader.number(2);
+    if (reader.failed || origin.empty() || origin == config.nodeName || parts == 0 || part >= parts)
+    {
+        return;
+    }
+    std::map<std::string, NodeState>::iterator known = nodes.find(origin);
+    if (known != nodes.end() &&
+        (stateEpoch < known->second.epoch || (stateEpoch == known->second.epoch && version <= known->second.version)))
+    {
+        // Already have it, or something newer: stop the flood here
+        return;
+    }
+
+    PartialState &pending = partial[origin];
+    if (!pending.parts.empty() &&
+        (stateEpoch < pending.epoch || (stateEpoch == pending.epoch && version < pending.version)))
+    {
+        // An older state interleaved with a newer one arriving over another link
+        return;
+    }
+    if (pending.parts.empty() || pending.epoch != stateEpoch || pending.version != version || pending.parts.size() != parts)
+    {
+        pending.epoch = stateEpoch;
+        pending.version = version;
+        pending.parts.assign(parts, std::string());
+        pending.received = 0;
+    }
+    if (pending.parts[part].empty())
+    {
+        pending.parts[part] = frame.body;
+        ++pending.received;
+    }
+    if (pending.received < parts)
+    {
+        return;
+    }
+
+    NodeState state;
+    state.epoch = stateEpoch;
+    state.version = version;
+    std::string blob;
+    for (const std::string &body : pending.parts)
+    {
+        blob.append(body, STATE_HEADER_SIZE, std::string::npos);
+        state.frames.push_back(makeMessageBuffer(encodeFrame(FrameType::NodeState, origin, body)));
+    }
+    partial.erase(origin);
+    Reader content(blob, 0);
+    if (!content.names(state.peers) || !content.names(state.rooms) || !content.names(state.users))
+    {
+        return;
+    }
+    std::sort(state.peers.begin(), state.peers.end());
+    nodes[origin] = state;
+
+    // Flooded to every other peer; the version check above ends it
+    for (const std::pair<const std::string, std::shared_ptr<PeerLink>> &peer : linked)
+    {
+        if (peer.second.get() == &link)
+        {
+            continue;
+        }
+        for (const MessageBuffer &stateFrame : state.frames)
+        {
+            send(*peer.second, stateFrame);
+        }
+    }
+    topologyChanged();
+}
+
+void Federation::refreshOwnState(int64_t now)
+{
+    if (!linksChanged && now < nextStateCheck)
+    {
+        return;
+    }
+    nextStateCheck = now + STATE_INTERVAL_MS;
+
+    NodeState &self = nodes[config.nodeName];
+    std::vector<std::string> rooms;
+    std::vector<std::string> users;
+    localState(rooms, users);
+    std::sort(rooms.begin(), rooms.end());
+    std::sort(users.begin(), users.end());
+    if (!linksChanged && rooms == self.rooms && users == self.users && !self.frames.empty())
+    {
+        return;
+    }
+    linksChanged = false;
+
+    self.epoch = epoch;
+    ++self.version;
+    self.peers.clear();
+    for (const std::pair<const std::string, std::shared_ptr<PeerLink>> &peer : linked)
+    {
+        self.peers.push_back(peer.first);
+    }
+    self.rooms.swap(rooms);
+    self.users.swap(users);
+
+    std::string blob;
+    putNames(blob, self.peers);
+    putNames(blob, self.rooms);
+    putNames(blob, self.users);
+    size_t parts = blob.empty() ? 1 : (blob.size() + STATE_CHUNK_BYTES - 1) / STATE_CHUNK_BYTES;
+    self.frames.clear();
+    for (size_t part = 0; part < parts; ++part)
+    {
+        std::string body;
+        putU64(body, self.epoch);
+        putU64(body, self.version);
+        putU16(body, static_cast<uint16_t>(part));
+        putU16(body, static_cast<uint16_t>(parts));
+        body.append(blob, part * STATE_CHUNK_BYTES, STATE_CHUNK_BYTES);
+        self.frames.push_back(makeMessageBuffer(encodeFrame(FrameType::NodeState, config.nodeName, body)));
+    }
+
+    for (const std::pair<const std::string, std::shared_ptr<PeerLink>> &peer : linked)
+    {
+        for (const MessageBuffer &stateFrame : self.frames)
+        {
+            send(*peer.second, stateFrame);
+        }
+    }
+    topologyChanged();
+}
+
+std::map<std::string, std::vector<std::string>> Federation::adjacency() const
+{
+    // A link only counts once both ends report it, so a stale state of a
+    // server that went away cannot pull traffic towards it
+    std::map<std::string, std::vector<std::string>> graph;
+    for (const std::pair<const std::string, NodeState> &entry : nodes)
+    {
+        std::vector<std::string> &neighbours = graph[entry.first];
+        for (const std::string &peer : entry.second.peers)
+        {
+            std::map<std::string, NodeState>::const_iterator other = nodes.find(peer);
+            if (other != nodes.end() && std::binary_search(other->second.peers.begin(), other->second.peers.end(), entry.first))
+            {
+                neighbours.push_back(peer);
+            }
+        }
+    }
+    return graph;
+}
+
+Federation::Routes Federation::computeRoutes(const std::string &origin, const std::map<std::string, std::vector<std::string>> &graph) const
+{
+    // Breadth-first tree from the origin; neighbours are visited in name
+    // order, so every server that has the same states builds the same tree
+    std::map<std::string, std::string> parent;
+    std::map<std::string, std::vector<std::string>> children;
+    std::deque<std::string> queue(1, origin);
+    parent[origin] = std::string();
+    while (!queue.empty())
+    {
+        std::string current = queue.front();
+        queue.pop_front();
+        std::map<std::string, std::vector<std::string>>::const_iterator neighbours = graph.find(current);
+        if (neighbours == graph.end())
+        {
+            continue;
+        }
+        for (const std::string &next : neighbours->second)
+        {
+            if (parent.count(next) == 0)
+            {
+                parent[next] = current;
+                children[current].push_back(next);
+                queue.push_back(next);
+            }
+        }
+    }
+
+    Routes routes;
+    if (parent.count(config.nodeName) == 0)
+    {
+        return routes;
+    }
+    for (const std::string &child : children[config.nodeName])
+    {
+        std::map<std::string, std::shared_ptr<PeerLink>>::const_iterator link = linked.find(child);
+        if (link == linked.end())
+        {
+            continue;
+        }
+        Route route;
+        route.link = link->second;
+        // Rooms with members anywhere in the child's subtree
+        std::vector<std::string> pending(1, child);
+        while (!pending.empty())
+        {
+            std::string current = pending.back();
+            pending.pop_back();
+            const NodeState &state = nodes.find(current)->second;
+            route.rooms.insert(state.rooms.begin(), state.rooms.end());
+            route.nodes.insert(current);
+            std::vector<std::string> &below = children[current];
+            pending.insert(pending.end(), below.begin(), below.end());
+        }
+        if (!route.rooms.empty())
+        {
+            routes.push_back(route);
+        }
+    }
+    return routes;
+}
+
+const Federation::Routes &Federation::routesFor(const std::string &origin)
+{
+    std::map<std::string, Routes>::iterator cached = routeCache.find(origin);
+    if (cached == routeCache.end())
+    {
+        cached = routeCache.insert(std::make_pair(origin, computeRoutes(origin, adjacency()))).first;
+    }
+    return cached->second;
+}
+
+void Federation::topologyChanged()
+{
+    routeCache.clear();
+    std::map<std::string, std::vector<std::string>> graph = adjacency();
+    std::atomic_store(&ownRoutes, std::shared_ptr<const Routes>(std::make_shared<Routes>(computeRoutes(config.nodeName, graph))));
+
+    // Servers reachable from here; the states of the rest are kept but ignored
+    std::unordered_set<std::string> nowReachable;
+    std::deque<std::string> queue(1, config.nodeName);
+    nowReachable.insert(config.nodeName);
+    while (!queue.empty())
+    {
+        std::string current = queue.front();
+        queue.pop_front();
+        for (const std::string &next : graph[current])
+        {
+            if (nowReachable.insert(next).second)
+            {
+                queue.push_back(next);
+            }
+        }
+    }
+
+    std::unordered_map<std::string, std::string> users;
+    for (const std::string &name : nowReachable)
+    {
+        if (name == config.nodeName)
+        {
+            continue;
+        }
+        const NodeState &state = nodes[name];
+        for (const std::string &user : state.users)
+        {
+            users[user] = name;
+        }
+        if (reachable.count(name) == 0)
+        {
+            notice("Server " + name + " joined the chat network with " + std::to_string(state.users.size()) + " users");
+        }
+    }
+    for (const std::string &name : reachable)
+    {
+        if (nowReachable.count(name) == 0)
+        {
+            notice("Lost contact with server " + name + ", its " + std::to_string(nodes[name].users.size()) + " users are out of reach");
+        }
+    }
+    reachable.swap(nowReachable);
+    {
+        std::lock_guard<std::mutex> guard(presenceLock);
+        remoteUsers.swap(users);
+    }
+}
+
+void Federation::updateStatus()
+{
+    FederationStatus current;
+    current.nodes = reachable.size() - 1;
+    for (const std::string &name : reachable)
+    {
+        if (name != config.nodeName)
+        {
+            current.remoteUsers += nodes[name].users.size();
+        }
+    }
+    for (const std::pair<const std::string, std::shared_ptr<PeerLink>> &peer : linked)
+    {
+        current.links.push_back(std::make_pair(peer.first, peer.second->outbound->pendingBytes()));
+    }
+    std::lock_guard<std::mutex> guard(statusLock);
+    status = current;
+}
@@ -0,0 +1,213 @@
+// Federation.hpp
+#pragma once
+#include "Protocol.hpp"
+#include "SendQueue.hpp"
+#include "SocketUtils.hpp"
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <bitset>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <functional>
+#include <cstdint>
+
+struct FederationConfig
+{
+    std::string nodeName;           // Unique name of this server among its peers, empty = hostname:port
+    int port = 0;                   // Peer servers connect here, 0 = only dial out
+    std::string bindAddress = "127.0.0.1"; // IPv4 address the peer port listens on, 0.0.0.0 = every interface
+    std::string secret;             // Every peer must present it in its PeerHello, empty = none
+    std::vector<std::string> peers; // host:port of peer servers this one dials, and redials when the link drops
+};
+
+// Peer links as reported on the metrics endpoint
+struct FederationStatus
+{
+    size_t nodes = 0;       // Other servers reachable through the links
+    size_t remoteUsers = 0; // Joined clients on those servers
+    std::vector<std::pair<std::string, size_t>> links; // Connected peer and the bytes queued for it
+};
+
+const size_t MAX_NODE_NAME_LENGTH = 64;
+
+// Joins several server processes into one chat. Servers keep persistent TCP
+// links to their peers and exchange frames of the usual wire format over them
+// (PeerHello, NodeState, Relay). Runs on its own thread, away from the client
+// sockets; only publish() is called from the threads that serve clients.
+//
+// Every server floods a versioned description of itself to the federation:
+// which peers it has a link to, which rooms have members on it and which
+// users are joined there. With that every server knows the whole topology
+// and who is where, without any central coordinator:
+//  - a message is relayed once per peer link, never once per remote user, and
+//    travels along the breadth-first tree rooted at the server it came from,
+//    pruned to the branches with members of its room, so a full mesh relays
+//    each message exactly once to each server that wants it;
+//  - every relay carries its origin, the origin's start time and a sequence
+//    number; a window of recently seen numbers per origin drops duplicates
+//    and a hop limit drops anything circling while views of the topology
+//    disagree;
+//  - usernames joined anywhere else are known, so a name stays unique, and a
+//    private message goes down the one branch that leads to its recipient's
+//    server.
+// Messages sent while a link is down are not replayed to that side later.
+class Federation
+{
+public:
+    // A message relayed from another server; room is its name, DEFAULT_ROOM
+    // included, or the recipient of a Direct message
+    typedef std::function<void(const std::string &room, FrameType type, const std::string &sender, const std::string &body)> Deliver;
+    // Rooms with members on this server, and the names of its joined clients
+    typedef std::function<void(std::vector<std::string> &rooms, std::vector<std::string> &users)> LocalState;
+    // Another server became reachable or was lost
+    typedef std::function<void(const std::string &text)> Notice;
+
+private:
+    // Sequence numbers remembered per origin for de-duplication
+    static const size_t SEEN_WINDOW = 4096;
+
+    struct PeerLink
+    {
+        socket_t socket;
+        std::shared_ptr<SendQueue> outbound; // Written by publish() on client threads as well
+        FrameParser parser;
+        std::string node;     // Peer's name, empty until its PeerHello arrived
+        int dialIndex;        // Entry of targets this link was dialed for, -1 when accepted
+        bool connecting;      // Non-blocking connect() still in progress
+        bool established;     // Handshake done and the link is the one used for node
+        bool open;
+        int64_t openedAt;
+        int64_t lastReceived;
+        int64_t lastPing;
+
+        PeerLink(socket_t peerSocket, int dialed, int64_t now);
+        // The descriptor outlives the link's removal until no route snapshot
+        // refers to it, so a late publish() can never write to a reused one
+        ~PeerLink();
+    };
+
+    struct NodeState
+    {
+        uint64_t epoch = 0;   // When that server process started; a restart supersedes the old state
+        uint64_t version = 0; // Bumped by every change within one epoch
+        std::vector<std::string> peers;
+        std::vector<std::string> rooms;
+        std::vector<std::string> users;
+        std::vector<MessageBuffer> frames; // As received, for passing it on to later links
+    };
+
+    // A state whose NodeState frames have not all arrived yet
+    struct PartialState
+    {
+        uint64_t epoch;
+        uint64_t version;
+        std::vector<std::string> parts;
+        size_t received;
+    };
+
+    struct SeenWindow
+    {
+        uint64_t epoch = 0;
+        uint64_t highest = 0;          // Newest sequence number seen; bit i of seen stands for highest - i
+        std::bitset<SEEN_WINDOW> seen;
+    };
+
+    // Peer link a message goes out on, and the rooms with members and the
+    // servers beyond it
+    struct Route
+    {
+        std::shared_ptr<PeerLink> link;
+        std::unordered_set<std::string> rooms;
+        std::unordered_set<std::string> nodes;
+    };
+    typedef std::vector<Route> Routes;
+
+    struct DialTarget
+    {
+        std::string address;
+        sockaddr_in endpoint;
+        std::string node; // Learned from the last handshake; not dialed while that node is linked anyway
+        int64_t nextAttempt;
+    };
+
+    FederationConfig config;
+    Deliver deliver;
+    LocalState localState;
+    Notice notice;
+    uint64_t epoch;
+    std::atomic<uint64_t> nextSequence;
+    std::atomic<bool> running;
+    std::thread worker;
+
+    // Federation thread only
+    socket_t listener;
+    in_addr listenAddress;
+    int64_t nextListenAttempt;
+    std::vector<DialTarget> targets;
+    std::vector<std::shared_ptr<PeerLink>> links;
+    std::map<std::string, std::shared_ptr<PeerLink>> linked; // Established link of every peer
+    std::map<std::string, NodeState> nodes;                   // Latest state of every known server, this one included
+    std::map<std::string, PartialState> partial;
+    std::unordered_map<std::string, SeenWindow> seen;
+    std::map<std::string, Routes> routeCache; // Routes of other origins' relays, until the topology changes
+    std::unordered_set<std::string> reachable;
+    bool linksChanged;
+    int64_t nextStateCheck;
+
+    // Read by client threads
+    std::shared_ptr<const Routes> ownRoutes; // Read and written with atomic_load/atomic_store
+    std::mutex presenceLock;
+    std::unordered_map<std::string, std::string> remoteUsers; // Username -> server it is joined on
+    std::mutex statusLock;
+    FederationStatus status;
+
+    void serve();
+    void openListener(int64_t now);
+    void dialPeers(int64_t now);
+    void acceptPeer(int64_t now);
+    void checkLinks(int64_t now);
+    void readLink(const std::shared_ptr<PeerLink> &link, int64_t now);
+    void closeLinks(int64_t now);
+    bool handleFrame(const std::shared_ptr<PeerLink> &link, const Frame &frame);
+    bool onHello(const std::shared_ptr<PeerLink> &link, const Frame &frame);
+    void onRelay(PeerLink &link, const Frame &frame);
+    void onState(PeerLink &link, const Frame &frame);
+    bool firstSighting(const std::string &origin, uint64_t originEpoch, uint64_t sequence);
+    void send(PeerLink &link, const MessageBuffer &frame);
+
+    // Publishes a new state of this server when its links, rooms or users changed
+    void refreshOwnState(int64_t now);
+    void topologyChanged();
+    std::map<std::string, std::vector<std::string>> adjacency() const;
+    Routes computeRoutes(const std::string &origin, const std::map<std::string, std::vector<std::string>> &graph) const;
+    const Routes &routesFor(const std::string &origin);
+    void updateStatus();
+
+public:
+    Federation(const FederationConfig &federationConfig, const Deliver &deliverRelay, const LocalState &describe, const Notice &announce);
+    ~Federation();
+
+    // False when the configuration is unusable; a busy peer port is retried in the background
+    bool start();
+    void stop();
+
+    // Any thread: relays a message that originated here to every server with
+    // members in room, queued once per peer link
+    void publish(const std::string &room, FrameType type, const std::string &sender, const std::string &body);
+
+    // Any thread: relays a private message to recipient on whichever server
+    // it is joined; false when it is not joined on any reachable one
+    bool sendDirect(const std::string &recipient, const std::string &sender, const std::string &body);
+
+    // Any thread: server where username is joined, empty when it is not joined elsewhere
+    std::string nodeOf(const std::string &username);
+    // Any thread: every user joined on another server, with that server's name
+    std::vector<std::pair<std::string, std::string>> remoteUserList();
+    FederationStatus currentStatus();
+    const std::string &nodeName() const { return config.nodeName; }
+};
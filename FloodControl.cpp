@@ -0,0 +1,69 @@
+#include "FloodControl.hpp"
+
+TokenBucket::TokenBucket(double rate, double burstSize)
+    : nsPerToken(rate > 0 ? 1e9 / rate : 0), burst(burstSize >= 1 ? burstSize : 1), capacityNs(0)
+{
+    capacityNs = static_cast<int64_t>(burst * nsPerToken);
+}
+
+FloodControl::FloodControl(const FloodConfig &config)
+    : floodPolicy(config.policy),
+      messages(config.messageRate, config.messageBurst > 0 ? config.messageBurst : config.messageRate),
+      bytes(config.byteRate, config.byteBurst > 0 ? config.byteBurst : config.byteRate),
+      fanout(config.fanoutRate, config.fanoutBurst > 0 ? config.fanoutBurst : config.fanoutRate),
+      fanoutFullAt(0)
+{
+    limited = !messages.unlimited() || !bytes.unlimited() || !fanout.unlimited();
+}
+
+int64_t FloodControl::admit(ClientFlood &client, size_t length, size_t recipients, int64_t now)
+{
+    // The client's own buckets first: they are private to the calling thread
+    int64_t retryAt = 0;
+    if (!messages.unlimited())
+    {
+        int64_t at = messages.availableAt(client.messagesFullAt, 1, now);
+        retryAt = at > now ? at : 0;
+    }
+    if (!bytes.unlimited() && length > 0)
+    {
+        int64_t at = bytes.availableAt(client.bytesFullAt, static_cast<double>(length), now);
+        if (at > now && at > retryAt)
+        {
+            retryAt = at;
+        }
+    }
+    if (retryAt != 0)
+    {
+        return retryAt;
+    }
+
+    // The shared bucket is only charged for a message that goes out
+    if (!fanout.unlimited() && recipients > 0)
+    {
+        double cost = static_cast<double>(recipients);
+        int64_t fullAt = fanoutFullAt.load(std::memory_order_relaxed);
+        while (true)
+        {
+            int64_t at = fanout.availableAt(fullAt, cost, now);
+            if (at > now)
+            {
+                return at;
+            }
+            if (fanoutFullAt.compare_exchange_weak(fullAt, fanout.take(fullAt, cost, now), std::memory_order_relaxed))
+            {
+                break;
+            }
+        }
+    }
+
+    if (!messages.unlimited())
+    {
+        client.messagesFullAt = messages.take(client.messagesFullAt, 1, now);
+    }
+    if (!bytes.unlimited())
+    {
+        client.bytesFullAt = bytes.take(client.bytesFullAt, static_cast<double>(length), now);
+    }
+    return 0;
+}
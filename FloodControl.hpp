@@ -0,0 +1,96 @@
+// FloodControl.hpp
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+
+// What happens to a client's message that is over its limit
+enum class FloodPolicy
+{
+    Delay, // Held back, and everything the client sends after it, until the limit allows it
+    Drop   // Discarded; the client is told how many of its messages were lost
+};
+
+struct FloodConfig
+{
+    double messageRate = 0;            // Messages per second one client may send, 0 = unlimited
+    double messageBurst = 0;           // Messages it may send at once after a quiet spell, 0 = one second's worth
+    double byteRate = 0;               // Message bytes per second one client may send, 0 = unlimited
+    double byteBurst = 0;              // 0 = one second's worth
+    double fanoutRate = 0;             // Deliveries per second across the server (messages x recipients), 0 = unlimited
+    double fanoutBurst = 0;            // 0 = one second's worth
+    FloodPolicy policy = FloodPolicy::Delay;
+};
+
+// Token bucket in its virtual-scheduling form (GCRA): rather than a token
+// count that a clock refills, the bucket is one timestamp, the time at which
+// it is full again. Taking tokens moves that time forward by how long they
+// take to refill, and they may be taken while it stays within one full
+// bucket's refill time of now. Checking a message is a comparison and an
+// addition; there is no refill step and no timer. Times are nanoseconds on
+// the steady clock.
+class TokenBucket
+{
+private:
+    double nsPerToken;  // 0 = unlimited
+    double burst;
+    int64_t capacityNs; // Refill time of an empty bucket
+
+    // Costs above the burst count as the burst, so every message conforms eventually
+    int64_t refillNs(double cost) const { return static_cast<int64_t>((cost < burst ? cost : burst) * nsPerToken); }
+
+public:
+    TokenBucket() : nsPerToken(0), burst(0), capacityNs(0) {}
+    TokenBucket(double rate, double burstSize);
+
+    bool unlimited() const { return nsPerToken <= 0; }
+
+    // Earliest time cost tokens can be taken from a bucket full at fullAt:
+    // now when they can be right away
+    int64_t availableAt(int64_t fullAt, double cost, int64_t now) const
+    {
+        int64_t after = (fullAt > now ? fullAt : now) + refillNs(cost);
+        return after - now <= capacityNs ? now : after - capacityNs;
+    }
+
+    // fullAt once cost tokens have been taken at now
+    int64_t take(int64_t fullAt, double cost, int64_t now) const
+    {
+        return (fullAt > now ? fullAt : now) + refillNs(cost);
+    }
+};
+
+// One client's position in its buckets, kept in its session
+struct ClientFlood
+{
+    int64_t messagesFullAt = 0;
+    int64_t bytesFullAt = 0;
+    int64_t heldUntil = 0;  // The frame last given to processFrame() was held back until then; 0 = it was not
+    uint64_t dropped = 0;   // Messages dropped since the client was last told
+    int64_t lastNotice = 0; // When the client was last told it is over its limit
+};
+
+// Flood limits of the whole server: the per-client buckets' parameters and
+// the fan-out bucket every client shares. Any thread may call admit() for
+// the clients it owns.
+class FloodControl
+{
+private:
+    FloodPolicy floodPolicy;
+    TokenBucket messages;
+    TokenBucket bytes;
+    TokenBucket fanout;
+    std::atomic<int64_t> fanoutFullAt;
+    bool limited;
+
+public:
+    explicit FloodControl(const FloodConfig &config);
+
+    bool enabled() const { return limited; }
+    FloodPolicy policy() const { return floodPolicy; }
+
+    // One message of length bytes for recipients deliveries. Returns 0 when
+    // it may go out now and takes its tokens; otherwise the time at which it
+    // could, without taking anything.
+    int64_t admit(ClientFlood &client, size_t length, size_t recipients, int64_t now);
+};
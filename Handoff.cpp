@@ -0,0 +1,443 @@
+#include "Handoff.hpp"
+#include "ConsoleUtils.hpp"
+#include <iostream>
+#include <cstring>
+#include <cstdint>
+
+#ifdef __linux__
+#include <sys/un.h>
+
+namespace
+{
+    // Identifies the blob layout; a successor from another release refuses a mismatch
+    const uint32_t HANDOFF_MAGIC = 0x4c434832; // "LCH2"
+
+    // Descriptors per sendmsg(); the kernel refuses more than SCM_MAX_FD (253)
+    const size_t FDS_PER_MESSAGE = 200;
+
+    const size_t MAX_BLOB_SIZE = 1024 * 1024 * 1024;
+
+    const char ACK = 'K';
+
+    void putU32(std::string &out, uint32_t value)
+    {
+        out += static_cast<char>((value >> 24) & 0xff);
+        out += static_cast<char>((value >> 16) & 0xff);
+        out += static_cast<char>((value >> 8) & 0xff);
+        out += static_cast<char>(value & 0xff);
+    }
+
+    void putString(std::string &out, const std::string &value)
+    {
+        putU32(out, static_cast<uint32_t>(value.size()));
+        out += value;
+    }
+
+    // Bounds-checked reads from a received blob; every failure is sticky
+    class BlobReader
+    {
+    private:
+        const std::string &blob;
+        size_t offset;
+        bool failed;
+
+    public:
+        explicit BlobReader(const std::string &data) : blob(data), offset(0), failed(false) {}
+
+        uint32_t u32()
+        {
+            if (failed || blob.size() - offset < 4)
+            {
+                failed = true;
+                return 0;
+            }
+            const unsigned char *p = reinterpret_cast<const unsigned char *>(blob.data() + offset);
+            offset += 4;
+            return (static_cast<uint32_t>(p[0]) << 24) | (static_cast<uint32_t>(p[1]) << 16) |
+                   (static_cast<uint32_t>(p[2]) << 8) | static_cast<uint32_t>(p[3]);
+        }
+
+        std::string string()
+        {
+            uint32_t length = u32();
+            if (failed || blob.size() - offset < length)
+            {
+                failed = true;
+                return std::string();
+            }
+            std::string value = blob.substr(offset, length);
+            offset += length;
+            return value;
+        }
+
+        bool ok() const { return !failed && offset == blob.size(); }
+    };
+
+    std::string serialize(const HandoffState &state)
+    {
+        std::string blob;
+        putU32(blob, HANDOFF_MAGIC);
+        putU32(blob, static_cast<uint32_t>(state.listeners.size()));
+        putU32(blob, static_cast<uint32_t>(state.sequence >> 32));
+        putU32(blob, static_cast<uint32_t>(state.sequence & 0xFFFFFFFF));
+        putU32(blob, static_cast<uint32_t>(state.clients.size()));
+        for (const HandoffClient &client : state.clients)
+        {
+            putString(blob, client.username);
+            putU32(blob, static_cast<uint32_t>(client.rooms.size()));
+            for (const std::string &room : client.rooms)
+            {
+                putString(blob, room);
+            }
+            putU32(blob, client.compression ? 1 : 0);
+            putString(blob, client.unparsedInput);
+            putString(blob, client.unsentOutput);
+        }
+        putU32(blob, static_cast<uint32_t>(state.rooms.size()));
+        for (const HandoffRoom &room : state.rooms)
+        {
+            putString(blob, room.name);
+            putU32(blob, static_cast<uint32_t>(room.history.size()));
+            for (const std::string &frame : room.history)
+            {
+                putString(blob, frame);
+            }
+        }
+        return blob;
+    }
+
+    // Counts are checked against the blob size before anything is reserved
+    bool deserialize(const std::string &blob, HandoffState &state, size_t &listenerCount)
+    {
+        BlobReader reader(blob);
+        if (reader.u32() != HANDOFF_MAGIC)
+        {
+            return false;
+        }
+        listenerCount = reader.u32();
+        uint64_t sequenceHigh = reader.u32();
+        state.sequence = (sequenceHigh << 32) | reader.u32();
+        uint32_t clientCount = reader.u32();
+        if (listenerCount == 0 || clientCount > blob.size())
+        {
+            return false;
+        }
+        state.clients.resize(clientCount);
+        for (HandoffClient &client : state.clients)
+        {
+            client.username = reader.string();
+            uint32_t roomCount = reader.u32();
+            if (roomCount > blob.size())
+            {
+                return false;
+            }
+            for (uint32_t i = 0; i < roomCount; ++i)
+            {
+                client.rooms.push_back(reader.string());
+            }
+            client.compression = reader.u32() != 0;
+            client.unparsedInput = reader.string();
+            client.unsentOutput = reader.string();
+        }
+        uint32_t roomCount = reader.u32();
+        if (roomCount > blob.size())
+        {
+            return false;
+        }
+        state.rooms.resize(roomCount);
+        for (HandoffRoom &room : state.rooms)
+        {
+            room.name = reader.string();
+            uint32_t frames = reader.u32();
+            if (frames > blob.size())
+            {
+                return false;
+            }
+            for (uint32_t i = 0; i < frames; ++i)
+            {
+                room.history.push_back(reader.string());
+            }
+        }
+        return reader.ok();
+    }
+
+    bool writeAll(socket_t channel, const char *data, size_t length)
+    {
+        while (length > 0)
+        {
+            ssize_t written = ::send(channel, data, length, SEND_FLAGS);
+            if (written < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (written <= 0)
+            {
+                return false;
+            }
+            data += written;
+            length -= written;
+        }
+        return true;
+    }
+
+    // Exactly length bytes: reading past the blob would swallow the first
+    // descriptor message and the descriptors attached to it
+    bool readAll(socket_t channel, char *data, size_t length)
+    {
+        while (length > 0)
+        {
+            ssize_t received = recv(channel, data, length, 0);
+            if (received < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (received <= 0)
+            {
+                return false;
+            }
+            data += received;
+            length -= received;
+        }
+        return true;
+    }
+
+    bool sendDescriptors(socket_t channel, const std::vector<int> &fds)
+    {
+        for (size_t first = 0; first < fds.size(); first += FDS_PER_MESSAGE)
+        {
+            size_t count = std::min(FDS_PER_MESSAGE, fds.size() - first);
+            std::vector<char> control(CMSG_SPACE(count * sizeof(int)));
+            char marker = 'F';
+            iovec part;
+            part.iov_base = &marker;
+            part.iov_len = 1;
+
+            msghdr message;
+            memset(&message, 0, sizeof(message));
+            message.msg_iov = &part;
+            message.msg_iovlen = 1;
+            message.msg_control = control.data();
+            message.msg_controllen = control.size();
+            cmsghdr *header = CMSG_FIRSTHDR(&message);
+            header->cmsg_level = SOL_SOCKET;
+            header->cmsg_type = SCM_RIGHTS;
+            header->cmsg_len = CMSG_LEN(count * sizeof(int));
+            memcpy(CMSG_DATA(header), &fds[first], count * sizeof(int));
+
+            ssize_t sent;
+            do
+            {
+                sent = sendmsg(channel, &message, SEND_FLAGS);
+            } while (sent < 0 && errno == EINTR);
+            if (sent != 1)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool receiveDescriptors(socket_t channel, size_t expected, std::vector<int> &fds)
+    {
+        while (fds.size() < expected)
+        {
+            size_t count = std::min(FDS_PER_MESSAGE, expected - fds.size());
+            std::vector<char> control(CMSG_SPACE(count * sizeof(int)));
+            char marker;
+            iovec part;
+            part.iov_base = &marker;
+            part.iov_len = 1;
+
+            msghdr message;
+            memset(&message, 0, sizeof(message));
+            message.msg_iov = &part;
+            message.msg_iovlen = 1;
+            message.msg_control = control.data();
+            message.msg_controllen = control.size();
+
+            ssize_t received;
+            do
+            {
+                received = recvmsg(channel, &message, MSG_CMSG_CLOEXEC);
+            } while (received < 0 && errno == EINTR);
+            if (received != 1)
+            {
+                return false;
+            }
+            size_t before = fds.size();
+            for (cmsghdr *header = CMSG_FIRSTHDR(&message); header; header = CMSG_NXTHDR(&message, header))
+            {
+                if (header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS)
+                {
+                    size_t n = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                    const int *passed = reinterpret_cast<const int *>(CMSG_DATA(header));
+                    fds.insert(fds.end(), passed, passed + n);
+                }
+            }
+            // Truncated control data means descriptors were lost on the way
+            if (fds.size() == before || (message.msg_flags & MSG_CTRUNC))
+            {
+                return false;
+            }
+        }
+        return fds.size() == expected;
+    }
+
+    bool unixAddress(const std::string &path, sockaddr_un &address)
+    {
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        if (path.empty() || path.size() >= sizeof(address.sun_path))
+        {
+            std::cerr << RED_COLOR "Handoff socket path is empty or too long: " << path << RESET_COLOR << std::endl;
+            return false;
+        }
+        strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+        return true;
+    }
+}
+
+socket_t Handoff::listen(const std::string &path)
+{
+    sockaddr_un address;
+    if (!unixAddress(path, address))
+    {
+        return SOCKET_ERROR_VAL;
+    }
+    // Left behind by the process this one took over from, or by a crash
+    unlink(path.c_str());
+    socket_t listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listener < 0)
+    {
+        return SOCKET_ERROR_VAL;
+    }
+    if (bind(listener, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 || ::listen(listener, 1) != 0)
+    {
+        std::cerr << RED_COLOR "Failed to open handoff socket " << path << RESET_COLOR << std::endl;
+        close(listener);
+        return SOCKET_ERROR_VAL;
+    }
+    return listener;
+}
+
+socket_t Handoff::connect(const std::string &path)
+{
+    sockaddr_un address;
+    if (!unixAddress(path, address))
+    {
+        return SOCKET_ERROR_VAL;
+    }
+    socket_t channel = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (channel < 0)
+    {
+        return SOCKET_ERROR_VAL;
+    }
+    if (::connect(channel, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0)
+    {
+        close(channel);
+        return SOCKET_ERROR_VAL;
+    }
+    return channel;
+}
+
+bool Handoff::send(socket_t channel, const HandoffState &state)
+{
+    std::string blob = serialize(state);
+    std::string length;
+    putU32(length, static_cast<uint32_t>(blob.size()));
+    if (!writeAll(channel, length.data(), length.size()) || !writeAll(channel, blob.data(), blob.size()))
+    {
+        return false;
+    }
+
+    std::vector<int> fds(state.listeners.begin(), state.listeners.end());
+    for (const HandoffClient &client : state.clients)
+    {
+        fds.push_back(client.socket);
+    }
+    return sendDescriptors(channel, fds);
+}
+
+bool Handoff::receive(socket_t channel, HandoffState &state)
+{
+    char lengthBytes[4];
+    if (!readAll(channel, lengthBytes, sizeof(lengthBytes)))
+    {
+        return false;
+    }
+    std::string length(lengthBytes, sizeof(lengthBytes));
+    BlobReader lengthReader(length);
+    uint32_t blobSize = lengthReader.u32();
+    if (blobSize > MAX_BLOB_SIZE)
+    {
+        return false;
+    }
+    std::string blob(blobSize, '\0');
+    if (blobSize > 0 && !readAll(channel, &blob[0], blobSize))
+    {
+        return false;
+    }
+
+    size_t listenerCount = 0;
+    if (!deserialize(blob, state, listenerCount))
+    {
+        std::cerr << RED_COLOR "Handoff state from the old server is malformed" RESET_COLOR << std::endl;
+        return false;
+    }
+
+    std::vector<int> fds;
+    if (!receiveDescriptors(channel, listenerCount + state.clients.size(), fds))
+    {
+        for (int fd : fds)
+        {
+            close(fd);
+        }
+        return false;
+    }
+    state.listeners.assign(fds.begin(), fds.begin() + listenerCount);
+    for (size_t i = 0; i < state.clients.size(); ++i)
+    {
+        state.clients[i].socket = fds[listenerCount + i];
+    }
+    return true;
+}
+
+bool Handoff::acknowledge(socket_t channel)
+{
+    return writeAll(channel, &ACK, 1);
+}
+
+bool Handoff::awaitAcknowledgement(socket_t channel, int timeoutMs)
+{
+    pollfd_t pfd;
+    pfd.fd = channel;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    if (pollSockets(&pfd, 1, timeoutMs) <= 0)
+    {
+        return false;
+    }
+    char answer = 0;
+    return recv(channel, &answer, 1, 0) == 1 && answer == ACK;
+}
+
+#else
+
+socket_t Handoff::listen(const std::string &)
+{
+    std::cerr << YELLOW_COLOR "Hot restart is only supported on Linux" RESET_COLOR << std::endl;
+    return SOCKET_ERROR_VAL;
+}
+
+socket_t Handoff::connect(const std::string &)
+{
+    std::cerr << YELLOW_COLOR "Hot restart is only supported on Linux" RESET_COLOR << std::endl;
+    return SOCKET_ERROR_VAL;
+}
+
+bool Handoff::send(socket_t, const HandoffState &) { return false; }
+bool Handoff::receive(socket_t, HandoffState &) { return false; }
+bool Handoff::acknowledge(socket_t) { return false; }
+bool Handoff::awaitAcknowledgement(socket_t, int) { return false; }
+
+#endif
@@ -0,0 +1,61 @@
+// Handoff.hpp
+#pragma once
+#include "SocketUtils.hpp"
+#include <string>
+#include <vector>
+#include <cstdint>
+
+// One client connection as it is handed to a successor process
+struct HandoffClient
+{
+    socket_t socket;
+    std::string username;           // Empty while the client is still handshaking
+    std::vector<std::string> rooms; // Rooms it is subscribed to, lobby included
+    bool compression;               // Negotiated compressed bodies
+    std::string unparsedInput;      // Received bytes of a frame that is not complete yet
+    std::string unsentOutput;       // Queued for the client and not written yet; may start mid-frame
+
+    HandoffClient() : socket(SOCKET_ERROR_VAL), compression(false) {}
+};
+
+// A room and its in-memory history, oldest frame first
+struct HandoffRoom
+{
+    std::string name;
+    std::vector<std::string> history;
+};
+
+// Everything a running server hands to the process replacing it
+struct HandoffState
+{
+    std::vector<socket_t> listeners; // The primary listener first, then any shard listeners
+    std::vector<HandoffClient> clients;
+    std::vector<HandoffRoom> rooms;  // Left empty when history lives in the durable log
+    uint64_t sequence;               // Last message sequence number handed out
+
+    HandoffState() : sequence(0) {}
+};
+
+// Hot restart channel between an old and a new server process on the same
+// machine, over a Unix domain socket. The old process listens on a path; the
+// new one connects and receives the state as one serialized blob, followed by
+// every descriptor passed with SCM_RIGHTS so the kernel objects themselves
+// move: listeners keep their backlog and connections keep their TCP state.
+// The new process acknowledges once it holds everything, and only then may
+// the old one let go. Linux only; the calls fail elsewhere.
+class Handoff
+{
+public:
+    // Old process: listens for a successor at path, replacing a stale socket file
+    static socket_t listen(const std::string &path);
+    // New process: connects to the old process waiting at path
+    static socket_t connect(const std::string &path);
+
+    static bool send(socket_t channel, const HandoffState &state);
+    // Descriptors arrive close-on-exec and owned by the caller
+    static bool receive(socket_t channel, HandoffState &state);
+
+    static bool acknowledge(socket_t channel);
+    // False when the successor went away or did not answer within timeoutMs
+    static bool awaitAcknowledgement(socket_t channel, int timeoutMs);
+};
@@ -0,0 +1,80 @@
+#include "HeartbeatMonitor.hpp"
+
+HeartbeatMonitor::HeartbeatMonitor(const Check &onDue, std::chrono::milliseconds tick)
+    : check(onDue), wheel(tick), plannedWakeup(TimerWheel::Clock::time_point::max()), stopping(false)
+{
+}
+
+HeartbeatMonitor::~HeartbeatMonitor()
+{
+    stop();
+}
+
+void HeartbeatMonitor::start()
+{
+    worker = std::thread(&HeartbeatMonitor::run, this);
+}
+
+void HeartbeatMonitor::stop()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    changed.notify_one();
+    if (worker.joinable())
+    {
+        worker.join();
+    }
+}
+
+void HeartbeatMonitor::watch(Liveness &liveness, TimerWheel::Clock::time_point first)
+{
+    if (first == TimerWheel::Clock::time_point::max())
+    {
+        return;
+    }
+    bool sooner;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        wheel.schedule(liveness, first);
+        sooner = first < plannedWakeup;
+    }
+    // Only a deadline ahead of the planned wakeup needs the thread's attention
+    if (sooner)
+    {
+        changed.notify_one();
+    }
+}
+
+void HeartbeatMonitor::forget(Liveness &liveness)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    wheel.cancel(liveness);
+}
+
+void HeartbeatMonitor::run()
+{
+    std::unique_lock<std::mutex> guard(lock);
+    while (!stopping)
+    {
+        wheel.advance(TimerWheel::Clock::now(), [this](TimerWheel::Timer &timer)
+                      {
+                          Liveness &liveness = static_cast<Liveness &>(timer);
+                          TimerWheel::Clock::time_point next = check(liveness);
+                          if (next != TimerWheel::Clock::time_point::max())
+                          {
+                              wheel.schedule(liveness, next);
+                          } });
+
+        plannedWakeup = wheel.empty() ? TimerWheel::Clock::time_point::max() : wheel.nextWakeup();
+        if (plannedWakeup == TimerWheel::Clock::time_point::max())
+        {
+            changed.wait(guard);
+        }
+        else
+        {
+            changed.wait_until(guard, plannedWakeup);
+        }
+    }
+}
@@ -0,0 +1,76 @@
+// HeartbeatMonitor.hpp
+#pragma once
+#include "TimerWheel.hpp"
+#include "SocketUtils.hpp"
+#include <atomic>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+// Heartbeat bookkeeping of one connection. Its timer is due whenever the
+// connection next needs a look: the handshake deadline, the next heartbeat,
+// or the end of the idle timeout. Receiving data only stores a timestamp; the
+// timer notices the change when it fires and moves itself out, so a busy
+// connection costs no timer operations at all.
+struct Liveness : TimerWheel::Timer
+{
+    socket_t socket;
+    std::atomic<int64_t> lastActivity; // Milliseconds on the steady clock, see now()
+    int64_t connectedAt;
+    int64_t lastPing; // Only touched by whoever owns the wheel
+
+    explicit Liveness(socket_t clientSocket)
+        : socket(clientSocket), lastActivity(now()), connectedAt(lastActivity.load()), lastPing(0)
+    {
+        key = clientSocket;
+    }
+
+    // Called for every read that returned data
+    void touch() { lastActivity.store(now(), std::memory_order_relaxed); }
+
+    static int64_t now()
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(TimerWheel::Clock::now().time_since_epoch()).count();
+    }
+    static TimerWheel::Clock::time_point at(int64_t millis)
+    {
+        return TimerWheel::Clock::time_point(std::chrono::milliseconds(millis));
+    }
+};
+
+// Liveness timers of the threaded mode. Handler threads register their
+// connection when it opens and drop it when they exit; one background thread
+// advances a shared wheel and runs the check of every timer that fires, so
+// idle clients cost one sleeping thread in total rather than a timer each.
+// Reactors keep a wheel of their own on the loop thread and do not use this.
+class HeartbeatMonitor
+{
+public:
+    // Runs with the monitor locked; returns when to check the connection
+    // again, TimerWheel::Clock::time_point::max() to stop watching it
+    typedef std::function<TimerWheel::Clock::time_point(Liveness &)> Check;
+
+private:
+    Check check;
+    TimerWheel wheel;
+    std::mutex lock;
+    std::condition_variable changed;
+    TimerWheel::Clock::time_point plannedWakeup; // When the thread looks at the wheel next
+    bool stopping;
+    std::thread worker;
+
+    void run();
+
+public:
+    HeartbeatMonitor(const Check &onDue, std::chrono::milliseconds tick);
+    ~HeartbeatMonitor();
+
+    void start();
+    void stop();
+
+    // Watches liveness from now on, first checking it at first
+    void watch(Liveness &liveness, TimerWheel::Clock::time_point first);
+    // Must be called before liveness is destroyed; waits for a running check of it
+    void forget(Liveness &liveness);
+};
@@ -0,0 +1,111 @@
+#include "LatencyHistogram.hpp"
+
+namespace
+{
+    // Values below SUB_BUCKETS get one exact bucket each, every power of two
+    // above that gets SUB_BUCKETS of them
+    const size_t BUCKET_COUNT = LatencyHistogram::SUB_BUCKETS * (64 - LatencyHistogram::SUB_BUCKET_BITS + 1);
+
+    int highestBit(uint64_t value)
+    {
+        int bit = 0;
+        while (value >>= 1)
+        {
+            ++bit;
+        }
+        return bit;
+    }
+}
+
+LatencyHistogram::LatencyHistogram()
+    : counts(BUCKET_COUNT, 0), total(0), valueSum(0), largest(0)
+{
+}
+
+size_t LatencyHistogram::bucketFor(uint64_t value)
+{
+    if (value < SUB_BUCKETS)
+    {
+        return static_cast<size_t>(value);
+    }
+    int shift = highestBit(value) - SUB_BUCKET_BITS;
+    uint64_t subBucket = (value >> shift) - SUB_BUCKETS;
+    return static_cast<size_t>(SUB_BUCKETS + shift * SUB_BUCKETS + subBucket);
+}
+
+uint64_t LatencyHistogram::bucketUpperBound(size_t index)
+{
+    if (index < SUB_BUCKETS)
+    {
+        return index;
+    }
+    size_t shift = (index - SUB_BUCKETS) / SUB_BUCKETS;
+    uint64_t subBucket = (index - SUB_BUCKETS) % SUB_BUCKETS;
+    uint64_t lower = (SUB_BUCKETS + subBucket) << shift;
+    return lower + ((1ULL << shift) - 1);
+}
+
+void LatencyHistogram::record(uint64_t value)
+{
+    ++counts[bucketFor(value)];
+    ++total;
+    valueSum += value;
+    if (value > largest)
+    {
+        largest = value;
+    }
+}
+
+void LatencyHistogram::merge(const LatencyHistogram &other)
+{
+    for (size_t i = 0; i < counts.size(); ++i)
+    {
+        counts[i] += other.counts[i];
+    }
+    total += other.total;
+    valueSum += other.valueSum;
+    if (other.largest > largest)
+    {
+        largest = other.largest;
+    }
+}
+
+void LatencyHistogram::reset()
+{
+    counts.assign(counts.size(), 0);
+    total = 0;
+    valueSum = 0;
+    largest = 0;
+}
+
+uint64_t LatencyHistogram::percentile(double fraction) const
+{
+    if (total == 0)
+    {
+        return 0;
+    }
+
+    uint64_t rank = static_cast<uint64_t>(fraction * total);
+    if (rank >= total)
+    {
+        rank = total - 1;
+    }
+
+    uint64_t seen = 0;
+    for (size_t i = 0; i < counts.size(); ++i)
+    {
+        seen += counts[i];
+        if (seen > rank)
+        {
+            // The bucket bound may overshoot the largest sample actually seen
+            uint64_t bound = bucketUpperBound(i);
+            return bound < largest ? bound : largest;
+        }
+    }
+    return largest;
+}
+
+double LatencyHistogram::mean() const
+{
+    return total == 0 ? 0.0 : static_cast<double>(valueSum) / total;
+}
@@ -0,0 +1,46 @@
+// LatencyHistogram.hpp
+#pragma once
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+// Log-linear histogram of non-negative integer samples (latencies in
+// microseconds, sizes in bytes). Every power of two is split into
+// SUB_BUCKETS equal buckets, so percentiles come back within ~3% of the true
+// value while the whole range of uint64_t fits in under 2000 counters.
+// Recording is a shift, an add and an increment with no allocation. Not
+// thread-safe: keep one per thread and merge() them when reading.
+class LatencyHistogram
+{
+public:
+    static const int SUB_BUCKET_BITS = 5;
+    static const uint64_t SUB_BUCKETS = 1ULL << SUB_BUCKET_BITS;
+
+private:
+    std::vector<uint64_t> counts;
+    uint64_t total;
+    uint64_t valueSum;
+    uint64_t largest;
+
+    static size_t bucketFor(uint64_t value);
+
+public:
+    LatencyHistogram();
+
+    void record(uint64_t value);
+    void merge(const LatencyHistogram &other);
+    void reset();
+
+    // Smallest bucket bound at or below which the given fraction (0..1) of samples fall
+    uint64_t percentile(double fraction) const;
+
+    uint64_t count() const { return total; }
+    uint64_t max() const { return largest; }
+    uint64_t sum() const { return valueSum; }
+    double mean() const;
+
+    // Bucket iteration, for exporters that print the distribution
+    size_t bucketCount() const { return counts.size(); }
+    uint64_t bucketSamples(size_t index) const { return counts[index]; }
+    static uint64_t bucketUpperBound(size_t index);
+};
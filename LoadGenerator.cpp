@@ -0,0 +1,559 @@
+#include "LoadGenerator.hpp"
+#include "AllocationCounter.hpp"
+#include <chrono>
+#include <thread>
+#include <functional>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#ifndef BENCH_REVISION
+#define BENCH_REVISION "unknown"
+#endif
+
+#ifndef _WIN32
+#include <netinet/tcp.h>
+#endif
+
+namespace
+{
+    // Hex digits of the send timestamp at the start of every message body,
+    // and of the sender's message count after it
+    const size_t TIMESTAMP_DIGITS = 16;
+    const size_t COUNT_DIGITS = 8;
+    const std::string BENCH_USER_PREFIX = "bench";
+
+    // Time allowed for the join notices of all clients to settle before sending starts
+    const int64_t SETTLE_NS = 500 * 1000 * 1000LL;
+
+    const int POLL_INTERVAL_MS = 1;
+
+    int64_t nowNs()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+    }
+
+    int64_t secondsToNs(double seconds)
+    {
+        return static_cast<int64_t>(seconds * 1e9);
+    }
+
+    bool sendAll(socket_t socket, const std::string &data)
+    {
+        size_t offset = 0;
+        while (offset < data.size())
+        {
+            int sent = send(socket, data.data() + offset, static_cast<int>(data.size() - offset), SEND_FLAGS);
+            if (sent <= 0)
+            {
+                return false;
+            }
+            offset += sent;
+        }
+        return true;
+    }
+
+    void sleepUntil(int64_t deadlineNs)
+    {
+        int64_t remaining = deadlineNs - nowNs();
+        if (remaining > 0)
+        {
+            std::this_thread::sleep_for(std::chrono::nanoseconds(remaining));
+        }
+    }
+
+    // Send time or message count written in hex in a message body; 0 when malformed
+    uint64_t parseHex(const std::string &body, size_t offset, size_t digits)
+    {
+        uint64_t value = 0;
+        for (size_t i = offset; i < offset + digits; ++i)
+        {
+            char c = body[i];
+            int digit = (c >= '0' && c <= '9') ? c - '0' : (c >= 'a' && c <= 'f') ? c - 'a' + 10 : -1;
+            if (digit < 0)
+            {
+                return 0;
+            }
+            value = (value << 4) | static_cast<uint64_t>(digit);
+        }
+        return value;
+    }
+
+    // Reads chat_heap_allocations_total from the server's admin port
+    bool readServerAllocations(const std::string &host, int port, uint64_t &allocations)
+    {
+        sockaddr_in adminAddr;
+        memset(&adminAddr, 0, sizeof(adminAddr));
+        adminAddr.sin_family = AF_INET;
+        adminAddr.sin_port = htons(port);
+        if (inet_pton(AF_INET, host.c_str(), &adminAddr.sin_addr) != 1)
+        {
+            return false;
+        }
+        socket_t adminSocket = socket(AF_INET, SOCK_STREAM, 0);
+        if (adminSocket == SOCKET_ERROR_VAL)
+        {
+            return false;
+        }
+        std::string response;
+        if (connect(adminSocket, (sockaddr *)&adminAddr, sizeof(adminAddr)) == 0 &&
+            sendAll(adminSocket, "GET /metrics HTTP/1.0\r\n\r\n"))
+        {
+            char buffer[4096];
+            int bytesReceived;
+            while ((bytesReceived = recv(adminSocket, buffer, sizeof(buffer), 0)) > 0)
+            {
+                response.append(buffer, bytesReceived);
+            }
+        }
+        closeSocket(adminSocket);
+
+        const std::string name = "\nchat_heap_allocations_total ";
+        size_t found = response.find(name);
+        if (found == std::string::npos)
+        {
+            return false;
+        }
+        allocations = std::strtoull(response.c_str() + found + name.size(), nullptr, 10);
+        return true;
+    }
+
+    std::string jsonEscape(const std::string &text)
+    {
+        std::string escaped;
+        for (char c : text)
+        {
+            if (c == '"' || c == '\\')
+            {
+                escaped += '\\';
+            }
+            escaped += c;
+        }
+        return escaped;
+    }
+}
+
+LoadGenerator::LoadGenerator(const BenchConfig &benchConfig)
+    : config(benchConfig), totalSent(0), totalReceived(0), startNs(0), measureNs(0), stopNs(0), drainNs(0)
+{
+    if (config.senders == 0 || config.senders > config.clients)
+    {
+        config.senders = config.clients;
+    }
+    if (config.messageSize < TIMESTAMP_DIGITS + COUNT_DIGITS)
+    {
+        config.messageSize = TIMESTAMP_DIGITS + COUNT_DIGITS;
+    }
+    if (config.messageSize > MAX_MESSAGE_LENGTH)
+    {
+        config.messageSize = MAX_MESSAGE_LENGTH;
+    }
+    if (config.threads == 0)
+    {
+        config.threads = std::thread::hardware_concurrency();
+        if (config.threads == 0)
+        {
+            config.threads = 1;
+        }
+        if (config.threads > 8)
+        {
+            config.threads = 8;
+        }
+    }
+    if (config.threads > config.clients)
+    {
+        config.threads = config.clients > 0 ? config.clients : 1;
+    }
+}
+
+LoadGenerator::~LoadGenerator()
+{
+    for (const std::unique_ptr<Worker> &worker : workers)
+    {
+        for (const std::unique_ptr<BenchConnection> &conn : worker->connections)
+        {
+            if (conn->socket != SOCKET_ERROR_VAL)
+            {
+                closeSocket(conn->socket);
+            }
+        }
+    }
+}
+
+bool LoadGenerator::connectAll()
+{
+    // Clients go round-robin over the servers, so each one's fan-out has to
+    // cross the federation to reach most recipients
+    std::vector<sockaddr_in> endpoints;
+    std::vector<std::string> addresses = config.servers;
+    if (addresses.empty())
+    {
+        addresses.push_back(config.host + ":" + std::to_string(config.port));
+    }
+    for (const std::string &address : addresses)
+    {
+        size_t colon = address.rfind(':');
+        sockaddr_in serverAddr;
+        memset(&serverAddr, 0, sizeof(serverAddr));
+        serverAddr.sin_family = AF_INET;
+        serverAddr.sin_port = htons(colon == std::string::npos ? 0 : std::atoi(address.c_str() + colon + 1));
+        if (colon == std::string::npos || inet_pton(AF_INET, address.substr(0, colon).c_str(), &serverAddr.sin_addr) != 1)
+        {
+            std::cerr << "Invalid server address: " << address << std::endl;
+            return false;
+        }
+        endpoints.push_back(serverAddr);
+    }
+
+    for (size_t i = 0; i < config.threads; ++i)
+    {
+        workers.push_back(std::unique_ptr<Worker>(new Worker()));
+    }
+
+    for (size_t i = 0; i < config.clients; ++i)
+    {
+        socket_t clientSocket = socket(AF_INET, SOCK_STREAM, 0);
+        if (clientSocket == SOCKET_ERROR_VAL)
+        {
+            std::cerr << "Failed to create socket for client " << i << std::endl;
+            return false;
+        }
+
+        Worker &worker = *workers[i % workers.size()];
+        bool sender = i < config.senders;
+        worker.connections.push_back(std::unique_ptr<BenchConnection>(new BenchConnection(clientSocket, sender)));
+        if (sender)
+        {
+            ++worker.senderCount;
+        }
+
+        const sockaddr_in &serverAddr = endpoints[i % endpoints.size()];
+        if (connect(clientSocket, (sockaddr *)&serverAddr, sizeof(serverAddr)) != 0)
+        {
+            std::cerr << "Failed to connect client " << i << " to " << addresses[i % addresses.size()] << std::endl;
+            return false;
+        }
+
+        int noDelay = 1;
+        setsockopt(clientSocket, IPPROTO_TCP, TCP_NODELAY, (const char *)&noDelay, sizeof(noDelay));
+
+        if (!sendAll(clientSocket, encodeFrame(FrameType::Join, BENCH_USER_PREFIX + std::to_string(i), "")) ||
+            !setNonBlocking(clientSocket))
+        {
+            std::cerr << "Handshake failed for client " << i << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+void LoadGenerator::makeMessage(int64_t now, uint32_t count, std::string &body) const
+{
+    char stamp[TIMESTAMP_DIGITS + COUNT_DIGITS + 1];
+    snprintf(stamp, sizeof(stamp), "%016llx%08x", static_cast<unsigned long long>(now), count);
+    body.assign(stamp, TIMESTAMP_DIGITS + COUNT_DIGITS);
+    body.resize(config.messageSize, 'x');
+}
+
+bool LoadGenerator::flushConnection(BenchConnection &conn)
+{
+    while (conn.outboundOffset < conn.outbound.size())
+    {
+        int sent = send(conn.socket, conn.outbound.data() + conn.outboundOffset,
+                        static_cast<int>(conn.outbound.size() - conn.outboundOffset), SEND_FLAGS);
+        if (sent < 0)
+        {
+            return socketWouldBlock();
+        }
+        conn.outboundOffset += sent;
+    }
+    conn.outbound.clear();
+    conn.outboundOffset = 0;
+    return true;
+}
+
+bool LoadGenerator::readConnection(Worker &worker, BenchConnection &conn, int64_t now)
+{
+    char buffer[16 * 1024];
+    int bytesReceived = recv(conn.socket, buffer, sizeof(buffer), 0);
+    if (bytesReceived < 0)
+    {
+        return socketWouldBlock();
+    }
+    if (bytesReceived == 0)
+    {
+        return false;
+    }
+
+    conn.parser.feed(buffer, bytesReceived);
+    Frame &frame = conn.frame;
+    while (conn.parser.next(frame))
+    {
+        if (frame.type != FrameType::Chat || frame.body.size() < TIMESTAMP_DIGITS + COUNT_DIGITS ||
+            frame.sender.compare(0, BENCH_USER_PREFIX.size(), BENCH_USER_PREFIX) != 0)
+        {
+            continue;
+        }
+
+        // Senders are the first clients, so their number indexes lastSeen
+        size_t senderIndex = std::strtoul(frame.sender.c_str() + BENCH_USER_PREFIX.size(), nullptr, 10);
+        if (senderIndex < config.senders)
+        {
+            if (conn.lastSeen.empty())
+            {
+                conn.lastSeen.resize(config.senders, 0);
+            }
+            uint32_t count = static_cast<uint32_t>(parseHex(frame.body, TIMESTAMP_DIGITS, COUNT_DIGITS));
+            if (count < conn.lastSeen[senderIndex])
+            {
+                ++worker.reordered;
+            }
+            else
+            {
+                conn.lastSeen[senderIndex] = count + 1;
+            }
+        }
+
+        int64_t sentAt = static_cast<int64_t>(parseHex(frame.body, 0, TIMESTAMP_DIGITS));
+        if (sentAt >= measureNs && sentAt < stopNs)
+        {
+            ++worker.received;
+            worker.latency.record(static_cast<uint64_t>(now - sentAt) / 1000);
+        }
+    }
+    return !conn.parser.hasError();
+}
+
+void LoadGenerator::runWorker(Worker &worker)
+{
+    std::vector<pollfd_t> fds;
+    std::vector<BenchConnection *> polled;
+    std::vector<BenchConnection *> senders;
+    for (const std::unique_ptr<BenchConnection> &conn : worker.connections)
+    {
+        if (conn->sender)
+        {
+            senders.push_back(conn.get());
+        }
+    }
+
+    double workerRate = config.rate * worker.senderCount / config.senders;
+    uint64_t issued = 0;
+    size_t nextSender = 0;
+    uint64_t publishedSent = 0;
+    uint64_t publishedReceived = 0;
+    uint64_t otherClients = config.clients - 1;
+
+    while (true)
+    {
+        int64_t now = nowNs();
+        if (now >= drainNs)
+        {
+            break;
+        }
+        if (now >= stopNs && totalReceived.load() >= totalSent.load() * otherClients)
+        {
+            break;
+        }
+
+        // Catch up with the schedule; a slow loop sends a burst rather than dropping the rate
+        if (!senders.empty() && now >= startNs && now < stopNs)
+        {
+            uint64_t due = static_cast<uint64_t>((now - startNs) * workerRate / 1e9);
+            while (issued < due)
+            {
+                BenchConnection &conn = *senders[nextSender];
+                nextSender = (nextSender + 1) % senders.size();
+                ++issued;
+                if (conn.socket == SOCKET_ERROR_VAL)
+                {
+                    continue;
+                }
+
+                makeMessage(now, conn.sentCount++, worker.body);
+                appendFrame(conn.outbound, FrameType::Chat, "", worker.body);
+                if (now >= measureNs)
+                {
+                    ++worker.sent;
+                }
+                flushConnection(conn);
+            }
+        }
+
+        fds.clear();
+        polled.clear();
+        for (const std::unique_ptr<BenchConnection> &conn : worker.connections)
+        {
+            if (conn->socket == SOCKET_ERROR_VAL)
+            {
+                continue;
+            }
+            pollfd_t entry;
+            entry.fd = conn->socket;
+            entry.events = POLLIN;
+            if (conn->outboundOffset < conn->outbound.size())
+            {
+                entry.events |= POLLOUT;
+            }
+            entry.revents = 0;
+            fds.push_back(entry);
+            polled.push_back(conn.get());
+        }
+        if (fds.empty())
+        {
+            break;
+        }
+
+        if (pollSockets(fds.data(), fds.size(), POLL_INTERVAL_MS) > 0)
+        {
+            now = nowNs();
+            for (size_t i = 0; i < fds.size(); ++i)
+            {
+                BenchConnection &conn = *polled[i];
+                bool open = true;
+                if (fds[i].revents & POLLOUT)
+                {
+                    open = flushConnection(conn);
+                }
+                if (open && (fds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+                {
+                    open = readConnection(worker, conn, now);
+                }
+                if (!open)
+                {
+                    closeSocket(conn.socket);
+                    conn.socket = SOCKET_ERROR_VAL;
+                }
+            }
+        }
+
+        totalSent += worker.sent - publishedSent;
+        totalReceived += worker.received - publishedReceived;
+        publishedSent = worker.sent;
+        publishedReceived = worker.received;
+    }
+}
+
+bool LoadGenerator::run(BenchResult &result)
+{
+    if (config.clients < 2)
+    {
+        std::cerr << "Need at least two clients to measure fan-out" << std::endl;
+        return false;
+    }
+    if (!connectAll())
+    {
+        return false;
+    }
+
+    startNs = nowNs() + SETTLE_NS;
+    measureNs = startNs + secondsToNs(config.warmup);
+    stopNs = measureNs + secondsToNs(config.duration);
+    drainNs = stopNs + secondsToNs(config.drain);
+
+    std::vector<std::thread> threads;
+    for (const std::unique_ptr<Worker> &worker : workers)
+    {
+        threads.push_back(std::thread(&LoadGenerator::runWorker, this, std::ref(*worker)));
+    }
+
+    // Allocation counts are taken at both ends of the measured window
+    sleepUntil(measureNs);
+    uint64_t benchBefore = AllocationCounter::allocations();
+    uint64_t serverBefore = 0;
+    bool serverRead = config.adminPort > 0 && readServerAllocations(config.host, config.adminPort, serverBefore);
+    sleepUntil(stopNs);
+    result.benchAllocations = AllocationCounter::allocations() - benchBefore;
+    uint64_t serverAfter = 0;
+    if (serverRead && readServerAllocations(config.host, config.adminPort, serverAfter))
+    {
+        result.serverAllocations = static_cast<int64_t>(serverAfter - serverBefore);
+    }
+    else if (config.adminPort > 0)
+    {
+        std::cerr << "Could not read the allocation count from the admin port " << config.adminPort << std::endl;
+    }
+
+    for (std::thread &thread : threads)
+    {
+        thread.join();
+    }
+
+    for (const std::unique_ptr<Worker> &worker : workers)
+    {
+        result.sent += worker->sent;
+        result.received += worker->received;
+        result.reordered += worker->reordered;
+        result.latency.merge(worker->latency);
+    }
+    result.expected = result.sent * (config.clients - 1);
+    result.seconds = config.duration;
+    return true;
+}
+
+bool LoadGenerator::passed(const BenchResult &result) const
+{
+    return !config.check || (result.received == result.expected && result.reordered == 0);
+}
+
+void LoadGenerator::printSummary(std::ostream &out, const BenchResult &result) const
+{
+    double seconds = result.seconds > 0 ? result.seconds : 1.0;
+    out << "Clients:   " << config.clients << " (" << config.senders << " sending"
+        << (config.servers.size() > 1 ? ", over " + std::to_string(config.servers.size()) + " servers" : std::string()) << "), "
+        << config.rate << " msg/s of " << config.messageSize << " bytes for " << config.duration << " s" << std::endl;
+    out << "Sent:      " << result.sent << " (" << result.sent / seconds << " msg/s)" << std::endl;
+    out << "Delivered: " << result.received << " of " << result.expected << " ("
+        << result.received / seconds << " msg/s, " << (result.expected - result.received) << " missing, "
+        << result.reordered << " out of order)" << std::endl;
+    out << "Fan-out latency (us): p50 " << result.latency.percentile(0.50)
+        << "  p99 " << result.latency.percentile(0.99)
+        << "  p999 " << result.latency.percentile(0.999)
+        << "  max " << result.latency.max()
+        << "  mean " << static_cast<uint64_t>(result.latency.mean()) << std::endl;
+    double sent = result.sent > 0 ? static_cast<double>(result.sent) : 1.0;
+    out << "Allocations: bench " << result.benchAllocations << " (" << result.benchAllocations / sent << " per message)";
+    if (result.serverAllocations >= 0)
+    {
+        out << ", server " << result.serverAllocations << " (" << result.serverAllocations / sent << " per message)";
+    }
+    out << std::endl;
+}
+
+void LoadGenerator::printJson(std::ostream &out, const BenchResult &result) const
+{
+    double seconds = result.seconds > 0 ? result.seconds : 1.0;
+    out << "{\"revision\":\"" << BENCH_REVISION << "\""
+        << ",\"label\":\"" << jsonEscape(config.label) << "\""
+        << ",\"servers\":" << (config.servers.empty() ? 1 : config.servers.size())
+        << ",\"clients\":" << config.clients
+        << ",\"senders\":" << config.senders
+        << ",\"rate\":" << config.rate
+        << ",\"size\":" << config.messageSize
+        << ",\"duration\":" << config.duration
+        << ",\"sent\":" << result.sent
+        << ",\"sent_per_sec\":" << result.sent / seconds
+        << ",\"expected\":" << result.expected
+        << ",\"received\":" << result.received
+        << ",\"delivered_per_sec\":" << result.received / seconds
+        << ",\"reordered\":" << result.reordered
+        << ",\"latency_us\":{\"p50\":" << result.latency.percentile(0.50)
+        << ",\"p99\":" << result.latency.percentile(0.99)
+        << ",\"p999\":" << result.latency.percentile(0.999)
+        << ",\"max\":" << result.latency.max()
+        << ",\"mean\":" << result.latency.mean() << "}"
+        << ",\"bench_allocations\":" << result.benchAllocations
+        << ",\"server_allocations\":";
+    if (result.serverAllocations >= 0)
+    {
+        out << result.serverAllocations;
+    }
+    else
+    {
+        out << "null";
+    }
+    out << "}" << std::endl;
+}
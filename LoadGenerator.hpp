@@ -0,0 +1,113 @@
+// LoadGenerator.hpp
+#pragma once
+#include "Protocol.hpp"
+#include "SocketUtils.hpp"
+#include "LatencyHistogram.hpp"
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <ostream>
+
+struct BenchConfig
+{
+    std::string host = "127.0.0.1";
+    int port = 12345;
+    std::vector<std::string> servers; // host:port of federated servers to spread the clients over; empty = host:port only
+    size_t clients = 50;      // Connections opened, every one of them receives
+    size_t senders = 0;       // How many of them also send, 0 = all
+    double rate = 1000.0;     // Messages per second across all senders
+    size_t messageSize = 128; // Chat body bytes, including the embedded timestamp
+    double warmup = 1.0;      // Seconds of load before measuring starts
+    double duration = 10.0;   // Seconds measured
+    double drain = 2.0;       // Longest wait for in-flight messages once sending stops
+    size_t threads = 0;       // Worker threads, 0 = one per core (at most 8)
+    std::string label;        // Free-form tag copied into the results, e.g. the server mode
+    int adminPort = 0;        // Admin port of the server on host, read for its allocation count; 0 = not read
+    bool check = false;       // Fail the run when a delivery is missing or out of order
+    std::string scenario;     // Scripted check run instead of the load (see BenchScenarios.hpp); empty = load
+};
+
+struct BenchResult
+{
+    uint64_t sent = 0;     // Messages sent during the measured window
+    uint64_t expected = 0; // Deliveries those should produce (sent x other clients)
+    uint64_t received = 0; // Deliveries observed
+    uint64_t reordered = 0; // Deliveries that arrived behind a later message of the same sender
+    double seconds = 0.0;
+    LatencyHistogram latency; // Sender timestamp to receipt, microseconds
+    uint64_t benchAllocations = 0;  // Heap allocations of the load generator during the measured window
+    int64_t serverAllocations = -1; // Same for the server, from its metrics; -1 when not read
+};
+
+// Headless load generator: opens a number of synthetic clients against a
+// running server, joins them, has the senders chat at a fixed total rate and
+// measures how long every broadcast takes to reach every other client. Each
+// message body starts with its send time and the sender's message count, so
+// latency and per-sender order are checked on receipt without any bookkeeping
+// shared between threads. Connections are spread
+// across worker threads that poll their own slice of sockets. Heap
+// allocations during the measured window are counted too, the server's
+// through its admin port, so a run shows whether the hot path allocates.
+class LoadGenerator
+{
+private:
+    struct BenchConnection
+    {
+        socket_t socket;
+        bool sender;
+        FrameParser parser;
+        Frame frame;          // Reused for every frame read
+        std::string outbound; // Bytes not yet accepted by the socket
+        size_t outboundOffset;
+        uint32_t sentCount;             // Messages this connection sent
+        std::vector<uint32_t> lastSeen; // Per sender: count of its last message received + 1, 0 = none yet
+
+        BenchConnection(socket_t clientSocket, bool isSender)
+            : socket(clientSocket), sender(isSender), outboundOffset(0), sentCount(0)
+        {
+        }
+    };
+
+    struct Worker
+    {
+        std::vector<std::unique_ptr<BenchConnection>> connections;
+        size_t senderCount;
+        uint64_t sent;
+        uint64_t received;
+        uint64_t reordered;
+        LatencyHistogram latency;
+        std::string body; // Scratch for the next message sent
+
+        Worker() : senderCount(0), sent(0), received(0), reordered(0) {}
+    };
+
+    BenchConfig config;
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::atomic<uint64_t> totalSent;     // Published by workers once per loop, for the drain check
+    std::atomic<uint64_t> totalReceived;
+    int64_t startNs;   // Senders start here
+    int64_t measureNs; // Messages sent from here on are measured
+    int64_t stopNs;    // Senders stop here
+    int64_t drainNs;   // Workers give up on missing deliveries here
+
+    bool connectAll();
+    void runWorker(Worker &worker);
+    bool flushConnection(BenchConnection &conn);
+    bool readConnection(Worker &worker, BenchConnection &conn, int64_t now);
+    void makeMessage(int64_t now, uint32_t count, std::string &body) const;
+
+public:
+    explicit LoadGenerator(const BenchConfig &benchConfig);
+    ~LoadGenerator();
+
+    // Blocks for warmup + duration (+ drain); false when the server cannot be reached
+    bool run(BenchResult &result);
+
+    // Under config.check: every delivery arrived, each sender's in order
+    bool passed(const BenchResult &result) const;
+
+    void printSummary(std::ostream &out, const BenchResult &result) const;
+    // One JSON object on one line, so runs can be appended to a file and diffed
+    void printJson(std::ostream &out, const BenchResult &result) const;
+};
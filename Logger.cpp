@@ -0,0 +1,411 @@
+#include "Logger.hpp"
+#include "MpscQueue.hpp"
+#include "ConsoleUtils.hpp"
+#include "Metrics.hpp"
+#include <iostream>
+#include <fstream>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <ctime>
+
+namespace
+{
+    // Records allowed to wait for the writer before new ones are dropped
+    const size_t MAX_PENDING = 64 * 1024;
+    // How long the writer sleeps once it has caught up
+    const int WRITE_INTERVAL_MS = 20;
+
+    struct LogRecord
+    {
+        std::chrono::system_clock::time_point time;
+        LogLevel level;
+        LogEvent event;
+        std::string user;
+        std::string room;
+        std::string text;
+        int64_t socket;
+    };
+
+    struct LoggerState
+    {
+        MpscQueue<LogRecord> queue;
+        std::atomic<int> level;
+        std::atomic<bool> running;
+        std::atomic<size_t> pending;
+        std::atomic<uint64_t> dropped;    // Since the writer last reported them
+        std::atomic<uint64_t> suppressed; // Chat lines over the rate, since last reported
+        std::atomic<int64_t> rateWindow;  // Second the chat line count belongs to
+        std::atomic<unsigned> rateCount;
+        unsigned chatRate;
+        std::ofstream file;
+        std::mutex directLock; // Synchronous writes while the writer is not running
+        std::thread writer;
+
+        LoggerState()
+            : level(static_cast<int>(LogLevel::Info)), running(false), pending(0), dropped(0), suppressed(0),
+              rateWindow(0), rateCount(0), chatRate(0)
+        {
+        }
+    };
+
+    // Leaked on purpose: handler threads may still log during static destruction
+    LoggerState &state()
+    {
+        static LoggerState *instance = new LoggerState();
+        return *instance;
+    }
+
+    const char *levelName(LogLevel level)
+    {
+        switch (level)
+        {
+        case LogLevel::Debug:
+            return "DEBUG";
+        case LogLevel::Info:
+            return "INFO ";
+        case LogLevel::Warn:
+            return "WARN ";
+        default:
+            return "ERROR";
+        }
+    }
+
+    void appendRoomLabel(std::string &out, const std::string &room)
+    {
+        if (!room.empty())
+        {
+            out += " #";
+            out += room;
+        }
+    }
+
+    // Appends one line, without its newline, to out. Console lines keep the
+    // server's colored look; file lines are plain text behind a timestamp and
+    // level. Appending lets the writer reuse one batch buffer, so the
+    // frequent chat and text lines cost no allocation once it has grown.
+    void format(const LogRecord &record, bool console, std::string &out)
+    {
+        if (!console)
+        {
+            std::time_t seconds = std::chrono::system_clock::to_time_t(record.time);
+            int millis = static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(record.time.time_since_epoch()).count() % 1000);
+            std::tm local;
+#ifdef _WIN32
+            localtime_s(&local, &seconds);
+#else
+            localtime_r(&seconds, &local);
+#endif
+            char stamp[32];
+            size_t length = std::strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &local);
+            snprintf(stamp + length, sizeof(stamp) - length, ".%03d ", millis);
+            out += stamp;
+            out += levelName(record.level);
+            out += ' ';
+        }
+
+        switch (record.event)
+        {
+        case LogEvent::Connect:
+            out += console ? BLUE_COLOR "New client connected. Socket ID: " : "New client connected. Socket ID: ";
+            out += std::to_string(record.socket);
+            if (console)
+            {
+                out += RESET_COLOR;
+            }
+            break;
+        case LogEvent::Join:
+            out += console ? FORMAT_USER_JOIN(record.user) : record.user + " joined the chat";
+            break;
+        case LogEvent::Leave:
+            out += console ? FORMAT_USER_LEAVE(record.user) : record.user + " left the chat";
+            break;
+        case LogEvent::RoomJoin:
+        case LogEvent::RoomLeave:
+            if (console)
+            {
+                out += BLUE_COLOR;
+            }
+            out += record.user;
+            out += record.event == LogEvent::RoomJoin ? " joined" : " left";
+            appendRoomLabel(out, record.room);
+            if (console)
+            {
+                out += RESET_COLOR;
+            }
+            break;
+        case LogEvent::Direct:
+            if (console)
+            {
+                out += MAGENTA_COLOR;
+            }
+            out += record.user;
+            out += " sent a private message to ";
+            out += record.room;
+            if (console)
+            {
+                out += RESET_COLOR;
+            }
+            break;
+        case LogEvent::Chat:
+            if (console)
+            {
+                out += CYAN_COLOR;
+            }
+            out += '[';
+            out += record.user;
+            appendRoomLabel(out, record.room);
+            out += "]: ";
+            if (console)
+            {
+                out += RESET_COLOR;
+            }
+            out += record.text;
+            break;
+        default:
+            if (console && record.level == LogLevel::Warn)
+            {
+                out += YELLOW_COLOR;
+                out += record.text;
+                out += RESET_COLOR;
+            }
+            else if (console && record.level == LogLevel::Error)
+            {
+                out += RED_COLOR;
+                out += record.text;
+                out += RESET_COLOR;
+            }
+            else
+            {
+                out += record.text;
+            }
+            break;
+        }
+    }
+
+    LogRecord notice(LogLevel level, const std::string &text)
+    {
+        LogRecord record;
+        record.time = std::chrono::system_clock::now();
+        record.level = level;
+        record.event = LogEvent::Text;
+        record.text = text;
+        record.socket = -1;
+        return record;
+    }
+
+    void writeOut(LoggerState &logger, const std::string &batch)
+    {
+        if (logger.file.is_open())
+        {
+            logger.file << batch;
+            logger.file.flush();
+        }
+        else
+        {
+            std::cout << batch;
+            std::cout.flush();
+        }
+    }
+
+    void writerLoop()
+    {
+        LoggerState &logger = state();
+        bool console = !logger.file.is_open();
+        // Cleared, not freed, between batches
+        std::string batch;
+        LogRecord record;
+        while (true)
+        {
+            bool finished = !logger.running.load(std::memory_order_acquire);
+
+            batch.clear();
+            size_t count = 0;
+            while (logger.queue.pop(record))
+            {
+                format(record, console, batch);
+                batch += '\n';
+                ++count;
+            }
+            logger.pending.fetch_sub(count, std::memory_order_relaxed);
+
+            uint64_t suppressed = logger.suppressed.exchange(0, std::memory_order_relaxed);
+            if (suppressed > 0)
+            {
+                format(notice(LogLevel::Info, std::to_string(suppressed) + " chat lines not logged (over the log rate limit)"), console, batch);
+                batch += '\n';
+            }
+            uint64_t dropped = logger.dropped.exchange(0, std::memory_order_relaxed);
+            if (dropped > 0)
+            {
+                format(notice(LogLevel::Warn, std::to_string(dropped) + " log records dropped, the log writer fell behind"), console, batch);
+                batch += '\n';
+            }
+
+            if (!batch.empty())
+            {
+                writeOut(logger, batch);
+            }
+            if (finished)
+            {
+                break;
+            }
+            if (count == 0)
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(WRITE_INTERVAL_MS));
+            }
+        }
+    }
+
+    void submit(LogRecord &record)
+    {
+        LoggerState &logger = state();
+        if (!logger.running.load(std::memory_order_acquire))
+        {
+            std::lock_guard<std::mutex> lock(logger.directLock);
+            std::string line;
+            format(record, !logger.file.is_open(), line);
+            line += '\n';
+            writeOut(logger, line);
+            return;
+        }
+
+        // Never wait for the writer: past the limit the record is only counted
+        if (logger.pending.fetch_add(1, std::memory_order_relaxed) >= MAX_PENDING)
+        {
+            logger.pending.fetch_sub(1, std::memory_order_relaxed);
+            logger.dropped.fetch_add(1, std::memory_order_relaxed);
+            Metrics::add(Counter::LogLinesDropped);
+            return;
+        }
+        logger.queue.push(std::move(record));
+    }
+}
+
+void Logger::start(const LogConfig &config)
+{
+    LoggerState &logger = state();
+    if (logger.running.load())
+    {
+        return;
+    }
+    logger.level.store(static_cast<int>(config.level));
+    logger.chatRate = config.chatRate;
+    if (!config.file.empty())
+    {
+        logger.file.open(config.file.c_str(), std::ios::out | std::ios::app);
+        if (!logger.file.is_open())
+        {
+            std::cerr << RED_COLOR "Cannot open log file " << config.file << ", logging to the console" RESET_COLOR << std::endl;
+        }
+    }
+    logger.running.store(true, std::memory_order_release);
+    logger.writer = std::thread(writerLoop);
+}
+
+void Logger::stop()
+{
+    LoggerState &logger = state();
+    if (!logger.running.exchange(false))
+    {
+        return;
+    }
+    logger.writer.join();
+}
+
+bool Logger::enabled(LogLevel level)
+{
+    return level != LogLevel::Off && static_cast<int>(level) >= state().level.load(std::memory_order_relaxed);
+}
+
+void Logger::text(LogLevel level, const std::string &line)
+{
+    if (enabled(level))
+    {
+        LogRecord record = notice(level, line);
+        submit(record);
+    }
+}
+
+void Logger::event(LogLevel level, LogEvent event, const std::string &user, const std::string &room, int64_t socket)
+{
+    if (!enabled(level))
+    {
+        return;
+    }
+    LogRecord record;
+    record.time = std::chrono::system_clock::now();
+    record.level = level;
+    record.event = event;
+    record.user = user;
+    record.room = room;
+    record.socket = socket;
+    submit(record);
+}
+
+void Logger::chat(const std::string &user, const std::string &room, const std::string &message)
+{
+    if (!enabled(LogLevel::Info))
+    {
+        return;
+    }
+
+    LoggerState &logger = state();
+    if (logger.chatRate > 0)
+    {
+        // Fixed one-second windows shared by every thread; the reset may race,
+        // which only lets a few extra lines through
+        int64_t second = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+        int64_t window = logger.rateWindow.load(std::memory_order_relaxed);
+        if (window != second && logger.rateWindow.compare_exchange_strong(window, second, std::memory_order_relaxed))
+        {
+            logger.rateCount.store(0, std::memory_order_relaxed);
+        }
+        if (logger.rateCount.fetch_add(1, std::memory_order_relaxed) >= logger.chatRate)
+        {
+            logger.suppressed.fetch_add(1, std::memory_order_relaxed);
+            Metrics::add(Counter::LogLinesSuppressed);
+            return;
+        }
+    }
+
+    LogRecord record;
+    record.time = std::chrono::system_clock::now();
+    record.level = LogLevel::Info;
+    record.event = LogEvent::Chat;
+    record.user = user;
+    record.room = room;
+    record.text = message;
+    record.socket = -1;
+    submit(record);
+}
+
+bool Logger::parseLevel(const std::string &name, LogLevel &level)
+{
+    if (name == "debug")
+    {
+        level = LogLevel::Debug;
+    }
+    else if (name == "info")
+    {
+        level = LogLevel::Info;
+    }
+    else if (name == "warn")
+    {
+        level = LogLevel::Warn;
+    }
+    else if (name == "error")
+    {
+        level = LogLevel::Error;
+    }
+    else if (name == "off")
+    {
+        level = LogLevel::Off;
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
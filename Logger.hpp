@@ -0,0 +1,54 @@
+// Logger.hpp
+#pragma once
+#include <string>
+#include <cstdint>
+
+enum class LogLevel
+{
+    Debug,
+    Info,
+    Warn,
+    Error,
+    Off
+};
+
+// What a record describes; the background thread turns it into text
+enum class LogEvent
+{
+    Text,      // Free-form line in text
+    Connect,   // New connection on socket
+    Join,      // user finished the handshake
+    Leave,     // user disconnected
+    RoomJoin,  // user joined room
+    RoomLeave, // user left room
+    Chat,      // user said text in room
+    Direct     // user sent a private message to room (the recipient); its text is never logged
+};
+
+struct LogConfig
+{
+    LogLevel level = LogLevel::Info;
+    std::string file;         // Append here instead of printing to the console
+    unsigned chatRate = 100;  // Chat lines logged per second, the rest are counted; 0 = all
+};
+
+// Server log that never makes a handler wait. Callers build a small record
+// and push it onto a lock-free queue; one background thread formats whatever
+// accumulated and writes it with a single flush per batch. Chat lines are
+// rate limited, and when the writer falls far behind new records are
+// dropped rather than queued; both are counted and reported in the log.
+class Logger
+{
+public:
+    // Until start() is called records are written synchronously
+    static void start(const LogConfig &config);
+    // Writes out everything still queued
+    static void stop();
+
+    static bool enabled(LogLevel level);
+    static void text(LogLevel level, const std::string &line);
+    static void event(LogLevel level, LogEvent event, const std::string &user, const std::string &room = "", int64_t socket = -1);
+    static void chat(const std::string &user, const std::string &room, const std::string &message);
+
+    static bool parseLevel(const std::string &name, LogLevel &level);
+};
@@ -0,0 +1,29 @@
+// MessageBuffer.hpp
+#pragma once
+#include <memory>
+#include <string>
+#include <utility>
+
+struct EncodedFrame;
+
+// An encoded frame, built once and then shared read-only by every send queue
+// and history slot it is handed to. Fanning a message out copies this pointer,
+// never the bytes behind it.
+typedef std::shared_ptr<const EncodedFrame> MessageBuffer;
+
+// The frame's bytes, plus the same frame with a compressed body when one was
+// made. Both are built once per message; each send queue picks the variant
+// its client negotiated, so no recipient costs a compression of its own.
+struct EncodedFrame : std::string
+{
+    MessageBuffer compressed; // Null when compression is off or did not pay
+
+    explicit EncodedFrame(std::string bytes) : std::string(std::move(bytes)) {}
+};
+
+inline MessageBuffer makeMessageBuffer(std::string bytes, MessageBuffer compressed = MessageBuffer())
+{
+    std::shared_ptr<EncodedFrame> frame = std::make_shared<EncodedFrame>(std::move(bytes));
+    frame->compressed = std::move(compressed);
+    return frame;
+}
@@ -0,0 +1,903 @@
+#include "MessageLog.hpp"
+#include "ConsoleUtils.hpp"
+#include "Metrics.hpp"
+#include "Logger.hpp"
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+
+namespace
+{
+    const size_t RECORD_HEADER_SIZE = 8; // length + crc32
+    const size_t RECORD_FIXED_SIZE = 9;  // timestamp + room length
+    const uint32_t MAX_RECORD_SIZE = 16 * 1024 * 1024;
+    const size_t SEGMENT_NAME_DIGITS = 20;
+
+    const uint32_t INDEX_MAGIC = 0x58434C4C; // "LLCX" on disk
+    const uint32_t INDEX_VERSION = 1;
+    const size_t INDEX_SIZE = 40;
+
+    // How often the background thread applies retention while idle
+    const int RETENTION_CHECK_MS = 1000;
+
+    struct CrcTable
+    {
+        uint32_t entries[256];
+
+        CrcTable()
+        {
+            for (uint32_t i = 0; i < 256; ++i)
+            {
+                uint32_t crc = i;
+                for (int bit = 0; bit < 8; ++bit)
+                {
+                    crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+                }
+                entries[i] = crc;
+            }
+        }
+    };
+
+    uint32_t crc32(const char *data, size_t length)
+    {
+        static const CrcTable table;
+        uint32_t crc = 0xFFFFFFFF;
+        for (size_t i = 0; i < length; ++i)
+        {
+            crc = table.entries[(crc ^ static_cast<unsigned char>(data[i])) & 0xFF] ^ (crc >> 8);
+        }
+        return crc ^ 0xFFFFFFFF;
+    }
+
+    // Records and index files are little-endian
+    void putU32(std::string &out, uint32_t value)
+    {
+        for (int i = 0; i < 4; ++i)
+        {
+            out += static_cast<char>((value >> (8 * i)) & 0xFF);
+        }
+    }
+
+    void putU64(std::string &out, uint64_t value)
+    {
+        for (int i = 0; i < 8; ++i)
+        {
+            out += static_cast<char>((value >> (8 * i)) & 0xFF);
+        }
+    }
+
+    uint32_t getU32(const char *p)
+    {
+        uint32_t value = 0;
+        for (int i = 3; i >= 0; --i)
+        {
+            value = (value << 8) | static_cast<unsigned char>(p[i]);
+        }
+        return value;
+    }
+
+    uint64_t getU64(const char *p)
+    {
+        uint64_t value = 0;
+        for (int i = 7; i >= 0; --i)
+        {
+            value = (value << 8) | static_cast<unsigned char>(p[i]);
+        }
+        return value;
+    }
+
+    int64_t nowMs()
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    void appendRecord(std::string &out, const std::string &room, const std::string &frame, int64_t timestamp)
+    {
+        size_t roomLength = room.size() > 255 ? 255 : room.size();
+        std::string payload;
+        payload.reserve(RECORD_FIXED_SIZE + roomLength + frame.size());
+        putU64(payload, static_cast<uint64_t>(timestamp));
+        payload += static_cast<char>(roomLength);
+        payload.append(room, 0, roomLength);
+        payload += frame;
+
+        putU32(out, static_cast<uint32_t>(payload.size()));
+        putU32(out, crc32(payload.data(), payload.size()));
+        out += payload;
+    }
+
+    // Calls visit(offset, timestamp, room, roomLength, frame, frameLength) for
+    // every record from the start of data and returns the length of the valid
+    // prefix. The crc is only checked when recovering; a segment that has
+    // been recovered is trusted afterwards.
+    template <typename Visitor>
+    size_t forEachRecord(const char *data, size_t length, bool verify, Visitor visit)
+    {
+        size_t offset = 0;
+        while (length - offset >= RECORD_HEADER_SIZE + RECORD_FIXED_SIZE)
+        {
+            uint32_t recordLength = getU32(data + offset);
+            if (recordLength < RECORD_FIXED_SIZE || recordLength > MAX_RECORD_SIZE ||
+                length - offset - RECORD_HEADER_SIZE < recordLength)
+            {
+                break;
+            }
+            const char *payload = data + offset + RECORD_HEADER_SIZE;
+            if (verify && crc32(payload, recordLength) != getU32(data + offset + 4))
+            {
+                break;
+            }
+            size_t roomLength = static_cast<unsigned char>(payload[8]);
+            if (RECORD_FIXED_SIZE + roomLength > recordLength)
+            {
+                break;
+            }
+            visit(static_cast<uint64_t>(offset), static_cast<int64_t>(getU64(payload)), payload + RECORD_FIXED_SIZE, roomLength,
+                  payload + RECORD_FIXED_SIZE + roomLength, recordLength - RECORD_FIXED_SIZE - roomLength);
+            offset += RECORD_HEADER_SIZE + recordLength;
+        }
+        return offset;
+    }
+
+    // Frame of the record at the start of data, which is known to be valid
+    std::pair<const char *, size_t> recordFrame(const char *data)
+    {
+        uint32_t recordLength = getU32(data);
+        const char *payload = data + RECORD_HEADER_SIZE;
+        size_t roomLength = static_cast<unsigned char>(payload[8]);
+        return std::make_pair(payload + RECORD_FIXED_SIZE + roomLength, recordLength - RECORD_FIXED_SIZE - roomLength);
+    }
+}
+
+MessageLog::MessageLog()
+    : writingDone(0), activeFd(-1), nextSequence(0), stopping(false)
+{
+}
+
+MessageLog::~MessageLog()
+{
+    close();
+}
+
+#ifndef _WIN32
+
+MessageLog::Mapping::~Mapping()
+{
+    munmap(const_cast<char *>(data), length);
+}
+
+std::string MessageLog::segmentPath(uint64_t baseSequence, const char *extension) const
+{
+    char name[SEGMENT_NAME_DIGITS + 1];
+    snprintf(name, sizeof(name), "%020llu", static_cast<unsigned long long>(baseSequence));
+    return config.directory + "/" + name + extension;
+}
+
+bool MessageLog::open(const MessageLogConfig &logConfig)
+{
+    config = logConfig;
+    if (mkdir(config.directory.c_str(), 0755) != 0 && errno != EEXIST)
+    {
+        std::cerr << RED_COLOR "Cannot create message log directory " << config.directory << RESET_COLOR << std::endl;
+        return false;
+    }
+
+    DIR *dir = opendir(config.directory.c_str());
+    if (!dir)
+    {
+        std::cerr << RED_COLOR "Cannot read message log directory " << config.directory << RESET_COLOR << std::endl;
+        return false;
+    }
+    std::vector<uint64_t> bases;
+    while (dirent *entry = readdir(dir))
+    {
+        std::string name = entry->d_name;
+        if (name.size() == SEGMENT_NAME_DIGITS + 4 && name.compare(SEGMENT_NAME_DIGITS, 4, ".log") == 0 &&
+            std::all_of(name.begin(), name.begin() + SEGMENT_NAME_DIGITS, ::isdigit))
+        {
+            bases.push_back(std::strtoull(name.c_str(), nullptr, 10));
+        }
+    }
+    closedir(dir);
+    std::sort(bases.begin(), bases.end());
+
+    for (size_t i = 0; i < bases.size(); ++i)
+    {
+        Segment segment;
+        segment.baseSequence = bases[i];
+        std::string path = segmentPath(bases[i], ".log");
+        struct stat info;
+        if (stat(path.c_str(), &info) != 0)
+        {
+            continue;
+        }
+        uint64_t fileSize = static_cast<uint64_t>(info.st_size);
+        bool active = (i + 1 == bases.size());
+
+        // Sealed segments are described by their index; only the active one is read
+        if (!active && readIndex(segment, fileSize))
+        {
+            segments.push_back(segment);
+            continue;
+        }
+
+        uint64_t validBytes = 0;
+        RoomOffsets rooms;
+        if (!scanSegment(segment, fileSize, validBytes, rooms))
+        {
+            std::cerr << RED_COLOR "Cannot read message log segment " << path << RESET_COLOR << std::endl;
+            return false;
+        }
+        if (validBytes < fileSize)
+        {
+            // A crash mid-write leaves a partial record at the end
+            std::cout << YELLOW_COLOR "Message log: dropping " << (fileSize - validBytes) << " torn bytes from " << path << RESET_COLOR << std::endl;
+            if (truncate(path.c_str(), static_cast<off_t>(validBytes)) != 0)
+            {
+                return false;
+            }
+        }
+        if (active)
+        {
+            activeRooms.swap(rooms);
+        }
+        else
+        {
+            writeIndex(segment);
+            segment.rooms = std::make_shared<const RoomOffsets>(std::move(rooms));
+        }
+        segments.push_back(segment);
+    }
+
+    if (segments.empty())
+    {
+        if (!startSegment(0))
+        {
+            return false;
+        }
+    }
+    else
+    {
+        activeFd = ::open(segmentPath(segments.back().baseSequence, ".log").c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+        if (activeFd < 0)
+        {
+            std::cerr << RED_COLOR "Cannot open message log segment for writing" RESET_COLOR << std::endl;
+            return false;
+        }
+    }
+    nextSequence = segments.back().baseSequence + segments.back().records;
+    applyRetention();
+
+    std::cout << BLUE_COLOR "Message log: " << nextSequence - segments.front().baseSequence << " records in "
+              << segments.size() << " segment" << (segments.size() == 1 ? "" : "s") << " under " << config.directory
+              << RESET_COLOR << std::endl;
+
+    stopping = false;
+    flusher = std::thread(&MessageLog::flushLoop, this);
+    return true;
+}
+
+bool MessageLog::scanSegment(Segment &segment, uint64_t fileSize, uint64_t &validBytes, RoomOffsets &rooms)
+{
+    segment.records = 0;
+    segment.bytes = 0;
+    segment.firstTimestamp = 0;
+    segment.lastTimestamp = 0;
+    validBytes = 0;
+    if (fileSize == 0)
+    {
+        return true;
+    }
+
+    int fd = ::open(segmentPath(segment.baseSequence, ".log").c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return false;
+    }
+    void *data = mmap(nullptr, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED)
+    {
+        return false;
+    }
+    Mapping mapping(static_cast<const char *>(data), fileSize);
+    madvise(data, fileSize, MADV_SEQUENTIAL);
+
+    validBytes = forEachRecord(mapping.data, mapping.length, true,
+                               [&segment, &rooms](uint64_t offset, int64_t timestamp, const char *roomName, size_t roomLength,
+                                                  const char *, size_t)
+                               {
+                                   rooms[std::string(roomName, roomLength)].push_back(offset);
+                                   if (segment.records == 0)
+                                   {
+                                       segment.firstTimestamp = timestamp;
+                                   }
+                                   segment.lastTimestamp = timestamp;
+                                   ++segment.records;
+                               });
+    segment.bytes = validBytes;
+    return true;
+}
+
+bool MessageLog::readIndex(Segment &segment, uint64_t fileSize)
+{
+    FILE *file = fopen(segmentPath(segment.baseSequence, ".idx").c_str(), "rb");
+    if (!file)
+    {
+        return false;
+    }
+    char buffer[INDEX_SIZE];
+    bool complete = fread(buffer, 1, sizeof(buffer), file) == sizeof(buffer);
+    fclose(file);
+
+    // An index that does not match the segment file is rebuilt by a scan
+    if (!complete || getU32(buffer) != INDEX_MAGIC || getU32(buffer + 4) != INDEX_VERSION || getU64(buffer + 16) != fileSize)
+    {
+        return false;
+    }
+    segment.records = getU64(buffer + 8);
+    segment.bytes = fileSize;
+    segment.firstTimestamp = static_cast<int64_t>(getU64(buffer + 24));
+    segment.lastTimestamp = static_cast<int64_t>(getU64(buffer + 32));
+    return true;
+}
+
+void MessageLog::writeIndex(const Segment &segment)
+{
+    std::string index;
+    putU32(index, INDEX_MAGIC);
+    putU32(index, INDEX_VERSION);
+    putU64(index, segment.records);
+    putU64(index, segment.bytes);
+    putU64(index, static_cast<uint64_t>(segment.firstTimestamp));
+    putU64(index, static_cast<uint64_t>(segment.lastTimestamp));
+
+    // Written aside and renamed, so a crash never leaves a half-written index
+    std::string path = segmentPath(segment.baseSequence, ".idx");
+    std::string temporary = path + ".tmp";
+    FILE *file = fopen(temporary.c_str(), "wb");
+    if (!file)
+    {
+        return;
+    }
+    bool written = fwrite(index.data(), 1, index.size(), file) == index.size();
+    written = (fflush(file) == 0) && written && fdatasync(fileno(file)) == 0;
+    fclose(file);
+    if (!written || rename(temporary.c_str(), path.c_str()) != 0)
+    {
+        unlink(temporary.c_str());
+    }
+}
+
+bool MessageLog::startSegment(uint64_t baseSequence)
+{
+    int fd = ::open(segmentPath(baseSequence, ".log").c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        std::cerr << RED_COLOR "Cannot create message log segment in " << config.directory << RESET_COLOR << std::endl;
+        return false;
+    }
+    // The new file name itself must survive a crash
+    int dirFd = ::open(config.directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirFd >= 0)
+    {
+        fsync(dirFd);
+        ::close(dirFd);
+    }
+
+    Segment segment;
+    segment.baseSequence = baseSequence;
+    segment.records = 0;
+    segment.bytes = 0;
+    segment.firstTimestamp = 0;
+    segment.lastTimestamp = 0;
+    {
+        std::lock_guard<std::mutex> lock(segmentsLock);
+        segments.push_back(segment);
+    }
+    activeFd = fd;
+    return true;
+}
+
+void MessageLog::sealActive()
+{
+    ::close(activeFd);
+    activeFd = -1;
+    Segment sealed;
+    {
+        std::lock_guard<std::mutex> lock(segmentsLock);
+        segments.back().rooms = std::make_shared<const RoomOffsets>(std::move(activeRooms));
+        activeRooms.clear();
+        sealed = segments.back();
+    }
+    writeIndex(sealed);
+}
+
+void MessageLog::applyRetention()
+{
+    if (config.retainBytes == 0 && config.retainSeconds == 0)
+    {
+        return;
+    }
+
+    int64_t cutoff = nowMs() - static_cast<int64_t>(config.retainSeconds) * 1000;
+    std::vector<uint64_t> expired;
+    {
+        std::lock_guard<std::mutex> lock(segmentsLock);
+        uint64_t total = 0;
+        for (const Segment &segment : segments)
+        {
+            total += segment.bytes;
+        }
+        // The active segment is never deleted; readers still holding a mapping keep it valid
+        while (segments.size() > 1)
+        {
+            const Segment &oldest = segments.front();
+            bool tooBig = config.retainBytes > 0 && total > config.retainBytes;
+            bool tooOld = config.retainSeconds > 0 && oldest.lastTimestamp < cutoff;
+            if (!tooBig && !tooOld)
+            {
+                break;
+            }
+            total -= oldest.bytes;
+            expired.push_back(oldest.baseSequence);
+            segments.erase(segments.begin());
+        }
+    }
+    for (uint64_t base : expired)
+    {
+        unlink(segmentPath(base, ".log").c_str());
+        unlink(segmentPath(base, ".idx").c_str());
+    }
+}
+
+void MessageLog::flushLoop()
+{
+    std::chrono::steady_clock::time_point lastRetention = std::chrono::steady_clock::now();
+    std::unique_lock<std::mutex> lock(pendingLock);
+    while (true)
+    {
+        pendingReady.wait_for(lock, std::chrono::milliseconds(RETENTION_CHECK_MS), [this]()
+                              { return stopping || !pending.empty(); });
+        if (!pending.empty() && !stopping)
+        {
+            // Let the group fill up; everything that arrives meanwhile shares one sync
+            pendingReady.wait_for(lock, std::chrono::milliseconds(config.syncIntervalMs), [this]()
+                                  { return stopping; });
+        }
+
+        // Readers still find the group in writing until it is in a segment
+        writing.swap(pending);
+        {
+            std::lock_guard<std::mutex> segmentsGuard(segmentsLock);
+            writingDone = 0;
+        }
+        bool finished = stopping;
+        lock.unlock();
+
+        if (!writing.empty())
+        {
+            writeBatch(writing);
+        }
+        if (std::chrono::steady_clock::now() - lastRetention >= std::chrono::milliseconds(RETENTION_CHECK_MS))
+        {
+            applyRetention();
+            lastRetention = std::chrono::steady_clock::now();
+        }
+
+        lock.lock();
+        writing.clear();
+        if (finished && pending.empty())
+        {
+            break;
+        }
+    }
+}
+
+void MessageLog::writeBatch(const std::vector<PendingRecord> &batch)
+{
+    size_t next = 0;
+    while (next < batch.size() && activeFd >= 0)
+    {
+        uint64_t activeBytes;
+        uint64_t activeRecords;
+        {
+            std::lock_guard<std::mutex> lock(segmentsLock);
+            activeBytes = segments.back().bytes;
+            activeRecords = segments.back().records;
+        }
+
+        // Everything that still fits into the active segment goes out in one write
+        std::string chunk;
+        std::vector<uint64_t> offsets;
+        size_t first = next;
+        while (next < batch.size())
+        {
+            size_t before = chunk.size();
+            appendRecord(chunk, batch[next].room, *batch[next].frame, batch[next].timestamp);
+            bool empty = activeRecords == 0 && next == first;
+            if (!empty && activeBytes + chunk.size() > config.segmentBytes)
+            {
+                chunk.resize(before);
+                break;
+            }
+            offsets.push_back(activeBytes + before);
+            ++next;
+        }
+
+        std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+        size_t written = 0;
+        bool failed = false;
+        while (written < chunk.size())
+        {
+            ssize_t result = write(activeFd, chunk.data() + written, chunk.size() - written);
+            if (result < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (result <= 0)
+            {
+                failed = true;
+                break;
+            }
+            written += static_cast<size_t>(result);
+        }
+        if (failed || fdatasync(activeFd) != 0)
+        {
+            Logger::text(LogLevel::Error, "Message log write failed, " + std::to_string(batch.size() - first) + " messages not persisted");
+            discardTail(activeBytes);
+            break;
+        }
+        Metrics::observe(Histogram::LogSync,
+                         std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - started).count());
+        Metrics::add(Counter::LogRecordsWritten, next - first);
+        Metrics::add(Counter::LogBytesWritten, chunk.size());
+
+        uint64_t nextBase;
+        {
+            std::lock_guard<std::mutex> lock(segmentsLock);
+            Segment &active = segments.back();
+            if (active.records == 0)
+            {
+                active.firstTimestamp = batch[first].timestamp;
+            }
+            active.lastTimestamp = batch[next - 1].timestamp;
+            active.records += next - first;
+            active.bytes += chunk.size();
+            for (size_t i = first; i < next; ++i)
+            {
+                activeRooms[batch[i].room].push_back(offsets[i - first]);
+            }
+            writingDone = next;
+            nextBase = active.baseSequence + active.records;
+        }
+
+        if (next < batch.size())
+        {
+            sealActive();
+            if (startSegment(nextBase))
+            {
+                applyRetention();
+            }
+        }
+    }
+
+    // Whatever did not make it into a segment is lost
+    std::lock_guard<std::mutex> lock(segmentsLock);
+    writingDone = batch.size();
+}
+
+void MessageLog::discardTail(uint64_t validBytes)
+{
+    // Readers trust the active segment up to its recorded size, so whatever
+    // part of a failed write reached the file must go before the next append
+    if (ftruncate(activeFd, static_cast<off_t>(validBytes)) == 0)
+    {
+        return;
+    }
+
+    // Cannot cut it off: leave the torn tail for open() to drop and continue
+    // in a new segment. An empty one cannot be sealed, so the log stops.
+    uint64_t nextBase;
+    bool empty;
+    {
+        std::lock_guard<std::mutex> lock(segmentsLock);
+        nextBase = segments.back().baseSequence + segments.back().records;
+        empty = segments.back().records == 0;
+    }
+    if (empty)
+    {
+        ::close(activeFd);
+        activeFd = -1;
+        Logger::text(LogLevel::Error, "Message log segment cannot be repaired, no longer persisting messages");
+        return;
+    }
+    sealActive();
+    startSegment(nextBase);
+}
+
+std::shared_ptr<MessageLog::Mapping> MessageLog::mapSegment(const Segment &segment, bool active)
+{
+    if (!active && segment.mapping)
+    {
+        return segment.mapping;
+    }
+    if (segment.bytes == 0)
+    {
+        return std::shared_ptr<Mapping>();
+    }
+
+    int fd = ::open(segmentPath(segment.baseSequence, ".log").c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        // Deleted by retention since the caller looked
+        return std::shared_ptr<Mapping>();
+    }
+    void *data = mmap(nullptr, segment.bytes, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED)
+    {
+        return std::shared_ptr<Mapping>();
+    }
+    std::shared_ptr<Mapping> mapping(new Mapping(static_cast<const char *>(data), segment.bytes));
+
+    // Sealed segments never change, so their mapping is kept for later reads.
+    // The active one is remapped every time because it keeps growing.
+    if (!active)
+    {
+        std::lock_guard<std::mutex> lock(segmentsLock);
+        for (Segment &known : segments)
+        {
+            if (known.baseSequence == segment.baseSequence && !known.mapping)
+            {
+                known.mapping = mapping;
+                break;
+            }
+        }
+    }
+    return mapping;
+}
+
+std::shared_ptr<const MessageLog::RoomOffsets> MessageLog::indexSegment(const Segment &segment, const Mapping &mapping)
+{
+    if (segment.rooms)
+    {
+        return segment.rooms;
+    }
+    std::shared_ptr<RoomOffsets> rooms = std::make_shared<RoomOffsets>();
+    forEachRecord(mapping.data, mapping.length, false,
+                  [&rooms](uint64_t offset, int64_t, const char *roomName, size_t roomLength, const char *, size_t)
+                  {
+                      (*rooms)[std::string(roomName, roomLength)].push_back(offset);
+                  });
+
+    // Kept like the mapping, so every later read of the segment is a lookup
+    std::lock_guard<std::mutex> lock(segmentsLock);
+    for (Segment &known : segments)
+    {
+        if (known.baseSequence == segment.baseSequence && !known.rooms)
+        {
+            known.rooms = rooms;
+            break;
+        }
+    }
+    return rooms;
+}
+
+void MessageLog::close()
+{
+    {
+        std::lock_guard<std::mutex> lock(pendingLock);
+        if (!flusher.joinable())
+        {
+            return;
+        }
+        stopping = true;
+    }
+    pendingReady.notify_all();
+    flusher.join();
+
+    // The active segment stays unsealed; the next open() scans it
+    if (activeFd >= 0)
+    {
+        ::close(activeFd);
+        activeFd = -1;
+    }
+    std::lock_guard<std::mutex> lock(segmentsLock);
+    segments.clear();
+    activeRooms.clear();
+}
+
+uint64_t MessageLog::append(const std::string &room, const MessageBuffer &frame)
+{
+    PendingRecord record;
+    record.room = room;
+    record.frame = frame;
+    record.timestamp = nowMs();
+
+    bool wasEmpty;
+    uint64_t sequence;
+    {
+        std::lock_guard<std::mutex> lock(pendingLock);
+        wasEmpty = pending.empty();
+        pending.push_back(record);
+        sequence = nextSequence++;
+    }
+    // One wakeup per group, not per message
+    if (wasEmpty)
+    {
+        pendingReady.notify_one();
+    }
+    return sequence;
+}
+
+std::vector<MessageBuffer> MessageLog::recent(const std::string &room, size_t count)
+{
+    std::vector<MessageBuffer> result;
+    if (count == 0)
+    {
+        return result;
+    }
+
+    // Records not written yet are the newest; the active segment's offsets
+    // are copied along with the segment sizes they belong to, and sealed
+    // segments' indexes never change
+    std::vector<MessageBuffer> unwritten;
+    std::vector<Segment> snapshot;
+    std::vector<uint64_t> activeOffsets;
+    size_t needed = count;
+    {
+        std::lock_guard<std::mutex> pendingGuard(pendingLock);
+        std::lock_guard<std::mutex> lock(segmentsLock);
+        for (size_t i = writingDone; i < writing.size(); ++i)
+        {
+            if (writing[i].room == room)
+            {
+                unwritten.push_back(writing[i].frame);
+            }
+        }
+        for (const PendingRecord &record : pending)
+        {
+            if (record.room == room)
+            {
+                unwritten.push_back(record.frame);
+            }
+        }
+        if (unwritten.size() > count)
+        {
+            unwritten.erase(unwritten.begin(), unwritten.end() - count);
+        }
+        needed -= unwritten.size();
+
+        snapshot = segments;
+        auto it = activeRooms.find(room);
+        if (it != activeRooms.end())
+        {
+            size_t take = std::min(needed, it->second.size());
+            activeOffsets.assign(it->second.end() - take, it->second.end());
+        }
+    }
+
+    // Walk segments newest first until enough records are found; within a
+    // segment only the positions are collected, frames are copied at the end
+    typedef std::pair<const char *, size_t> FrameRef;
+    std::vector<std::vector<FrameRef>> found;
+    std::vector<std::shared_ptr<Mapping>> mappings;
+    for (size_t i = snapshot.size(); i-- > 0 && needed > 0;)
+    {
+        bool active = i + 1 == snapshot.size();
+        // Segments known to hold nothing of the room are not even mapped
+        if (active ? activeOffsets.empty() : (snapshot[i].rooms && snapshot[i].rooms->count(room) == 0))
+        {
+            continue;
+        }
+        std::shared_ptr<Mapping> mapping = mapSegment(snapshot[i], active);
+        if (!mapping)
+        {
+            continue;
+        }
+        std::shared_ptr<const RoomOffsets> rooms;
+        const std::vector<uint64_t> *offsets = &activeOffsets;
+        if (!active)
+        {
+            rooms = indexSegment(snapshot[i], *mapping);
+            auto it = rooms->find(room);
+            if (it == rooms->end())
+            {
+                continue;
+            }
+            offsets = &it->second;
+        }
+
+        size_t take = std::min(needed, offsets->size());
+        std::vector<FrameRef> matches;
+        matches.reserve(take);
+        for (size_t j = offsets->size() - take; j < offsets->size(); ++j)
+        {
+            matches.push_back(recordFrame(mapping->data + (*offsets)[j]));
+        }
+        needed -= take;
+        found.push_back(matches);
+        mappings.push_back(mapping);
+    }
+
+    result.reserve(count - needed);
+    for (size_t i = found.size(); i-- > 0;)
+    {
+        for (const FrameRef &frame : found[i])
+        {
+            result.push_back(makeMessageBuffer(std::string(frame.first, frame.second)));
+        }
+    }
+    result.insert(result.end(), unwritten.begin(), unwritten.end());
+    return result;
+}
+
+#else
+
+MessageLog::Mapping::~Mapping()
+{
+}
+
+bool MessageLog::open(const MessageLogConfig &logConfig)
+{
+    config = logConfig;
+    std::cerr << YELLOW_COLOR "The durable message log is not supported on Windows" RESET_COLOR << std::endl;
+    return false;
+}
+
+void MessageLog::close()
+{
+}
+
+uint64_t MessageLog::append(const std::string &, const MessageBuffer &)
+{
+    return nextSequence++;
+}
+
+std::vector<MessageBuffer> MessageLog::recent(const std::string &, size_t)
+{
+    return std::vector<MessageBuffer>();
+}
+
+#endif
+
+uint64_t MessageLog::recordCount()
+{
+    std::lock_guard<std::mutex> lock(segmentsLock);
+    uint64_t total = 0;
+    for (const Segment &segment : segments)
+    {
+        total += segment.records;
+    }
+    return total;
+}
+
+uint64_t MessageLog::diskBytes()
+{
+    std::lock_guard<std::mutex> lock(segmentsLock);
+    uint64_t total = 0;
+    for (const Segment &segment : segments)
+    {
+        total += segment.bytes;
+    }
+    return total;
+}
+
+size_t MessageLog::segmentCount()
+{
+    std::lock_guard<std::mutex> lock(segmentsLock);
+    return segments.size();
+}
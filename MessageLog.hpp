@@ -0,0 +1,117 @@
+// MessageLog.hpp
+#pragma once
+#include "MessageBuffer.hpp"
+#include <string>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <memory>
+#include <unordered_map>
+#include <cstdint>
+
+struct MessageLogConfig
+{
+    std::string directory;                  // Empty = no durable log
+    size_t segmentBytes = 64 * 1024 * 1024; // A segment is sealed and a new one started past this size
+    uint64_t retainBytes = 0;               // Oldest segments are deleted beyond this total, 0 = keep all
+    uint64_t retainSeconds = 0;             // Segments whose newest record is older are deleted, 0 = keep all
+    int syncIntervalMs = 20;                // Longest a record waits for its group to be written and fsynced
+};
+
+// Durable message history: a directory of append-only segment files named
+// after the sequence number of their first record. Every record is
+//
+//   [uint32 length][uint32 crc32][int64 unix ms][uint8 roomLength][room][frame]
+//
+// with length counting the bytes after the crc. append() only queues the
+// record; a background thread writes everything queued since its last pass
+// with one write() and one fdatasync(), so many messages share one sync.
+// Sealed segments get a small index file, so opening the log reads those
+// and scans only the active segment (truncating a torn tail after a crash).
+// Reads map the segment files instead of copying them into the heap, and
+// find a room's records through a per-segment index of record offsets by
+// room, built when the segment is first read.
+// POSIX only; open() reports failure on Windows.
+class MessageLog
+{
+private:
+    struct Mapping
+    {
+        const char *data;
+        size_t length;
+        Mapping(const char *start, size_t size) : data(start), length(size) {}
+        ~Mapping();
+    };
+
+    // Offsets of a segment's records, grouped by room, oldest first
+    typedef std::unordered_map<std::string, std::vector<uint64_t>> RoomOffsets;
+
+    struct Segment
+    {
+        uint64_t baseSequence;
+        uint64_t records;
+        uint64_t bytes;
+        int64_t firstTimestamp; // Unix ms of its first and last record, 0 when empty
+        int64_t lastTimestamp;
+        std::shared_ptr<Mapping> mapping; // Sealed segments only: mapped on first read, then reused
+        std::shared_ptr<const RoomOffsets> rooms; // Sealed segments only: indexed on first read, then reused
+    };
+
+    struct PendingRecord
+    {
+        std::string room;
+        MessageBuffer frame;
+        int64_t timestamp;
+    };
+
+    MessageLogConfig config;
+
+    std::mutex segmentsLock; // Guards segments; never held across disk I/O by readers
+    std::vector<Segment> segments; // Oldest first, back() is the active segment
+    RoomOffsets activeRooms;       // The active segment's records, grown by every write; under segmentsLock
+    size_t writingDone;            // Records of writing already in a segment or given up on; under segmentsLock
+    int activeFd;
+
+    std::mutex pendingLock;
+    std::condition_variable pendingReady;
+    std::vector<PendingRecord> pending;
+    std::vector<PendingRecord> writing; // The group being written; changed by the flusher under pendingLock
+    uint64_t nextSequence;
+    bool stopping;
+    std::thread flusher;
+
+    std::string segmentPath(uint64_t baseSequence, const char *extension) const;
+    bool scanSegment(Segment &segment, uint64_t fileSize, uint64_t &validBytes, RoomOffsets &rooms);
+    bool readIndex(Segment &segment, uint64_t fileSize);
+    void writeIndex(const Segment &segment);
+    bool startSegment(uint64_t baseSequence);
+    void sealActive();
+    void applyRetention();
+    void flushLoop();
+    void writeBatch(const std::vector<PendingRecord> &batch);
+    void discardTail(uint64_t validBytes);
+    std::shared_ptr<Mapping> mapSegment(const Segment &segment, bool active);
+    std::shared_ptr<const RoomOffsets> indexSegment(const Segment &segment, const Mapping &mapping);
+
+public:
+    MessageLog();
+    ~MessageLog();
+
+    // Recovers existing segments from logConfig.directory (created if missing)
+    bool open(const MessageLogConfig &logConfig);
+    // Writes out everything still queued and stops the background thread
+    void close();
+
+    // Thread-safe; returns the sequence number of the record. Durable at the
+    // latest syncIntervalMs later.
+    uint64_t append(const std::string &room, const MessageBuffer &frame);
+
+    // Up to count most recent frames of room, oldest first, including those
+    // appended but not yet written
+    std::vector<MessageBuffer> recent(const std::string &room, size_t count);
+
+    uint64_t recordCount();
+    uint64_t diskBytes();
+    size_t segmentCount();
+};
@@ -0,0 +1,208 @@
+#include "Metrics.hpp"
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <algorithm>
+
+namespace
+{
+    const size_t COUNTER_COUNT = static_cast<size_t>(Counter::Count);
+    const size_t HISTOGRAM_COUNT = static_cast<size_t>(Histogram::Count);
+
+    struct MetricInfo
+    {
+        const char *name;
+        const char *help;
+    };
+
+    const MetricInfo COUNTER_INFO[COUNTER_COUNT] = {
+        {"chat_connections_opened_total", "Client connections accepted"},
+        {"chat_connections_closed_total", "Client connections closed"},
+        {"chat_messages_in_total", "Frames received from clients"},
+        {"chat_messages_out_total", "Frames written to client sockets"},
+        {"chat_bytes_in_total", "Bytes received from clients"},
+        {"chat_bytes_out_total", "Bytes written to client sockets"},
+        {"chat_messages_dropped_total", "Queued messages discarded for slow clients"},
+        {"chat_slow_consumer_disconnects_total", "Clients disconnected for falling behind"},
+        {"chat_log_records_written_total", "Records written and synced to the message log"},
+        {"chat_log_bytes_written_total", "Bytes written to the message log"},
+        {"chat_server_log_suppressed_total", "Chat lines left out of the server log by its rate limit"},
+        {"chat_server_log_dropped_total", "Server log records dropped because the log writer fell behind"},
+        {"chat_socket_writes_total", "Write calls that handed queued output to client sockets"},
+        {"chat_flushes_deferred_total", "Flushes held back by the coalescing window to batch with later output"},
+        {"chat_compression_input_bytes_total", "Bytes of encoded frames offered to the compressor"},
+        {"chat_compression_output_bytes_total", "Bytes of the same frames after compression, or unchanged when it did not pay"},
+        {"chat_compression_skipped_total", "Frames left uncompressed because compression did not shrink them"},
+        {"chat_heartbeats_sent_total", "Pings sent to clients that had gone quiet"},
+        {"chat_idle_disconnects_total", "Connections closed because nothing arrived within the idle timeout"},
+        {"chat_handshake_timeouts_total", "Connections closed because they did not join within the handshake timeout"},
+        {"chat_federation_relayed_total", "Messages relayed to peer servers, counted once per peer link"},
+        {"chat_federation_received_total", "Messages relayed from peer servers"},
+        {"chat_federation_duplicates_total", "Relayed messages dropped because they had been seen already"},
+        {"chat_direct_messages_total", "Private messages delivered to a local client or handed to a peer server"},
+        {"chat_sessions_resumed_total", "Reconnected clients sent only the messages they missed"},
+        {"chat_resumed_messages_total", "Missed messages sent to reconnected clients"},
+        {"chat_frame_allocations_total", "Encoded frames allocated because the buffer pool had none free"},
+        {"chat_flood_delayed_total", "Client messages held back until they were within the flood limits"},
+        {"chat_flood_dropped_total", "Client messages discarded for being over the flood limits"},
+        {"chat_searches_total", "History searches answered"},
+    };
+
+    const MetricInfo HISTOGRAM_INFO[HISTOGRAM_COUNT] = {
+        {"chat_receive_to_broadcast_microseconds", "Time from parsing a chat frame until it is queued for every recipient"},
+        {"chat_log_sync_microseconds", "Time to write and fsync one group of message log records"},
+        {"chat_compression_microseconds", "Time to compress one message body"},
+        {"chat_search_microseconds", "Time to look up and merge the matches of one history search"},
+    };
+
+    // Bucket bounds of the exported histograms; the internal histogram is much finer
+    const uint64_t EXPORT_BOUNDS[] = {10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000};
+
+    struct Shard
+    {
+        std::atomic<uint64_t> counters[COUNTER_COUNT];
+        std::mutex histogramLock; // Only contended while a scrape copies the histograms
+        LatencyHistogram histograms[HISTOGRAM_COUNT];
+
+        Shard()
+        {
+            for (size_t i = 0; i < COUNTER_COUNT; ++i)
+            {
+                counters[i].store(0, std::memory_order_relaxed);
+            }
+        }
+    };
+
+    struct Registry
+    {
+        std::mutex lock;
+        std::vector<Shard *> live;
+        uint64_t retiredCounters[COUNTER_COUNT];
+        LatencyHistogram retiredHistograms[HISTOGRAM_COUNT];
+
+        Registry()
+        {
+            std::fill(retiredCounters, retiredCounters + COUNTER_COUNT, 0);
+        }
+    };
+
+    // Never destroyed: detached threads may still retire their shard during exit
+    Registry &registry()
+    {
+        static Registry *instance = new Registry();
+        return *instance;
+    }
+
+    // Registers the calling thread's shard on first use and folds it into the
+    // retired totals when the thread exits
+    struct ShardHandle
+    {
+        Shard *shard;
+
+        ShardHandle() : shard(new Shard())
+        {
+            Registry &reg = registry();
+            std::lock_guard<std::mutex> guard(reg.lock);
+            reg.live.push_back(shard);
+        }
+
+        ~ShardHandle()
+        {
+            Registry &reg = registry();
+            std::lock_guard<std::mutex> guard(reg.lock);
+            reg.live.erase(std::find(reg.live.begin(), reg.live.end(), shard));
+            for (size_t i = 0; i < COUNTER_COUNT; ++i)
+            {
+                reg.retiredCounters[i] += shard->counters[i].load(std::memory_order_relaxed);
+            }
+            for (size_t i = 0; i < HISTOGRAM_COUNT; ++i)
+            {
+                reg.retiredHistograms[i].merge(shard->histograms[i]);
+            }
+            delete shard;
+        }
+    };
+
+    Shard &localShard()
+    {
+        thread_local ShardHandle handle;
+        return *handle.shard;
+    }
+}
+
+void Metrics::add(Counter counter, uint64_t amount)
+{
+    // Only this thread writes the slot, so no read-modify-write instruction is needed
+    std::atomic<uint64_t> &slot = localShard().counters[static_cast<size_t>(counter)];
+    slot.store(slot.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+}
+
+void Metrics::observe(Histogram histogram, uint64_t value)
+{
+    Shard &shard = localShard();
+    std::lock_guard<std::mutex> guard(shard.histogramLock);
+    shard.histograms[static_cast<size_t>(histogram)].record(value);
+}
+
+uint64_t Metrics::read(Counter counter)
+{
+    size_t index = static_cast<size_t>(counter);
+    Registry &reg = registry();
+    std::lock_guard<std::mutex> guard(reg.lock);
+    uint64_t total = reg.retiredCounters[index];
+    for (Shard *shard : reg.live)
+    {
+        total += shard->counters[index].load(std::memory_order_relaxed);
+    }
+    return total;
+}
+
+LatencyHistogram Metrics::read(Histogram histogram)
+{
+    size_t index = static_cast<size_t>(histogram);
+    Registry &reg = registry();
+    std::lock_guard<std::mutex> guard(reg.lock);
+    LatencyHistogram total = reg.retiredHistograms[index];
+    for (Shard *shard : reg.live)
+    {
+        std::lock_guard<std::mutex> shardGuard(shard->histogramLock);
+        total.merge(shard->histograms[index]);
+    }
+    return total;
+}
+
+void Metrics::render(std::ostream &out)
+{
+    for (size_t i = 0; i < COUNTER_COUNT; ++i)
+    {
+        const MetricInfo &info = COUNTER_INFO[i];
+        out << "# HELP " << info.name << " " << info.help << "\n";
+        out << "# TYPE " << info.name << " counter\n";
+        out << info.name << " " << read(static_cast<Counter>(i)) << "\n";
+    }
+
+    for (size_t i = 0; i < HISTOGRAM_COUNT; ++i)
+    {
+        const MetricInfo &info = HISTOGRAM_INFO[i];
+        LatencyHistogram histogram = read(static_cast<Histogram>(i));
+        out << "# HELP " << info.name << " " << info.help << "\n";
+        out << "# TYPE " << info.name << " histogram\n";
+
+        // Cumulative counts; fine buckets straddling an exported bound count
+        // towards the next one, which is within the histogram's precision
+        uint64_t cumulative = 0;
+        size_t bucket = 0;
+        for (uint64_t bound : EXPORT_BOUNDS)
+        {
+            while (bucket < histogram.bucketCount() && LatencyHistogram::bucketUpperBound(bucket) <= bound)
+            {
+                cumulative += histogram.bucketSamples(bucket);
+                ++bucket;
+            }
+            out << info.name << "_bucket{le=\"" << bound << "\"} " << cumulative << "\n";
+        }
+        out << info.name << "_bucket{le=\"+Inf\"} " << histogram.count() << "\n";
+        out << info.name << "_sum " << histogram.sum() << "\n";
+        out << info.name << "_count " << histogram.count() << "\n";
+    }
+}
@@ -0,0 +1,69 @@
+// Metrics.hpp
+#pragma once
+#include "LatencyHistogram.hpp"
+#include <ostream>
+#include <cstdint>
+
+// Monotonic event counts, exported with a _total suffix
+enum class Counter
+{
+    ConnectionsOpened,
+    ConnectionsClosed,
+    MessagesIn,      // Frames received from clients
+    MessagesOut,     // Frames fully handed to the kernel
+    BytesIn,
+    BytesOut,
+    MessagesDropped, // Discarded by the DropOldest overflow policy
+    SlowConsumerDisconnects,
+    LogRecordsWritten, // Records made durable by the message log
+    LogBytesWritten,
+    LogLinesSuppressed, // Chat lines over the server log's rate limit
+    LogLinesDropped,    // Server log records discarded because the writer fell behind
+    SocketWrites,       // Write calls that handed queued output to the kernel
+    FlushesDeferred,    // Flushes held back to coalesce with later output
+    CompressionInputBytes,  // Encoded frames offered to the compressor
+    CompressionOutputBytes, // Their size afterwards; unchanged when compression did not pay
+    CompressionSkipped,     // Frames sent uncompressed because compressing did not shrink them
+    HeartbeatsSent,     // Pings sent to clients that had gone quiet
+    IdleDisconnects,    // Connections closed after the idle timeout
+    HandshakeTimeouts,  // Connections closed for not joining in time
+    FederationRelayed,   // Relays queued on peer links, once per link
+    FederationReceived,  // Relays received from peer servers
+    FederationDuplicates, // Of those, relays seen before and dropped
+    DirectMessages,      // Private messages delivered here or handed to a peer server
+    SessionsResumed,     // Joins that resumed after a reconnect instead of replaying history
+    MessagesResumed,     // Missed messages sent to those clients
+    FrameAllocations,    // Encoded frames the buffer pool could not recycle and allocated
+    FloodDelayed,        // Client messages held back for being over a flood limit
+    FloodDropped,        // Client messages discarded for being over a flood limit
+    Searches,            // History searches answered
+    Count
+};
+
+// Latency distributions, recorded in microseconds
+enum class Histogram
+{
+    ReceiveToBroadcast, // Chat frame parsed until it is queued for every recipient
+    LogSync,            // One group commit of the message log: write() plus fdatasync()
+    Compression,        // Compressing one message body
+    Search,             // Answering one history search, index lookups and merge
+    Count
+};
+
+// Process-wide instrumentation that is cheap enough to leave on. Every
+// thread that records gets its own shard of counters and histograms, so the
+// hot path is a plain load and store on memory no other thread writes; the
+// scraper sums the shards when it reads. Shards of exited threads are folded
+// into a retired total, so per-client threads do not accumulate.
+class Metrics
+{
+public:
+    static void add(Counter counter, uint64_t amount = 1);
+    static void observe(Histogram histogram, uint64_t value);
+
+    static uint64_t read(Counter counter);
+    static LatencyHistogram read(Histogram histogram);
+
+    // Writes every counter and histogram in the Prometheus text format
+    static void render(std::ostream &out);
+};
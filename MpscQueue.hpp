@@ -0,0 +1,61 @@
+// MpscQueue.hpp
+#pragma once
+#include <atomic>
+#include <utility>
+
+// Unbounded lock-free multi-producer/single-consumer queue (Vyukov's
+// intrusive design). Any thread may push(); only the owning thread may pop().
+// A push is one atomic exchange plus one store, and messages from the same
+// producer come out in the order they went in.
+template <typename T>
+class MpscQueue
+{
+private:
+    struct Node
+    {
+        std::atomic<Node *> next;
+        T value;
+
+        Node() : next(nullptr) {}
+        explicit Node(T item) : next(nullptr), value(std::move(item)) {}
+    };
+
+    std::atomic<Node *> head; // Most recently pushed node, shared by producers
+    Node *tail;               // Consumer-owned dummy whose successor is the oldest item
+
+public:
+    MpscQueue() : head(new Node()), tail(head.load()) {}
+
+    ~MpscQueue()
+    {
+        T discarded;
+        while (pop(discarded))
+        {
+        }
+        delete tail;
+    }
+
+    MpscQueue(const MpscQueue &) = delete;
+    MpscQueue &operator=(const MpscQueue &) = delete;
+
+    void push(T item)
+    {
+        Node *node = new Node(std::move(item));
+        Node *previous = head.exchange(node, std::memory_order_acq_rel);
+        previous->next.store(node, std::memory_order_release);
+    }
+
+    // Returns false when empty (or when a producer is midway through push())
+    bool pop(T &item)
+    {
+        Node *next = tail->next.load(std::memory_order_acquire);
+        if (next == nullptr)
+        {
+            return false;
+        }
+        item = std::move(next->value);
+        delete tail;
+        tail = next;
+        return true;
+    }
+};
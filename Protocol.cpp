@@ -0,0 +1,248 @@
+#include "Protocol.hpp"
+#include "Compression.hpp"
+
+namespace
+{
+    // Everything up to the body; bodyLength only goes into the length prefix
+    void appendHeader(std::string &out, FrameType type, const std::string &sender, const std::string &room, uint8_t flags, size_t bodyLength, uint64_t sequence)
+    {
+        size_t senderLength = sender.size() > 255 ? 255 : sender.size();
+        size_t roomLength = room.size() > 255 ? 255 : room.size();
+        uint32_t length = static_cast<uint32_t>(frameSize(sender, bodyLength, room, sequence) - FRAME_LENGTH_SIZE);
+
+        flags = static_cast<uint8_t>(flags & ~(FLAG_ROOM | FLAG_SEQUENCE));
+        if (!room.empty())
+        {
+            flags |= FLAG_ROOM;
+        }
+        if (sequence != 0)
+        {
+            flags |= FLAG_SEQUENCE;
+        }
+
+        out.reserve(out.size() + FRAME_LENGTH_SIZE + length);
+        out += static_cast<char>((length >> 24) & 0xFF);
+        out += static_cast<char>((length >> 16) & 0xFF);
+        out += static_cast<char>((length >> 8) & 0xFF);
+        out += static_cast<char>(length & 0xFF);
+        out += static_cast<char>(type);
+        out += static_cast<char>(flags);
+        out += static_cast<char>(senderLength);
+        out.append(sender, 0, senderLength);
+        if (!room.empty())
+        {
+            out += static_cast<char>(roomLength);
+            out.append(room, 0, roomLength);
+        }
+        for (int shift = 56; shift >= 0 && sequence != 0; shift -= 8)
+        {
+            out += static_cast<char>((sequence >> shift) & 0xFF);
+        }
+    }
+
+    uint64_t readSequence(const unsigned char *p)
+    {
+        uint64_t value = 0;
+        for (size_t i = 0; i < FRAME_SEQUENCE_SIZE; ++i)
+        {
+            value = (value << 8) | p[i];
+        }
+        return value;
+    }
+}
+
+size_t frameSize(const std::string &sender, size_t bodyLength, const std::string &room, uint64_t sequence)
+{
+    size_t senderLength = sender.size() > 255 ? 255 : sender.size();
+    size_t roomField = room.empty() ? 0 : 1 + (room.size() > 255 ? 255 : room.size());
+    size_t sequenceField = sequence == 0 ? 0 : FRAME_SEQUENCE_SIZE;
+    return FRAME_HEADER_SIZE + senderLength + roomField + sequenceField + bodyLength;
+}
+
+void appendFrame(std::string &out, FrameType type, const std::string &sender, const std::string &body, const std::string &room, uint8_t flags, uint64_t sequence)
+{
+    appendHeader(out, type, sender, room, flags, body.size(), sequence);
+    out += body;
+}
+
+bool appendCompressedFrame(std::string &out, FrameType type, const std::string &sender, const std::string &body, const std::string &room, uint64_t sequence)
+{
+    std::string packed;
+    if (!compressBody(body.data(), body.size(), packed))
+    {
+        return false;
+    }
+    appendHeader(out, type, sender, room, FLAG_COMPRESSED, packed.size(), sequence);
+    out += packed;
+    return true;
+}
+
+std::string encodeFrame(FrameType type, const std::string &sender, const std::string &body, const std::string &room, uint8_t flags, uint64_t sequence)
+{
+    std::string out;
+    appendFrame(out, type, sender, body, room, flags, sequence);
+    return out;
+}
+
+uint64_t frameSequence(const char *frame, size_t length)
+{
+    const unsigned char *p = reinterpret_cast<const unsigned char *>(frame);
+    if (length < FRAME_HEADER_SIZE || !(p[5] & FLAG_SEQUENCE))
+    {
+        return 0;
+    }
+    size_t offset = FRAME_HEADER_SIZE + p[6];
+    if ((p[5] & FLAG_ROOM) && offset < length)
+    {
+        offset += 1 + p[offset];
+    }
+    if (offset + FRAME_SEQUENCE_SIZE > length)
+    {
+        return 0;
+    }
+    return readSequence(p + offset);
+}
+
+std::string encodeResume(uint64_t lastSequence, const std::vector<std::string> &rooms)
+{
+    std::string body;
+    for (int shift = 56; shift >= 0; shift -= 8)
+    {
+        body += static_cast<char>((lastSequence >> shift) & 0xFF);
+    }
+    size_t count = rooms.size() > 255 ? 255 : rooms.size();
+    body += static_cast<char>(count);
+    for (size_t i = 0; i < count; ++i)
+    {
+        size_t roomLength = rooms[i].size() > 255 ? 255 : rooms[i].size();
+        body += static_cast<char>(roomLength);
+        body.append(rooms[i], 0, roomLength);
+    }
+    return body;
+}
+
+bool parseResume(const std::string &body, uint64_t &lastSequence, std::vector<std::string> &rooms)
+{
+    const unsigned char *p = reinterpret_cast<const unsigned char *>(body.data());
+    if (body.size() < FRAME_SEQUENCE_SIZE + 1)
+    {
+        return false;
+    }
+    lastSequence = readSequence(p);
+    size_t count = p[FRAME_SEQUENCE_SIZE];
+    size_t offset = FRAME_SEQUENCE_SIZE + 1;
+    rooms.clear();
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (offset >= body.size() || offset + 1 + p[offset] > body.size())
+        {
+            return false;
+        }
+        rooms.push_back(body.substr(offset + 1, p[offset]));
+        offset += 1 + p[offset];
+    }
+    return offset == body.size();
+}
+
+FrameParser::FrameParser() : readOffset(0), corrupt(false)
+{
+}
+
+void FrameParser::feed(const char *data, size_t length)
+{
+    // Compact lazily so a burst of small frames does not shift the buffer once per frame
+    if (readOffset > 0 && readOffset == buffer.size())
+    {
+        buffer.clear();
+        readOffset = 0;
+    }
+    else if (readOffset > 4096 && readOffset * 2 > buffer.size())
+    {
+        buffer.erase(0, readOffset);
+        readOffset = 0;
+    }
+    buffer.append(data, length);
+}
+
+bool FrameParser::next(Frame &frame)
+{
+    if (corrupt)
+    {
+        return false;
+    }
+
+    size_t available = buffer.size() - readOffset;
+    if (available < FRAME_LENGTH_SIZE)
+    {
+        return false;
+    }
+
+    const unsigned char *p = reinterpret_cast<const unsigned char *>(buffer.data() + readOffset);
+    uint32_t length = (static_cast<uint32_t>(p[0]) << 24) | (static_cast<uint32_t>(p[1]) << 16) |
+                      (static_cast<uint32_t>(p[2]) << 8) | static_cast<uint32_t>(p[3]);
+    if (length < FRAME_HEADER_SIZE - FRAME_LENGTH_SIZE || length > MAX_FRAME_SIZE)
+    {
+        corrupt = true;
+        return false;
+    }
+    if (available < FRAME_LENGTH_SIZE + length)
+    {
+        return false;
+    }
+
+    size_t senderLength = p[6];
+    if (FRAME_HEADER_SIZE - FRAME_LENGTH_SIZE + senderLength > length)
+    {
+        corrupt = true;
+        return false;
+    }
+
+    frame.type = static_cast<FrameType>(p[4]);
+    frame.flags = p[5];
+    frame.sender.assign(reinterpret_cast<const char *>(p) + FRAME_HEADER_SIZE, senderLength);
+
+    size_t bodyOffset = FRAME_HEADER_SIZE + senderLength;
+    frame.room.clear();
+    if (frame.flags & FLAG_ROOM)
+    {
+        if (bodyOffset + 1 > FRAME_LENGTH_SIZE + length || bodyOffset + 1 + p[bodyOffset] > FRAME_LENGTH_SIZE + length)
+        {
+            corrupt = true;
+            return false;
+        }
+        size_t roomLength = p[bodyOffset];
+        frame.room.assign(reinterpret_cast<const char *>(p) + bodyOffset + 1, roomLength);
+        bodyOffset += 1 + roomLength;
+    }
+    frame.sequence = 0;
+    if (frame.flags & FLAG_SEQUENCE)
+    {
+        if (bodyOffset + FRAME_SEQUENCE_SIZE > FRAME_LENGTH_SIZE + length)
+        {
+            corrupt = true;
+            return false;
+        }
+        frame.sequence = readSequence(p + bodyOffset);
+        bodyOffset += FRAME_SEQUENCE_SIZE;
+    }
+    const char *body = reinterpret_cast<const char *>(p) + bodyOffset;
+    size_t bodyLength = FRAME_LENGTH_SIZE + length - bodyOffset;
+    if (frame.flags & FLAG_COMPRESSED)
+    {
+        // A body never grows past what one uncompressed frame could carry
+        if (!decompressBody(body, bodyLength, MAX_FRAME_SIZE, scratch))
+        {
+            corrupt = true;
+            return false;
+        }
+        frame.body.swap(scratch);
+        frame.flags &= static_cast<uint8_t>(~FLAG_COMPRESSED);
+    }
+    else
+    {
+        frame.body.assign(body, bodyLength);
+    }
+
+    readOffset += FRAME_LENGTH_SIZE + length;
+    return true;
+}
@@ -0,0 +1,146 @@
+// Protocol.hpp
+#pragma once
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+// Wire format shared by ChatServer and ChatClient. Every frame is
+//
+//   [uint32 length][uint8 type][uint8 flags][uint8 senderLength][sender]
+//   [uint8 roomLength][room]   (only when flags has FLAG_ROOM)
+//   [uint64 sequence]          (only when flags has FLAG_SEQUENCE)
+//   [body]
+//
+// where length and sequence are big-endian and length counts every byte
+// after itself. Frames are
+// self-delimiting, so any number of them can share one recv() and a frame can
+// be split across several. A frame without a room belongs to DEFAULT_ROOM.
+//
+// Compression is negotiated in the handshake: a client that can read
+// compressed bodies sets FLAG_COMPRESSION on its Join, and a server that has
+// compression on answers with a System frame carrying the same flag. From
+// then on either side may send bodies of at least COMPRESS_MIN_BYTES with
+// FLAG_COMPRESSED (see Compression.hpp); the parser undoes it transparently.
+//
+// A taken username is answered with a System notice instead, whose sender is
+// the refused name, and the client may send another Join.
+//
+// Every message a server keeps in history (chat lines, join and leave
+// notices, room notices) carries a sequence number that grows across all
+// rooms and across restarts of that server. A client that reconnects puts
+// the highest one it saw and its rooms in the body of its Join (see
+// encodeResume()); the server puts it back in those rooms and sends just the
+// messages it missed, as one Batch, instead of the usual replay.
+//
+// A server pings clients that have gone quiet and closes connections that
+// send nothing at all, so clients answer every Ping with a Pong.
+//
+// Federated servers talk to each other in the same format on separate peer
+// links; clients never see the peer frame types.
+enum class FrameType : uint8_t
+{
+    Join = 1,   // client -> server: handshake, sender = requested username
+                // server -> client: sender joined the chat; the joining client gets
+                // its own Join too, after the replay, once the name is accepted
+    Leave = 2,  // client -> server: graceful goodbye
+                // server -> client: sender left the chat
+    Chat = 3,   // client -> server: body is the message text
+                // server -> client: sender said body
+    System = 4, // server -> client: informational notice in body
+    RoomJoin = 5,  // client -> server: subscribe to room (created on first use)
+                   // server -> client: sender joined room
+    RoomLeave = 6, // client -> server: unsubscribe from room
+                   // server -> client: sender left room
+    Batch = 7,     // server -> client: body is a run of complete frames (history replay),
+                   // sent compressed to clients that negotiated it
+    Ping = 8,      // either way: heartbeat, the receiver answers with Pong
+    Pong = 9,      // either way: answer to a Ping
+    PeerHello = 10, // server -> server: opens a peer link, sender = the server's node name
+    NodeState = 11, // server -> server: part of a server's flooded description, see Federation.hpp
+    Relay = 12,     // server -> server: a message from a client of another server
+    Direct = 13,    // client -> server: private message in body, sender = the recipient's name
+                    // server -> client: sender wrote body to this client alone; with FLAG_ECHO,
+                    // the client's own message went on to sender, the recipient. A message
+                    // that cannot be delivered is answered with a System notice instead
+    Who = 14,       // client -> server: asks who is online
+                    // server -> client: body has one joined username per line, followed by a
+                    // tab and the server's node name for users on peer servers; a long list
+                    // spans several Who frames
+    Search = 15     // client -> server: body is a query, words and from:NAME, all of which
+                    // must match; the server answers with a System notice and the newest
+                    // matching history messages of the client's rooms, newest first
+};
+
+// Bits of Frame::flags
+const uint8_t FLAG_ROOM = 0x01;        // A room name follows the sender
+const uint8_t FLAG_COMPRESSED = 0x02;  // Body is compressed; cleared by the parser once undone
+const uint8_t FLAG_COMPRESSION = 0x04; // Join: sender reads compressed bodies; System: server agrees
+const uint8_t FLAG_SEQUENCE = 0x08;    // A server sequence number follows the room
+const uint8_t FLAG_ECHO = 0x10;        // Direct: the receiver's own private message, delivered
+
+struct Frame
+{
+    FrameType type;
+    uint8_t flags;
+    std::string sender;
+    std::string room; // Empty for DEFAULT_ROOM
+    uint64_t sequence; // 0 when the frame has none
+    std::string body;
+};
+
+const size_t FRAME_LENGTH_SIZE = 4;
+const size_t FRAME_HEADER_SIZE = FRAME_LENGTH_SIZE + 3;
+const size_t FRAME_SEQUENCE_SIZE = 8;
+const size_t MAX_FRAME_SIZE = 64 * 1024;
+const size_t MAX_USERNAME_LENGTH = 32;
+const size_t MAX_ROOM_NAME_LENGTH = 32;
+const size_t MAX_MESSAGE_LENGTH = MAX_FRAME_SIZE - FRAME_HEADER_SIZE - 255 - 1 - MAX_ROOM_NAME_LENGTH - FRAME_SEQUENCE_SIZE;
+
+// Room every client is in after the handshake; frames for it carry no room name
+const char *const DEFAULT_ROOM = "lobby";
+
+// Bodies shorter than this are not worth compressing by default
+const size_t COMPRESS_MIN_BYTES = 512;
+
+// Serializes one frame; appendFrame() lets callers batch several into one buffer.
+// FLAG_ROOM is added automatically when room is not empty, FLAG_SEQUENCE when
+// sequence is not 0.
+std::string encodeFrame(FrameType type, const std::string &sender, const std::string &body, const std::string &room = "", uint8_t flags = 0, uint64_t sequence = 0);
+void appendFrame(std::string &out, FrameType type, const std::string &sender, const std::string &body, const std::string &room = "", uint8_t flags = 0, uint64_t sequence = 0);
+// Bytes the encoded frame takes, length prefix included
+size_t frameSize(const std::string &sender, size_t bodyLength, const std::string &room = "", uint64_t sequence = 0);
+// Same frame with a compressed body; returns false and leaves out untouched
+// when compression would not make it smaller
+bool appendCompressedFrame(std::string &out, FrameType type, const std::string &sender, const std::string &body, const std::string &room = "", uint64_t sequence = 0);
+
+// Sequence number of one complete encoded frame, 0 when it has none
+uint64_t frameSequence(const char *frame, size_t length);
+
+// Join body of a client resuming a session: the highest sequence number it
+// received and the rooms it was in besides DEFAULT_ROOM. parseResume() is
+// false for an empty or malformed body, which is a plain join.
+std::string encodeResume(uint64_t lastSequence, const std::vector<std::string> &rooms);
+bool parseResume(const std::string &body, uint64_t &lastSequence, std::vector<std::string> &rooms);
+
+// Incremental per-connection decoder: feed() whatever recv() returned, then
+// call next() until it reports no complete frame is left. Compressed bodies
+// come out decompressed; one that fails to decompress counts as corruption.
+class FrameParser
+{
+private:
+    std::string buffer;
+    size_t readOffset;
+    bool corrupt;
+    std::string scratch; // Decompression target, swapped into frame.body
+
+public:
+    FrameParser();
+    void feed(const char *data, size_t length);
+    bool next(Frame &frame);
+
+    // Set once a malformed or oversized frame is seen; the stream cannot be resynchronized
+    bool hasError() const { return corrupt; }
+    // Received bytes that do not make up a complete frame yet
+    std::string unparsed() const { return buffer.substr(readOffset); }
+};
@@ -0,0 +1,650 @@
+#include "Reactor.hpp"
+#include "ConsoleUtils.hpp"
+#include "Logger.hpp"
+#include "Metrics.hpp"
+#include <iostream>
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#endif
+
+namespace
+{
+    thread_local Reactor *currentReactor = nullptr;
+}
+
+Reactor::Reactor(ChatServer &owner, socket_t listeningSocket, bool closeListener, size_t index)
+    : server(owner), config(owner.config), listenSocket(listeningSocket), ownsListener(closeListener), wakeFd(-1),
+      timerFd(-1), timerArmed(false), timers(std::chrono::milliseconds(LIVENESS_TICK_MS)), wakePending(false),
+      shardIndex(index)
+{
+}
+
+Reactor *Reactor::current()
+{
+    return currentReactor;
+}
+
+Reactor::~Reactor()
+{
+    for (auto &entry : connections)
+    {
+        closeSocket(entry.first);
+    }
+#ifdef __linux__
+    if (wakeFd >= 0)
+    {
+        close(wakeFd);
+    }
+    if (timerFd >= 0)
+    {
+        close(timerFd);
+    }
+#endif
+    if (ownsListener)
+    {
+        closeSocket(listenSocket);
+    }
+}
+
+bool Reactor::openWakeFd()
+{
+#ifdef __linux__
+    wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    return wakeFd >= 0;
+#else
+    return false;
+#endif
+}
+
+bool Reactor::needsTimer() const
+{
+    return config.delivery.mode == DeliveryMode::Coalesce || server.livenessEnabled() ||
+           (server.flood.enabled() && server.flood.policy() == FloodPolicy::Delay);
+}
+
+bool Reactor::openTimer(bool nonBlocking)
+{
+#ifdef __linux__
+    timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | (nonBlocking ? TFD_NONBLOCK : 0));
+    return timerFd >= 0;
+#else
+    return false;
+#endif
+}
+
+void Reactor::armTimer(std::chrono::steady_clock::time_point deadline)
+{
+    // An earlier expiry already covers this deadline: the loop re-arms for the rest then
+    if (timerArmed && timerDeadline <= deadline)
+    {
+        return;
+    }
+#ifdef __linux__
+    int64_t wait = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline - std::chrono::steady_clock::now()).count();
+    itimerspec spec = {};
+    // A zero value would disarm the timer
+    wait = wait > 0 ? wait : 1;
+    spec.it_value.tv_sec = static_cast<time_t>(wait / 1000000000);
+    spec.it_value.tv_nsec = static_cast<long>(wait % 1000000000);
+    if (timerfd_settime(timerFd, 0, &spec, nullptr) == 0)
+    {
+        timerArmed = true;
+        timerDeadline = deadline;
+    }
+#endif
+}
+
+void Reactor::onTimer()
+{
+    timerArmed = false;
+}
+
+bool Reactor::isRunning() const
+{
+    return server.running && !server.handingOff;
+}
+
+bool Reactor::isHandingOff() const
+{
+    return server.handingOff;
+}
+
+void Reactor::enterLoop()
+{
+    currentReactor = this;
+}
+
+void Reactor::leaveLoop()
+{
+    currentReactor = nullptr;
+}
+
+void Reactor::stop()
+{
+#ifdef __linux__
+    uint64_t one = 1;
+    if (wakeFd >= 0 && write(wakeFd, &one, sizeof(one)) < 0)
+    {
+        Logger::text(LogLevel::Error, "Failed to wake event loop");
+    }
+#endif
+}
+
+void Reactor::addConnection(Connection *conn)
+{
+    connections[conn->socket].reset(conn);
+    setNoDelay(conn->socket);
+    server.clients.add(conn->socket, shardIndex, std::shared_ptr<SendQueue>());
+    Metrics::add(Counter::ConnectionsOpened);
+    Logger::event(LogLevel::Info, LogEvent::Connect, "", "", conn->socket);
+    if (server.livenessEnabled())
+    {
+        // Armed by the expireTimers() at the end of this loop iteration
+        std::chrono::steady_clock::time_point first = server.checkLiveness(conn->liveness, false);
+        if (first != std::chrono::steady_clock::time_point::max())
+        {
+            timers.schedule(conn->liveness, first);
+        }
+    }
+}
+
+void Reactor::adopt(const HandoffClient &client)
+{
+    Connection *conn = adoptConnection(client.socket);
+    if (conn == nullptr)
+    {
+        closeSocket(client.socket);
+        return;
+    }
+    // Queued first: it may end halfway through a frame the client is still reading
+    if (!client.unsentOutput.empty())
+    {
+        conn->outbound.push(makeMessageBuffer(client.unsentOutput));
+        markDirty(*conn);
+    }
+    addConnection(conn);
+    server.restoreSession(conn->socket, conn->session, client);
+    conn->parser.feed(client.unparsedInput.data(), client.unparsedInput.size());
+}
+
+void Reactor::exportConnections(std::vector<HandoffClient> &clients)
+{
+    // Every loop has stopped, so each lane is emptied in the order its sender
+    // posted: the ring first, then what waited behind it in the overflow.
+    // Not through drainInbox(), whose resendOverflow() would move this
+    // shard's own overflow into the rings of shards already exported.
+    InboxItem item;
+    for (const std::unique_ptr<Lane> &lane : lanes)
+    {
+        if (!lane)
+        {
+            continue;
+        }
+        while (lane->ring.pop(item))
+        {
+            dispatch(item);
+        }
+        while (!lane->overflow.empty())
+        {
+            dispatch(lane->overflow.front());
+            lane->overflow.pop_front();
+        }
+        lane->spilled.store(false);
+    }
+    while (inbox.pop(item))
+    {
+        dispatch(item);
+    }
+    for (auto &entry : connections)
+    {
+        Connection &conn = *entry.second;
+        clients.push_back(ChatServer::exportSession(conn.socket, conn.session, conn.parser, conn.outbound, conn.held ? &conn.frame : nullptr));
+    }
+}
+
+bool Reactor::handleInput(Connection &conn, const char *data, size_t length)
+{
+    Metrics::add(Counter::BytesIn, length);
+    conn.liveness.touch();
+    conn.parser.feed(data, length);
+    // A read already under way when the hold began only adds to the backlog
+    return conn.held || processInput(conn);
+}
+
+bool Reactor::processInput(Connection &conn)
+{
+    while (conn.parser.next(conn.frame))
+    {
+        if (!server.processFrame(conn.socket, conn.session, conn.frame))
+        {
+            return false;
+        }
+        if (conn.session.flood.heldUntil != 0)
+        {
+            // conn.frame stays as it is until the timer passes it on
+            timers.schedule(conn.hold, std::chrono::steady_clock::time_point(
+                std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::nanoseconds(conn.session.flood.heldUntil))));
+            if (!conn.held)
+            {
+                conn.held = true;
+                holdChanged(conn);
+            }
+            return true;
+        }
+    }
+    return !conn.parser.hasError();
+}
+
+void Reactor::releaseInput(Connection &conn)
+{
+    bool open = server.processFrame(conn.socket, conn.session, conn.frame);
+    if (open && conn.session.flood.heldUntil != 0)
+    {
+        timers.schedule(conn.hold, std::chrono::steady_clock::time_point(
+            std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::nanoseconds(conn.session.flood.heldUntil))));
+        return;
+    }
+    conn.held = false;
+    open = open && processInput(conn);
+    if (!open)
+    {
+        // Torn down where the backend notices the dead socket, as for a
+        // failed delivery, so no timer callback closes a connection itself
+        shutdownSocket(conn.socket);
+    }
+    if (!conn.held)
+    {
+        holdChanged(conn);
+    }
+}
+
+void Reactor::closeClient(socket_t clientSocket)
+{
+    auto it = connections.find(clientSocket);
+    if (it == connections.end())
+    {
+        return;
+    }
+    // Kept alive until it has been unsubscribed from its rooms
+    std::unique_ptr<Connection> conn(std::move(it->second));
+    connections.erase(it);
+    timers.cancel(conn->liveness);
+    timers.cancel(conn->hold);
+    server.clients.remove(clientSocket);
+    Metrics::add(Counter::ConnectionsClosed);
+
+    if (!conn->session.username.empty())
+    {
+        server.announceLeave(clientSocket, conn->session);
+    }
+    // Closing also drops the socket from an epoll interest list
+    closeSocket(clientSocket);
+}
+
+void Reactor::closeAll()
+{
+    for (auto &entry : connections)
+    {
+        timers.cancel(entry.second->liveness);
+        timers.cancel(entry.second->hold);
+        server.clients.remove(entry.first);
+        closeSocket(entry.first);
+    }
+    Metrics::add(Counter::ConnectionsClosed, connections.size());
+    connections.clear();
+    for (auto &entry : roomMembers)
+    {
+        for (size_t i = 0; i < entry.second.members.size(); ++i)
+        {
+            entry.second.room->removeShardMember(shardIndex);
+        }
+    }
+    roomMembers.clear();
+}
+
+void Reactor::markDirty(Connection &conn)
+{
+    // While the backend has a write scheduled, its completion flushes the rest
+    if (!conn.dirty && !conn.wantWrite)
+    {
+        conn.dirty = true;
+        dirtySockets.push_back(conn.socket);
+    }
+}
+
+void Reactor::flushDirty()
+{
+    const DeliveryPolicy &delivery = config.delivery;
+    std::chrono::steady_clock::time_point now;
+    std::chrono::steady_clock::time_point earliest;
+    if (delivery.mode == DeliveryMode::Coalesce)
+    {
+        now = std::chrono::steady_clock::now();
+    }
+
+    for (socket_t clientSocket : dirtySockets)
+    {
+        auto it = connections.find(clientSocket);
+        if (it == connections.end() || !it->second->dirty)
+        {
+            continue;
+        }
+        Connection &conn = *it->second;
+        std::chrono::steady_clock::time_point deadline;
+        if (delivery.mode == DeliveryMode::LowLatency || conn.outbound.flushDue(delivery, now, deadline))
+        {
+            conn.dirty = false;
+            writeToClient(conn);
+            continue;
+        }
+
+        // Stays dirty, so later output joins it without another entry
+        if (deferredSockets.empty() || deadline < earliest)
+        {
+            earliest = deadline;
+        }
+        deferredSockets.push_back(clientSocket);
+        Metrics::add(Counter::FlushesDeferred);
+    }
+
+    dirtySockets.swap(deferredSockets);
+    deferredSockets.clear();
+    if (!dirtySockets.empty())
+    {
+        armTimer(earliest);
+    }
+}
+
+void Reactor::expireTimers()
+{
+    if (timers.empty())
+    {
+        return;
+    }
+    timers.advance(std::chrono::steady_clock::now(), [this](TimerWheel::Timer &timer)
+                   {
+                       auto it = connections.find(static_cast<socket_t>(timer.key));
+                       if (it == connections.end())
+                       {
+                           return;
+                       }
+                       Connection &conn = *it->second;
+                       if (&timer == &conn.hold)
+                       {
+                           releaseInput(conn);
+                           return;
+                       }
+                       // Pings only queue output; the flushDirty() after this sends them
+                       std::chrono::steady_clock::time_point next = server.checkLiveness(conn.liveness, !conn.session.username.empty());
+                       if (next != std::chrono::steady_clock::time_point::max())
+                       {
+                           timers.schedule(conn.liveness, next);
+                       } });
+    if (!timers.empty())
+    {
+        armTimer(timers.nextWakeup());
+    }
+}
+
+void Reactor::deliver(Connection &conn, const MessageBuffer &message)
+{
+    if (conn.outbound.push(message))
+    {
+        markDirty(conn);
+    }
+    else
+    {
+        // Slow consumer under the Disconnect policy; the backend notices
+        // the dead socket on its next read and cleans up there, so a
+        // broadcast never tears down connections it is iterating over
+        shutdownSocket(conn.socket);
+    }
+}
+
+void Reactor::broadcast(const MessageBuffer &message, socket_t sender, uint64_t room)
+{
+    if (room != 0)
+    {
+        auto members = roomMembers.find(room);
+        if (members == roomMembers.end())
+        {
+            return;
+        }
+        for (Connection *conn : members->second.members)
+        {
+            if (conn->socket != sender)
+            {
+                deliver(*conn, message);
+            }
+        }
+        return;
+    }
+
+    for (auto &entry : connections)
+    {
+        if (entry.first != sender)
+        {
+            deliver(*entry.second, message);
+        }
+    }
+}
+
+void Reactor::subscribe(socket_t clientSocket, const std::shared_ptr<Room> &room)
+{
+    auto it = connections.find(clientSocket);
+    if (it == connections.end())
+    {
+        return;
+    }
+    RoomMembers &entry = roomMembers[room->id()];
+    entry.room = room;
+    entry.members.push_back(it->second.get());
+    room->addShardMember(shardIndex);
+}
+
+void Reactor::enableCompression(socket_t clientSocket)
+{
+    auto it = connections.find(clientSocket);
+    if (it != connections.end())
+    {
+        it->second->outbound.enableCompression();
+    }
+}
+
+void Reactor::unsubscribe(socket_t clientSocket, const Room &room)
+{
+    auto members = roomMembers.find(room.id());
+    if (members == roomMembers.end())
+    {
+        return;
+    }
+    std::vector<Connection *> &list = members->second.members;
+    for (size_t i = 0; i < list.size(); ++i)
+    {
+        if (list[i]->socket == clientSocket)
+        {
+            // Order within a room does not matter
+            list[i] = list.back();
+            list.pop_back();
+            members->second.room->removeShardMember(shardIndex);
+            break;
+        }
+    }
+    if (list.empty())
+    {
+        roomMembers.erase(members);
+    }
+}
+
+void Reactor::connectShards(size_t shardCount)
+{
+    lanes.resize(shardCount);
+    for (size_t i = 0; i < shardCount; ++i)
+    {
+        if (i != shardIndex)
+        {
+            lanes[i].reset(new Lane());
+        }
+    }
+}
+
+void Reactor::post(const MessageBuffer &message, socket_t sender, uint64_t room)
+{
+    InboxItem item;
+    item.message = message;
+    item.sender = sender;
+    item.room = room;
+    if (!postFromShard(item))
+    {
+        inbox.push(item);
+    }
+    wake();
+}
+
+void Reactor::post(const std::function<void()> &task)
+{
+    InboxItem item;
+    item.sender = SOCKET_ERROR_VAL;
+    item.room = 0;
+    item.task = task;
+    // Through the same lane as the sending shard's broadcasts, so they keep their order
+    if (!postFromShard(item))
+    {
+        inbox.push(item);
+    }
+    wake();
+}
+
+bool Reactor::postFromShard(InboxItem &item)
+{
+    Reactor *sender = current();
+    if (!sender || sender == this || sender->shardIndex >= lanes.size() || !lanes[sender->shardIndex])
+    {
+        return false;
+    }
+    Lane &lane = *lanes[sender->shardIndex];
+    // Never ahead of posts that are already waiting
+    if (!lane.overflow.empty() || !lane.ring.push(item))
+    {
+        lane.overflow.push_back(std::move(item));
+        // The sender's resendOverflow() at the end of this loop iteration, or
+        // this shard's next drain, picks them up
+        lane.spilled.store(true);
+    }
+    return true;
+}
+
+void Reactor::resendOverflow()
+{
+    for (const std::unique_ptr<Reactor> &shard : server.reactors)
+    {
+        if (shard.get() == this || shardIndex >= shard->lanes.size() || !shard->lanes[shardIndex])
+        {
+            continue;
+        }
+        Lane &lane = *shard->lanes[shardIndex];
+        if (lane.overflow.empty())
+        {
+            continue;
+        }
+        while (!lane.overflow.empty() && lane.ring.push(lane.overflow.front()))
+        {
+            lane.overflow.pop_front();
+        }
+        if (!lane.overflow.empty())
+        {
+            lane.spilled.store(true);
+        }
+        shard->wake();
+    }
+}
+
+void Reactor::wake()
+{
+#ifdef __linux__
+    // One eventfd write per wakeup, not per message
+    if (!wakePending.exchange(true))
+    {
+        uint64_t one = 1;
+        if (write(wakeFd, &one, sizeof(one)) < 0)
+        {
+            Logger::text(LogLevel::Error, "Failed to wake event loop");
+        }
+    }
+#endif
+}
+
+void Reactor::drainInbox()
+{
+    wakePending.store(false);
+    InboxItem item;
+    for (size_t i = 0; i < lanes.size(); ++i)
+    {
+        if (!lanes[i])
+        {
+            continue;
+        }
+        while (lanes[i]->ring.pop(item))
+        {
+            dispatch(item);
+        }
+        // That shard held posts back while the ring was full; there is room now
+        if (lanes[i]->spilled.exchange(false))
+        {
+            server.reactors[i]->wake();
+        }
+    }
+    while (inbox.pop(item))
+    {
+        dispatch(item);
+    }
+    resendOverflow();
+}
+
+void Reactor::dispatch(InboxItem &item)
+{
+    if (item.task)
+    {
+        item.task();
+    }
+    else
+    {
+        broadcast(item.message, item.sender, item.room);
+    }
+}
+
+std::vector<ClientQueueStat> Reactor::queueStats() const
+{
+    std::vector<ClientQueueStat> stats;
+    stats.reserve(connections.size());
+    for (const auto &entry : connections)
+    {
+        ClientQueueStat stat;
+        stat.socket = entry.first;
+        stat.username = entry.second->session.username;
+        stat.queuedBytes = entry.second->outbound.pendingBytes();
+        stats.push_back(stat);
+    }
+    return stats;
+}
+
+void Reactor::sendTo(socket_t clientSocket, const std::vector<MessageBuffer> &batch)
+{
+    auto it = connections.find(clientSocket);
+    if (it == connections.end())
+    {
+        return;
+    }
+
+    Connection &conn = *it->second;
+    if (conn.outbound.push(batch))
+    {
+        markDirty(conn);
+    }
+    else
+    {
+        shutdownSocket(conn.socket);
+    }
+}
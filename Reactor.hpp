@@ -0,0 +1,185 @@
+// Reactor.hpp
+#pragma once
+#include "ChatServer.hpp"
+#include "MpscQueue.hpp"
+#include "SpscRing.hpp"
+#include <string>
+#include <deque>
+#include <vector>
+#include <unordered_map>
+#include <functional>
+#include <chrono>
+
+// Event-driven connection handling: one loop multiplexes a listening socket
+// and every client socket it accepted. In sharded mode several reactors run
+// side by side, each on its own thread with its own SO_REUSEPORT listener and
+// clients; broadcasts reach other shards through lock-free queues.
+//
+// This base class owns the per-connection state, the inbox and the fan-out
+// logic. The I/O itself comes from a backend subclass (EpollReactor or
+// UringReactor). Only available on Linux; open() reports failure elsewhere so
+// the server can fall back to the threaded path.
+class Reactor
+{
+protected:
+    struct Connection
+    {
+        socket_t socket;
+        ClientSession session;
+        FrameParser parser;
+        Frame frame; // Reused for every frame parsed, so its strings keep their capacity
+        SendQueue outbound;
+        bool wantWrite; // A write is already scheduled by the backend (EPOLLOUT armed, send in flight)
+        bool dirty;     // Queued output not yet flushed this loop iteration
+        Liveness liveness; // Heartbeat and timeout timer, on the reactor's wheel
+        // Flood control holds frame back: nothing more is parsed, and the
+        // backend reads nothing more, until the hold timer lets it go
+        bool held;
+        bool readPaused; // Backend state: reading has stopped for the hold
+        TimerWheel::Timer hold;
+
+        Connection(socket_t clientSocket, size_t queueLimit, OverflowPolicy policy)
+            : socket(clientSocket), outbound(clientSocket, queueLimit, policy), wantWrite(false), dirty(false),
+              liveness(clientSocket), held(false), readPaused(false)
+        {
+            hold.key = clientSocket;
+        }
+        virtual ~Connection() {}
+    };
+
+    // Broadcast handed over from another shard, or a task to run on the loop thread
+    struct InboxItem
+    {
+        MessageBuffer message;
+        socket_t sender;
+        uint64_t room; // Room::id(), 0 for a broadcast to every client
+        std::function<void()> task;
+    };
+
+    // Posts from one other shard's loop thread. A ring per sending shard lets
+    // cross-shard fan-out reuse its slots rather than allocate a queue node
+    // per message. What a full ring cannot take waits in overflow, in order,
+    // until the sender's loop moves it over.
+    struct Lane
+    {
+        SpscRing<InboxItem> ring;
+        std::deque<InboxItem> overflow; // Sending shard's loop thread only
+        std::atomic<bool> spilled;      // overflow has items; the receiver wakes the sender once it made room
+
+        Lane() : ring(LANE_CAPACITY), spilled(false) {}
+    };
+    static const size_t LANE_CAPACITY = 1024;
+
+    ChatServer &server;
+    const ServerConfig &config;
+    socket_t listenSocket;
+    bool ownsListener;
+    int wakeFd;
+    int timerFd; // timerfd that wakes the loop for deferred output and liveness timers
+    bool timerArmed;
+    std::chrono::steady_clock::time_point timerDeadline;
+    TimerWheel timers; // Liveness of this shard's connections
+    MpscQueue<InboxItem> inbox; // Posts from threads other than the shards' loops
+    std::vector<std::unique_ptr<Lane>> lanes; // Indexed by sending shard; empty unless sharded
+    std::atomic<bool> wakePending; // Set by the first post() since the loop last drained the inbox
+    std::unordered_map<socket_t, std::unique_ptr<Connection>> connections;
+    std::vector<socket_t> dirtySockets;
+    std::vector<socket_t> deferredSockets; // Coalesce mode: dirty, but still inside their window
+    size_t shardIndex;
+    // This shard's members of a room, which the entry keeps alive
+    struct RoomMembers
+    {
+        std::shared_ptr<Room> room;
+        std::vector<Connection *> members;
+    };
+    // By Room::id(), so a post for a room dropped meanwhile finds nothing
+    // rather than another room at the same address; loop thread only
+    std::unordered_map<uint64_t, RoomMembers> roomMembers;
+
+    // Backend hook: start writing conn's queued output
+    virtual void writeToClient(Connection &conn) = 0;
+    // Backend hook: conn.held changed; stop reading from the socket while it
+    // is set, start again once it is cleared
+    virtual void holdChanged(Connection &conn) = 0;
+    // Backend hook: wraps a socket inherited from a previous server process
+    // for addConnection(); nullptr when it cannot be watched
+    virtual Connection *adoptConnection(socket_t clientSocket) = 0;
+
+    bool openWakeFd();
+    // Whether the loop needs its timer at all: Coalesce delivery or liveness checks
+    bool needsTimer() const;
+    // Blocking for backends that read it asynchronously, non-blocking for readiness backends
+    bool openTimer(bool nonBlocking);
+    void armTimer(std::chrono::steady_clock::time_point deadline);
+    // Backend hook: the timer expired; the next flushDirty() and expireTimers() recheck
+    void onTimer();
+    void wake();
+    // False for a shutdown and for a handoff; only the first closes the connections
+    bool isRunning() const;
+    bool isHandingOff() const;
+    void enterLoop();
+    void leaveLoop();
+    void addConnection(Connection *conn);
+
+    // Feeds received bytes through the frame parser and into the server.
+    // Returns false when the connection should be closed.
+    bool handleInput(Connection &conn, const char *data, size_t length);
+    // Runs the parsed frames through the server until flood control holds one back
+    bool processInput(Connection &conn);
+    // The hold timer fired: the held frame goes out, then the input after it
+    void releaseInput(Connection &conn);
+    void closeClient(socket_t clientSocket);
+    void closeAll();
+    void markDirty(Connection &conn);
+    void deliver(Connection &conn, const MessageBuffer &message);
+    // Writes the output queued since the last call; in Coalesce mode output
+    // that is neither old nor large enough waits for a later call
+    void flushDirty();
+    // Runs the liveness checks that are due and re-arms the timer for the next
+    void expireTimers();
+    void drainInbox();
+    void dispatch(InboxItem &item);
+    // Loop thread of another shard: queues item on this shard's lane for it
+    bool postFromShard(InboxItem &item);
+    // Loop thread: moves posts that other shards' full lanes held back
+    void resendOverflow();
+
+public:
+    Reactor(ChatServer &owner, socket_t listeningSocket, bool closeListener, size_t index);
+    virtual ~Reactor();
+    virtual bool open() = 0;
+    virtual void run() = 0;
+    void stop();
+    // Before any loop runs, in sharded mode: one lane for each other shard
+    void connectShards(size_t shardCount);
+
+    // Must be called from the loop thread (i.e. from inside a ChatServer callback).
+    // They only enqueue; sockets are written once the current batch of events is handled.
+    // Room 0 reaches every client of this shard, any other Room::id() its members.
+    void broadcast(const MessageBuffer &message, socket_t sender, uint64_t room = 0);
+    void sendTo(socket_t clientSocket, const std::vector<MessageBuffer> &batch);
+    void subscribe(socket_t clientSocket, const std::shared_ptr<Room> &room);
+    void enableCompression(socket_t clientSocket);
+    void unsubscribe(socket_t clientSocket, const Room &room);
+
+    // Safe from any thread: queues a broadcast for this shard's clients and wakes its loop
+    void post(const MessageBuffer &message, socket_t sender, uint64_t room = 0);
+    // Safe from any thread: runs task on the loop thread at its next wakeup
+    void post(const std::function<void()> &task);
+
+    // Loop thread only: outbound queue depth of every connection
+    std::vector<ClientQueueStat> queueStats() const;
+
+    // Handoff, loop thread only: takes over a client of the previous server
+    // process, in the rooms it was in and with its unsent output queued
+    virtual void adopt(const HandoffClient &client);
+    // Handoff, with the loop stopped: describes every connection, after
+    // delivering whatever other shards posted before they stopped
+    void exportConnections(std::vector<HandoffClient> &clients);
+    socket_t listener() const { return listenSocket; }
+
+    size_t index() const { return shardIndex; }
+
+    // Reactor whose loop is running on the calling thread, nullptr elsewhere
+    static Reactor *current();
+};
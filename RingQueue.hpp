@@ -0,0 +1,111 @@
+// RingQueue.hpp
+#pragma once
+#include <vector>
+#include <utility>
+#include <cstddef>
+
+// FIFO queue over one array that grows by doubling and never shrinks, so a
+// queue that keeps filling and draining reuses the same slots instead of
+// allocating and freeing a block every few dozen entries the way std::deque
+// does. Not thread-safe. Popped slots are reset to T() so they release
+// whatever they referenced.
+template <typename T>
+class RingQueue
+{
+private:
+    std::vector<T> slots; // Capacity is always zero or a power of two
+    size_t head;          // Index of the oldest entry
+    size_t count;
+
+    size_t slot(size_t index) const { return (head + index) & (slots.size() - 1); }
+
+    void grow()
+    {
+        std::vector<T> larger(slots.empty() ? 16 : slots.size() * 2);
+        for (size_t i = 0; i < count; ++i)
+        {
+            larger[i] = std::move(slots[slot(i)]);
+        }
+        slots.swap(larger);
+        head = 0;
+    }
+
+public:
+    RingQueue() : head(0), count(0) {}
+
+    bool empty() const { return count == 0; }
+    size_t size() const { return count; }
+
+    // index 0 is the oldest entry
+    T &operator[](size_t index) { return slots[slot(index)]; }
+    const T &operator[](size_t index) const { return slots[slot(index)]; }
+    T &front() { return slots[head]; }
+    T &back() { return slots[slot(count - 1)]; }
+
+    void push_back(T item)
+    {
+        if (count == slots.size())
+        {
+            grow();
+        }
+        slots[slot(count)] = std::move(item);
+        ++count;
+    }
+
+    void push_front(T item)
+    {
+        if (count == slots.size())
+        {
+            grow();
+        }
+        head = (head + slots.size() - 1) & (slots.size() - 1);
+        slots[head] = std::move(item);
+        ++count;
+    }
+
+    void pop_front()
+    {
+        slots[head] = T();
+        head = slot(1);
+        --count;
+    }
+
+    // Removes entries index..index+n-1. Whichever side of them is shorter
+    // moves to close the gap, so dropping a run just behind the front costs
+    // the entries in front of it plus the run, not the whole queue.
+    void erase(size_t index, size_t n = 1)
+    {
+        if (index < count - index - n)
+        {
+            for (size_t i = index; i > 0; --i)
+            {
+                slots[slot(i - 1 + n)] = std::move(slots[slot(i - 1)]);
+            }
+            for (size_t i = 0; i < n; ++i)
+            {
+                slots[slot(i)] = T();
+            }
+            head = slot(n);
+        }
+        else
+        {
+            for (size_t i = index; i + n < count; ++i)
+            {
+                slots[slot(i)] = std::move(slots[slot(i + n)]);
+            }
+            for (size_t i = count - n; i < count; ++i)
+            {
+                slots[slot(i)] = T();
+            }
+        }
+        count -= n;
+    }
+
+    void clear()
+    {
+        while (count > 0)
+        {
+            pop_front();
+        }
+    }
+};
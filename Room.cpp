@@ -0,0 +1,167 @@
+#include "Room.hpp"
+#include "Protocol.hpp"
+#include <algorithm>
+#include <cctype>
+
+namespace
+{
+    std::atomic<uint64_t> nextRoomId(1);
+}
+
+Room::Room(const std::string &name, size_t historyDepth, size_t shards)
+    : roomId(nextRoomId.fetch_add(1)), roomName(name), roomHistory(historyDepth), subscribers(std::make_shared<const Subscribers>()),
+      shardCount(shards > 0 ? shards : 1), shardMembers(new std::atomic<uint32_t>[shardCount]()), memberCount(0)
+{
+}
+
+void Room::subscribe(const std::shared_ptr<SendQueue> &queue)
+{
+    std::lock_guard<std::mutex> guard(membershipLock);
+    std::shared_ptr<Subscribers> next = std::make_shared<Subscribers>(*subscribers);
+    next->push_back(queue);
+    std::atomic_store(&subscribers, std::shared_ptr<const Subscribers>(next));
+    memberCount.fetch_add(1, std::memory_order_relaxed);
+}
+
+void Room::unsubscribe(const std::shared_ptr<SendQueue> &queue)
+{
+    std::lock_guard<std::mutex> guard(membershipLock);
+    auto it = std::find(subscribers->begin(), subscribers->end(), queue);
+    if (it == subscribers->end())
+    {
+        return;
+    }
+    std::shared_ptr<Subscribers> next = std::make_shared<Subscribers>(*subscribers);
+    next->erase(next->begin() + (it - subscribers->begin()));
+    std::atomic_store(&subscribers, std::shared_ptr<const Subscribers>(next));
+    memberCount.fetch_sub(1, std::memory_order_relaxed);
+}
+
+std::shared_ptr<const Room::Subscribers> Room::snapshot() const
+{
+    return std::atomic_load(&subscribers);
+}
+
+void Room::addShardMember(size_t shard)
+{
+    shardMembers[shard % shardCount].fetch_add(1, std::memory_order_relaxed);
+    memberCount.fetch_add(1, std::memory_order_relaxed);
+}
+
+void Room::removeShardMember(size_t shard)
+{
+    shardMembers[shard % shardCount].fetch_sub(1, std::memory_order_relaxed);
+    memberCount.fetch_sub(1, std::memory_order_relaxed);
+}
+
+bool Room::hasMembersOn(size_t shard) const
+{
+    return shardMembers[shard % shardCount].load(std::memory_order_relaxed) > 0;
+}
+
+RoomRegistry::RoomRegistry(size_t roomHistoryDepth, size_t shards, size_t roomLimit, MessageLog *messageLog)
+    : historyDepth(roomHistoryDepth), shardCount(shards), maxRooms(roomLimit), log(messageLog)
+{
+}
+
+std::shared_ptr<Room> RoomRegistry::acquire(const std::string &name)
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = rooms.find(name);
+        if (it != rooms.end())
+        {
+            ++it->second.holders;
+            return it->second.room;
+        }
+        if (rooms.size() >= maxRooms)
+        {
+            return std::shared_ptr<Room>();
+        }
+    }
+
+    // Seeded before anyone can see the room, so logged messages stay in order.
+    // The log is read without the lock; joins of other rooms go on meanwhile.
+    std::shared_ptr<Room> room = std::make_shared<Room>(name, historyDepth, shardCount);
+    if (log)
+    {
+        for (const MessageBuffer &entry : log->recent(name, historyDepth))
+        {
+            room->history().append(entry);
+        }
+    }
+
+    // A join of the same room may have created it meanwhile; theirs wins
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = rooms.find(name);
+    if (it != rooms.end())
+    {
+        ++it->second.holders;
+        return it->second.room;
+    }
+    if (rooms.size() >= maxRooms)
+    {
+        return std::shared_ptr<Room>();
+    }
+    Entry &entry = rooms[name];
+    entry.room = room;
+    entry.holders = 1;
+    return room;
+}
+
+void RoomRegistry::release(const std::shared_ptr<Room> &room)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = rooms.find(room->name());
+    if (it != rooms.end() && it->second.room == room && --it->second.holders == 0)
+    {
+        rooms.erase(it);
+    }
+}
+
+std::shared_ptr<Room> RoomRegistry::find(const std::string &name)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = rooms.find(name);
+    return it == rooms.end() ? std::shared_ptr<Room>() : it->second.room;
+}
+
+std::vector<std::shared_ptr<Room>> RoomRegistry::list()
+{
+    std::vector<std::shared_ptr<Room>> all;
+    list(all);
+    return all;
+}
+
+void RoomRegistry::list(std::vector<std::shared_ptr<Room>> &all)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    all.clear();
+    all.reserve(rooms.size());
+    for (const auto &entry : rooms)
+    {
+        all.push_back(entry.second.room);
+    }
+}
+
+size_t RoomRegistry::size()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return rooms.size();
+}
+
+bool isValidRoomName(const std::string &name)
+{
+    if (name.empty() || name.size() > MAX_ROOM_NAME_LENGTH)
+    {
+        return false;
+    }
+    for (char c : name)
+    {
+        if (!std::isalnum(static_cast<unsigned char>(c)) && c != '-' && c != '_')
+        {
+            return false;
+        }
+    }
+    return true;
+}
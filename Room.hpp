@@ -0,0 +1,95 @@
+// Room.hpp
+#pragma once
+#include "ChatHistory.hpp"
+#include "SearchIndex.hpp"
+#include "SendQueue.hpp"
+#include "MessageLog.hpp"
+#include <string>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <unordered_map>
+
+// A named channel with its own subscribers and history. Sending to a room
+// never takes a lock shared with other rooms or with membership changes:
+//  - threaded mode reads an immutable subscriber list, which joins and leaves
+//    replace wholesale (copy-on-write) under the room's own mutex;
+//  - the event-driven modes keep the member list of each shard on that shard's
+//    loop thread, and the room only tracks how many members every shard has
+//    so a message is handed to shards that actually have someone listening.
+class Room
+{
+public:
+    typedef std::vector<std::shared_ptr<SendQueue>> Subscribers;
+
+private:
+    uint64_t roomId;
+    std::string roomName;
+    ChatHistory roomHistory;
+    SearchIndex searchIndex; // Follows roomHistory on the indexer thread
+    std::mutex membershipLock; // Serializes writers of subscribers; readers never take it
+    std::shared_ptr<const Subscribers> subscribers;
+    size_t shardCount;
+    std::unique_ptr<std::atomic<uint32_t>[]> shardMembers;
+    std::atomic<uint32_t> memberCount;
+
+public:
+    Room(const std::string &name, size_t historyDepth, size_t shards);
+
+    // Unique for the life of the process, unlike the room's address once it is gone
+    uint64_t id() const { return roomId; }
+    const std::string &name() const { return roomName; }
+    ChatHistory &history() { return roomHistory; }
+    SearchIndex &index() { return searchIndex; }
+    size_t members() const { return memberCount.load(std::memory_order_relaxed); }
+
+    // Threaded mode: the queues subscribed to this room
+    void subscribe(const std::shared_ptr<SendQueue> &queue);
+    void unsubscribe(const std::shared_ptr<SendQueue> &queue);
+    std::shared_ptr<const Subscribers> snapshot() const;
+
+    // Event-driven modes: members held by each shard
+    void addShardMember(size_t shard);
+    void removeShardMember(size_t shard);
+    bool hasMembersOn(size_t shard) const;
+};
+
+// Every room of the server, created on first join and dropped, history and
+// all, once nobody holds it any more. Its lock is only taken to look a room up
+// by name when a client joins or leaves one; sessions keep the rooms they are
+// in, so sending a message never goes through here. With a durable log a new
+// room starts with its most recent logged messages in its history.
+class RoomRegistry
+{
+private:
+    struct Entry
+    {
+        std::shared_ptr<Room> room;
+        size_t holders; // acquire() calls not yet matched by release()
+    };
+
+    std::mutex lock;
+    std::unordered_map<std::string, Entry> rooms;
+    size_t historyDepth;
+    size_t shardCount;
+    size_t maxRooms;
+    MessageLog *log;
+
+public:
+    RoomRegistry(size_t roomHistoryDepth, size_t shards, size_t roomLimit, MessageLog *messageLog);
+
+    // Existing room, or a new one; nullptr once maxRooms exist. The caller
+    // holds the room it gets until it calls release() for it.
+    std::shared_ptr<Room> acquire(const std::string &name);
+    void release(const std::shared_ptr<Room> &room);
+    // Existing room only, nullptr when there is none
+    std::shared_ptr<Room> find(const std::string &name);
+    std::vector<std::shared_ptr<Room>> list();
+    // Same into a vector the caller reuses
+    void list(std::vector<std::shared_ptr<Room>> &all);
+    size_t size();
+};
+
+// Valid room names: 1..MAX_ROOM_NAME_LENGTH letters, digits, '-' or '_'
+bool isValidRoomName(const std::string &name);
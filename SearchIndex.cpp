@@ -0,0 +1,457 @@
+#include "SearchIndex.hpp"
+#include "Protocol.hpp"
+#include <algorithm>
+
+namespace
+{
+    const uint64_t FNV_OFFSET = 14695981039346656037ULL;
+    const uint64_t FNV_PRIME = 1099511628211ULL;
+    // Folded into sender terms first, so a name never hashes like the same word
+    const unsigned char SENDER_MARKER = 0x01;
+
+    bool isWordByte(unsigned char c)
+    {
+        // Bytes of multi-byte UTF-8 characters count as letters
+        return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c >= 0x80;
+    }
+
+    uint64_t addByte(uint64_t hash, unsigned char c)
+    {
+        if (c >= 'A' && c <= 'Z')
+        {
+            c = static_cast<unsigned char>(c - 'A' + 'a');
+        }
+        return (hash ^ c) * FNV_PRIME;
+    }
+
+    // 0 marks a free table slot, so no term may hash to it
+    uint64_t finish(uint64_t hash)
+    {
+        return hash != 0 ? hash : 1;
+    }
+
+    // FNV's low bits are weak; spread them before they pick a table slot
+    size_t slotOf(uint64_t hash, size_t mask)
+    {
+        hash ^= hash >> 33;
+        hash *= 0xff51afd7ed558ccdULL;
+        hash ^= hash >> 33;
+        return static_cast<size_t>(hash) & mask;
+    }
+}
+
+SearchIndex::SearchIndex()
+    : firstEntry(1), firstPosting(0), termCount(0), nextTicket(1)
+{
+}
+
+void SearchIndex::wordTerms(const char *text, size_t length, std::vector<uint64_t> &terms)
+{
+    size_t first = terms.size();
+    size_t i = 0;
+    while (i < length)
+    {
+        if (!isWordByte(static_cast<unsigned char>(text[i])))
+        {
+            ++i;
+            continue;
+        }
+        uint64_t hash = FNV_OFFSET;
+        while (i < length && isWordByte(static_cast<unsigned char>(text[i])))
+        {
+            hash = addByte(hash, static_cast<unsigned char>(text[i++]));
+        }
+        terms.push_back(finish(hash));
+    }
+    std::sort(terms.begin() + first, terms.end());
+    terms.erase(std::unique(terms.begin() + first, terms.end()), terms.end());
+}
+
+uint64_t SearchIndex::senderTerm(const char *name, size_t length)
+{
+    uint64_t hash = addByte(FNV_OFFSET, SENDER_MARKER);
+    for (size_t i = 0; i < length; ++i)
+    {
+        hash = addByte(hash, static_cast<unsigned char>(name[i]));
+    }
+    return finish(hash);
+}
+
+std::vector<uint64_t> SearchIndex::parseQuery(const std::string &query)
+{
+    std::vector<uint64_t> terms;
+    size_t start = 0;
+    while (start < query.size())
+    {
+        size_t end = query.find_first_of(" \t", start);
+        if (end == std::string::npos)
+        {
+            end = query.size();
+        }
+        if (end - start > 5 && query.compare(start, 5, "from:") == 0)
+        {
+            terms.push_back(senderTerm(query.data() + start + 5, end - start - 5));
+        }
+        else
+        {
+            wordTerms(query.data() + start, end - start, terms);
+        }
+        start = end + 1;
+    }
+    std::sort(terms.begin(), terms.end());
+    terms.erase(std::unique(terms.begin(), terms.end()), terms.end());
+    return terms;
+}
+
+uint32_t SearchIndex::keyOf(uint64_t term)
+{
+    uint32_t key = static_cast<uint32_t>(term ^ (term >> 32));
+    return key != 0 ? key : 1;
+}
+
+bool SearchIndex::messageTerms(const MessageBuffer &message, std::vector<uint64_t> &terms)
+{
+    // Only chat messages are searched; history also keeps joins and leaves
+    terms.clear();
+    if (!message || message->size() < FRAME_HEADER_SIZE)
+    {
+        return false;
+    }
+    const unsigned char *p = reinterpret_cast<const unsigned char *>(message->data());
+    if (static_cast<FrameType>(p[4]) != FrameType::Chat || (p[5] & FLAG_COMPRESSED))
+    {
+        return false;
+    }
+    size_t senderLength = p[6];
+    size_t offset = FRAME_HEADER_SIZE + senderLength;
+    if ((p[5] & FLAG_ROOM) && offset < message->size())
+    {
+        offset += 1 + p[offset];
+    }
+    if (p[5] & FLAG_SEQUENCE)
+    {
+        offset += FRAME_SEQUENCE_SIZE;
+    }
+    if (offset > message->size())
+    {
+        return false;
+    }
+
+    wordTerms(message->data() + offset, message->size() - offset, terms);
+    uint64_t sender = senderTerm(message->data() + FRAME_HEADER_SIZE, senderLength);
+    terms.insert(std::lower_bound(terms.begin(), terms.end(), sender), sender);
+    return true;
+}
+
+size_t SearchIndex::findTerm(uint32_t key) const
+{
+    if (table.empty())
+    {
+        return 0;
+    }
+    size_t mask = table.size() - 1;
+    for (size_t i = slotOf(key, mask); table[i].key != 0; i = (i + 1) & mask)
+    {
+        if (table[i].key == key)
+        {
+            return i;
+        }
+    }
+    return table.size();
+}
+
+SearchIndex::Term &SearchIndex::insertTerm(uint32_t key)
+{
+    if ((termCount + 1) * 2 > table.size())
+    {
+        growTable();
+    }
+    size_t mask = table.size() - 1;
+    size_t i = slotOf(key, mask);
+    while (table[i].key != 0 && table[i].key != key)
+    {
+        i = (i + 1) & mask;
+    }
+    if (table[i].key == 0)
+    {
+        table[i].key = key;
+        table[i].count = 0;
+        table[i].newest = 0;
+        ++termCount;
+    }
+    return table[i];
+}
+
+void SearchIndex::eraseTerm(size_t slot)
+{
+    // Linear probing without tombstones: later keys of the same probe run
+    // move back into the hole, so lookups can keep stopping at a free slot
+    size_t mask = table.size() - 1;
+    size_t hole = slot;
+    table[hole].key = 0;
+    --termCount;
+    for (size_t i = (hole + 1) & mask; table[i].key != 0; i = (i + 1) & mask)
+    {
+        size_t home = slotOf(table[i].key, mask);
+        // The key may fill the hole unless its home slot lies after the hole, up to i
+        bool stays = hole <= i ? (home > hole && home <= i) : (home > hole || home <= i);
+        if (!stays)
+        {
+            table[hole] = table[i];
+            table[i].key = 0;
+            hole = i;
+        }
+    }
+}
+
+void SearchIndex::growTable()
+{
+    std::vector<Term> old(table.empty() ? 64 : table.size() * 2);
+    old.swap(table);
+    for (Term &slot : table)
+    {
+        slot.key = 0;
+    }
+    size_t mask = table.size() - 1;
+    for (const Term &term : old)
+    {
+        if (term.key == 0)
+        {
+            continue;
+        }
+        size_t i = slotOf(term.key, mask);
+        while (table[i].key != 0)
+        {
+            i = (i + 1) & mask;
+        }
+        table[i] = term;
+    }
+}
+
+size_t SearchIndex::findPosting(const Entry &entry, uint32_t key) const
+{
+    // A message's postings are sorted by key
+    size_t low = static_cast<size_t>(entry.firstPosting - firstPosting);
+    size_t high = low + entry.postings;
+    while (low < high)
+    {
+        size_t middle = low + (high - low) / 2;
+        uint32_t found = postings[middle].key;
+        if (found == key)
+        {
+            return middle;
+        }
+        if (found < key)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    return postings.size();
+}
+
+void SearchIndex::add(uint64_t ticket, const MessageBuffer &message)
+{
+    if (!messageTerms(message, scratch))
+    {
+        return;
+    }
+    // Keys of one message in ascending order; words whose keys clash share a posting
+    for (uint64_t &term : scratch)
+    {
+        term = keyOf(term);
+    }
+    std::sort(scratch.begin(), scratch.end());
+    scratch.erase(std::unique(scratch.begin(), scratch.end()), scratch.end());
+
+    uint64_t number = firstEntry + entries.size();
+    Entry entry;
+    entry.ticket = ticket;
+    entry.firstPosting = firstPosting + postings.size();
+    entry.postings = static_cast<uint32_t>(scratch.size());
+    entries.push_back(entry);
+    for (uint64_t key : scratch)
+    {
+        Term &term = insertTerm(static_cast<uint32_t>(key));
+        uint64_t back = term.newest != 0 ? number - term.newest : 0;
+        Posting posting;
+        posting.key = static_cast<uint32_t>(key);
+        // A chain longer than 32 bits can span ends there
+        posting.back = back <= UINT32_MAX ? static_cast<uint32_t>(back) : 0;
+        postings.push_back(posting);
+        term.newest = number;
+        ++term.count;
+    }
+}
+
+void SearchIndex::evictBefore(uint64_t ticket)
+{
+    while (!entries.empty() && entries.front().ticket < ticket)
+    {
+        for (uint32_t i = 0; i < entries.front().postings; ++i)
+        {
+            size_t slot = findTerm(postings.front().key);
+            if (slot < table.size() && --table[slot].count == 0)
+            {
+                eraseTerm(slot);
+            }
+            postings.pop_front();
+            ++firstPosting;
+        }
+        entries.pop_front();
+        ++firstEntry;
+    }
+}
+
+bool SearchIndex::catchUp(const ChatHistory &history, size_t limit)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    uint64_t end = history.end();
+    uint64_t oldest = end > history.capacity() ? end - history.capacity() : 1;
+    if (nextTicket < oldest)
+    {
+        // Overwritten before they could be indexed
+        nextTicket = oldest;
+    }
+
+    bool done = true;
+    for (size_t indexed = 0; nextTicket < end; ++indexed, ++nextTicket)
+    {
+        if (indexed == limit)
+        {
+            done = false;
+            break;
+        }
+        MessageBuffer message;
+        ChatHistory::Lookup found = history.at(nextTicket, message);
+        if (found == ChatHistory::Lookup::Pending)
+        {
+            // Picked up by the next pass, once its writer is done
+            break;
+        }
+        if (found == ChatHistory::Lookup::Found)
+        {
+            add(nextTicket, message);
+        }
+    }
+    evictBefore(oldest);
+    return done;
+}
+
+void SearchIndex::search(const ChatHistory &history, const std::vector<uint64_t> &terms, size_t limit,
+                         std::vector<MessageBuffer> &matches) const
+{
+    std::lock_guard<std::mutex> guard(lock);
+    if (terms.empty() || table.empty())
+    {
+        return;
+    }
+
+    // The rarest key has the shortest chain to walk
+    std::vector<uint32_t> keys;
+    const Term *rarest = nullptr;
+    for (uint64_t term : terms)
+    {
+        uint32_t key = keyOf(term);
+        size_t slot = findTerm(key);
+        if (slot == table.size())
+        {
+            return;
+        }
+        keys.push_back(key);
+        if (!rarest || table[slot].count < rarest->count)
+        {
+            rarest = &table[slot];
+        }
+    }
+
+    std::vector<uint64_t> found;
+    size_t count = 0;
+    uint64_t number = rarest->newest;
+    while (number >= firstEntry && count < limit)
+    {
+        const Entry &entry = entries[static_cast<size_t>(number - firstEntry)];
+        bool all = true;
+        for (size_t i = 0; all && i < keys.size(); ++i)
+        {
+            all = keys[i] == rarest->key || findPosting(entry, keys[i]) != postings.size();
+        }
+        MessageBuffer message;
+        if (all && history.at(entry.ticket, message) == ChatHistory::Lookup::Found && messageTerms(message, found))
+        {
+            for (size_t i = 0; all && i < terms.size(); ++i)
+            {
+                all = std::binary_search(found.begin(), found.end(), terms[i]);
+            }
+            if (all)
+            {
+                matches.push_back(message);
+                ++count;
+            }
+        }
+
+        // Step to the previous message of the rarest key
+        uint32_t back = postings[findPosting(entry, rarest->key)].back;
+        number = back != 0 ? number - back : 0;
+    }
+}
+
+size_t SearchIndex::messages() const
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return entries.size();
+}
+
+size_t SearchIndex::postingCount() const
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return postings.size();
+}
+
+SearchIndexer::SearchIndexer(std::function<bool()> indexRooms, std::chrono::milliseconds period)
+    : pass(std::move(indexRooms)), interval(period), stopping(false)
+{
+}
+
+SearchIndexer::~SearchIndexer()
+{
+    stop();
+}
+
+void SearchIndexer::start()
+{
+    stopping = false;
+    worker = std::thread(&SearchIndexer::run, this);
+}
+
+void SearchIndexer::stop()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    wake.notify_one();
+    if (worker.joinable())
+    {
+        worker.join();
+    }
+}
+
+void SearchIndexer::run()
+{
+    std::unique_lock<std::mutex> guard(lock);
+    while (!stopping)
+    {
+        guard.unlock();
+        bool done = pass();
+        guard.lock();
+        if (done)
+        {
+            wake.wait_for(guard, interval, [this]()
+                          { return stopping; });
+        }
+    }
+}
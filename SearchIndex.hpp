@@ -0,0 +1,122 @@
+// SearchIndex.hpp
+#pragma once
+#include "ChatHistory.hpp"
+#include "RingQueue.hpp"
+#include <vector>
+#include <string>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <functional>
+#include <condition_variable>
+#include <cstdint>
+
+// Inverted index over the chat messages of one room's history, for /search.
+// It follows the history ring instead of being told about new messages, so
+// the message path never touches it: a background thread calls catchUp(),
+// which indexes what was appended since and forgets what the ring has
+// overwritten, so the index covers exactly the history's retention window.
+//
+// A message gets one posting per distinct word of its body and one for its
+// sender. Each posting links to the previous message with the same term, so
+// a term's messages form a chain from newest to oldest. The term table keeps
+// the newest message of every term and how many messages have it; a query
+// walks the chain of its rarest term backwards and checks those messages for
+// the other terms, which yields the newest matches first and stops as soon
+// as enough are found. Terms are hashes of the lowercased word; postings keep
+// 32 bits of them, which is 8 bytes per posting, and the rare message that
+// matches only through a clash of those bits is weeded out by checking the
+// full hashes of its words before it is returned. The term table is open
+// addressing, and messages and postings sit in rings, so once the window has
+// filled indexing allocates nothing.
+class SearchIndex
+{
+private:
+    struct Entry
+    {
+        uint64_t ticket;       // History entry number of the message
+        uint64_t firstPosting; // Number of its first posting
+        uint32_t postings;
+    };
+
+    struct Posting
+    {
+        uint32_t key;  // Term key, see keyOf()
+        uint32_t back; // Entries back to the previous message with this key, 0 when none
+    };
+
+    struct Term
+    {
+        uint32_t key;    // 0 marks a free slot
+        uint32_t count;  // Messages in the index with this key
+        uint64_t newest; // Entry number of the newest of them
+    };
+
+    mutable std::mutex lock;
+    RingQueue<Entry> entries;
+    RingQueue<Posting> postings;
+    uint64_t firstEntry;   // Entry number of entries.front(); numbers start at 1
+    uint64_t firstPosting; // Posting number of postings.front()
+    std::vector<Term> table; // Size is zero or a power of two, at most half full
+    size_t termCount;
+    uint64_t nextTicket;   // Next history entry to index
+    std::vector<uint64_t> scratch;
+
+    static uint32_t keyOf(uint64_t term);
+    // Sender and word terms of a chat message, sorted; false for other frames
+    static bool messageTerms(const MessageBuffer &message, std::vector<uint64_t> &terms);
+    // Slot of key in table, table.size() when it is not there
+    size_t findTerm(uint32_t key) const;
+    Term &insertTerm(uint32_t key);
+    void eraseTerm(size_t slot);
+    void growTable();
+    // Index of entry's posting for key in postings, postings.size() when it has none
+    size_t findPosting(const Entry &entry, uint32_t key) const;
+    void add(uint64_t ticket, const MessageBuffer &message);
+    void evictBefore(uint64_t ticket);
+
+public:
+    SearchIndex();
+
+    // Indexes at most limit new history entries and drops those the ring no
+    // longer holds. Returns false when more are left to index.
+    bool catchUp(const ChatHistory &history, size_t limit);
+
+    // Up to limit messages of history that have every term, newest first
+    void search(const ChatHistory &history, const std::vector<uint64_t> &terms, size_t limit,
+                std::vector<MessageBuffer> &matches) const;
+
+    size_t messages() const;
+    size_t postingCount() const;
+
+    // Appends the terms of text, one per word, lowercased, duplicates removed
+    static void wordTerms(const char *text, size_t length, std::vector<uint64_t> &terms);
+    static uint64_t senderTerm(const char *name, size_t length);
+    // Terms of a query: words, and from:NAME for messages sent by NAME.
+    // Empty when the query has neither.
+    static std::vector<uint64_t> parseQuery(const std::string &query);
+};
+
+// Background thread that keeps every index caught up. pass() is called every
+// interval and should run catchUp() on each room; it is called again right
+// away while it returns false, so a backlog is worked off in slices and
+// searches are never locked out for long.
+class SearchIndexer
+{
+private:
+    std::function<bool()> pass;
+    std::chrono::milliseconds interval;
+    std::mutex lock;
+    std::condition_variable wake;
+    bool stopping;
+    std::thread worker;
+
+    void run();
+
+public:
+    SearchIndexer(std::function<bool()> indexRooms, std::chrono::milliseconds period);
+    ~SearchIndexer();
+
+    void start();
+    void stop();
+};
@@ -0,0 +1,232 @@
+#include "SendQueue.hpp"
+#include "Metrics.hpp"
+
+SendQueue::SendQueue(socket_t clientSocket, size_t limit, OverflowPolicy overflowPolicy)
+    : socket(clientSocket), highWaterMark(limit), policy(overflowPolicy),
+      headOffset(0), queuedBytes(0), pinned(0), dropped(0), scheduled(false), compression(false)
+{
+}
+
+bool SendQueue::admit(size_t incomingBytes)
+{
+    // An empty queue always accepts one message, however large
+    if (queuedBytes == 0 || queuedBytes + incomingBytes <= highWaterMark)
+    {
+        return true;
+    }
+    if (policy == OverflowPolicy::Disconnect)
+    {
+        Metrics::add(Counter::SlowConsumerDisconnects);
+        return false;
+    }
+
+    // The head may be partially written, so it has to stay to keep framing
+    // intact, and so do messages the kernel is still reading from
+    size_t keep = pinned > 1 ? pinned : 1;
+    size_t victims = 0;
+    while (keep + victims < messages.size() && queuedBytes + incomingBytes > highWaterMark)
+    {
+        queuedBytes -= messages[keep + victims]->size();
+        ++victims;
+    }
+    if (victims > 0)
+    {
+        // One erase for the whole run: the few kept head messages move up to
+        // close the gap, the rest of the queue stays where it is
+        messages.erase(keep, victims);
+        dropped += victims;
+        Metrics::add(Counter::MessagesDropped, victims);
+    }
+    return true;
+}
+
+void SendQueue::enableCompression()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    compression = true;
+}
+
+bool SendQueue::push(const MessageBuffer &message)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    const MessageBuffer &chosen = (compression && message->compressed) ? message->compressed : message;
+    if (!admit(chosen->size()))
+    {
+        return false;
+    }
+    if (queuedBytes == 0)
+    {
+        pendingSince = std::chrono::steady_clock::now();
+    }
+    messages.push_back(chosen);
+    queuedBytes += chosen->size();
+    return true;
+}
+
+bool SendQueue::push(const std::vector<MessageBuffer> &batch)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    if (queuedBytes == 0 && !batch.empty())
+    {
+        pendingSince = std::chrono::steady_clock::now();
+    }
+    for (const MessageBuffer &message : batch)
+    {
+        const MessageBuffer &chosen = (compression && message->compressed) ? message->compressed : message;
+        if (!admit(chosen->size()))
+        {
+            return false;
+        }
+        messages.push_back(chosen);
+        queuedBytes += chosen->size();
+    }
+    return true;
+}
+
+SendQueue::FlushResult SendQueue::flush()
+{
+    std::unique_lock<std::mutex> guard(lock, std::try_to_lock);
+    if (!guard.owns_lock())
+    {
+        return FlushResult::Busy;
+    }
+
+    while (!messages.empty())
+    {
+        // Gather as many queued messages as fit into one write call
+#ifdef _WIN32
+        WSABUF parts[MAX_BATCH];
+#else
+        iovec parts[MAX_BATCH];
+#endif
+        int count = 0;
+        for (; count < MAX_BATCH && static_cast<size_t>(count) < messages.size(); ++count)
+        {
+            const MessageBuffer &message = messages[count];
+            size_t skip = (count == 0) ? headOffset : 0;
+#ifdef _WIN32
+            parts[count].buf = const_cast<char *>(message->data()) + skip;
+            parts[count].len = static_cast<ULONG>(message->size() - skip);
+#else
+            parts[count].iov_base = const_cast<char *>(message->data()) + skip;
+            parts[count].iov_len = message->size() - skip;
+#endif
+        }
+
+#ifdef _WIN32
+        DWORD written = 0;
+        if (WSASend(socket, parts, count, &written, 0, nullptr, nullptr) != 0)
+        {
+            return socketWouldBlock() ? FlushResult::Pending : FlushResult::Failed;
+        }
+        size_t sent = written;
+#else
+        // sendmsg() rather than writev() so SEND_FLAGS can suppress SIGPIPE
+        msghdr header = {};
+        header.msg_iov = parts;
+        header.msg_iovlen = count;
+        ssize_t result = sendmsg(socket, &header, SEND_FLAGS);
+        if (result < 0)
+        {
+            return socketWouldBlock() ? FlushResult::Pending : FlushResult::Failed;
+        }
+        size_t sent = static_cast<size_t>(result);
+#endif
+
+        consume(sent);
+    }
+    return FlushResult::Drained;
+}
+
+void SendQueue::consume(size_t sent)
+{
+    // Retire every message the kernel took in full, remember where the partial one stopped
+    if (sent == 0)
+    {
+        return;
+    }
+    queuedBytes -= sent;
+    Metrics::add(Counter::SocketWrites);
+    Metrics::add(Counter::BytesOut, sent);
+    uint64_t completed = 0;
+    while (sent > 0)
+    {
+        size_t remaining = messages.front()->size() - headOffset;
+        if (sent < remaining)
+        {
+            headOffset += sent;
+            break;
+        }
+        sent -= remaining;
+        messages.pop_front();
+        headOffset = 0;
+        ++completed;
+    }
+    Metrics::add(Counter::MessagesOut, completed);
+}
+
+#ifndef _WIN32
+int SendQueue::prepareSend(iovec *parts, int maxParts)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    int count = 0;
+    for (; count < maxParts && static_cast<size_t>(count) < messages.size(); ++count)
+    {
+        const MessageBuffer &message = messages[count];
+        size_t skip = (count == 0) ? headOffset : 0;
+        parts[count].iov_base = const_cast<char *>(message->data()) + skip;
+        parts[count].iov_len = message->size() - skip;
+    }
+    pinned = count;
+    return count;
+}
+
+void SendQueue::completeSend(size_t sent)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    pinned = 0;
+    consume(sent);
+}
+#endif
+
+bool SendQueue::flushDue(const DeliveryPolicy &delivery, std::chrono::steady_clock::time_point now,
+                         std::chrono::steady_clock::time_point &deadline)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    if (delivery.mode == DeliveryMode::LowLatency || queuedBytes >= delivery.flushBytes)
+    {
+        return true;
+    }
+    deadline = pendingSince + std::chrono::microseconds(delivery.windowMicros);
+    return now >= deadline;
+}
+
+bool SendQueue::hasPending()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return !messages.empty();
+}
+
+size_t SendQueue::pendingBytes()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return queuedBytes;
+}
+
+std::string SendQueue::unsentBytes()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    std::string bytes;
+    bytes.reserve(queuedBytes);
+    for (size_t i = 0; i < messages.size(); ++i)
+    {
+        bytes.append(*messages[i], i == 0 ? headOffset : 0, std::string::npos);
+    }
+    return bytes;
+}
+
+uint64_t SendQueue::droppedMessages()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return dropped;
+}
@@ -0,0 +1,113 @@
+// SendQueue.hpp
+#pragma once
+#include "SocketUtils.hpp"
+#include "MessageBuffer.hpp"
+#include "RingQueue.hpp"
+#include <string>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+#ifndef _WIN32
+#include <sys/uio.h>
+#endif
+
+// What to do when a client stops reading and its queue reaches the high-water mark
+enum class OverflowPolicy
+{
+    DropOldest, // Discard the oldest unsent messages to make room
+    Disconnect  // Give up on the client
+};
+
+// When queued output is written to the socket. Sockets use TCP_NODELAY in
+// both modes: the server decides when to send, Nagle's algorithm never holds
+// a write back waiting for an ACK.
+enum class DeliveryMode
+{
+    LowLatency, // Write as soon as the event that queued the output is handled
+    Coalesce    // Hold output for a short window or until enough bytes piled up, then write it at once
+};
+
+struct DeliveryPolicy
+{
+    DeliveryMode mode = DeliveryMode::LowLatency;
+    unsigned windowMicros = 1000;   // Coalesce: longest a message waits for company
+    size_t flushBytes = 16 * 1024;  // Coalesce: queued bytes that are written without waiting
+};
+
+// Outbound messages for one connection. Producers only append a reference to
+// a shared buffer under the queue's own lock; bytes reach the socket through
+// flush(), which never blocks and hands several queued messages to the kernel
+// per call with a scatter/gather write. Completion-based backends (io_uring)
+// use prepareSend()/completeSend() instead and let the kernel do the write.
+class SendQueue
+{
+public:
+    enum class FlushResult
+    {
+        Drained, // Everything queued has been handed to the kernel
+        Pending, // Socket buffer is full, call flush() again when writable
+        Busy,    // Another thread is flushing right now and will finish the job
+        Failed   // Socket error, the connection is unusable
+    };
+
+    // Buffers gathered into one write call
+    static const int MAX_BATCH = 64;
+
+private:
+    socket_t socket;
+    size_t highWaterMark;
+    OverflowPolicy policy;
+
+    std::mutex lock;
+    RingQueue<MessageBuffer> messages; // Keeps its slots, so steady traffic queues without allocating
+    size_t headOffset;  // Bytes of messages.front() already written
+    size_t queuedBytes; // Unwritten bytes across all messages
+    size_t pinned;      // Head messages referenced by an asynchronous send in flight
+    uint64_t dropped;
+    std::chrono::steady_clock::time_point pendingSince; // When the queue last went from empty to non-empty
+    std::atomic<bool> scheduled; // Handed to a coalescing flusher that has not run yet
+    bool compression;            // Client negotiated compressed bodies
+
+    bool admit(size_t incomingBytes);
+    void consume(size_t sent);
+
+public:
+    SendQueue(socket_t clientSocket, size_t limit, OverflowPolicy overflowPolicy);
+
+    // Later pushes queue the compressed variant of messages that have one
+    void enableCompression();
+
+    // Returns false when the client overflowed under the Disconnect policy
+    bool push(const MessageBuffer &message);
+    bool push(const std::vector<MessageBuffer> &batch);
+    FlushResult flush();
+
+#ifndef _WIN32
+    // Describes up to maxParts queued messages for a write the caller submits
+    // itself; returns the number of parts, 0 when nothing is queued. Those
+    // messages are pinned (never dropped) until completeSend() reports how
+    // many bytes the kernel took. At most one such send may be in flight.
+    int prepareSend(iovec *parts, int maxParts);
+    void completeSend(size_t sent);
+#endif
+
+    // Coalesce mode: true when the queued output should be written now, either
+    // because enough bytes piled up or the oldest message waited the whole
+    // window; otherwise deadline is set to when it will be due
+    bool flushDue(const DeliveryPolicy &delivery, std::chrono::steady_clock::time_point now,
+                  std::chrono::steady_clock::time_point &deadline);
+    // Claims the queue for a coalescing flusher; false when it already has it
+    bool schedule() { return !scheduled.exchange(true); }
+    void unschedule() { scheduled.store(false); }
+    bool isScheduled() const { return scheduled.load(); }
+
+    bool hasPending();
+    size_t pendingBytes();
+    // Copy of everything not written yet, starting with the rest of a partly written message
+    std::string unsentBytes();
+    uint64_t droppedMessages();
+    socket_t getSocket() const { return socket; }
+};
@@ -0,0 +1,90 @@
+// SocketUtils.hpp
+#pragma once
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "ws2_32.lib")
+typedef SOCKET socket_t;
+#define SOCKET_ERROR_VAL INVALID_SOCKET
+#else
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <cerrno>
+typedef int socket_t;
+#define SOCKET_ERROR_VAL -1
+#endif
+
+// Small cross-platform wrappers for the socket calls the non-blocking paths need
+
+#ifdef _WIN32
+typedef WSAPOLLFD pollfd_t;
+// Windows never raises SIGPIPE, so there is no flag to suppress it
+const int SEND_FLAGS = 0;
+#else
+typedef pollfd pollfd_t;
+// A peer that vanished must not kill the whole server with SIGPIPE
+const int SEND_FLAGS = MSG_NOSIGNAL;
+#endif
+
+// enabled = false makes the socket blocking again, e.g. one inherited from another process
+inline bool setNonBlocking(socket_t socket, bool enabled = true)
+{
+#ifdef _WIN32
+    u_long mode = enabled ? 1 : 0;
+    return ioctlsocket(socket, FIONBIO, &mode) == 0;
+#else
+    int flags = fcntl(socket, F_GETFL, 0);
+    return flags >= 0 && fcntl(socket, F_SETFL, enabled ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK)) == 0;
+#endif
+}
+
+// Turns off Nagle's algorithm: small writes go out without waiting for the
+// peer to acknowledge earlier ones
+inline bool setNoDelay(socket_t socket)
+{
+    int on = 1;
+    return setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char *>(&on), sizeof(on)) == 0;
+}
+
+// True when the last send/recv failed only because it would have blocked
+inline bool socketWouldBlock()
+{
+#ifdef _WIN32
+    return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+#endif
+}
+
+inline int pollSockets(pollfd_t *fds, unsigned long count, int timeoutMs)
+{
+#ifdef _WIN32
+    return WSAPoll(fds, count, timeoutMs);
+#else
+    return poll(fds, count, timeoutMs);
+#endif
+}
+
+inline void shutdownSocket(socket_t socket)
+{
+#ifdef _WIN32
+    shutdown(socket, SD_BOTH);
+#else
+    shutdown(socket, SHUT_RDWR);
+#endif
+}
+
+inline void closeSocket(socket_t socket)
+{
+#ifdef _WIN32
+    closesocket(socket);
+#else
+    close(socket);
+#endif
+}
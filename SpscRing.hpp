@@ -0,0 +1,67 @@
+// SpscRing.hpp
+#pragma once
+#include <atomic>
+#include <vector>
+#include <utility>
+#include <cstddef>
+
+// Bounded lock-free single-producer/single-consumer queue over a fixed array.
+// One thread may push() and one other thread may pop(); the slots are
+// allocated once, so passing items through it never touches the heap. push()
+// fails instead of waiting when the ring is full.
+template <typename T>
+class SpscRing
+{
+private:
+    std::vector<T> slots; // Capacity is a power of two
+    size_t mask;
+    // Each index on its own cache line, so the two threads do not contend
+    char padHead[64];
+    std::atomic<size_t> head; // Next slot to pop, written by the consumer
+    char padTail[64];
+    std::atomic<size_t> tail; // Next slot to fill, written by the producer
+    char padEnd[64];
+
+public:
+    // capacity is rounded up to a power of two
+    explicit SpscRing(size_t capacity) : head(0), tail(0)
+    {
+        size_t size = 1;
+        while (size < capacity)
+        {
+            size <<= 1;
+        }
+        slots.resize(size);
+        mask = size - 1;
+    }
+
+    SpscRing(const SpscRing &) = delete;
+    SpscRing &operator=(const SpscRing &) = delete;
+
+    // Producer only; false when full, leaving item untouched
+    bool push(T &item)
+    {
+        size_t position = tail.load(std::memory_order_relaxed);
+        if (position - head.load(std::memory_order_acquire) == slots.size())
+        {
+            return false;
+        }
+        slots[position & mask] = std::move(item);
+        tail.store(position + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer only; false when empty. The slot is reset so it releases what it held.
+    bool pop(T &item)
+    {
+        size_t position = head.load(std::memory_order_relaxed);
+        if (position == tail.load(std::memory_order_acquire))
+        {
+            return false;
+        }
+        item = std::move(slots[position & mask]);
+        slots[position & mask] = T();
+        head.store(position + 1, std::memory_order_release);
+        return true;
+    }
+};
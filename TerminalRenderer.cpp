@@ -0,0 +1,206 @@
+#include "TerminalRenderer.hpp"
+#include "ConsoleUtils.hpp"
+#include <iostream>
+#include <cstring>
+#include <algorithm>
+
+namespace
+{
+    // Longest run copied in one append; wider boxes take several
+    const size_t RUN_LENGTH = 128;
+
+    // Widths the ConsoleUtils boxes pad their text to
+    const size_t SYSTEM_TEXT_WIDTH = 35;
+    const size_t JOIN_TEXT_WIDTH = 32;
+    const size_t LEAVE_TEXT_WIDTH = 33;
+
+#ifdef _WIN32
+    const char *JOIN_MARKER = "  * ";
+    const char *LEAVE_MARKER = "  - ";
+    const char *SEPARATOR = DIM_TEXT "-------------------------------------------------" RESET_COLOR "\n";
+#else
+    const char *JOIN_MARKER = "  🎉 ";
+    const char *LEAVE_MARKER = "  👋 ";
+    const char *SEPARATOR = DIM_TEXT "─────────────────────────────────────────────────" RESET_COLOR "\n";
+#endif
+
+    std::string repeat(const char *unit, size_t count)
+    {
+        std::string run;
+        run.reserve(std::strlen(unit) * count);
+        for (size_t i = 0; i < count; ++i)
+        {
+            run += unit;
+        }
+        return run;
+    }
+
+    const std::string &horizontalRun()
+    {
+        static const std::string run = repeat(HORIZONTAL_LINE, RUN_LENGTH);
+        return run;
+    }
+
+    const std::string &spaceRun()
+    {
+        static const std::string run(RUN_LENGTH, ' ');
+        return run;
+    }
+}
+
+std::mutex &TerminalRenderer::outputLock()
+{
+    static std::mutex lock;
+    return lock;
+}
+
+const std::string &TerminalRenderer::userColor(const std::string &username)
+{
+    auto it = colors.find(username);
+    if (it == colors.end())
+    {
+        it = colors.emplace(username, &assignUserColor(username)).first;
+    }
+    return *it->second;
+}
+
+void TerminalRenderer::appendRepeated(const std::string &run, size_t unitBytes, size_t count)
+{
+    size_t perRun = run.size() / unitBytes;
+    while (count > 0)
+    {
+        size_t step = std::min(count, perRun);
+        buffer.append(run, 0, step * unitBytes);
+        count -= step;
+    }
+}
+
+void TerminalRenderer::bubble(const std::string &label, const std::string &body, const std::string &borderColor)
+{
+    // Same geometry as createBorderedMessage(): label: body, two columns of
+    // padding on each side, at least 20 wide
+    size_t contentLength = label.size() + 2 + body.size();
+    size_t boxWidth = std::max(contentLength + 4, static_cast<size_t>(20));
+    size_t lineBytes = std::strlen(HORIZONTAL_LINE);
+
+    buffer += borderColor;
+    buffer += TOP_LEFT_CORNER;
+    appendRepeated(horizontalRun(), lineBytes, boxWidth);
+    buffer += TOP_RIGHT_CORNER RESET_COLOR "\n";
+
+    buffer += borderColor;
+    buffer += VERTICAL_LINE RESET_COLOR BORDER_PADDING;
+    buffer += borderColor;
+    buffer += BOLD_TEXT;
+    buffer += label;
+    buffer += RESET_COLOR ": ";
+    buffer += body;
+    appendRepeated(spaceRun(), 1, boxWidth - contentLength - 2);
+    buffer += borderColor;
+    buffer += VERTICAL_LINE RESET_COLOR "\n";
+
+    buffer += borderColor;
+    buffer += BOTTOM_LEFT_CORNER;
+    appendRepeated(horizontalRun(), lineBytes, boxWidth);
+    buffer += BOTTOM_RIGHT_CORNER RESET_COLOR "\n";
+}
+
+void TerminalRenderer::chat(const std::string &sender, const std::string &room, const std::string &body)
+{
+    // The color follows the user, not the room
+    if (room.empty())
+    {
+        bubble(sender, body, userColor(sender));
+    }
+    else
+    {
+        label.assign(sender);
+        label += " #";
+        label += room;
+        bubble(label, body, userColor(sender));
+    }
+}
+
+void TerminalRenderer::sent(const std::string &room, const std::string &body)
+{
+    static const std::string color = BRIGHT_CYAN_COLOR;
+    label.assign(room.empty() ? "You" : "You #");
+    label += room;
+    bubble(label, body, color);
+}
+
+void TerminalRenderer::system(const std::string &message)
+{
+    buffer += YELLOW_COLOR SYSTEM_BOX_TOP RESET_COLOR "\n";
+    buffer += YELLOW_COLOR SYSTEM_BOX_SIDE RESET_COLOR BOLD_TEXT "  [SYSTEM] " RESET_COLOR;
+    buffer += message;
+    if (message.size() < SYSTEM_TEXT_WIDTH)
+    {
+        appendRepeated(spaceRun(), 1, SYSTEM_TEXT_WIDTH - message.size());
+    }
+    buffer += YELLOW_COLOR SYSTEM_BOX_SIDE RESET_COLOR "\n";
+    buffer += YELLOW_COLOR SYSTEM_BOX_BOTTOM RESET_COLOR "\n";
+}
+
+void TerminalRenderer::appendBox(const char *color, const char *top, const char *side, const char *bottom,
+                                 const char *marker, const std::string &user, const char *suffix, size_t padding)
+{
+    buffer += color;
+    buffer += top;
+    buffer += RESET_COLOR "\n";
+    buffer += color;
+    buffer += side;
+    buffer += RESET_COLOR;
+    buffer += marker;
+    buffer += BOLD_TEXT;
+    buffer += user;
+    buffer += suffix;
+    buffer += RESET_COLOR;
+    if (user.size() < padding)
+    {
+        appendRepeated(spaceRun(), 1, padding - user.size());
+    }
+    buffer += color;
+    buffer += side;
+    buffer += RESET_COLOR "\n";
+    buffer += color;
+    buffer += bottom;
+    buffer += RESET_COLOR "\n";
+}
+
+void TerminalRenderer::userJoin(const std::string &user)
+{
+    appendBox(BRIGHT_GREEN_COLOR, JOIN_BOX_TOP, JOIN_BOX_SIDE, JOIN_BOX_BOTTOM, JOIN_MARKER, user, " joined the chat!", JOIN_TEXT_WIDTH);
+}
+
+void TerminalRenderer::userLeave(const std::string &user)
+{
+    appendBox(BRIGHT_RED_COLOR, LEAVE_BOX_TOP, LEAVE_BOX_SIDE, LEAVE_BOX_BOTTOM, LEAVE_MARKER, user, " left the chat", LEAVE_TEXT_WIDTH);
+}
+
+void TerminalRenderer::separator()
+{
+    buffer += SEPARATOR;
+}
+
+void TerminalRenderer::line(const char *color, const std::string &text)
+{
+    buffer += color;
+    buffer += text;
+    buffer += RESET_COLOR "\n";
+}
+
+void TerminalRenderer::flush()
+{
+    if (buffer.empty())
+    {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> guard(outputLock());
+        std::cout.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+        std::cout.flush();
+    }
+    // Keep the capacity for the next batch
+    buffer.clear();
+}
@@ -0,0 +1,49 @@
+// TerminalRenderer.hpp
+#pragma once
+#include <string>
+#include <mutex>
+#include <unordered_map>
+
+// Draws chat output the way ConsoleUtils does, but straight into one buffer
+// that is reused from batch to batch. Box edges are literals, border runs and
+// padding are built once and copied from, and nothing reaches the terminal
+// until flush(), so the receive thread can draw everything one recv()
+// returned and hand it over in a single write. Each thread that draws keeps its own renderer;
+// user colors and the terminal itself are shared and locked.
+class TerminalRenderer
+{
+private:
+    std::string buffer;
+    std::string label; // Bubble label with its room, composed here to reuse the capacity
+    // This renderer's view of the shared color table, read without a lock
+    std::unordered_map<std::string, const std::string *> colors;
+
+    // Serializes flushes from different threads so batches do not interleave
+    static std::mutex &outputLock();
+
+    void appendRepeated(const std::string &run, size_t unitBytes, size_t count);
+    void appendBox(const char *color, const char *top, const char *side, const char *bottom,
+                   const char *marker, const std::string &user, const char *suffix, size_t padding);
+
+public:
+    // Same assignment as getUserColor(), cached per renderer
+    const std::string &userColor(const std::string &username);
+
+    // label: body inside a border of borderColor, as createBorderedMessage()
+    void bubble(const std::string &label, const std::string &body, const std::string &borderColor);
+    // Message from another user; a room is shown after the name
+    void chat(const std::string &sender, const std::string &room, const std::string &body);
+    // Our own message, echoed locally under "You" as FORMAT_SENT_MESSAGE does;
+    // a room is shown after it, as for chat()
+    void sent(const std::string &room, const std::string &body);
+    void system(const std::string &message);
+    void userJoin(const std::string &user);
+    void userLeave(const std::string &user);
+    void separator();
+    // Text in a single color, on a line of its own
+    void line(const char *color, const std::string &text);
+
+    bool empty() const { return buffer.empty(); }
+    // Writes the batch to the terminal with one write and one flush
+    void flush();
+};
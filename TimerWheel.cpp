@@ -0,0 +1,156 @@
+#include "TimerWheel.hpp"
+
+TimerWheel::TimerWheel(std::chrono::milliseconds tickLength)
+    : origin(Clock::now()), tick(tickLength.count() > 0 ? tickLength : std::chrono::milliseconds(1)), current(0), count(0)
+{
+    for (int level = 0; level < LEVELS; ++level)
+    {
+        for (uint64_t slot = 0; slot < SLOTS; ++slot)
+        {
+            slots[level][slot].prev = &slots[level][slot];
+            slots[level][slot].next = &slots[level][slot];
+        }
+    }
+}
+
+uint64_t TimerWheel::tickOf(Clock::time_point when) const
+{
+    if (when <= origin)
+    {
+        return 0;
+    }
+    // Rounded up, so a timer never fires early
+    uint64_t elapsed = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(when - origin).count());
+    uint64_t length = static_cast<uint64_t>(tick.count());
+    return (elapsed + length - 1) / length;
+}
+
+void TimerWheel::link(Timer &timer)
+{
+    // The level is picked by how far away the expiry is; past the top level
+    // the timer waits in the top level's furthest slot and moves down later
+    uint64_t delta = timer.expiry > current ? timer.expiry - current : 0;
+    int level = 0;
+    while (level < LEVELS - 1 && delta >= (SLOTS << (level * SLOT_BITS)))
+    {
+        ++level;
+    }
+    uint64_t expiry = timer.expiry;
+    if (level == LEVELS - 1 && delta >= (SLOTS << (level * SLOT_BITS)))
+    {
+        expiry = current + (SLOTS << (level * SLOT_BITS)) - 1;
+    }
+    Timer &head = slots[level][(expiry >> (level * SLOT_BITS)) & (SLOTS - 1)];
+
+    timer.next = &head;
+    timer.prev = head.prev;
+    head.prev->next = &timer;
+    head.prev = &timer;
+}
+
+void TimerWheel::unlink(Timer &timer)
+{
+    timer.prev->next = timer.next;
+    timer.next->prev = timer.prev;
+    timer.prev = nullptr;
+    timer.next = nullptr;
+}
+
+void TimerWheel::schedule(Timer &timer, Clock::time_point when)
+{
+    if (timer.pending())
+    {
+        unlink(timer);
+        --count;
+    }
+    uint64_t expiry = tickOf(when);
+    timer.expiry = expiry > current ? expiry : current + 1;
+    link(timer);
+    ++count;
+}
+
+void TimerWheel::cancel(Timer &timer)
+{
+    if (timer.pending())
+    {
+        unlink(timer);
+        --count;
+    }
+}
+
+void TimerWheel::cascade(int level)
+{
+    // Everything in this slot is now less than one slot of the level below away
+    Timer &head = slots[level][(current >> (level * SLOT_BITS)) & (SLOTS - 1)];
+    while (head.next != &head)
+    {
+        Timer &timer = *head.next;
+        unlink(timer);
+        link(timer);
+    }
+}
+
+void TimerWheel::advance(Clock::time_point now, const std::function<void(Timer &)> &onExpire)
+{
+    uint64_t target = tickOf(now);
+    // Rounded up above; only ticks that have fully passed are processed
+    if (target > 0 && origin + tick * target > now)
+    {
+        --target;
+    }
+
+    while (current < target && count > 0)
+    {
+        ++current;
+        for (int level = 1; level < LEVELS; ++level)
+        {
+            if ((current & ((static_cast<uint64_t>(1) << (level * SLOT_BITS)) - 1)) != 0)
+            {
+                break;
+            }
+            cascade(level);
+        }
+
+        // Detached first: callbacks may schedule new timers, never into this slot
+        Timer &head = slots[0][current & (SLOTS - 1)];
+        Timer due;
+        if (head.next == &head)
+        {
+            continue;
+        }
+        due.next = head.next;
+        due.prev = head.prev;
+        due.next->prev = &due;
+        due.prev->next = &due;
+        head.next = &head;
+        head.prev = &head;
+
+        while (due.next != &due)
+        {
+            Timer &timer = *due.next;
+            unlink(timer);
+            --count;
+            onExpire(timer);
+        }
+    }
+    // Nothing left to fire: jump straight to the present
+    if (count == 0 && current < target)
+    {
+        current = target;
+    }
+}
+
+TimerWheel::Clock::time_point TimerWheel::nextWakeup() const
+{
+    for (uint64_t ahead = 1; ahead <= SLOTS; ++ahead)
+    {
+        uint64_t at = current + ahead;
+        const Timer &head = slots[0][at & (SLOTS - 1)];
+        if (head.next != &head || (at & (SLOTS - 1)) == 0)
+        {
+            // A timer is due, or higher levels move down at that tick
+            return origin + tick * at;
+        }
+    }
+    return origin + tick * (current + SLOTS);
+}
@@ -0,0 +1,68 @@
+// TimerWheel.hpp
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <functional>
+
+// Hierarchical timing wheel for per-connection deadlines. Time advances in
+// fixed ticks; level 0 has one slot per tick for the next SLOTS ticks, and
+// each higher level has slots SLOTS times as wide. Scheduling and cancelling
+// a timer link or unlink it from one slot's list, O(1) whatever the number of
+// timers. Timers on a higher level move down once when time reaches their
+// slot, so every timer is touched at most LEVELS times before it fires.
+//
+// Timers are intrusive: the owner embeds a Timer (or derives from it) and
+// must cancel it before destroying it. Not thread-safe; each event loop has
+// its own wheel and the threaded mode guards its wheel with a lock.
+class TimerWheel
+{
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Timer
+    {
+        Timer *prev;     // nullptr while not scheduled
+        Timer *next;
+        uint64_t expiry; // Tick it fires at
+        int64_t key;     // Free for the owner, e.g. the socket the timer belongs to
+
+        Timer() : prev(nullptr), next(nullptr), expiry(0), key(0) {}
+        bool pending() const { return prev != nullptr; }
+    };
+
+    static const int LEVELS = 4;
+    static const int SLOT_BITS = 6;
+    static const uint64_t SLOTS = 1 << SLOT_BITS;
+
+private:
+    Clock::time_point origin;
+    std::chrono::milliseconds tick;
+    uint64_t current; // Last tick processed
+    size_t count;
+    Timer slots[LEVELS][SLOTS]; // List heads; an empty list points at itself
+
+    uint64_t tickOf(Clock::time_point when) const;
+    void link(Timer &timer);
+    static void unlink(Timer &timer);
+    void cascade(int level);
+
+    TimerWheel(const TimerWheel &) = delete;
+    TimerWheel &operator=(const TimerWheel &) = delete;
+
+public:
+    explicit TimerWheel(std::chrono::milliseconds tickLength);
+
+    // Fires at the first tick at or after when; reschedules if already pending
+    void schedule(Timer &timer, Clock::time_point when);
+    void cancel(Timer &timer);
+
+    // Fires every timer due by now, in tick order. onExpire may schedule the
+    // timer it was given again, or any other.
+    void advance(Clock::time_point now, const std::function<void(Timer &)> &onExpire);
+
+    // When advance() next has work to do: the next tick with a timer in it,
+    // or the next time timers move down a level. Only meaningful when !empty().
+    Clock::time_point nextWakeup() const;
+    bool empty() const { return count == 0; }
+    size_t size() const { return count; }
+};
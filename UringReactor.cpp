@@ -0,0 +1,712 @@
+#include "UringReactor.hpp"
+#include "ConsoleUtils.hpp"
+#include "Logger.hpp"
+#include <iostream>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING 1
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <cerrno>
+#include <cstring>
+
+namespace
+{
+    const unsigned RING_ENTRIES = 1024;
+
+    // Receive buffers registered with the ring; later connections use RECV
+    const int REGISTERED_READ_SLOTS = 256;
+    const size_t READ_SLOT_SIZE = RECV_BUFFER_SIZE;
+
+    // Accepts kept outstanding so a burst of connections does not take one
+    // loop iteration each
+    const int ACCEPT_DEPTH = 4;
+
+    // Request kind in the low byte of user_data, socket above it (for an
+    // accept, its slot, so each one can be cancelled on its own). A socket is
+    // only closed once none of its requests are in flight, so a completion
+    // can never refer to a reused descriptor.
+    enum Operation : uint64_t
+    {
+        OP_ACCEPT = 1,
+        OP_WAKE,
+        OP_TIMER,
+        OP_READ,
+        OP_SEND,
+        OP_CANCEL
+    };
+
+    uint64_t packUserData(socket_t socket, Operation op)
+    {
+        return (static_cast<uint64_t>(socket) << 8) | op;
+    }
+
+    int ioUringSetup(unsigned entries, io_uring_params *params)
+    {
+        return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+    }
+
+    int ioUringEnter(int ringFd, unsigned toSubmit, unsigned minComplete, unsigned flags)
+    {
+        return static_cast<int>(syscall(__NR_io_uring_enter, ringFd, toSubmit, minComplete, flags, nullptr, 0));
+    }
+
+    int ioUringRegister(int ringFd, unsigned opcode, const void *arg, unsigned count)
+    {
+        return static_cast<int>(syscall(__NR_io_uring_register, ringFd, opcode, arg, count));
+    }
+
+    template <typename T>
+    T *ringField(void *ring, unsigned offset)
+    {
+        return reinterpret_cast<T *>(static_cast<char *>(ring) + offset);
+    }
+}
+
+UringReactor::UringReactor(ChatServer &owner, socket_t listeningSocket, bool closeListener, size_t index)
+    : Reactor(owner, listeningSocket, closeListener, index), ringFd(-1), sqRing(MAP_FAILED), cqRing(MAP_FAILED),
+      sqRingSize(0), cqRingSize(0), sqes(static_cast<io_uring_sqe *>(MAP_FAILED)), sqesSize(0),
+      sqHead(nullptr), sqTail(nullptr), sqMask(0), sqEntries(0), sqArray(nullptr),
+      cqHead(nullptr), cqTail(nullptr), cqMask(0), cqes(nullptr), unsubmitted(0), outstanding(0), draining(false),
+      readArena(nullptr), wakeCounter(0), timerExpirations(0)
+{
+}
+
+UringReactor::~UringReactor()
+{
+    closeRing();
+    delete[] readArena;
+}
+
+void UringReactor::closeRing()
+{
+    // Closing the ring cancels whatever is still in flight
+    if (sqes != MAP_FAILED)
+    {
+        munmap(sqes, sqesSize);
+        sqes = static_cast<io_uring_sqe *>(MAP_FAILED);
+    }
+    if (cqRing != MAP_FAILED && cqRing != sqRing)
+    {
+        munmap(cqRing, cqRingSize);
+    }
+    cqRing = MAP_FAILED;
+    if (sqRing != MAP_FAILED)
+    {
+        munmap(sqRing, sqRingSize);
+        sqRing = MAP_FAILED;
+    }
+    if (ringFd >= 0)
+    {
+        close(ringFd);
+        ringFd = -1;
+    }
+}
+
+bool UringReactor::open()
+{
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ringFd = ioUringSetup(RING_ENTRIES, &params);
+    if (ringFd < 0)
+    {
+        // ENOSYS on old kernels, EPERM where io_uring is disabled by policy
+        return false;
+    }
+
+    sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool singleMap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (singleMap && cqRingSize > sqRingSize)
+    {
+        sqRingSize = cqRingSize;
+    }
+
+    sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+    if (sqRing == MAP_FAILED)
+    {
+        closeRing();
+        return false;
+    }
+    cqRing = singleMap ? sqRing
+                       : mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+    sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    sqes = static_cast<io_uring_sqe *>(mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES));
+    if (cqRing == MAP_FAILED || sqes == MAP_FAILED)
+    {
+        closeRing();
+        return false;
+    }
+
+    sqHead = ringField<unsigned>(sqRing, params.sq_off.head);
+    sqTail = ringField<unsigned>(sqRing, params.sq_off.tail);
+    sqMask = *ringField<unsigned>(sqRing, params.sq_off.ring_mask);
+    sqEntries = *ringField<unsigned>(sqRing, params.sq_off.ring_entries);
+    sqArray = ringField<unsigned>(sqRing, params.sq_off.array);
+    cqHead = ringField<unsigned>(cqRing, params.cq_off.head);
+    cqTail = ringField<unsigned>(cqRing, params.cq_off.tail);
+    cqMask = *ringField<unsigned>(cqRing, params.cq_off.ring_mask);
+    cqes = ringField<io_uring_cqe>(cqRing, params.cq_off.cqes);
+
+    // Registration pins the pool, which RLIMIT_MEMLOCK may not allow; plain
+    // RECV still works without it
+    readArena = new char[REGISTERED_READ_SLOTS * READ_SLOT_SIZE];
+    iovec pool;
+    pool.iov_base = readArena;
+    pool.iov_len = REGISTERED_READ_SLOTS * READ_SLOT_SIZE;
+    if (ioUringRegister(ringFd, IORING_REGISTER_BUFFERS, &pool, 1) == 0)
+    {
+        for (int slot = REGISTERED_READ_SLOTS - 1; slot >= 0; --slot)
+        {
+            freeSlots.push_back(slot);
+        }
+    }
+    else
+    {
+        std::cout << YELLOW_COLOR "Could not register io_uring read buffers, using plain receives" RESET_COLOR << std::endl;
+        delete[] readArena;
+        readArena = nullptr;
+    }
+
+    if (!openWakeFd() || (needsTimer() && !openTimer(false)))
+    {
+        return false;
+    }
+
+    // The ring waits for readiness itself, so the eventfd and listener stay
+    // blocking; a non-blocking descriptor would just complete with -EAGAIN
+    int flags = fcntl(wakeFd, F_GETFL, 0);
+    return flags >= 0 && fcntl(wakeFd, F_SETFL, flags & ~O_NONBLOCK) == 0;
+}
+
+io_uring_sqe *UringReactor::nextSqe(uint8_t opcode, int fd, uint64_t userData)
+{
+    unsigned tail = *sqTail;
+    while (tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries)
+    {
+        // Submission ring full: hand the batch to the kernel to make room
+        if (enter(0) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+        {
+            return nullptr;
+        }
+    }
+
+    unsigned index = tail & sqMask;
+    io_uring_sqe *sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = userData;
+    sqArray[index] = index;
+    __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+    ++unsubmitted;
+    ++outstanding;
+    return sqe;
+}
+
+int UringReactor::enter(unsigned waitFor)
+{
+    int submitted = ioUringEnter(ringFd, unsubmitted, waitFor, waitFor > 0 ? IORING_ENTER_GETEVENTS : 0);
+    if (submitted > 0)
+    {
+        unsubmitted -= submitted;
+    }
+    return submitted;
+}
+
+void UringReactor::run()
+{
+    enterLoop();
+    draining = false;
+
+    for (int slot = 0; slot < ACCEPT_DEPTH; ++slot)
+    {
+        submitAccept(slot);
+    }
+    submitWakeRead();
+    submitTimerRead();
+
+    // Connections kept through a handoff that failed had their requests cancelled
+    std::vector<socket_t> kept;
+    for (auto &entry : connections)
+    {
+        kept.push_back(entry.first);
+    }
+    for (socket_t clientSocket : kept)
+    {
+        UringConnection *conn = find(clientSocket);
+        if (conn != nullptr && !conn->closing)
+        {
+            // A held connection reads again once its hold timer releases it
+            if (!conn->held)
+            {
+                submitRead(*conn);
+            }
+            markDirty(*conn);
+        }
+    }
+
+    while (isRunning())
+    {
+        // One system call submits everything queued by the last batch and
+        // waits for at least one completion
+        if (enter(1) < 0 && errno != EINTR && errno != EBUSY && errno != EAGAIN)
+        {
+            Logger::text(LogLevel::Error, "io_uring_enter failed");
+            break;
+        }
+
+        reapCompletions();
+
+        // Broadcasts from other shards and due heartbeats, then everything the
+        // batch enqueued goes out, at most one send request per client
+        drainInbox();
+        expireTimers();
+        flushDirty();
+    }
+
+    if (isHandingOff())
+    {
+        // Still on the loop: input that completes meanwhile is processed as usual
+        quiesce();
+        leaveLoop();
+        return;
+    }
+    leaveLoop();
+    closeRing();
+    closeAll();
+}
+
+void UringReactor::quiesce()
+{
+    // A receive left in flight could take bytes the successor never sees, so
+    // every request is cancelled; those that already completed are handled,
+    // and nothing new is submitted until run() starts over
+    draining = true;
+    for (int slot = 0; slot < ACCEPT_DEPTH; ++slot)
+    {
+        submitCancel(packUserData(slot, OP_ACCEPT));
+    }
+    submitCancel(packUserData(0, OP_WAKE));
+    if (timerFd >= 0)
+    {
+        submitCancel(packUserData(0, OP_TIMER));
+    }
+    for (auto &entry : connections)
+    {
+        UringConnection &conn = static_cast<UringConnection &>(*entry.second);
+        if (conn.inFlight == 0)
+        {
+            continue;
+        }
+        submitCancel(packUserData(conn.socket, OP_READ));
+        if (conn.wantWrite)
+        {
+            submitCancel(packUserData(conn.socket, OP_SEND));
+        }
+    }
+
+    // Blocking eventfd and timerfd reads may sit in a kernel worker where a
+    // cancel cannot reach them; make them complete instead
+    stop();
+    if (timerFd >= 0)
+    {
+        armTimer(std::chrono::steady_clock::now());
+    }
+
+    while (outstanding > 0)
+    {
+        if (enter(1) < 0 && errno != EINTR && errno != EBUSY && errno != EAGAIN)
+        {
+            Logger::text(LogLevel::Error, "io_uring_enter failed while handing off");
+            return;
+        }
+        reapCompletions();
+    }
+}
+
+void UringReactor::reapCompletions()
+{
+    unsigned head = *cqHead;
+    unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+
+    while (head != tail)
+    {
+        const io_uring_cqe &cqe = cqes[head & cqMask];
+        uint64_t userData = cqe.user_data;
+        int result = cqe.res;
+        // Release the entry before handling it, handlers may queue new requests
+        ++head;
+        __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+        --outstanding;
+
+        socket_t clientSocket = static_cast<socket_t>(userData >> 8);
+        switch (static_cast<Operation>(userData & 0xff))
+        {
+        case OP_ACCEPT:
+            onAccept(static_cast<int>(clientSocket), result);
+            break;
+        case OP_WAKE:
+            if (!draining)
+            {
+                submitWakeRead();
+            }
+            break;
+        case OP_TIMER:
+            onTimer();
+            if (!draining)
+            {
+                submitTimerRead();
+            }
+            break;
+        case OP_READ:
+            onRead(clientSocket, result);
+            break;
+        case OP_SEND:
+            onSend(clientSocket, result);
+            break;
+        case OP_CANCEL:
+            // -ENOENT when the request completed first, which is just as good
+            break;
+        }
+
+        if (head == tail)
+        {
+            tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+        }
+    }
+}
+
+void UringReactor::submitAccept(int slot)
+{
+    io_uring_sqe *sqe = nextSqe(IORING_OP_ACCEPT, listenSocket, packUserData(slot, OP_ACCEPT));
+    if (sqe != nullptr)
+    {
+        sqe->accept_flags = SOCK_CLOEXEC;
+    }
+}
+
+void UringReactor::submitWakeRead()
+{
+    io_uring_sqe *sqe = nextSqe(IORING_OP_READ, wakeFd, packUserData(0, OP_WAKE));
+    if (sqe != nullptr)
+    {
+        sqe->addr = reinterpret_cast<uint64_t>(&wakeCounter);
+        sqe->len = sizeof(wakeCounter);
+    }
+}
+
+void UringReactor::submitTimerRead()
+{
+    // Blocks in the kernel until the timer expires, like the eventfd read
+    if (timerFd < 0)
+    {
+        return;
+    }
+    io_uring_sqe *sqe = nextSqe(IORING_OP_READ, timerFd, packUserData(0, OP_TIMER));
+    if (sqe != nullptr)
+    {
+        sqe->addr = reinterpret_cast<uint64_t>(&timerExpirations);
+        sqe->len = sizeof(timerExpirations);
+    }
+}
+
+void UringReactor::submitCancel(uint64_t target)
+{
+    io_uring_sqe *sqe = nextSqe(IORING_OP_ASYNC_CANCEL, -1, packUserData(0, OP_CANCEL));
+    if (sqe != nullptr)
+    {
+        sqe->addr = target;
+    }
+}
+
+void UringReactor::submitRead(UringConnection &conn)
+{
+    io_uring_sqe *sqe;
+    if (conn.readSlot >= 0)
+    {
+        sqe = nextSqe(IORING_OP_READ_FIXED, conn.socket, packUserData(conn.socket, OP_READ));
+        if (sqe != nullptr)
+        {
+            sqe->addr = reinterpret_cast<uint64_t>(readArena + conn.readSlot * READ_SLOT_SIZE);
+            sqe->len = READ_SLOT_SIZE;
+            sqe->buf_index = 0;
+        }
+    }
+    else
+    {
+        sqe = nextSqe(IORING_OP_RECV, conn.socket, packUserData(conn.socket, OP_READ));
+        if (sqe != nullptr)
+        {
+            sqe->addr = reinterpret_cast<uint64_t>(conn.ownBuffer.data());
+            sqe->len = conn.ownBuffer.size();
+        }
+    }
+
+    if (sqe == nullptr)
+    {
+        beginClose(conn);
+        return;
+    }
+    ++conn.inFlight;
+}
+
+void UringReactor::writeToClient(Connection &base)
+{
+    UringConnection &conn = static_cast<UringConnection &>(base);
+    conn.dirty = false;
+    if (conn.closing || conn.wantWrite)
+    {
+        return;
+    }
+
+    int count = conn.outbound.prepareSend(conn.parts, SendQueue::MAX_BATCH);
+    if (count == 0)
+    {
+        return;
+    }
+
+    memset(&conn.header, 0, sizeof(conn.header));
+    conn.header.msg_iov = conn.parts;
+    conn.header.msg_iovlen = count;
+
+    io_uring_sqe *sqe = nextSqe(IORING_OP_SENDMSG, conn.socket, packUserData(conn.socket, OP_SEND));
+    if (sqe == nullptr)
+    {
+        conn.outbound.completeSend(0);
+        shutdownSocket(conn.socket);
+        return;
+    }
+    sqe->addr = reinterpret_cast<uint64_t>(&conn.header);
+    sqe->len = 1;
+    sqe->msg_flags = SEND_FLAGS;
+    conn.wantWrite = true;
+    ++conn.inFlight;
+}
+
+UringReactor::UringConnection *UringReactor::newConnection(socket_t clientSocket)
+{
+    UringConnection *conn = new UringConnection(clientSocket, config.sendQueueLimit, config.overflowPolicy);
+    if (!freeSlots.empty())
+    {
+        conn->readSlot = freeSlots.back();
+        freeSlots.pop_back();
+    }
+    else
+    {
+        conn->ownBuffer.resize(RECV_BUFFER_SIZE);
+    }
+    return conn;
+}
+
+void UringReactor::onAccept(int slot, int result)
+{
+    if (!isRunning() && !draining)
+    {
+        if (result >= 0)
+        {
+            close(result);
+        }
+        return;
+    }
+    if (!draining)
+    {
+        submitAccept(slot);
+    }
+    if (result < 0)
+    {
+        // Per-connection noise (aborted handshake, fd limit) or a cancelled accept
+        return;
+    }
+
+    // Accepted while draining: handed off with the rest, its first read comes from the successor
+    UringConnection *conn = newConnection(result);
+    addConnection(conn);
+    if (!draining)
+    {
+        submitRead(*conn);
+    }
+}
+
+Reactor::Connection *UringReactor::adoptConnection(socket_t clientSocket)
+{
+    // Receives wait in the kernel, so the socket blocks like an accepted one
+    if (!setNonBlocking(clientSocket, false))
+    {
+        return nullptr;
+    }
+    return newConnection(clientSocket);
+}
+
+void UringReactor::adopt(const HandoffClient &client)
+{
+    Reactor::adopt(client);
+    UringConnection *conn = find(client.socket);
+    if (conn != nullptr)
+    {
+        submitRead(*conn);
+    }
+}
+
+void UringReactor::onRead(socket_t clientSocket, int result)
+{
+    UringConnection *conn = find(clientSocket);
+    if (conn == nullptr)
+    {
+        return;
+    }
+    --conn->inFlight;
+
+    if (conn->closing)
+    {
+        beginClose(*conn);
+        return;
+    }
+    if (draining && (result == -ECANCELED || result == -EAGAIN || result == -EINTR))
+    {
+        return;
+    }
+    if (result == -EAGAIN || result == -EINTR)
+    {
+        submitRead(*conn);
+        return;
+    }
+    if (result <= 0)
+    {
+        beginClose(*conn);
+        return;
+    }
+
+    const char *data = (conn->readSlot >= 0) ? readArena + conn->readSlot * READ_SLOT_SIZE : conn->ownBuffer.data();
+    if (!handleInput(*conn, data, result))
+    {
+        beginClose(*conn);
+        return;
+    }
+    // A held connection gets its next read from holdChanged()
+    if (!draining && !conn->held)
+    {
+        submitRead(*conn);
+    }
+}
+
+void UringReactor::holdChanged(Connection &base)
+{
+    UringConnection &conn = static_cast<UringConnection &>(base);
+    if (!conn.held && !conn.closing && !draining)
+    {
+        submitRead(conn);
+    }
+}
+
+void UringReactor::onSend(socket_t clientSocket, int result)
+{
+    UringConnection *conn = find(clientSocket);
+    if (conn == nullptr)
+    {
+        return;
+    }
+    --conn->inFlight;
+    conn->wantWrite = false;
+    conn->outbound.completeSend(result > 0 ? result : 0);
+
+    if (conn->closing)
+    {
+        beginClose(*conn);
+        return;
+    }
+    if (draining)
+    {
+        // Whatever is left stays queued and goes to the successor
+        return;
+    }
+    if (result < 0 && result != -EAGAIN && result != -EINTR)
+    {
+        // Broken peer: the pending read completes with an error and cleans up
+        shutdownSocket(conn->socket);
+        return;
+    }
+    // Short write or more queued meanwhile: keep going right away
+    writeToClient(*conn);
+}
+
+void UringReactor::beginClose(UringConnection &conn)
+{
+    conn.closing = true;
+    if (conn.inFlight > 0)
+    {
+        // Make the outstanding requests complete promptly, finish up then
+        shutdownSocket(conn.socket);
+        return;
+    }
+    release(conn);
+}
+
+void UringReactor::release(UringConnection &conn)
+{
+    if (conn.readSlot >= 0)
+    {
+        freeSlots.push_back(conn.readSlot);
+    }
+    closeClient(conn.socket);
+}
+
+UringReactor::UringConnection *UringReactor::find(socket_t clientSocket)
+{
+    auto it = connections.find(clientSocket);
+    if (it == connections.end())
+    {
+        return nullptr;
+    }
+    return static_cast<UringConnection *>(it->second.get());
+}
+
+#else
+
+UringReactor::UringReactor(ChatServer &owner, socket_t listeningSocket, bool closeListener, size_t index)
+    : Reactor(owner, listeningSocket, closeListener, index), ringFd(-1), sqRing(nullptr), cqRing(nullptr),
+      sqRingSize(0), cqRingSize(0), sqes(nullptr), sqesSize(0), sqHead(nullptr), sqTail(nullptr),
+      sqMask(0), sqEntries(0), sqArray(nullptr), cqHead(nullptr), cqTail(nullptr), cqMask(0),
+      cqes(nullptr), unsubmitted(0), outstanding(0), draining(false), readArena(nullptr), wakeCounter(0),
+      timerExpirations(0)
+{
+}
+
+UringReactor::~UringReactor() {}
+
+bool UringReactor::open()
+{
+    // io_uring is Linux-only
+    return false;
+}
+
+void UringReactor::run() {}
+void UringReactor::closeRing() {}
+io_uring_sqe *UringReactor::nextSqe(uint8_t, int, uint64_t) { return nullptr; }
+int UringReactor::enter(unsigned) { return -1; }
+void UringReactor::reapCompletions() {}
+void UringReactor::submitAccept(int) {}
+void UringReactor::submitWakeRead() {}
+void UringReactor::submitTimerRead() {}
+void UringReactor::submitRead(UringConnection &) {}
+void UringReactor::submitCancel(uint64_t) {}
+void UringReactor::quiesce() {}
+UringReactor::UringConnection *UringReactor::newConnection(socket_t) { return nullptr; }
+Reactor::Connection *UringReactor::adoptConnection(socket_t) { return nullptr; }
+void UringReactor::adopt(const HandoffClient &) {}
+void UringReactor::writeToClient(Connection &) {}
+void UringReactor::holdChanged(Connection &) {}
+void UringReactor::onAccept(int, int) {}
+void UringReactor::onRead(socket_t, int) {}
+void UringReactor::onSend(socket_t, int) {}
+void UringReactor::beginClose(UringConnection &) {}
+void UringReactor::release(UringConnection &) {}
+UringReactor::UringConnection *UringReactor::find(socket_t) { return nullptr; }
+
+#endif
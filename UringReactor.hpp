@@ -0,0 +1,93 @@
+// UringReactor.hpp
+#pragma once
+#include "Reactor.hpp"
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+// Completion-based backend on io_uring. Accepts, receives and sends are
+// submitted as requests and the kernel performs them; every loop iteration
+// submits everything queued so far and reaps all completions with a single
+// io_uring_enter() call. Receives land in buffers registered with the ring
+// up front (READ_FIXED), so the kernel does not have to pin and map user
+// memory for every read; connections beyond the registered pool fall back to
+// plain RECV into their own buffer. Talks to the kernel through the raw
+// system calls, so no liburing is needed. open() fails when the kernel lacks
+// io_uring (or it is disabled), and the server then uses EpollReactor.
+class UringReactor : public Reactor
+{
+private:
+    struct UringConnection : Connection
+    {
+        int readSlot;                 // Registered buffer index, -1 when reading into ownBuffer
+        std::vector<char> ownBuffer;
+        int inFlight;                 // Submitted requests whose completion has not been reaped
+        bool closing;                 // Waiting for in-flight requests before the socket is closed
+#ifndef _WIN32
+        iovec parts[SendQueue::MAX_BATCH];
+        msghdr header;                // Must stay valid until the SENDMSG completes
+#endif
+
+        UringConnection(socket_t clientSocket, size_t queueLimit, OverflowPolicy policy)
+            : Connection(clientSocket, queueLimit, policy), readSlot(-1), inFlight(0), closing(false)
+        {
+        }
+    };
+
+    int ringFd;
+    void *sqRing;
+    void *cqRing;
+    size_t sqRingSize;
+    size_t cqRingSize;
+    io_uring_sqe *sqes;
+    size_t sqesSize;
+    unsigned *sqHead;
+    unsigned *sqTail;
+    unsigned sqMask;
+    unsigned sqEntries;
+    unsigned *sqArray;
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned cqMask;
+    io_uring_cqe *cqes;
+    unsigned unsubmitted; // SQEs queued since the last io_uring_enter()
+    unsigned outstanding; // Submitted requests whose completion has not been reaped
+    bool draining;        // Handing off: requests are cancelled and nothing new is submitted
+
+    char *readArena;      // Registered receive buffers, READ_SLOT_SIZE bytes each
+    std::vector<int> freeSlots;
+    uint64_t wakeCounter; // Target of the pending eventfd read
+    uint64_t timerExpirations; // Target of the pending timer read
+
+    io_uring_sqe *nextSqe(uint8_t opcode, int fd, uint64_t userData);
+    int enter(unsigned waitFor);
+    void reapCompletions();
+
+    void submitAccept(int slot);
+    void submitWakeRead();
+    void submitTimerRead();
+    void submitRead(UringConnection &conn);
+    void submitCancel(uint64_t target);
+    // Cancels every request and reaps until none is left in flight
+    void quiesce();
+    UringConnection *newConnection(socket_t clientSocket);
+    void onAccept(int slot, int result);
+    void onRead(socket_t clientSocket, int result);
+    void onSend(socket_t clientSocket, int result);
+    void beginClose(UringConnection &conn);
+    void release(UringConnection &conn);
+    UringConnection *find(socket_t clientSocket);
+    void closeRing();
+
+protected:
+    void writeToClient(Connection &conn) override;
+    void holdChanged(Connection &conn) override;
+    Connection *adoptConnection(socket_t clientSocket) override;
+
+public:
+    UringReactor(ChatServer &owner, socket_t listeningSocket, bool closeListener, size_t index);
+    ~UringReactor();
+    bool open() override;
+    void run() override;
+    void adopt(const HandoffClient &client) override;
+};
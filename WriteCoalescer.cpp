@@ -0,0 +1,119 @@
+#include "WriteCoalescer.hpp"
+#include "Metrics.hpp"
+
+WriteCoalescer::WriteCoalescer(const DeliveryPolicy &policy)
+    : delivery(policy), stopping(false)
+{
+}
+
+WriteCoalescer::~WriteCoalescer()
+{
+    stop();
+}
+
+void WriteCoalescer::start()
+{
+    stopping = false;
+    flusher = std::thread(&WriteCoalescer::run, this);
+}
+
+void WriteCoalescer::stop()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    ready.notify_one();
+    if (flusher.joinable())
+    {
+        flusher.join();
+    }
+    // Output still waiting stays queued; a handler thread writes it once the queue is free again
+    for (const std::shared_ptr<SendQueue> &queue : waiting)
+    {
+        queue->unschedule();
+    }
+    waiting.clear();
+}
+
+void WriteCoalescer::write(SendQueue &queue)
+{
+    // Pending output is retried by the owning handler thread once the socket is writable
+    if (queue.flush() == SendQueue::FlushResult::Failed)
+    {
+        shutdownSocket(queue.getSocket());
+    }
+}
+
+void WriteCoalescer::submit(const std::shared_ptr<SendQueue> &queue)
+{
+    if (queue->pendingBytes() >= delivery.flushBytes)
+    {
+        write(*queue);
+        return;
+    }
+    // Already waiting: the new message goes out with the rest
+    if (!queue->schedule())
+    {
+        return;
+    }
+    Metrics::add(Counter::FlushesDeferred);
+
+    bool wasIdle;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        wasIdle = waiting.empty();
+        waiting.push_back(queue);
+    }
+    if (wasIdle)
+    {
+        ready.notify_one();
+    }
+}
+
+void WriteCoalescer::run()
+{
+    std::vector<std::shared_ptr<SendQueue>> batch;
+    std::vector<std::shared_ptr<SendQueue>> notDue;
+    std::unique_lock<std::mutex> guard(lock);
+    while (!stopping)
+    {
+        if (waiting.empty())
+        {
+            ready.wait(guard);
+            continue;
+        }
+
+        batch.swap(waiting);
+        guard.unlock();
+
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        std::chrono::steady_clock::time_point earliest;
+        for (const std::shared_ptr<SendQueue> &queue : batch)
+        {
+            std::chrono::steady_clock::time_point deadline;
+            if (!queue->flushDue(delivery, now, deadline))
+            {
+                if (notDue.empty() || deadline < earliest)
+                {
+                    earliest = deadline;
+                }
+                notDue.push_back(queue);
+                continue;
+            }
+            // Released first: output queued while this write runs schedules it again
+            queue->unschedule();
+            write(*queue);
+        }
+        batch.clear();
+
+        guard.lock();
+        waiting.insert(waiting.end(), notDue.begin(), notDue.end());
+        if (!notDue.empty())
+        {
+            notDue.clear();
+            ready.wait_until(guard, earliest, [this]()
+                             { return stopping; });
+        }
+    }
+}
@@ -0,0 +1,38 @@
+// WriteCoalescer.hpp
+#pragma once
+#include "SendQueue.hpp"
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+// Coalesce delivery for the threaded mode. Threads that broadcast only
+// queue the message and hand the recipient's queue over; one background
+// thread writes each queue once its oldest message has waited the window,
+// so a burst reaches a client in one write instead of one per message.
+// Reactors defer on their own loop thread and do not use this.
+class WriteCoalescer
+{
+private:
+    DeliveryPolicy delivery;
+    std::mutex lock;
+    std::condition_variable ready;
+    std::vector<std::shared_ptr<SendQueue>> waiting;
+    bool stopping;
+    std::thread flusher;
+
+    void run();
+    static void write(SendQueue &queue);
+
+public:
+    explicit WriteCoalescer(const DeliveryPolicy &policy);
+    ~WriteCoalescer();
+
+    void start();
+    void stop();
+
+    // Writes queue right away once it holds flushBytes, otherwise leaves it
+    // to the background thread
+    void submit(const std::shared_ptr<SendQueue> &queue);
+};
@@ -0,0 +1,182 @@
+#include "LoadGenerator.hpp"
+#include "BenchScenarios.hpp"
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <cstdlib>
+
+void printUsage(const char *program)
+{
+    std::cout << "Usage: " << program << " [--host IP] [--port N] [--servers IP:PORT,...] [--clients M] [--senders S] [--rate R] [--size B]" << std::endl;
+    std::cout << "       [--warmup SEC] [--duration SEC] [--drain SEC] [--threads N] [--label TEXT] [--append FILE] [--admin-port N]" << std::endl;
+    std::cout << "       [--check] [--scenario NAME]" << std::endl;
+    std::cout << "  --servers LIST  federated servers to spread the clients over, instead of --host/--port" << std::endl;
+    std::cout << "  --clients M     connections opened against the server (default 50)" << std::endl;
+    std::cout << "  --senders S     how many of them send, the rest only receive (default: all)" << std::endl;
+    std::cout << "  --rate R        messages per second across all senders (default 1000)" << std::endl;
+    std::cout << "  --size B        message body size in bytes (default 128)" << std::endl;
+    std::cout << "  --warmup SEC    load applied before measuring (default 1)" << std::endl;
+    std::cout << "  --duration SEC  measured time (default 10)" << std::endl;
+    std::cout << "  --drain SEC     longest wait for in-flight messages afterwards (default 2)" << std::endl;
+    std::cout << "  --threads N     load generator threads (default: one per core, at most 8)" << std::endl;
+    std::cout << "  --label TEXT    tag stored with the results, e.g. the server mode under test" << std::endl;
+    std::cout << "  --append FILE   also append the JSON result line to FILE" << std::endl;
+    std::cout << "  --admin-port N  server admin port on --host, read to report the server's heap allocations" << std::endl;
+    std::cout << "  --check         exit with 1 when a delivery is missing or arrives out of its sender's order" << std::endl;
+    std::cout << "  --scenario NAME run a scripted regression check instead of the load: resume, rooms" << std::endl;
+    std::cout << "The summary goes to stderr, a single JSON result line to stdout." << std::endl;
+}
+
+bool parseArguments(int argc, char *argv[], BenchConfig &config, std::string &appendPath)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg == "--check")
+        {
+            config.check = true;
+            continue;
+        }
+        if (i + 1 >= argc)
+        {
+            return false;
+        }
+        const char *value = argv[++i];
+
+        if (arg == "--host")
+        {
+            config.host = value;
+        }
+        else if (arg == "--port")
+        {
+            config.port = std::atoi(value);
+        }
+        else if (arg == "--servers")
+        {
+            std::string list = value;
+            size_t start = 0;
+            while (start <= list.size())
+            {
+                size_t comma = list.find(',', start);
+                std::string address = list.substr(start, comma == std::string::npos ? std::string::npos : comma - start);
+                if (!address.empty())
+                {
+                    config.servers.push_back(address);
+                }
+                if (comma == std::string::npos)
+                {
+                    break;
+                }
+                start = comma + 1;
+            }
+        }
+        else if (arg == "--clients")
+        {
+            config.clients = std::strtoul(value, nullptr, 10);
+        }
+        else if (arg == "--senders")
+        {
+            config.senders = std::strtoul(value, nullptr, 10);
+        }
+        else if (arg == "--rate")
+        {
+            config.rate = std::atof(value);
+        }
+        else if (arg == "--size")
+        {
+            config.messageSize = std::strtoul(value, nullptr, 10);
+        }
+        else if (arg == "--warmup")
+        {
+            config.warmup = std::atof(value);
+        }
+        else if (arg == "--duration")
+        {
+            config.duration = std::atof(value);
+        }
+        else if (arg == "--drain")
+        {
+            config.drain = std::atof(value);
+        }
+        else if (arg == "--threads")
+        {
+            config.threads = std::strtoul(value, nullptr, 10);
+        }
+        else if (arg == "--label")
+        {
+            config.label = value;
+        }
+        else if (arg == "--append")
+        {
+            appendPath = value;
+        }
+        else if (arg == "--admin-port")
+        {
+            config.adminPort = std::atoi(value);
+        }
+        else if (arg == "--scenario")
+        {
+            config.scenario = value;
+        }
+        else
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    BenchConfig config;
+    std::string appendPath;
+    if (!parseArguments(argc, argv, config, appendPath))
+    {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+#ifdef _WIN32
+    WSADATA wsaData;
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0)
+    {
+        std::cerr << "WSAStartup failed" << std::endl;
+        return 1;
+    }
+#endif
+
+    if (!config.scenario.empty())
+    {
+        bool passed = runScenario(config, std::cerr);
+        std::cerr << (passed ? "Scenario passed" : "Scenario failed") << std::endl;
+#ifdef _WIN32
+        WSACleanup();
+#endif
+        return passed ? 0 : 1;
+    }
+
+    LoadGenerator generator(config);
+    BenchResult result;
+    bool ok = generator.run(result);
+
+    if (ok)
+    {
+        generator.printSummary(std::cerr, result);
+        generator.printJson(std::cout, result);
+        if (!appendPath.empty())
+        {
+            std::ofstream out(appendPath.c_str(), std::ios::app);
+            generator.printJson(out, result);
+        }
+        if (!generator.passed(result))
+        {
+            std::cerr << "Check failed: deliveries missing or out of order" << std::endl;
+            ok = false;
+        }
+    }
+
+#ifdef _WIN32
+    WSACleanup();
+#endif
+    return ok ? 0 : 1;
+}
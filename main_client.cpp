@@ -1,5 +1,6 @@
 #include "ChatClient.hpp"
 #include "ConsoleUtils.hpp"
+#include "Protocol.hpp"
 #include <iostream>
 #include <string>
 
@@ -32,25 +33,40 @@ int main()
     std::cout << CYAN_COLOR "Enter your username: " RESET_COLOR;
     std::string username;
     std::getline(std::cin, username);
-    while (username.empty())
+    while (username.empty() || username.size() > MAX_USERNAME_LENGTH)
     {
-        std::cout << RED_COLOR "Username cannot be empty! Try again: " RESET_COLOR;
+        std::cout << RED_COLOR "Username must be 1-" << MAX_USERNAME_LENGTH << " characters! Try again: " RESET_COLOR;
         std::getline(std::cin, username);
     }
 
     std::cout << YELLOW_COLOR "Connecting to " << serverIP << "..." RESET_COLOR << std::endl;
-    if (!client.connect(serverIP, 12345))
+    JoinResult result;
+    while ((result = client.join(serverIP, 12345, username)) == JoinResult::NameTaken)
+    {
+        // The server's notice says why; any other free name will do
+        std::cout << CYAN_COLOR "Choose another username: " RESET_COLOR;
+        if (!std::getline(std::cin, username))
+        {
+            return 1;
+        }
+        while (username.empty() || username.size() > MAX_USERNAME_LENGTH)
+        {
+            std::cout << RED_COLOR "Username must be 1-" << MAX_USERNAME_LENGTH << " characters! Try again: " RESET_COLOR;
+            std::getline(std::cin, username);
+        }
+    }
+    if (result != JoinResult::Joined)
     {
         std::cout << RED_COLOR BOLD_TEXT "Failed to connect to server." RESET_COLOR << std::endl;
         return 1;
     }
 
-    // Send username to server as first message
-    client.sendMessage(username);
-
     clearScreen();
     std::cout << GREEN_COLOR BOLD_TEXT "===== Connected to Chat Server =====" RESET_COLOR << std::endl;
     std::cout << YELLOW_COLOR "Type 'exit' to quit or 'clear' to clear screen" RESET_COLOR << std::endl;
+    std::cout << YELLOW_COLOR "Rooms: /join NAME, /leave NAME, /room NAME to talk in a room you joined" RESET_COLOR << std::endl;
+    std::cout << YELLOW_COLOR "Private: /msg NAME TEXT, /who lists everyone online" RESET_COLOR << std::endl;
+    std::cout << YELLOW_COLOR "History: /search WORDS, add from:NAME for one user's messages" RESET_COLOR << std::endl;
 
     std::string message;
     while (std::getline(std::cin, message))
@@ -67,6 +83,39 @@ int main()
             std::cout << YELLOW_COLOR "Type 'exit' to quit or 'clear' to clear screen" RESET_COLOR << std::endl;
             continue;
         }
+        else if (message.compare(0, 6, "/join ") == 0 && message.size() > 6)
+        {
+            // Joining also makes it the room plain messages go to
+            client.joinRoom(message.substr(6));
+            client.switchRoom(message.substr(6));
+            continue;
+        }
+        else if (message.compare(0, 7, "/leave ") == 0 && message.size() > 7)
+        {
+            client.leaveRoom(message.substr(7));
+            continue;
+        }
+        else if (message.compare(0, 6, "/room ") == 0 && message.size() > 6)
+        {
+            client.switchRoom(message.substr(6));
+            continue;
+        }
+        else if (message.compare(0, 5, "/msg ") == 0 && message.find(' ', 5) != std::string::npos)
+        {
+            size_t space = message.find(' ', 5);
+            client.sendDirect(message.substr(5, space - 5), message.substr(space + 1));
+            continue;
+        }
+        else if (message == "/who")
+        {
+            client.listUsers();
+            continue;
+        }
+        else if (message.compare(0, 8, "/search ") == 0 && message.size() > 8)
+        {
+            client.search(message.substr(8));
+            continue;
+        }
 
         // No need to add username here as the server handles it with the stored username
         client.sendMessage(message);
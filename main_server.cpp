@@ -2,7 +2,11 @@
 #include "ConsoleUtils.hpp"
 #include <iostream>
 #include <string>
+#include <cstdlib>
 #include <thread>
+#include <mutex>
+#include <memory>
+#include <condition_variable>
 
 void clearScreen()
 {
@@ -13,34 +17,396 @@ void clearScreen()
 #endif
 }
 
-int main()
+struct StopSignal
 {
+    std::mutex lock;
+    std::condition_variable raised;
+    bool set = false;
+
+    void raise()
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        set = true;
+        raised.notify_all();
+    }
+
+    void wait()
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        raised.wait(guard, [this]()
+                    { return set; });
+    }
+};
+
+void printUsage(const char *program)
+{
+    std::cout << "Usage: " << program << " [--port N] [--mode threaded|epoll|sharded] [--io epoll|uring] [--shards N]" << std::endl;
+    std::cout << "       [--history N] [--replay N] [--max-rooms N] [--client-rooms N]" << std::endl;
+    std::cout << "       [--queue-limit BYTES] [--overflow drop-oldest|disconnect]" << std::endl;
+    std::cout << "       [--delivery low-latency|coalesce] [--coalesce-us N] [--coalesce-bytes N]" << std::endl;
+    std::cout << "       [--compress] [--compress-min BYTES]" << std::endl;
+    std::cout << "       [--flood-rate N] [--flood-burst N] [--flood-bytes N] [--flood-byte-burst N]" << std::endl;
+    std::cout << "       [--fanout-limit N] [--fanout-burst N] [--flood-policy delay|drop]" << std::endl;
+    std::cout << "       [--heartbeat S] [--idle-timeout S] [--handshake-timeout S]" << std::endl;
+    std::cout << "       [--admin-port N] [--admin-socket PATH] [--handoff-socket PATH] [--takeover PATH]" << std::endl;
+    std::cout << "       [--node NAME] [--peer-port N] [--peer-bind ADDR] [--peer-secret S] [--peer HOST:PORT]..." << std::endl;
+    std::cout << "       [--log-level debug|info|warn|error|off] [--log-file PATH] [--log-rate N]" << std::endl;
+    std::cout << "       [--log-dir DIR] [--log-segment-mb N] [--log-retain-mb N] [--log-retain-hours N] [--log-sync-ms N]" << std::endl;
+    std::cout << "  --port N          port clients connect to, the next free one of N..N+9 is used (default 12345)" << std::endl;
+    std::cout << "  --mode threaded   one thread per client (default)" << std::endl;
+    std::cout << "  --mode epoll      single event loop over non-blocking sockets (Linux)" << std::endl;
+    std::cout << "  --mode sharded    one event loop per core with SO_REUSEPORT listeners (Linux)" << std::endl;
+    std::cout << "  --io epoll|uring  I/O backend of the event loops; uring falls back to epoll when unsupported" << std::endl;
+    std::cout << "  --shards N        number of event loops in sharded mode (default: core count)" << std::endl;
+    std::cout << "  --history N       keep the last N messages of each room in memory (default 1000)" << std::endl;
+    std::cout << "  --replay N        send the last N messages of a room to clients joining it (default 50)" << std::endl;
+    std::cout << "  --max-rooms N     rooms that may exist at once, including the lobby (default 256)" << std::endl;
+    std::cout << "  --client-rooms N  rooms one client may be in at once, including the lobby (default 32)" << std::endl;
+    std::cout << "  --queue-limit B   unsent bytes allowed per client before it counts as slow (default 1 MiB)" << std::endl;
+    std::cout << "  --overflow P      what to do with slow clients: drop-oldest messages (default) or disconnect" << std::endl;
+    std::cout << "  --delivery D      low-latency writes every message at once (default), coalesce batches" << std::endl;
+    std::cout << "                    each client's output for up to --coalesce-us or --coalesce-bytes" << std::endl;
+    std::cout << "  --coalesce-us N   longest output waits to be coalesced, in microseconds (default 1000)" << std::endl;
+    std::cout << "  --coalesce-bytes N  queued bytes written without waiting for the window (default 16384)" << std::endl;
+    std::cout << "  --compress        compress long messages and history replays for clients that support it (default off)" << std::endl;
+    std::cout << "  --compress-min B  shortest message body worth compressing, implies --compress (default " << COMPRESS_MIN_BYTES << ")" << std::endl;
+    std::cout << "  --flood-rate N    messages per second one client may send, 0 = unlimited (default 0)" << std::endl;
+    std::cout << "  --flood-burst N   messages one client may send at once after a quiet spell (default one second's worth)" << std::endl;
+    std::cout << "  --flood-bytes N   message bytes per second one client may send, 0 = unlimited (default 0)" << std::endl;
+    std::cout << "  --flood-byte-burst N  message bytes one client may send at once (default one second's worth)" << std::endl;
+    std::cout << "  --fanout-limit N  deliveries per second across the server, a message to M clients counting M," << std::endl;
+    std::cout << "                    0 = unlimited (default 0)" << std::endl;
+    std::cout << "  --fanout-burst N  deliveries the server may make at once (default: one second's worth)" << std::endl;
+    std::cout << "  --flood-policy P  what to do with messages over the limits: delay them (default) or drop them" << std::endl;
+    std::cout << "  --heartbeat S     ping a client after S seconds without data from it, 0 = off (default 30)" << std::endl;
+    std::cout << "  --idle-timeout S  close connections that sent nothing for S seconds, 0 = off (default 90)" << std::endl;
+    std::cout << "  --handshake-timeout S  close connections that have not joined after S seconds, 0 = off (default 10)" << std::endl;
+    std::cout << "  --admin-port N    serve metrics on 127.0.0.1:N in the Prometheus text format (default off)" << std::endl;
+    std::cout << "  --admin-socket P  serve the same metrics on Unix socket P (default off)" << std::endl;
+    std::cout << "  --handoff-socket P  let a new server process take over every connection through Unix socket P (Linux)" << std::endl;
+    std::cout << "  --takeover P      take over the port and clients of the server listening on handoff socket P" << std::endl;
+    std::cout << "  --node NAME       this server's unique name among its peers (default: hostname:port)" << std::endl;
+    std::cout << "  --peer-port N     accept links from peer servers on port N (default off)" << std::endl;
+    std::cout << "  --peer-bind ADDR  IPv4 address the peer port listens on, 0.0.0.0 = all (default 127.0.0.1)" << std::endl;
+    std::cout << "  --peer-secret S   secret every peer server must present; set the same on all of them (default none)" << std::endl;
+    std::cout << "  --peer H:P        link to the peer server whose peer port is H:P; repeat for more peers" << std::endl;
+    std::cout << "  --log-level L     least severe server log lines to print (default info)" << std::endl;
+    std::cout << "  --log-file PATH   append the server log to PATH instead of the console" << std::endl;
+    std::cout << "  --log-rate N      log at most N chat lines per second, 0 = all (default 100)" << std::endl;
+    std::cout << "  --log-dir DIR     keep a durable message log in DIR and reload history from it (default off)" << std::endl;
+    std::cout << "  --log-segment-mb N  start a new log segment after N MiB (default 64)" << std::endl;
+    std::cout << "  --log-retain-mb N   delete the oldest segments beyond N MiB in total (default: keep all)" << std::endl;
+    std::cout << "  --log-retain-hours N  delete segments older than N hours (default: keep all)" << std::endl;
+    std::cout << "  --log-sync-ms N     longest a message waits to be written and fsynced (default 20)" << std::endl;
+}
+
+bool parseArguments(int argc, char *argv[], int &port, ServerConfig &config)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg == "--port" && i + 1 < argc)
+        {
+            port = std::atoi(argv[++i]);
+        }
+        else if (arg == "--mode" && i + 1 < argc)
+        {
+            std::string mode = argv[++i];
+            if (mode == "threaded")
+            {
+                config.mode = ServerMode::Threaded;
+            }
+            else if (mode == "epoll")
+            {
+                config.mode = ServerMode::Epoll;
+            }
+            else if (mode == "sharded")
+            {
+                config.mode = ServerMode::Sharded;
+            }
+            else
+            {
+                std::cerr << RED_COLOR "Unknown mode: " << mode << RESET_COLOR << std::endl;
+                return false;
+            }
+        }
+        else if (arg == "--io" && i + 1 < argc)
+        {
+            std::string backend = argv[++i];
+            if (backend == "epoll")
+            {
+                config.ioBackend = IoBackend::Epoll;
+            }
+            else if (backend == "uring")
+            {
+                config.ioBackend = IoBackend::IoUring;
+            }
+            else
+            {
+                std::cerr << RED_COLOR "Unknown I/O backend: " << backend << RESET_COLOR << std::endl;
+                return false;
+            }
+        }
+        else if (arg == "--shards" && i + 1 < argc)
+        {
+            config.shards = std::strtoul(argv[++i], nullptr, 10);
+        }
+        else if (arg == "--history" && i + 1 < argc)
+        {
+            config.historyDepth = std::strtoul(argv[++i], nullptr, 10);
+        }
+        else if (arg == "--replay" && i + 1 < argc)
+        {
+            config.historyReplay = std::strtoul(argv[++i], nullptr, 10);
+        }
+        else if (arg == "--log-level" && i + 1 < argc)
+        {
+            std::string level = argv[++i];
+            if (!Logger::parseLevel(level, config.logging.level))
+            {
+                std::cerr << RED_COLOR "Unknown log level: " << level << RESET_COLOR << std::endl;
+                return false;
+            }
+        }
+        else if (arg == "--log-file" && i + 1 < argc)
+        {
+            config.logging.file = argv[++i];
+        }
+        else if (arg == "--log-rate" && i + 1 < argc)
+        {
+            config.logging.chatRate = static_cast<unsigned>(std::strtoul(argv[++i], nullptr, 10));
+        }
+        else if (arg == "--log-dir" && i + 1 < argc)
+        {
+            config.log.directory = argv[++i];
+        }
+        else if (arg == "--log-segment-mb" && i + 1 < argc)
+        {
+            config.log.segmentBytes = std::strtoul(argv[++i], nullptr, 10) * 1024 * 1024;
+        }
+        else if (arg == "--log-retain-mb" && i + 1 < argc)
+        {
+            config.log.retainBytes = std::strtoull(argv[++i], nullptr, 10) * 1024 * 1024;
+        }
+        else if (arg == "--log-retain-hours" && i + 1 < argc)
+        {
+            config.log.retainSeconds = std::strtoull(argv[++i], nullptr, 10) * 3600;
+        }
+        else if (arg == "--log-sync-ms" && i + 1 < argc)
+        {
+            config.log.syncIntervalMs = std::atoi(argv[++i]);
+        }
+        else if (arg == "--max-rooms" && i + 1 < argc)
+        {
+            config.maxRooms = std::strtoul(argv[++i], nullptr, 10);
+        }
+        else if (arg == "--client-rooms" && i + 1 < argc)
+        {
+            config.maxRoomsPerClient = std::strtoul(argv[++i], nullptr, 10);
+        }
+        else if (arg == "--queue-limit" && i + 1 < argc)
+        {
+            config.sendQueueLimit = std::strtoul(argv[++i], nullptr, 10);
+        }
+        else if (arg == "--overflow" && i + 1 < argc)
+        {
+            std::string policy = argv[++i];
+            if (policy == "drop-oldest")
+            {
+                config.overflowPolicy = OverflowPolicy::DropOldest;
+            }
+            else if (policy == "disconnect")
+            {
+                config.overflowPolicy = OverflowPolicy::Disconnect;
+            }
+            else
+            {
+                std::cerr << RED_COLOR "Unknown overflow policy: " << policy << RESET_COLOR << std::endl;
+                return false;
+            }
+        }
+        else if (arg == "--delivery" && i + 1 < argc)
+        {
+            std::string delivery = argv[++i];
+            if (delivery == "low-latency")
+            {
+                config.delivery.mode = DeliveryMode::LowLatency;
+            }
+            else if (delivery == "coalesce")
+            {
+                config.delivery.mode = DeliveryMode::Coalesce;
+            }
+            else
+            {
+                std::cerr << RED_COLOR "Unknown delivery mode: " << delivery << RESET_COLOR << std::endl;
+                return false;
+            }
+        }
+        else if (arg == "--coalesce-us" && i + 1 < argc)
+        {
+            config.delivery.windowMicros = static_cast<unsigned>(std::strtoul(argv[++i], nullptr, 10));
+        }
+        else if (arg == "--coalesce-bytes" && i + 1 < argc)
+        {
+            config.delivery.flushBytes = std::strtoul(argv[++i], nullptr, 10);
+        }
+        else if (arg == "--compress")
+        {
+            config.compressMin = COMPRESS_MIN_BYTES;
+        }
+        else if (arg == "--compress-min" && i + 1 < argc)
+        {
+            config.compressMin = std::strtoul(argv[++i], nullptr, 10);
+        }
+        else if (arg == "--flood-rate" && i + 1 < argc)
+        {
+            config.flood.messageRate = std::strtod(argv[++i], nullptr);
+        }
+        else if (arg == "--flood-burst" && i + 1 < argc)
+        {
+            config.flood.messageBurst = std::strtod(argv[++i], nullptr);
+        }
+        else if (arg == "--flood-bytes" && i + 1 < argc)
+        {
+            config.flood.byteRate = std::strtod(argv[++i], nullptr);
+        }
+        else if (arg == "--flood-byte-burst" && i + 1 < argc)
+        {
+            config.flood.byteBurst = std::strtod(argv[++i], nullptr);
+        }
+        else if (arg == "--fanout-limit" && i + 1 < argc)
+        {
+            config.flood.fanoutRate = std::strtod(argv[++i], nullptr);
+        }
+        else if (arg == "--fanout-burst" && i + 1 < argc)
+        {
+            config.flood.fanoutBurst = std::strtod(argv[++i], nullptr);
+        }
+        else if (arg == "--flood-policy" && i + 1 < argc)
+        {
+            std::string policy = argv[++i];
+            if (policy == "delay")
+            {
+                config.flood.policy = FloodPolicy::Delay;
+            }
+            else if (policy == "drop")
+            {
+                config.flood.policy = FloodPolicy::Drop;
+            }
+            else
+            {
+                std::cerr << RED_COLOR "Unknown flood policy: " << policy << RESET_COLOR << std::endl;
+                return false;
+            }
+        }
+        else if (arg == "--heartbeat" && i + 1 < argc)
+        {
+            config.heartbeatSeconds = static_cast<unsigned>(std::strtoul(argv[++i], nullptr, 10));
+        }
+        else if (arg == "--idle-timeout" && i + 1 < argc)
+        {
+            config.idleTimeoutSeconds = static_cast<unsigned>(std::strtoul(argv[++i], nullptr, 10));
+        }
+        else if (arg == "--handshake-timeout" && i + 1 < argc)
+        {
+            config.handshakeTimeoutSeconds = static_cast<unsigned>(std::strtoul(argv[++i], nullptr, 10));
+        }
+        else if (arg == "--admin-port" && i + 1 < argc)
+        {
+            config.adminPort = std::atoi(argv[++i]);
+        }
+        else if (arg == "--admin-socket" && i + 1 < argc)
+        {
+            config.adminSocket = argv[++i];
+        }
+        else if (arg == "--handoff-socket" && i + 1 < argc)
+        {
+            config.handoffPath = argv[++i];
+        }
+        else if (arg == "--takeover" && i + 1 < argc)
+        {
+            config.takeoverPath = argv[++i];
+        }
+        else if (arg == "--node" && i + 1 < argc)
+        {
+            config.federation.nodeName = argv[++i];
+        }
+        else if (arg == "--peer-port" && i + 1 < argc)
+        {
+            config.federation.port = std::atoi(argv[++i]);
+        }
+        else if (arg == "--peer-bind" && i + 1 < argc)
+        {
+            config.federation.bindAddress = argv[++i];
+        }
+        else if (arg == "--peer-secret" && i + 1 < argc)
+        {
+            config.federation.secret = argv[++i];
+        }
+        else if (arg == "--peer" && i + 1 < argc)
+        {
+            config.federation.peers.push_back(argv[++i]);
+        }
+        else
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    int port = 12345;
+    ServerConfig config;
+    if (!parseArguments(argc, argv, port, config))
+    {
+        printUsage(argv[0]);
+        return 1;
+    }
+
     // Initialize console colors
     initConsoleColors();
 
     clearScreen();
     std::cout << BLUE_COLOR BOLD_TEXT "===== Local Chat Server =====" RESET_COLOR << std::endl;
 
-    int port = 12345;
-    ChatServer server(port);
+    // Per-connection and per-message logging goes through the background writer
+    Logger::start(config.logging);
+
+    ChatServer server(port, config);
 
     std::cout << BLUE_COLOR "Server starting on port " << port << RESET_COLOR << std::endl;
     std::cout << YELLOW_COLOR "Press Enter to stop the server." RESET_COLOR << std::endl;
 
+    // Raised by Enter, or by start() returning once a successor took over
+    std::shared_ptr<StopSignal> stopSignal = std::make_shared<StopSignal>();
+
     // Start server in a separate thread
-    std::thread serverThread([&server]()
-                             { server.start(); });
+    std::thread serverThread([&server, stopSignal]()
+                             { server.start(); stopSignal->raise(); });
 
-    // Wait for Enter key to stop the server
-    std::cin.get();
+    // Wait for Enter key to stop the server; detached, as nobody presses it after a handoff
+    std::thread([stopSignal]()
+                { std::cin.get(); stopSignal->raise(); })
+        .detach();
+    stopSignal->wait();
 
-    std::cout << RED_COLOR "Stopping server..." RESET_COLOR << std::endl;
+    if (server.handedOff())
+    {
+        std::cout << GREEN_COLOR "Handed over to the new server process." RESET_COLOR << std::endl;
+    }
+    else
+    {
+        std::cout << RED_COLOR "Stopping server..." RESET_COLOR << std::endl;
+    }
     server.stop();
 
     if (serverThread.joinable())
     {
         serverThread.join();
     }
+    Logger::stop();
 
     std::cout << GREEN_COLOR "Server stopped successfully." RESET_COLOR << std::endl;
 